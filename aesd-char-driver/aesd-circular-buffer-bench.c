@@ -0,0 +1,203 @@
+/**
+ * @file aesd-circular-buffer-bench.c
+ * @brief Userspace microbenchmark for the aesd circular buffer
+ *
+ * Measures aesd_circular_buffer_add_entry and
+ * aesd_circular_buffer_find_entry_offset_for_fpos throughput for a set of
+ * entry sizes and fpos access patterns.  The ring size is a compile time
+ * constant (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED), so one executable is
+ * built per ring size.
+ *
+ * Results are printed as CSV on stdout, one line per measurement:
+ *   ring_size,entry_size,operation,pattern,iterations,ns_per_op,mops
+ *
+ * Usage: aesd-circular-buffer-bench [-n iterations] [-H]
+ *   -n  number of operations per measurement (default 2000000)
+ *   -H  do not print the CSV header line
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "aesd-circular-buffer.h"
+
+#define DEFAULT_ITERATIONS 2000000UL
+
+static const size_t entry_sizes[] = { 1, 16, 128, 1024, 8192 };
+
+/* Keeps the compiler from discarding the measured calls */
+static volatile size_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* xorshift64, good enough to spread fpos values without libc overhead */
+static uint64_t next_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+static void report(size_t entry_size, const char *operation, const char *pattern,
+            unsigned long iterations, uint64_t elapsed_ns)
+{
+    double ns_per_op = (double)elapsed_ns / (double)iterations;
+    printf("%d,%zu,%s,%s,%lu,%.3f,%.3f\n", AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED,
+            entry_size, operation, pattern, iterations, ns_per_op,
+            ns_per_op > 0 ? 1000.0 / ns_per_op : 0.0);
+}
+
+/**
+ * Fills @param buffer until full with entries of @param entry_size bytes all pointing to @param data
+ * @return the total number of bytes stored in the buffer
+ */
+static size_t fill_buffer(struct aesd_circular_buffer *buffer, const char *data, size_t entry_size)
+{
+    struct aesd_buffer_entry entry = { .buffptr = data, .size = entry_size };
+    int i;
+
+    aesd_circular_buffer_init(buffer);
+    for(i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; i++)
+    {
+        aesd_circular_buffer_add_entry(buffer, &entry);
+    }
+    return entry_size * AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+static void bench_add(const char *data, size_t entry_size, unsigned long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entry = { .buffptr = data, .size = entry_size };
+    unsigned long i;
+    size_t evicted = 0;
+
+    /* Empty ring: the first N adds do not evict, the rest do */
+    aesd_circular_buffer_init(&buffer);
+    uint64_t start = now_ns();
+    for(i = 0; i < iterations; i++)
+    {
+        evicted += (aesd_circular_buffer_add_entry(&buffer, &entry) != NULL);
+    }
+    report(entry_size, "add_entry", "steady_state_evict", iterations, now_ns() - start);
+    sink = evicted;
+}
+
+static void bench_find(const char *data, size_t entry_size, unsigned long iterations)
+{
+    struct aesd_circular_buffer buffer;
+    size_t total = fill_buffer(&buffer, data, entry_size);
+    size_t offset_rtn = 0;
+    size_t acc = 0;
+    unsigned long i;
+    uint64_t start;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+
+    /*
+     * Sequential scan: what aesd_read does, one lookup per entry while
+     * walking fpos from 0 to the end of the buffer.
+     */
+    size_t fpos = 0;
+    start = now_ns();
+    for(i = 0; i < iterations; i++)
+    {
+        struct aesd_buffer_entry *entry =
+            aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, fpos, &offset_rtn);
+        acc += (entry != NULL) + offset_rtn;
+        fpos += entry_size;
+        if(fpos >= total)
+        {
+            fpos = 0;
+        }
+    }
+    report(entry_size, "find_entry_offset_for_fpos", "sequential_scan", iterations, now_ns() - start);
+
+    /* Random fpos anywhere inside the stored data */
+    start = now_ns();
+    for(i = 0; i < iterations; i++)
+    {
+        struct aesd_buffer_entry *entry =
+            aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, next_rand(&seed) % total, &offset_rtn);
+        acc += (entry != NULL) + offset_rtn;
+    }
+    report(entry_size, "find_entry_offset_for_fpos", "random_fpos", iterations, now_ns() - start);
+
+    /* Tail read: every lookup lands in the newest entry, the worst case walk */
+    size_t tail_base = total - entry_size;
+    start = now_ns();
+    for(i = 0; i < iterations; i++)
+    {
+        struct aesd_buffer_entry *entry =
+            aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, tail_base + (i % entry_size), &offset_rtn);
+        acc += (entry != NULL) + offset_rtn;
+    }
+    report(entry_size, "find_entry_offset_for_fpos", "tail_read", iterations, now_ns() - start);
+
+    sink = acc;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    int header = 1;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:H")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 'H':
+                header = 0;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-H]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(iterations == 0)
+    {
+        fprintf(stderr, "Error: iterations must be greater than 0\n");
+        return 1;
+    }
+
+    size_t max_entry_size = entry_sizes[sizeof(entry_sizes) / sizeof(entry_sizes[0]) - 1];
+    char *data = malloc(max_entry_size);
+    if(data == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    memset(data, 'a', max_entry_size);
+    data[max_entry_size - 1] = '\n';
+
+    if(header)
+    {
+        printf("ring_size,entry_size,operation,pattern,iterations,ns_per_op,mops\n");
+    }
+
+    size_t i;
+    for(i = 0; i < sizeof(entry_sizes) / sizeof(entry_sizes[0]); i++)
+    {
+        bench_add(data, entry_sizes[i], iterations);
+        bench_find(data, entry_sizes[i], iterations);
+    }
+
+    free(data);
+    return 0;
+}
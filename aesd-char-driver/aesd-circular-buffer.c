@@ -10,8 +10,12 @@
 
 #ifdef __KERNEL__
 #include <linux/string.h>
+#include "aesdchar_trace.h"
 #else
 #include <string.h>
+/* Tracepoints only exist in the driver build */
+#define trace_aesdchar_commit(slot, size) do { } while(0)
+#define trace_aesdchar_evict(slot, size) do { } while(0)
 #endif
 
 #include "aesd-circular-buffer.h"
@@ -81,6 +85,7 @@ char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const
     char * res = NULL;
     if(!buffer->full)
     {
+        trace_aesdchar_commit(buffer->in_offs, add_entry->size);
         buffer->entry[buffer->in_offs] = *add_entry;
         buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
         if(buffer->in_offs == buffer->out_offs)
@@ -90,6 +95,8 @@ char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer, const
     }
     else
     {
+        trace_aesdchar_evict(buffer->out_offs, buffer->entry[buffer->out_offs].size);
+        trace_aesdchar_commit(buffer->out_offs, add_entry->size);
         res = buffer->entry[buffer->out_offs].buffptr;
         buffer->entry[buffer->out_offs] = *add_entry;
         buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
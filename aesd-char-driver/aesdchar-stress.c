@@ -0,0 +1,550 @@
+/**
+ * @file aesdchar-stress.c
+ * @brief Multi-threaded stress and throughput harness for /dev/aesdchar
+ *
+ * Runs concurrent writers and readers against the aesdchar device for a fixed
+ * duration, measures ops/s and latency for each kind of operation, and checks
+ * the invariants the driver is expected to keep:
+ *
+ *  - every line read back is a complete, well formed record written by one
+ *    writer (no torn or interleaved records)
+ *  - a single read never returns more than AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+ *    lines
+ *  - inside one read, the records of a given writer appear in increasing
+ *    sequence order
+ *  - across successive reads of one reader, the newest sequence seen for a
+ *    given writer never goes backwards
+ *
+ * Split writers issue each record as several write() calls.  The driver keeps
+ * a single partial-line buffer per device, so running more than one split
+ * writer (or split writers alongside whole line writers) is expected to
+ * report torn records; it is kept as an option to observe that behaviour.
+ *
+ * Works against the host kernel or inside qemu, after ./aesdchar_load.
+ * Results are printed as key=value lines on stdout, exit status is 1 when an
+ * invariant was violated.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "aesd-circular-buffer.h"
+#include "framing.h"
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+#define MAX_LINE_SIZE 4096
+#define MIN_LINE_SIZE 32
+#define LATENCY_BUCKETS 40
+#define SCAN_BATCH 64
+
+struct latency_stats
+{
+    /**
+     * Bucket i counts operations which took between 2^i and 2^(i+1) nanoseconds
+     */
+    uint64_t buckets[LATENCY_BUCKETS];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+struct stress_config
+{
+    const char *device;
+    int writers;
+    int split_writers;
+    int readers;
+    int seconds;
+    size_t line_size;
+};
+
+struct worker
+{
+    pthread_t thread;
+    int id;
+    bool split;
+    const struct stress_config *config;
+    struct latency_stats latency;
+    uint64_t bytes;
+    uint64_t errors;
+    /* reader only */
+    uint64_t lines_checked;
+    uint64_t torn_records;
+    uint64_t order_violations;
+    uint64_t too_many_lines;
+    uint64_t *last_seq;
+};
+
+static volatile bool stop;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void latency_record(struct latency_stats *stats, uint64_t ns)
+{
+    int bucket = 0;
+    while(bucket < LATENCY_BUCKETS - 1 && (ns >> (bucket + 1)) != 0)
+    {
+        bucket++;
+    }
+    stats->buckets[bucket]++;
+    stats->count++;
+    stats->total_ns += ns;
+    if(ns > stats->max_ns)
+    {
+        stats->max_ns = ns;
+    }
+}
+
+static void latency_merge(struct latency_stats *dst, const struct latency_stats *src)
+{
+    int i;
+    for(i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        dst->buckets[i] += src->buckets[i];
+    }
+    dst->count += src->count;
+    dst->total_ns += src->total_ns;
+    if(src->max_ns > dst->max_ns)
+    {
+        dst->max_ns = src->max_ns;
+    }
+}
+
+/**
+ * @return the upper bound in ns of the bucket holding percentile @param pct
+ */
+static uint64_t latency_percentile(const struct latency_stats *stats, double pct)
+{
+    uint64_t target = (uint64_t)(stats->count * pct / 100.0);
+    uint64_t seen = 0;
+    int i;
+    for(i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += stats->buckets[i];
+        if(seen > target)
+        {
+            return 2ULL << i;
+        }
+    }
+    return stats->max_ns;
+}
+
+/* FNV-1a, used as the record checksum */
+static uint32_t checksum(const char *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for(i = 0; i < len; i++)
+    {
+        hash ^= (uint8_t)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Formats a record "W<writer>:<seq>:<padding>:<checksum>\n" of exactly @param line_size bytes
+ * @return the record length
+ */
+static size_t format_record(char *line, size_t line_size, int writer, uint64_t seq)
+{
+    int header = snprintf(line, line_size, "W%d:%llu:", writer, (unsigned long long)seq);
+    /* 8 hex digits of checksum plus the line break */
+    size_t padding = line_size - header - 9;
+    memset(line + header, 'a' + (seq % 26), padding);
+    size_t body = header + padding;
+    snprintf(line + body, 10, "%08x", checksum(line, body));
+    line[line_size - 1] = '\n';
+    return line_size;
+}
+
+/**
+ * Parses and validates a record of @param len bytes, line break excluded
+ * @return true if the record is well formed, with @param writer and @param seq set
+ */
+static bool parse_record(const char *line, size_t len, int *writer, uint64_t *seq)
+{
+    if(len < 12 || line[0] != 'W')
+    {
+        return false;
+    }
+    char *end;
+    long w = strtol(line + 1, &end, 10);
+    if(*end != ':' || w < 0)
+    {
+        return false;
+    }
+    unsigned long long s = strtoull(end + 1, &end, 10);
+    if(*end != ':')
+    {
+        return false;
+    }
+    char expected[9];
+    snprintf(expected, sizeof(expected), "%08x", checksum(line, len - 8));
+    if(memcmp(expected, line + len - 8, 8) != 0)
+    {
+        return false;
+    }
+    *writer = (int)w;
+    *seq = s;
+    return true;
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t ret = write(fd, data, len);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static void *writer_thread(void *param)
+{
+    struct worker *worker = (struct worker *) param;
+    const struct stress_config *config = worker->config;
+    char line[MAX_LINE_SIZE];
+    uint64_t seq = 0;
+
+    int fd = open(config->device, O_WRONLY);
+    if(fd == -1)
+    {
+        perror("open");
+        worker->errors++;
+        return NULL;
+    }
+
+    while(!stop)
+    {
+        size_t len = format_record(line, config->line_size, worker->id, seq);
+        uint64_t start = now_ns();
+        bool ok;
+        if(worker->split)
+        {
+            /* Three chunks, the last one carrying the line break */
+            size_t first = len / 3;
+            size_t second = len / 3;
+            ok = write_all(fd, line, first)
+                && write_all(fd, line + first, second)
+                && write_all(fd, line + first + second, len - first - second);
+        }
+        else
+        {
+            ok = write_all(fd, line, len);
+        }
+        if(!ok)
+        {
+            perror("write");
+            worker->errors++;
+            break;
+        }
+        latency_record(&worker->latency, now_ns() - start);
+        worker->bytes += len;
+        seq++;
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static void check_snapshot(struct worker *worker, const char *buffer, size_t len, int total_writers)
+{
+    uint64_t snapshot_seq[total_writers];
+    bool seen[total_writers];
+    size_t lines = 0;
+    const char *pos = buffer;
+    const char *end = buffer + len;
+
+    size_t ends[SCAN_BATCH];
+    size_t scanned = 0;
+    size_t found;
+
+    memset(seen, 0, sizeof(seen));
+    do
+    {
+        /* All line ends of the snapshot, found with the framing scanner of aesdsocket */
+        found = framing_scan(buffer + scanned, len - scanned, '\n', ends, SCAN_BATCH);
+        size_t k;
+        for(k = 0; k < found; k++)
+        {
+            const char *eol = buffer + scanned + ends[k] - 1;
+            int writer;
+            uint64_t seq;
+            lines++;
+            worker->lines_checked++;
+            if(!parse_record(pos, eol - pos, &writer, &seq) || writer >= total_writers)
+            {
+                worker->torn_records++;
+            }
+            else
+            {
+                if(seen[writer] && seq <= snapshot_seq[writer])
+                {
+                    worker->order_violations++;
+                }
+                seen[writer] = true;
+                snapshot_seq[writer] = seq;
+            }
+            pos = eol + 1;
+        }
+        if(found > 0)
+        {
+            scanned += ends[found - 1];
+        }
+    } while(found == SCAN_BATCH);
+    if(pos < end)
+    {
+        /* A read only returns complete entries */
+        worker->torn_records++;
+    }
+
+    if(lines > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    {
+        worker->too_many_lines++;
+    }
+
+    int i;
+    for(i = 0; i < total_writers; i++)
+    {
+        if(seen[i])
+        {
+            if(worker->last_seq[i] != UINT64_MAX && snapshot_seq[i] < worker->last_seq[i])
+            {
+                worker->order_violations++;
+            }
+            worker->last_seq[i] = snapshot_seq[i];
+        }
+    }
+}
+
+static void *reader_thread(void *param)
+{
+    struct worker *worker = (struct worker *) param;
+    const struct stress_config *config = worker->config;
+    int total_writers = config->writers + config->split_writers;
+    /*
+     * Large enough for the whole ring plus slack for partial lines, so that a
+     * single read() returns a consistent snapshot taken under the driver lock.
+     */
+    size_t buffer_size = (AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 2) * config->line_size * 4;
+    char *buffer = malloc(buffer_size);
+    if(buffer == NULL)
+    {
+        perror("malloc");
+        worker->errors++;
+        return NULL;
+    }
+    int i;
+    for(i = 0; i < total_writers; i++)
+    {
+        worker->last_seq[i] = UINT64_MAX;
+    }
+
+    int fd = open(config->device, O_RDONLY);
+    if(fd == -1)
+    {
+        perror("open");
+        worker->errors++;
+        free(buffer);
+        return NULL;
+    }
+
+    while(!stop)
+    {
+        uint64_t start = now_ns();
+        ssize_t ret = pread(fd, buffer, buffer_size, 0);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("pread");
+            worker->errors++;
+            break;
+        }
+        latency_record(&worker->latency, now_ns() - start);
+        worker->bytes += ret;
+        check_snapshot(worker, buffer, ret, total_writers);
+    }
+
+    close(fd);
+    free(buffer);
+    return NULL;
+}
+
+static void print_stats(const char *kind, const struct latency_stats *stats, uint64_t bytes, double seconds)
+{
+    printf("%s_ops=%llu\n", kind, (unsigned long long)stats->count);
+    printf("%s_ops_per_sec=%.1f\n", kind, stats->count / seconds);
+    printf("%s_mib_per_sec=%.3f\n", kind, bytes / seconds / (1024.0 * 1024.0));
+    printf("%s_latency_avg_ns=%llu\n", kind,
+            (unsigned long long)(stats->count ? stats->total_ns / stats->count : 0));
+    printf("%s_latency_p50_ns=%llu\n", kind, (unsigned long long)latency_percentile(stats, 50.0));
+    printf("%s_latency_p99_ns=%llu\n", kind, (unsigned long long)latency_percentile(stats, 99.0));
+    printf("%s_latency_max_ns=%llu\n", kind, (unsigned long long)stats->max_ns);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d device] [-w writers] [-s split_writers] [-r readers]"
+            " [-t seconds] [-l line_size]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    struct stress_config config = {
+        .device = DEFAULT_DEVICE,
+        .writers = 4,
+        .split_writers = 0,
+        .readers = 4,
+        .seconds = 5,
+        .line_size = 64,
+    };
+    int opt;
+
+    while((opt = getopt(argc, argv, "d:w:s:r:t:l:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'd': config.device = optarg; break;
+            case 'w': config.writers = atoi(optarg); break;
+            case 's': config.split_writers = atoi(optarg); break;
+            case 'r': config.readers = atoi(optarg); break;
+            case 't': config.seconds = atoi(optarg); break;
+            case 'l': config.line_size = strtoul(optarg, NULL, 0); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(config.writers < 0 || config.split_writers < 0 || config.readers < 0 || config.seconds <= 0
+            || config.writers + config.split_writers == 0
+            || config.line_size < MIN_LINE_SIZE || config.line_size > MAX_LINE_SIZE)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    int total_writers = config.writers + config.split_writers;
+    int total = total_writers + config.readers;
+    struct worker *workers = calloc(total, sizeof(struct worker));
+    if(workers == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+
+    int i;
+    int started = 0;
+    uint64_t start = now_ns();
+    for(i = 0; i < total; i++)
+    {
+        struct worker *worker = &workers[i];
+        worker->config = &config;
+        worker->id = i;
+        void *(*func)(void *) = writer_thread;
+        if(i >= total_writers)
+        {
+            worker->last_seq = calloc(total_writers, sizeof(uint64_t));
+            if(worker->last_seq == NULL)
+            {
+                perror("calloc");
+                break;
+            }
+            func = reader_thread;
+        }
+        else
+        {
+            worker->split = i >= config.writers;
+        }
+        if(pthread_create(&worker->thread, NULL, func, worker) != 0)
+        {
+            fprintf(stderr, "pthread_create failed\n");
+            break;
+        }
+        started++;
+    }
+
+    if(started == total)
+    {
+        sleep(config.seconds);
+    }
+    stop = true;
+    for(i = 0; i < started; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    struct latency_stats write_stats = {0};
+    struct latency_stats read_stats = {0};
+    uint64_t write_bytes = 0, read_bytes = 0, errors = 0;
+    uint64_t lines = 0, torn = 0, order = 0, too_many = 0;
+    for(i = 0; i < started; i++)
+    {
+        struct worker *worker = &workers[i];
+        errors += worker->errors;
+        if(i < total_writers)
+        {
+            latency_merge(&write_stats, &worker->latency);
+            write_bytes += worker->bytes;
+        }
+        else
+        {
+            latency_merge(&read_stats, &worker->latency);
+            read_bytes += worker->bytes;
+            lines += worker->lines_checked;
+            torn += worker->torn_records;
+            order += worker->order_violations;
+            too_many += worker->too_many_lines;
+        }
+    }
+
+    printf("device=%s\n", config.device);
+    printf("writers=%d\nsplit_writers=%d\nreaders=%d\nline_size=%zu\n",
+            config.writers, config.split_writers, config.readers, config.line_size);
+    printf("elapsed_sec=%.3f\n", elapsed);
+    print_stats("write", &write_stats, write_bytes, elapsed);
+    print_stats("read", &read_stats, read_bytes, elapsed);
+    printf("lines_checked=%llu\n", (unsigned long long)lines);
+    printf("torn_records=%llu\n", (unsigned long long)torn);
+    printf("order_violations=%llu\n", (unsigned long long)order);
+    printf("oversized_reads=%llu\n", (unsigned long long)too_many);
+    printf("errors=%llu\n", (unsigned long long)errors);
+
+    for(i = total_writers; i < total; i++)
+    {
+        free(workers[i].last_seq);
+    }
+    free(workers);
+
+    bool failed = started != total || errors || torn || order || too_many;
+    printf("result=%s\n", failed ? "FAIL" : "PASS");
+    return failed ? 1 : 0;
+}
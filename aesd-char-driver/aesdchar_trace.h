@@ -0,0 +1,84 @@
+/*
+ * aesdchar_trace.h
+ *
+ * Tracepoints of the aesdchar driver, under events/aesdchar/.  They cost a
+ * static branch while disabled, enable them with e.g.
+ *   perf record -e 'aesdchar:*' -a
+ *   bpftrace -e 'tracepoint:aesdchar:aesdchar_evict { @evicted = sum(args->size); }'
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM aesdchar
+
+#if !defined(AESDCHAR_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define AESDCHAR_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+/*
+ * aesd_read/aesd_write completion, with the time spent waiting on the device mutex
+ * and the total time in the call
+ */
+DECLARE_EVENT_CLASS(aesdchar_io,
+    TP_PROTO(size_t count, loff_t pos, ssize_t ret, u64 lock_ns, u64 total_ns),
+    TP_ARGS(count, pos, ret, lock_ns, total_ns),
+    TP_STRUCT__entry(
+        __field(size_t, count)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+        __field(u64, lock_ns)
+        __field(u64, total_ns)
+    ),
+    TP_fast_assign(
+        __entry->count = count;
+        __entry->pos = pos;
+        __entry->ret = ret;
+        __entry->lock_ns = lock_ns;
+        __entry->total_ns = total_ns;
+    ),
+    TP_printk("count=%zu pos=%lld ret=%zd lock_ns=%llu total_ns=%llu",
+        __entry->count, __entry->pos, __entry->ret, __entry->lock_ns, __entry->total_ns)
+);
+
+DEFINE_EVENT(aesdchar_io, aesdchar_read,
+    TP_PROTO(size_t count, loff_t pos, ssize_t ret, u64 lock_ns, u64 total_ns),
+    TP_ARGS(count, pos, ret, lock_ns, total_ns));
+
+DEFINE_EVENT(aesdchar_io, aesdchar_write,
+    TP_PROTO(size_t count, loff_t pos, ssize_t ret, u64 lock_ns, u64 total_ns),
+    TP_ARGS(count, pos, ret, lock_ns, total_ns));
+
+/*
+ * A complete command entering the circular buffer at @slot, or the oldest one
+ * leaving it from @slot to make room
+ */
+DECLARE_EVENT_CLASS(aesdchar_entry,
+    TP_PROTO(unsigned int slot, size_t size),
+    TP_ARGS(slot, size),
+    TP_STRUCT__entry(
+        __field(unsigned int, slot)
+        __field(size_t, size)
+    ),
+    TP_fast_assign(
+        __entry->slot = slot;
+        __entry->size = size;
+    ),
+    TP_printk("slot=%u size=%zu", __entry->slot, __entry->size)
+);
+
+DEFINE_EVENT(aesdchar_entry, aesdchar_commit,
+    TP_PROTO(unsigned int slot, size_t size),
+    TP_ARGS(slot, size));
+
+DEFINE_EVENT(aesdchar_entry, aesdchar_evict,
+    TP_PROTO(unsigned int slot, size_t size),
+    TP_ARGS(slot, size));
+
+#endif /* AESDCHAR_TRACE_H_ */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE aesdchar_trace
+#include <trace/define_trace.h>
@@ -18,7 +18,10 @@
 #include <linux/slab.h>
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
+#include <linux/ktime.h>
 #include "aesdchar.h"
+#define CREATE_TRACE_POINTS
+#include "aesdchar_trace.h"
 int aesd_major =   0; // use dynamic major
 int aesd_minor =   0;
 
@@ -58,6 +61,8 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = 0;
+    loff_t pos = *f_pos;
+    u64 start = ktime_get_ns();
     PDEBUG("read %zu bytes with offset %lld",count,*f_pos);
     /**
      * TODO: handle read
@@ -66,6 +71,7 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     struct aesd_circular_buffer *buffer = &dev->buffer;
 
     mutex_lock(&dev->mutex);
+    u64 locked = ktime_get_ns();
     struct aesd_buffer_entry * entry;
 
     // int index;
@@ -97,6 +103,7 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
 
 
     mutex_unlock(&dev->mutex);
+    trace_aesdchar_read(count, pos, retval, locked - start, ktime_get_ns() - start);
     return retval;
 }
 
@@ -110,6 +117,8 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
                 loff_t *f_pos)
 {
     ssize_t retval = -ENOMEM;
+    loff_t pos = *f_pos;
+    u64 start = ktime_get_ns();
     PDEBUG("write %zu bytes with offset %lld",count,*f_pos);
 
     // char * localbuf = kmalloc(count + 1, GFP_KERNEL);
@@ -128,32 +137,31 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     struct aesd_circular_buffer *buffer = &dev->buffer;
 
     mutex_lock(&dev->mutex);
+    u64 locked = ktime_get_ns();
     struct aesd_buffer_entry * entry = &dev->tempEntry;
     // char * localbuf = entry->buffptr;
     // size_t localbuf_size = entry->size;
     if(entry->buffptr == NULL) {
         entry->buffptr = kmalloc(count, GFP_KERNEL);
         if(entry->buffptr == NULL) {
-            mutex_unlock(&dev->mutex);
-            return -ENOMEM;
+            goto out;
         }
         if(copy_from_user(entry->buffptr, buf, count)) {
-            mutex_unlock(&dev->mutex);
-            return -EFAULT;
+            retval = -EFAULT;
+            goto out;
         }
         entry->size = count;
     } else {
         // append to the buffer
         char * tmp = kmalloc(entry->size + count, GFP_KERNEL);
         if(tmp == NULL) {
-            mutex_unlock(&dev->mutex);
-            return -ENOMEM;
+            goto out;
         }
         memcpy(tmp, entry->buffptr, entry->size);
         if(copy_from_user(tmp + entry->size, buf, count)) {
             kfree(tmp);
-            mutex_unlock(&dev->mutex);
-            return -EFAULT;
+            retval = -EFAULT;
+            goto out;
         }
         kfree(entry->buffptr);
         entry->buffptr = tmp;
@@ -184,10 +192,12 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count,
     else {
         PDEBUG("buffering the command");
     }
+    retval = count;
 
+out:
     mutex_unlock(&dev->mutex);
-
-    return count;
+    trace_aesdchar_write(count, pos, retval, locked - start, ktime_get_ns() - start);
+    return retval;
 }
 
 
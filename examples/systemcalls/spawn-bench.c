@@ -0,0 +1,154 @@
+/**
+ * @file spawn-bench.c
+ * @brief Command start latency of the systemcalls functions against the parent RSS
+ *
+ * Grows the resident set of the process to each size in turn, touching every page, then
+ * times running /bin/true with:
+ *   fork            fork() + execv() + waitpid(), the former do_exec
+ *   do_exec         posix_spawn() + waitpid()
+ *   do_system       system("true"), through /bin/sh
+ *   do_system_direct "true" looked up in PATH and spawned without the shell
+ * fork() copies the page tables of the whole resident set and write protects it, so its cost
+ * grows with the RSS while posix_spawn() shares the address space until the exec.
+ *
+ * Results are printed as CSV on stdout, one line per measurement:
+ *   method,rss_mib,iterations,us_per_command
+ *
+ * Usage: spawn-bench [-n iterations] [-s sizes] [-H]
+ *   -n  commands run per measurement (default 200)
+ *   -s  comma separated resident set sizes in MiB (default 0,256,1024,2048)
+ *   -H  do not print the CSV header line
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+
+#define DEFAULT_ITERATIONS 200UL
+#define DEFAULT_SIZES "0,256,1024,2048"
+#define MIB (1024UL * 1024)
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/* The fork() based do_exec this benchmark compares against */
+static bool fork_exec(char *const argv[])
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        return false;
+    } else if (pid == 0) {
+        execv(argv[0], argv);
+        _exit(1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void report(const char *method, unsigned long rss_mib, unsigned long iterations, uint64_t elapsed_ns)
+{
+    printf("%s,%lu,%lu,%.1f\n", method, rss_mib, iterations, (double)elapsed_ns / iterations / 1000.0);
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    char *sizes = strdup(DEFAULT_SIZES);
+    int header = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:H")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            free(sizes);
+            sizes = strdup(optarg);
+            break;
+        case 'H':
+            header = 0;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-s sizes] [-H]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (iterations == 0 || sizes == NULL) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+
+    char *const true_argv[] = { "/bin/true", NULL };
+    if (header) {
+        printf("method,rss_mib,iterations,us_per_command\n");
+    }
+
+    int status = 0;
+    char *save;
+    char *size;
+    for (size = strtok_r(sizes, ",", &save); size != NULL; size = strtok_r(NULL, ",", &save)) {
+        unsigned long rss_mib = strtoul(size, NULL, 10);
+        char *ballast = NULL;
+        if (rss_mib > 0) {
+            ballast = mmap(NULL, rss_mib * MIB, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (ballast == MAP_FAILED) {
+                perror("mmap");
+                status = 1;
+                continue;
+            }
+            // resident and dirty, as the heap of a long running daemon
+            memset(ballast, 1, rss_mib * MIB);
+        }
+
+        unsigned long i;
+        uint64_t start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            status |= !fork_exec(true_argv);
+        }
+        report("fork", rss_mib, iterations, now_ns() - start);
+
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            status |= !do_exec(1, "/bin/true");
+        }
+        report("do_exec", rss_mib, iterations, now_ns() - start);
+
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            status |= !do_system("true");
+        }
+        report("do_system", rss_mib, iterations, now_ns() - start);
+
+        start = now_ns();
+        for (i = 0; i < iterations; i++) {
+            status |= !do_system_direct("true");
+        }
+        report("do_system_direct", rss_mib, iterations, now_ns() - start);
+
+        if (ballast != NULL) {
+            munmap(ballast, rss_mib * MIB);
+        }
+    }
+
+    if (status) {
+        fprintf(stderr, "Some commands failed\n");
+    }
+    free(sizes);
+    return status;
+}
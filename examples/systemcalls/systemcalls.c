@@ -1,10 +1,61 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <spawn.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+extern char **environ;
+
+// Initial size of a captured output buffer, doubled as needed
+#define CAPTURE_INITIAL_SIZE 4096
+// Pipe size asked for by do_exec_sink, and most bytes it moves at once
+#define SINK_PIPE_SIZE (1024 * 1024)
+
+// Longest command do_system_direct splits itself, and most words in it
+#define DIRECT_COMMAND_MAX 4096
+#define DIRECT_ARGS_MAX 256
+
+/**
+ * Starts @param argv[0] with arguments @param argv through posix_spawn, which the C library implements
+ * with vfork semantics (clone(CLONE_VM|CLONE_VFORK) on glibc): the parent's page tables are neither
+ * copied nor write protected, so the cost does not grow with the caller's RSS the way fork() does.
+ * @param actions may redirect the child's descriptors, @param search looks the command up in PATH.
+ * @return true if the command ran and exited with status 0
+ */
+static bool spawn_and_wait(char *const argv[], const posix_spawn_file_actions_t *actions, bool search)
+{
+    // the child does not inherit the stdio buffers, but output ordering still relies on them being out
+    fflush(stdout);
+
+    pid_t pid;
+    int ret = search ? posix_spawnp(&pid, argv[0], actions, NULL, argv, environ)
+            : posix_spawn(&pid, argv[0], actions, NULL, argv, environ);
+    if (ret != 0) {
+        // includes execv failures, reported by the C library instead of an exit status
+        return false;
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
 
 /**
  * @param cmd the command to execute with system()
@@ -30,6 +81,58 @@ bool do_system(const char *cmd)
     }
 }
 
+/**
+ * @param cmd the command to execute, as with do_system()
+ * @return the same as do_system(@param cmd), but a command made of plain words separated by blanks,
+ *   with nothing for a shell to expand, redirect or interpret, is split and run directly, looked up
+ *   in PATH, without starting /bin/sh in between.  Other commands go through do_system().
+ *   Unlike system(), SIGINT and SIGQUIT are not ignored while a direct command runs.
+*/
+bool do_system_direct(const char *cmd)
+{
+    // quoting, expansions, redirections, globs, operators and comments need the shell
+    if (cmd == NULL || strlen(cmd) >= DIRECT_COMMAND_MAX ||
+            strpbrk(cmd, "|&;<>()$`\\\"'*?[]#~{}\n") != NULL) {
+        return do_system(cmd);
+    }
+
+    char words[DIRECT_COMMAND_MAX];
+    char *argv[DIRECT_ARGS_MAX + 1];
+    int count = 0;
+    char *save;
+    char *word;
+    strcpy(words, cmd);
+    for (word = strtok_r(words, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save))
+    {
+        if (count == DIRECT_ARGS_MAX) {
+            return do_system(cmd);
+        }
+        argv[count++] = word;
+    }
+    argv[count] = NULL;
+    // empty commands and leading variable assignments need it as well
+    if (count == 0 || strchr(argv[0], '=') != NULL) {
+        return do_system(cmd);
+    }
+
+    // builtins and keywords only exist in the shell
+    static const char *const shell_words[] = {
+        "cd", "exit", "export", "unset", "set", "alias", "source", ".", "exec", "eval", "read", "wait",
+        "ulimit", "umask", "trap", "shift", "return", "break", "continue", "readonly", "local", "type",
+        "command", "hash", "times", "getopts", "jobs", "fg", "bg", "if", "then", "else", "elif", "fi",
+        "for", "while", "until", "do", "done", "case", "esac", "!",
+    };
+    size_t i;
+    for (i = 0; i < sizeof(shell_words) / sizeof(shell_words[0]); i++)
+    {
+        if (strcmp(argv[0], shell_words[i]) == 0) {
+            return do_system(cmd);
+        }
+    }
+
+    return spawn_and_wait(argv, NULL, true);
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -59,39 +162,16 @@ bool do_exec(int count, ...)
     // and may be removed
     command[count] = command[count];
 
+    va_end(args);
+
 /*
- *   Execute a system command by calling fork, execv(),
- *   and wait instead of system (see LSP page 161).
- *   Use the command[0] as the full path to the command to execute
- *   (first argument to execv), and use the remaining arguments
- *   as second argument to the execv() command.
+ *   Execute a system command with posix_spawn() and wait instead of
+ *   system (see LSP page 161), without the fork() page table copy.
+ *   Use the command[0] as the full path to the command to execute,
+ *   no PATH search is done, as with execv().
  *
 */
-    fflush(stdout);
-    
-    int pid = fork();
-    if (pid == -1) {
-        // fork failed
-        return false;
-    } else if (pid == 0) {
-        // child process
-        execv(command[0], command);
-        // execv failed
-        exit(1);
-    } else {
-        // parent process
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            return true;
-        } else {
-            return false;
-        }
-    }
-
-    va_end(args);
-
-    return true;
+    return spawn_and_wait(command, NULL, false);
 }
 
 /**
@@ -115,45 +195,547 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
     command[count] = command[count];
 
 
+    va_end(args);
+
 /*
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
+ *   Same as do_exec(), with standard out redirected to the file specified
+ *   by outputfile: the spawn file actions open it as the child's stdout
+ *   before the command runs, failing the spawn if it can not be opened.
  *
 */
-    int fd = open(outputfile, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
-    if (fd == -1) {
-        // failed to open output file
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
         return false;
     }
+    bool result = false;
+    if (posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, outputfile,
+                O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR) == 0) {
+        result = spawn_and_wait(command, &actions, false);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    return result;
+}
 
+/**
+ * Moves up to @param len bytes from pipe @param from to @param to with splice(), copying them through
+ * user space when @param to does not support it
+ * @return the number of bytes moved, 0 at end of file, -1 on error
+ */
+static ssize_t move_chunk(int from, int to, size_t len)
+{
+    ssize_t moved;
+    do {
+        moved = splice(from, NULL, to, NULL, len, SPLICE_F_MOVE);
+    } while (moved == -1 && errno == EINTR);
+    if (moved != -1 || errno != EINVAL) {
+        return moved;
+    }
+
+    char copy[65536];
+    ssize_t ret;
+    do {
+        ret = read(from, copy, len < sizeof(copy) ? len : sizeof(copy));
+    } while (ret == -1 && errno == EINTR);
+    ssize_t written = 0;
+    while (written < ret) {
+        ssize_t n = write(to, copy + written, ret - written);
+        if (n == -1 && errno != EINTR) {
+            return -1;
+        }
+        written += n > 0 ? n : 0;
+    }
+    return ret;
+}
+
+/**
+ * Captures into @param sink up to @param len bytes available in pipe @param from, discarding
+ * into @param devnull what does not fit, or what is there until end of file when @param exact is
+ * false
+ * @return the number of bytes consumed, 0 at end of file, -1 on error
+ */
+static ssize_t capture_chunk(struct exec_sink *sink, int from, int devnull, size_t len, bool exact)
+{
+    size_t done = 0;
+    do {
+        size_t room = sink->buffer != NULL ? sink->buffer_size - sink->length : 0;
+        ssize_t ret;
+        if (room > 0) {
+            ret = read(from, sink->buffer + sink->length, room < len - done ? room : len - done);
+            if (ret > 0) {
+                sink->length += ret;
+            }
+        } else {
+            ret = move_chunk(from, devnull, len - done);
+            if (ret > 0 && sink->buffer != NULL) {
+                sink->truncated = true;
+            }
+        }
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return done > 0 ? (ssize_t)done : ret;
+        }
+        done += ret;
+    } while (exact && done < len);
+    return done;
+}
+
+/**
+* Runs a command like do_exec(), forwarding its standard output to @param sink while it runs.
+* @param sink - where the output goes: to descriptor sink->fd if it is not -1, a file, pipe or
+*   socket, and into the sink->buffer_size bytes at sink->buffer if it is not NULL.  The output
+*   moves from the pipe the command writes to straight to sink->fd with splice(), without going
+*   through user space; when it is also captured, tee() duplicates it into a second pipe that is
+*   read into the buffer.  At most the buffer size stays in memory: sink->length tells how much
+*   was captured and sink->truncated whether more output was dropped.  Output is forwarded as
+*   produced, SINK_PIPE_SIZE bytes at most at a time, so large outputs need no more memory.
+*   Writing to a socket whose peer closed raises SIGPIPE as any write would.
+* @param count, ... - the command and its arguments, see do_exec()
+* @return true if the command exited with status 0 and all of its output reached sink->fd
+*/
+bool do_exec_sink(struct exec_sink *sink, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    sink->length = 0;
+    sink->truncated = false;
+    int out[2] = { -1, -1 };
+    int copy[2] = { -1, -1 };
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    if (devnull == -1 || pipe2(out, O_CLOEXEC) == -1 ||
+            (sink->fd != -1 && sink->buffer != NULL && pipe2(copy, O_CLOEXEC) == -1)) {
+        goto fail;
+    }
+    // bigger pipes, fewer round trips; the limit for unprivileged users may refuse it
+    fcntl(out[1], F_SETPIPE_SZ, SINK_PIPE_SIZE);
+    if (copy[1] != -1) {
+        fcntl(copy[1], F_SETPIPE_SZ, SINK_PIPE_SIZE);
+    }
+
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        goto fail;
+    }
+    pid_t pid;
     fflush(stdout);
+    int ret = posix_spawn_file_actions_adddup2(&actions, out[1], STDOUT_FILENO);
+    if (ret == 0) {
+        ret = posix_spawn(&pid, command[0], &actions, NULL, command, environ);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    close(out[1]);
+    out[1] = -1;
+    if (ret != 0) {
+        goto fail;
+    }
 
-    int pid = fork();
-    if (pid == -1) {
-        // fork failed
-        close(fd);
-        return false;
-    } else if (pid == 0) {
-        // child process
-        dup2(fd, STDOUT_FILENO);
-        close(fd);
-        execv(command[0], command);
-        // execv failed
-        exit(1);
-    } else {
-        // parent process
-        close(fd);
-        int status;
-        waitpid(pid, &status, 0);
-        if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
-            return true;
+    bool forwarded = true;
+    while (1) {
+        ssize_t moved;
+        if (sink->fd != -1 && forwarded && copy[1] != -1) {
+            // duplicate what is in the pipe, forward the original and capture the copy
+            moved = tee(out[0], copy[1], SINK_PIPE_SIZE, 0);
+            if (moved == -1 && errno == EINTR) {
+                continue;
+            }
+            ssize_t done = 0;
+            while (moved > 0 && done < moved) {
+                ssize_t ret = move_chunk(out[0], sink->fd, moved - done);
+                if (ret <= 0) {
+                    // the rest of the output is only captured, this chunk already is through the copy
+                    forwarded = false;
+                    while (done < moved && (ret = move_chunk(out[0], devnull, moved - done)) > 0) {
+                        done += ret;
+                    }
+                    break;
+                }
+                done += ret;
+            }
+            if (moved > 0) {
+                capture_chunk(sink, copy[0], devnull, moved, true);
+            }
+        } else if (sink->fd != -1 && forwarded) {
+            moved = move_chunk(out[0], sink->fd, SINK_PIPE_SIZE);
+            if (moved == -1) {
+                forwarded = false;
+                continue;
+            }
         } else {
+            moved = capture_chunk(sink, out[0], devnull, SINK_PIPE_SIZE, false);
+        }
+        if (moved <= 0) {
+            if (moved == -1 && forwarded) {
+                forwarded = false;
+                continue;
+            }
+            break;
+        }
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            status = -1;
+            break;
+        }
+    }
+    close(out[0]);
+    close(devnull);
+    if (copy[0] != -1) {
+        close(copy[0]);
+        close(copy[1]);
+    }
+    return forwarded && status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+fail:
+    for (i = 0; i < 2; i++)
+    {
+        if (out[i] != -1) {
+            close(out[i]);
+        }
+        if (copy[i] != -1) {
+            close(copy[i]);
+        }
+    }
+    if (devnull != -1) {
+        close(devnull);
+    }
+    return false;
+}
+
+// Which descriptor of a command an epoll event is about
+struct exec_source {
+    struct exec_handle *handle;
+    bool output;
+};
+
+struct exec_handle {
+    pid_t pid;
+    int pidfd;
+    // read end of the stdout pipe, -1 without capture or once it reached end of file
+    int outfd;
+    struct exec_source pid_source;
+    struct exec_source out_source;
+    bool exited;
+    int status;
+    char *output;
+    size_t output_len;
+    size_t output_size;
+    // next finished command not returned by exec_wait_any yet
+    struct exec_handle *next;
+};
+
+struct exec_group {
+    int epfd;
+    int max_running;
+    // started and not finished, bounded by max_running
+    int running;
+    // started and not returned by exec_wait_any yet
+    int outstanding;
+    struct exec_handle *finished;
+    struct exec_handle *finished_tail;
+};
+
+/**
+ * @param max_running - how many commands started with exec_async() may run at once, at least 1
+ * @return a group to start commands in and wait for them together, NULL on failure
+*/
+struct exec_group *exec_group_create(int max_running)
+{
+    struct exec_group *group = calloc(1, sizeof(struct exec_group));
+    if (group == NULL) {
+        return NULL;
+    }
+    group->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (group->epfd == -1) {
+        free(group);
+        return NULL;
+    }
+    group->max_running = max_running > 0 ? max_running : 1;
+    return group;
+}
+
+// Reads what is available from the stdout pipe of @param handle @return true at end of file
+static bool read_output(struct exec_handle *handle)
+{
+    while (1) {
+        if (handle->output_len == handle->output_size) {
+            size_t size = handle->output_size == 0 ? CAPTURE_INITIAL_SIZE : handle->output_size * 2;
+            char *output = realloc(handle->output, size + 1);
+            if (output == NULL) {
+                // out of memory, the rest of the output is drained and dropped
+                char drain[4096];
+                ssize_t ret = read(handle->outfd, drain, sizeof(drain));
+                if (ret == 0 || (ret == -1 && errno != EINTR && errno != EAGAIN)) {
+                    return true;
+                }
+                if (ret == -1 && errno == EAGAIN) {
+                    return false;
+                }
+                continue;
+            }
+            handle->output = output;
+            handle->output_size = size;
+        }
+        ssize_t ret = read(handle->outfd, handle->output + handle->output_len,
+                handle->output_size - handle->output_len);
+        if (ret > 0) {
+            handle->output_len += ret;
+        } else if (ret == 0) {
+            return true;
+        } else if (errno == EAGAIN) {
             return false;
+        } else if (errno != EINTR) {
+            return true;
         }
     }
+}
 
-    va_end(args);
+// Queues @param handle as finished once its process exited and its output is complete
+static void finish_if_done(struct exec_group *group, struct exec_handle *handle)
+{
+    if (!handle->exited || handle->outfd != -1) {
+        return;
+    }
+    group->running--;
+    handle->next = NULL;
+    if (group->finished_tail != NULL) {
+        group->finished_tail->next = handle;
+    } else {
+        group->finished = handle;
+    }
+    group->finished_tail = handle;
+}
 
+/**
+ * Waits up to @param timeout_ms (-1 for no limit) for events on the commands of @param group
+ * @return false if epoll failed
+*/
+static bool poll_group(struct exec_group *group, int timeout_ms)
+{
+    struct epoll_event events[16];
+    int count = epoll_wait(group->epfd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+    if (count == -1) {
+        return errno == EINTR;
+    }
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        struct exec_source *source = events[i].data.ptr;
+        struct exec_handle *handle = source->handle;
+        if (source->output) {
+            if (read_output(handle)) {
+                epoll_ctl(group->epfd, EPOLL_CTL_DEL, handle->outfd, NULL);
+                close(handle->outfd);
+                handle->outfd = -1;
+                if (handle->output != NULL) {
+                    handle->output[handle->output_len] = '\0';
+                }
+            }
+        } else {
+            // the pidfd is readable once the process exited, reaping it keeps the status
+            siginfo_t info;
+            memset(&info, 0, sizeof(info));
+            if (waitid((idtype_t)P_PIDFD, handle->pidfd, &info, WEXITED) == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                handle->status = -1;
+            } else if (info.si_code == CLD_EXITED) {
+                handle->status = info.si_status << 8;
+            } else {
+                // killed or dumped, as waitpid() reports it
+                handle->status = info.si_status | (info.si_code == CLD_DUMPED ? 0x80 : 0);
+            }
+            epoll_ctl(group->epfd, EPOLL_CTL_DEL, handle->pidfd, NULL);
+            handle->exited = true;
+        }
+        finish_if_done(group, handle);
+    }
     return true;
 }
+
+/**
+* Starts a command like do_exec() without waiting for it.
+* @param group - the group it belongs to.  When max_running of its commands are running already,
+*   this waits for one of them to finish first.
+* @param capture - whether the standard output of the command is kept in memory, see exec_output()
+* @param count, ... - the command and its arguments, see do_exec()
+* @return a handle on the running command, backed by a pidfd, to get from exec_wait_any() once
+*   it finished, NULL if it could not be started
+*/
+struct exec_handle *exec_async(struct exec_group *group, bool capture, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
+    va_end(args);
+
+    while (group->running >= group->max_running) {
+        if (!poll_group(group, -1)) {
+            return NULL;
+        }
+    }
+
+    struct exec_handle *handle = calloc(1, sizeof(struct exec_handle));
+    if (handle == NULL) {
+        return NULL;
+    }
+    handle->pidfd = -1;
+    handle->outfd = -1;
+    handle->pid_source.handle = handle;
+    handle->out_source.handle = handle;
+    handle->out_source.output = true;
+
+    int pipefd[2] = { -1, -1 };
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        free(handle);
+        return NULL;
+    }
+    bool started = false;
+    if (!capture || (pipe2(pipefd, O_CLOEXEC) == 0 &&
+                posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO) == 0)) {
+        fflush(stdout);
+        started = posix_spawn(&handle->pid, command[0], &actions, NULL, command, environ) == 0;
+    }
+    posix_spawn_file_actions_destroy(&actions);
+    if (pipefd[1] != -1) {
+        close(pipefd[1]);
+    }
+    if (started) {
+        // the child is not reaped before waitid(), its pid can not be reused in between
+        handle->pidfd = syscall(SYS_pidfd_open, handle->pid, 0);
+    }
+    if (handle->pidfd == -1) {
+        if (started) {
+            waitpid(handle->pid, NULL, 0);
+        }
+        if (pipefd[0] != -1) {
+            close(pipefd[0]);
+        }
+        free(handle);
+        return NULL;
+    }
+
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = &handle->pid_source };
+    epoll_ctl(group->epfd, EPOLL_CTL_ADD, handle->pidfd, &event);
+    if (capture) {
+        handle->outfd = pipefd[0];
+        fcntl(handle->outfd, F_SETFL, O_NONBLOCK);
+        event.data.ptr = &handle->out_source;
+        epoll_ctl(group->epfd, EPOLL_CTL_ADD, handle->outfd, &event);
+    }
+    group->running++;
+    group->outstanding++;
+    return handle;
+}
+
+/**
+* @param group - the group whose commands to wait for
+* @param timeout_ms - how long to wait at most, -1 for no limit
+* @return the next command of @param group that finished, to release with exec_free(), or NULL
+*   if none did in time or none is left
+*/
+struct exec_handle *exec_wait_any(struct exec_group *group, int timeout_ms)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long deadline_ms = now.tv_sec * 1000LL + now.tv_nsec / 1000000 + timeout_ms;
+    int wait_ms = timeout_ms;
+    while (group->finished == NULL && group->outstanding > 0) {
+        if (!poll_group(group, wait_ms) || wait_ms == 0) {
+            break;
+        }
+        if (timeout_ms != -1) {
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long left = deadline_ms - (now.tv_sec * 1000LL + now.tv_nsec / 1000000);
+            // a last look without blocking once the time is up
+            wait_ms = left > 0 ? (int)left : 0;
+        }
+    }
+    struct exec_handle *handle = group->finished;
+    if (handle != NULL) {
+        group->finished = handle->next;
+        if (group->finished == NULL) {
+            group->finished_tail = NULL;
+        }
+        group->outstanding--;
+    }
+    return handle;
+}
+
+/**
+* @return the pidfd of the command of @param handle, readable once it exited and valid until exec_free()
+*/
+int exec_pidfd(const struct exec_handle *handle)
+{
+    return handle->pidfd;
+}
+
+/**
+* @return true if the finished command of @param handle exited with status 0, as do_exec()
+*/
+bool exec_succeeded(const struct exec_handle *handle)
+{
+    return handle->exited && WIFEXITED(handle->status) && WEXITSTATUS(handle->status) == 0;
+}
+
+/**
+* @return the wait status of the finished command of @param handle, as returned by waitpid()
+*/
+int exec_status(const struct exec_handle *handle)
+{
+    return handle->status;
+}
+
+/**
+* @return the NUL terminated standard output captured from the finished command of @param handle,
+*   its length in @param len if not NULL, NULL without capture
+*/
+const char *exec_output(const struct exec_handle *handle, size_t *len)
+{
+    if (len != NULL) {
+        *len = handle->output_len;
+    }
+    return handle->output;
+}
+
+void exec_free(struct exec_handle *handle)
+{
+    if (handle->pidfd != -1) {
+        close(handle->pidfd);
+    }
+    free(handle->output);
+    free(handle);
+}
+
+/**
+* Waits for the commands of @param group still running, releases those not returned by
+* exec_wait_any() yet, then @param group itself
+*/
+void exec_group_destroy(struct exec_group *group)
+{
+    struct exec_handle *handle;
+    while ((handle = exec_wait_any(group, -1)) != NULL) {
+        exec_free(handle);
+    }
+    close(group->epfd);
+    free(group);
+}
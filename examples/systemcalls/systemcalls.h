@@ -4,6 +4,44 @@
 
 bool do_system(const char *command);
 
+bool do_system_direct(const char *command);
+
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+// Destinations of the standard output of do_exec_sink()
+struct exec_sink {
+    // descriptor the output is forwarded to, -1 for none
+    int fd;
+    // memory the output is captured into, NULL for none
+    char *buffer;
+    size_t buffer_size;
+    // set by do_exec_sink(): bytes captured, and whether more did not fit
+    size_t length;
+    bool truncated;
+};
+
+bool do_exec_sink(struct exec_sink *sink, int count, ...);
+
+// Commands started together without waiting, see exec_async()
+struct exec_group;
+struct exec_handle;
+
+struct exec_group *exec_group_create(int max_running);
+
+struct exec_handle *exec_async(struct exec_group *group, bool capture, int count, ...);
+
+struct exec_handle *exec_wait_any(struct exec_group *group, int timeout_ms);
+
+int exec_pidfd(const struct exec_handle *handle);
+
+bool exec_succeeded(const struct exec_handle *handle);
+
+int exec_status(const struct exec_handle *handle);
+
+const char *exec_output(const struct exec_handle *handle, size_t *len);
+
+void exec_free(struct exec_handle *handle);
+
+void exec_group_destroy(struct exec_group *group);
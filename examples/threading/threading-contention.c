@@ -0,0 +1,103 @@
+/**
+ * @file threading-contention.c
+ * @brief Contention on the mutex handoff of threadfunc, measured with lockprof
+ *
+ * Starts the given number of threads with start_thread_obtaining_mutex, all on the same
+ * mutex, joins them and writes the lockprof report of the threadfunc lock site to stdout:
+ * how many acquisitions had to wait, the total wait and hold times and their histograms
+ * (lock_wait_ns and lock_hold_ns, buckets in ns).  With every thread holding the mutex for
+ * the release time, the last one to get it waits for about threads * release ms, the same
+ * serialization a single global mutex puts on the server's connection threads.
+ *
+ * Usage: threading-contention [-t threads] [-o obtain_ms] [-r release_ms]
+ *   -t  threads started (default 16)
+ *   -o  wait_to_obtain_ms of every thread (default 0)
+ *   -r  wait_to_release_ms of every thread (default 1)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "threading.h"
+#include "lockprof.h"
+
+#define DEFAULT_THREADS 16
+#define DEFAULT_OBTAIN_MS 0
+#define DEFAULT_RELEASE_MS 1
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = DEFAULT_THREADS;
+    int obtain_ms = DEFAULT_OBTAIN_MS;
+    int release_ms = DEFAULT_RELEASE_MS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:o:r:")) != -1) {
+        switch (opt) {
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'o':
+            obtain_ms = atoi(optarg);
+            break;
+        case 'r':
+            release_ms = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads] [-o obtain_ms] [-r release_ms]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (threads <= 0 || obtain_ms < 0 || release_ms < 0) {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+
+    pthread_t *ids = calloc(threads, sizeof(pthread_t));
+    if (ids == NULL) {
+        perror("calloc");
+        return 1;
+    }
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+    int status = 0;
+    int started;
+    uint64_t start = now_ns();
+    for (started = 0; started < threads; started++) {
+        if (!start_thread_obtaining_mutex(&ids[started], &mutex, obtain_ms, release_ms)) {
+            status = 1;
+            break;
+        }
+    }
+    int i;
+    for (i = 0; i < started; i++) {
+        void *result;
+        pthread_join(ids[i], &result);
+        struct thread_data *thread_func_args = (struct thread_data *) result;
+        if (!thread_func_args->thread_complete_success) {
+            status = 1;
+        }
+        free(thread_func_args);
+    }
+    uint64_t elapsed = now_ns() - start;
+
+    printf("# %d threads, obtain %d ms, release %d ms, %.1f ms\n", started, obtain_ms, release_ms,
+           (double)elapsed / 1000000.0);
+    lockprof_report(stdout);
+
+    if (status) {
+        fprintf(stderr, "Some threads failed\n");
+    }
+    free(ids);
+    return status;
+}
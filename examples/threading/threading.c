@@ -3,6 +3,14 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+// Built with -DTHREADING_LOCKPROF (see threading-contention.c) the mutex is profiled by the server's lockprof
+#ifdef THREADING_LOCKPROF
+#include "lockprof.h"
+#else
+#define lockprof_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define lockprof_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+#endif
+
 // Optional: use these functions to add debug or error prints to your application
 #define DEBUG_LOG(msg,...)
 //#define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
@@ -21,13 +29,13 @@ void* threadfunc(void* thread_param)
     usleep(thread_func_args->wait_to_obtain_ms * 1000);
     
     // Obtain the mutex
-    pthread_mutex_lock(thread_func_args->mutex);
+    lockprof_mutex_lock(thread_func_args->mutex);
     
     // Sleep for wait_to_release_ms milliseconds
     usleep(thread_func_args->wait_to_release_ms * 1000);
     
     // Release the mutex
-    pthread_mutex_unlock(thread_func_args->mutex);
+    lockprof_mutex_unlock(thread_func_args->mutex);
     thread_func_args->thread_complete_success = true;
     return thread_param;
 }
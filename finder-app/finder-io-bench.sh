@@ -0,0 +1,67 @@
+#!/bin/sh
+
+# Compares the file readers of finder on a tree of many small files, with a cold and a warm page cache:
+# io_uring (the default) and the thread pool fallback (FINDER_IO=threads), each with several worker counts.
+#
+# The tree is created once with a writer batch, 100 directories of <files>/100 files of about 2 KiB.
+# Cold runs drop the page cache first, which needs root; they are skipped otherwise.
+#
+# Prints CSV on stdout, one line per run:
+#   reader,cache,threads,files,lines,seconds
+#
+# Usage: finder-io-bench.sh [treedir] [files]
+#   treedir  defaults to /tmp/finder-io-bench
+#   files    defaults to 100000
+
+treedir=${1:-/tmp/finder-io-bench}
+files=${2:-100000}
+bindir=$(cd "$(dirname "$0")" && pwd)
+searchstr=needle
+
+if [ ! -d "$treedir" ]; then
+    manifest=$(mktemp)
+    line="lorem ipsum dolor sit amet consectetur adipiscing elit sed do eiusmod tempor\\n"
+    content=$(printf '%s' "$line$line$line$line$line$line$line$line$line$line$line$line")
+    content="$content$content${searchstr} in one line\\n"
+    per_dir=$((files / 100))
+    for d in $(seq 1 100); do
+        printf '%s/d%d/f%%d.txt\t%s\t%d\n' "$treedir" "$d" "$content" "$per_dir" >> "$manifest"
+    done
+    if ! "$bindir/writer" -m "$manifest"; then
+        echo "Error: could not create $treedir" >&2
+        rm -f "$manifest"
+        exit 1
+    fi
+    rm -f "$manifest"
+fi
+
+drop_caches() {
+    sync
+    echo 3 > /proc/sys/vm/drop_caches 2>/dev/null
+}
+
+if drop_caches; then
+    caches="cold warm"
+else
+    echo "Cannot drop the page cache (not root?), only warm runs" >&2
+    caches="warm"
+fi
+
+echo "reader,cache,threads,files,lines,seconds"
+for reader in uring threads; do
+    for threads in 1 4 16; do
+        for cache in $caches; do
+            if [ "$cache" = cold ]; then
+                drop_caches
+            else
+                # warm up
+                FINDER_IO=$reader FINDER_THREADS=$threads "$bindir/finder" "$treedir" "$searchstr" > /dev/null
+            fi
+            start=$(date +%s%N)
+            result=$(FINDER_IO=$reader FINDER_THREADS=$threads "$bindir/finder" "$treedir" "$searchstr" | tail -n 1)
+            end=$(date +%s%N)
+            counts=$(echo "$result" | sed -n 's/The number of files are \([0-9]*\) and the number of matching lines are \([0-9]*\)/\1,\2/p')
+            echo "$reader,$cache,$threads,$counts,$(echo "$start $end" | awk '{ printf "%.3f", ($2 - $1) / 1e9 }')"
+        done
+    done
+done
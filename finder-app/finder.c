@@ -0,0 +1,721 @@
+/*
+* Native replacement for finder.sh, with the same arguments and output:
+*   finder <filesdir> <searchstr>
+* prints "The number of files are X and the number of matching lines are Y" where X is the number of regular
+* files in filesdir and all its subdirectories and Y the number of lines of these files containing searchstr.
+
+* Both counts come out of a single traversal.  Directories are listed in parallel by a pool of workers
+* (FINDER_THREADS, default one per online CPU), each with its own deque of tasks: a worker takes its
+* newest task first and steals the oldest one of another worker when it runs out.  Listing a directory
+* queues its subdirectories and batches of its files, so wide directories are searched in parallel too.
+
+* Lines are counted with the SIMD search of search.c.  Counts follow "find -type f | wc -l" and
+* "grep -r | wc -l": symbolic links are neither counted nor followed, searchstr is matched as a fixed
+* string, and files holding a NUL byte count no lines since grep only reports them as "binary file
+* matches" on stderr.
+
+* Files are read through io_uring where the kernel supports it (see uring_reader.h): each worker keeps
+* many opens and reads in flight instead of waiting on one file at a time, which matters with a cold page
+* cache.  FINDER_IO=threads forces the fallback, where each worker opens and reads its files in turn.
+
+* With -i, a trigram index kept next to filesdir (see trigram_index.h) narrows the search down to
+* the files holding every trigram of searchstr.  The index is updated first, reading only the files
+* added or modified since, unless "finder -w <filesdir>" is running and keeping it current.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "search.h"
+#include "trigram_index.h"
+#include "uring_reader.h"
+
+// Files per queued batch
+#define FILE_BATCH 64
+// Files up to this size are read into the worker buffer, larger ones are mapped
+#define READ_BUFFER_SIZE (256 * 1024)
+#define DEQUE_INITIAL_SIZE 64
+// Files in flight per worker with io_uring, and their buffer: larger files are read again by the worker
+#define URING_DEPTH 32
+#define URING_BUFFER_SIZE (128 * 1024)
+// Quiet time after a change before the watcher updates the index
+#define INDEX_SETTLE_MS 500
+
+enum task_kind {
+    TASK_DIRECTORY,
+    TASK_FILES,
+};
+
+// Directory path shared by its listing task and its file batches
+struct dir_ref {
+    int refs;
+    char path[];
+};
+
+struct task {
+    enum task_kind kind;
+    struct dir_ref *dir;
+    int count;
+    char *names[FILE_BATCH];
+};
+
+// Tasks of one worker, taken by the owner at the bottom and stolen by the others at the top
+struct deque {
+    pthread_mutex_t lock;
+    struct task **items;
+    size_t capacity;
+    size_t top;
+    // read without the lock by idle workers
+    size_t count;
+};
+
+struct worker {
+    struct finder *finder;
+    int index;
+    pthread_t thread;
+    struct deque deque;
+    char *buffer;
+    // NULL when files are opened and read by the worker itself
+    struct uring_reader *reader;
+    unsigned long files;
+    unsigned long lines;
+};
+
+struct finder {
+    struct search search;
+    struct worker *workers;
+    int nworkers;
+    // queued and running tasks, the search is over when it drops to 0
+    size_t pending;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+    int sleepers;
+
+    // index mode: the files holding every trigram of the searched string
+    const struct trigram_index *index;
+    int rootfd;
+    const char *root;
+    const uint32_t *candidates;
+    size_t candidate_count;
+    size_t next_candidate;
+};
+
+static struct dir_ref *dir_ref_new(const char *parent, const char *name) {
+    size_t parent_len = strlen(parent);
+    size_t name_len = name != NULL ? strlen(name) : 0;
+    struct dir_ref *dir = malloc(sizeof(struct dir_ref) + parent_len + name_len + 2);
+    if (dir == NULL) {
+        return NULL;
+    }
+    dir->refs = 1;
+    memcpy(dir->path, parent, parent_len);
+    if (name != NULL) {
+        dir->path[parent_len] = '/';
+        memcpy(dir->path + parent_len + 1, name, name_len + 1);
+    } else {
+        dir->path[parent_len] = '\0';
+    }
+    return dir;
+}
+
+static void dir_ref_put(struct dir_ref *dir) {
+    if (__atomic_sub_fetch(&dir->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(dir);
+    }
+}
+
+static void deque_init(struct deque *deque) {
+    pthread_mutex_init(&deque->lock, NULL);
+    deque->items = NULL;
+    deque->capacity = 0;
+    deque->top = 0;
+    deque->count = 0;
+}
+
+static bool deque_push(struct deque *deque, struct task *task) {
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t capacity = deque->capacity == 0 ? DEQUE_INITIAL_SIZE : deque->capacity * 2;
+        struct task **items = malloc(capacity * sizeof(struct task *));
+        if (items == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return false;
+        }
+        // unwrap the ring into the new array
+        size_t i;
+        for (i = 0; i < deque->count; i++) {
+            items[i] = deque->items[(deque->top + i) % deque->capacity];
+        }
+        free(deque->items);
+        deque->items = items;
+        deque->capacity = capacity;
+        deque->top = 0;
+    }
+    deque->items[(deque->top + deque->count) % deque->capacity] = task;
+    __atomic_store_n(&deque->count, deque->count + 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&deque->lock);
+    return true;
+}
+
+// Newest task, for the owner
+static struct task *deque_pop(struct deque *deque) {
+    struct task *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        task = deque->items[(deque->top + deque->count - 1) % deque->capacity];
+        __atomic_store_n(&deque->count, deque->count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+// Oldest task, closest to the root, for thieves
+static struct task *deque_steal(struct deque *deque) {
+    if (__atomic_load_n(&deque->count, __ATOMIC_RELAXED) == 0) {
+        return NULL;
+    }
+    struct task *task = NULL;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count > 0) {
+        task = deque->items[deque->top];
+        deque->top = (deque->top + 1) % deque->capacity;
+        __atomic_store_n(&deque->count, deque->count - 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return task;
+}
+
+static bool work_available(struct finder *finder) {
+    int i;
+    for (i = 0; i < finder->nworkers; i++) {
+        if (__atomic_load_n(&finder->workers[i].deque.count, __ATOMIC_SEQ_CST) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Queues a task on the deque of @param worker and wakes up idle workers to steal it
+static bool submit(struct worker *worker, struct task *task) {
+    struct finder *finder = worker->finder;
+    __atomic_add_fetch(&finder->pending, 1, __ATOMIC_SEQ_CST);
+    if (!deque_push(&worker->deque, task)) {
+        __atomic_sub_fetch(&finder->pending, 1, __ATOMIC_SEQ_CST);
+        return false;
+    }
+    // pairs with the sleepers increment before the last work_available() check of an idle worker
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&finder->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&finder->idle_lock);
+        pthread_cond_signal(&finder->idle_cond);
+        pthread_mutex_unlock(&finder->idle_lock);
+    }
+    return true;
+}
+
+static struct task *task_new(enum task_kind kind, struct dir_ref *dir) {
+    struct task *task = malloc(sizeof(struct task));
+    if (task == NULL) {
+        return NULL;
+    }
+    task->kind = kind;
+    task->dir = dir;
+    task->count = 0;
+    return task;
+}
+
+static void task_free(struct task *task) {
+    int i;
+    for (i = 0; i < task->count; i++) {
+        free(task->names[i]);
+    }
+    dir_ref_put(task->dir);
+    free(task);
+}
+
+/**
+ * @return the number of lines of the @param len bytes at @param data containing the searched string
+ */
+static unsigned long count_matching_lines(struct finder *finder, const char *data, size_t len) {
+    unsigned long lines = search_count_lines(&finder->search, data, len);
+    if (lines > 0 && memchr(data, '\0', len) != NULL) {
+        return 0;
+    }
+    return lines;
+}
+
+static void search_file(struct worker *worker, int dirfd, const char *name, const char *dirpath) {
+    int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) {
+        fprintf(stderr, "finder: %s/%s: %s\n", dirpath, name, strerror(errno));
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        fprintf(stderr, "finder: %s/%s: %s\n", dirpath, name, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    if (st.st_size <= READ_BUFFER_SIZE) {
+        size_t len = 0;
+        ssize_t ret;
+        while (len < READ_BUFFER_SIZE && (ret = read(fd, worker->buffer + len, READ_BUFFER_SIZE - len)) != 0) {
+            if (ret == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "finder: %s/%s: %s\n", dirpath, name, strerror(errno));
+                break;
+            }
+            len += ret;
+        }
+        worker->lines += count_matching_lines(worker->finder, worker->buffer, len);
+    } else {
+        char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "finder: %s/%s: %s\n", dirpath, name, strerror(errno));
+        } else {
+            madvise(data, st.st_size, MADV_SEQUENTIAL);
+            worker->lines += count_matching_lines(worker->finder, data, st.st_size);
+            munmap(data, st.st_size);
+        }
+    }
+    close(fd);
+}
+
+struct file_batch {
+    struct worker *worker;
+    int dirfd;
+    const char *dirpath;
+    const char *const *names;
+};
+
+static void file_read(void *arg, size_t index, const char *data, size_t len, int err) {
+    struct file_batch *batch = arg;
+    const char *name = batch->names[index];
+    if (err == 0) {
+        batch->worker->lines += count_matching_lines(batch->worker->finder, data, len);
+    } else if (err == EFBIG || err == ECANCELED) {
+        search_file(batch->worker, batch->dirfd, name, batch->dirpath);
+    } else {
+        fprintf(stderr, "finder: %s/%s: %s\n", batch->dirpath, name, strerror(err));
+    }
+}
+
+// Searches the @param count files @param names of directory @param dirfd
+static void search_files(struct worker *worker, int dirfd, const char *dirpath, const char *const *names,
+        size_t count) {
+    if (worker->reader != NULL) {
+        struct file_batch batch = { worker, dirfd, dirpath, names };
+        int ret = uring_reader_run(worker->reader, dirfd, names, count, file_read, &batch);
+        if (ret != 0) {
+            // the files it missed were searched by file_read, the next ones are read directly
+            fprintf(stderr, "finder: io_uring: %s\n", strerror(ret));
+            uring_reader_destroy(worker->reader);
+            free(worker->reader);
+            worker->reader = NULL;
+        }
+        return;
+    }
+    size_t i;
+    for (i = 0; i < count; i++) {
+        search_file(worker, dirfd, names[i], dirpath);
+    }
+}
+
+static void run_files(struct worker *worker, struct task *task) {
+    int dirfd = open(task->dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirfd == -1) {
+        fprintf(stderr, "finder: %s: %s\n", task->dir->path, strerror(errno));
+        return;
+    }
+    search_files(worker, dirfd, task->dir->path, (const char *const *)task->names, task->count);
+    close(dirfd);
+}
+
+// @return the DT_* type of @param entry, looked up when the filesystem does not report it
+static unsigned char entry_type(int dirfd, struct dirent *entry) {
+    if (entry->d_type != DT_UNKNOWN) {
+        return entry->d_type;
+    }
+    struct stat st;
+    if (fstatat(dirfd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        return DT_UNKNOWN;
+    }
+    return S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+}
+
+// Queues every subdirectory and batches of the files of the directory of @param task
+static void run_directory(struct worker *worker, struct task *task) {
+    struct dir_ref *dir = task->dir;
+    int fd = open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *listing = fd != -1 ? fdopendir(fd) : NULL;
+    if (listing == NULL) {
+        fprintf(stderr, "finder: %s: %s\n", dir->path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return;
+    }
+
+    struct task *batch = NULL;
+    struct dirent *entry;
+    while ((entry = readdir(listing)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        unsigned char type = entry_type(fd, entry);
+        if (type == DT_DIR) {
+            struct dir_ref *subdir = dir_ref_new(dir->path, name);
+            struct task *subtask = subdir != NULL ? task_new(TASK_DIRECTORY, subdir) : NULL;
+            if (subtask == NULL || !submit(worker, subtask)) {
+                fprintf(stderr, "finder: %s/%s: %s\n", dir->path, name, strerror(ENOMEM));
+                if (subtask != NULL) {
+                    task_free(subtask);
+                } else {
+                    free(subdir);
+                }
+            }
+            continue;
+        }
+        if (type != DT_REG) {
+            continue;
+        }
+
+        worker->files++;
+        if (batch == NULL) {
+            __atomic_add_fetch(&dir->refs, 1, __ATOMIC_RELAXED);
+            batch = task_new(TASK_FILES, dir);
+            if (batch == NULL) {
+                dir_ref_put(dir);
+                fprintf(stderr, "finder: %s/%s: %s\n", dir->path, name, strerror(ENOMEM));
+                continue;
+            }
+        }
+        batch->names[batch->count] = strdup(name);
+        if (batch->names[batch->count] == NULL) {
+            fprintf(stderr, "finder: %s/%s: %s\n", dir->path, name, strerror(ENOMEM));
+            continue;
+        }
+        if (++batch->count == FILE_BATCH) {
+            if (!submit(worker, batch)) {
+                run_files(worker, batch);
+                task_free(batch);
+            }
+            batch = NULL;
+        }
+    }
+    closedir(listing);
+
+    // the last partial batch is searched right away, there is nothing left to share here
+    if (batch != NULL) {
+        run_files(worker, batch);
+        task_free(batch);
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *worker = arg;
+    struct finder *finder = worker->finder;
+    int victim = worker->index;
+
+    while (1) {
+        struct task *task = deque_pop(&worker->deque);
+        int tries;
+        for (tries = 1; task == NULL && tries < finder->nworkers; tries++) {
+            victim = (victim + 1) % finder->nworkers;
+            if (victim != worker->index) {
+                task = deque_steal(&finder->workers[victim].deque);
+            }
+        }
+
+        if (task == NULL) {
+            // nothing to steal, sleep until new tasks are queued or the last one completes
+            pthread_mutex_lock(&finder->idle_lock);
+            __atomic_add_fetch(&finder->sleepers, 1, __ATOMIC_SEQ_CST);
+            while (__atomic_load_n(&finder->pending, __ATOMIC_SEQ_CST) != 0 && !work_available(finder)) {
+                pthread_cond_wait(&finder->idle_cond, &finder->idle_lock);
+            }
+            __atomic_sub_fetch(&finder->sleepers, 1, __ATOMIC_SEQ_CST);
+            bool done = __atomic_load_n(&finder->pending, __ATOMIC_SEQ_CST) == 0;
+            pthread_mutex_unlock(&finder->idle_lock);
+            if (done) {
+                break;
+            }
+            continue;
+        }
+
+        if (task->kind == TASK_DIRECTORY) {
+            run_directory(worker, task);
+        } else {
+            run_files(worker, task);
+        }
+        task_free(task);
+
+        if (__atomic_sub_fetch(&finder->pending, 1, __ATOMIC_SEQ_CST) == 0) {
+            pthread_mutex_lock(&finder->idle_lock);
+            pthread_cond_broadcast(&finder->idle_cond);
+            pthread_mutex_unlock(&finder->idle_lock);
+        }
+    }
+    return NULL;
+}
+
+static int worker_count(void) {
+    const char *env = getenv("FINDER_THREADS");
+    long count = env != NULL ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) {
+        count = 1;
+    }
+    return count > 256 ? 256 : (int)count;
+}
+
+// Runs @param start_routine on every worker until they all return
+static void run_workers(struct finder *finder, void *(*start_routine)(void *)) {
+    int started;
+    for (started = 0; started < finder->nworkers; started++) {
+        struct worker *worker = &finder->workers[started];
+        if (pthread_create(&worker->thread, NULL, start_routine, worker) != 0) {
+            if (started == 0) {
+                fprintf(stderr, "pthread_create failed\n");
+                exit(1);
+            }
+            // the workers already running take everything anyway
+            break;
+        }
+    }
+    int i;
+    for (i = 0; i < started; i++) {
+        pthread_join(finder->workers[i].thread, NULL);
+    }
+}
+
+// Searches the candidates of the index mode, each worker taking the next batch until none is left
+static void *verify_main(void *arg) {
+    struct worker *worker = arg;
+    struct finder *finder = worker->finder;
+    const char *names[FILE_BATCH];
+    size_t first;
+    while ((first = __atomic_fetch_add(&finder->next_candidate, FILE_BATCH, __ATOMIC_RELAXED)) <
+            finder->candidate_count) {
+        size_t count = finder->candidate_count - first < FILE_BATCH ? finder->candidate_count - first : FILE_BATCH;
+        size_t i;
+        for (i = 0; i < count; i++) {
+            names[i] = trigram_index_path(finder->index, finder->candidates[first + i]);
+        }
+        search_files(worker, finder->rootfd, finder->root, names, count);
+    }
+    return NULL;
+}
+
+/**
+ * @return the path of the index of @param filesdir, next to it: the canonical path is used so
+ *  that "." or "dir/.." still put it in the parent directory rather than in the tree
+ */
+static char *index_path(const char *filesdir) {
+    char *canonical = realpath(filesdir, NULL);
+    const char *dir = canonical != NULL ? canonical : filesdir;
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') {
+        len--;
+    }
+    char *path = malloc(len + sizeof(TRIGRAM_INDEX_SUFFIX));
+    if (path == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    memcpy(path, dir, len);
+    memcpy(path + len, TRIGRAM_INDEX_SUFFIX, sizeof(TRIGRAM_INDEX_SUFFIX));
+    free(canonical);
+    return path;
+}
+
+/**
+ * Index mode: brings the index of @param filesdir up to date unless a watcher keeps it current,
+ * then only searches the files holding every trigram of searchstr
+ * @return the number of files of filesdir
+ */
+static unsigned long run_indexed(struct finder *finder, const char *filesdir) {
+    char *path = index_path(filesdir);
+    struct trigram_index index;
+    int ret = trigram_index_open(&index, path);
+    if (ret != 0) {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(ret));
+    }
+    if (!trigram_index_live(path)) {
+        bool changed;
+        ret = trigram_index_update(&index, filesdir, finder->nworkers, &changed);
+        if (ret != 0) {
+            fprintf(stderr, "finder: indexing %s: %s\n", filesdir, strerror(ret));
+            exit(1);
+        }
+        // a read only parent only costs the next query a full indexing
+        if (changed && (ret = trigram_index_write(&index, path)) != 0) {
+            fprintf(stderr, "finder: %s: %s\n", path, strerror(ret));
+        }
+    }
+
+    uint32_t *candidates;
+    long count = trigram_index_candidates(&index, finder->search.needle, finder->search.len, &candidates);
+    finder->rootfd = open(filesdir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (count < 0 || finder->rootfd == -1) {
+        perror(filesdir);
+        exit(1);
+    }
+    finder->index = &index;
+    finder->root = filesdir;
+    finder->candidates = candidates;
+    finder->candidate_count = count;
+    finder->next_candidate = 0;
+    run_workers(finder, verify_main);
+
+    unsigned long files = index.file_count;
+    close(finder->rootfd);
+    free(candidates);
+    trigram_index_close(&index);
+    free(path);
+    return files;
+}
+
+int main(int argc, char *argv[]) {
+    bool use_index = false;
+    bool watch = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "iw")) != -1) {
+        switch (opt) {
+        case 'i':
+            use_index = true;
+            break;
+        case 'w':
+            watch = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-i] <filesdir> <searchstr>\n       %s -w <filesdir>\n", argv[0], argv[0]);
+            exit(1);
+        }
+    }
+
+    if (watch) {
+        if (argc - optind != 1) {
+            printf("Error: Please provide the path to a directory.\n");
+            exit(1);
+        }
+        const char *filesdir = argv[optind];
+        char *path = index_path(filesdir);
+        int ret = trigram_index_watch(filesdir, path, worker_count(), INDEX_SETTLE_MS);
+        if (ret != 0) {
+            fprintf(stderr, "finder: watching %s: %s\n", filesdir,
+                    ret == EBUSY ? "already watched" : strerror(ret));
+            exit(1);
+        }
+        free(path);
+        return 0;
+    }
+
+    // Check if the required arguments are provided
+    if (argc - optind != 2) {
+        printf("Error: Please provide the path to a directory and a search string.\n");
+        exit(1);
+    }
+
+    const char *filesdir = argv[optind];
+    const char *searchstr = argv[optind + 1];
+    printf("filesdir: %s\n", filesdir);
+    printf("searchstr: %s\n", searchstr);
+
+    // Check if filesdir is a directory
+    struct stat st;
+    if (stat(filesdir, &st) == -1 || !S_ISDIR(st.st_mode)) {
+        printf("Error: %s is not a directory.\n", filesdir);
+        exit(1);
+    }
+    fflush(stdout);
+
+    struct finder finder;
+    search_init(&finder.search, searchstr, strlen(searchstr));
+    finder.nworkers = worker_count();
+    finder.pending = 0;
+    finder.sleepers = 0;
+    pthread_mutex_init(&finder.idle_lock, NULL);
+    pthread_cond_init(&finder.idle_cond, NULL);
+    finder.workers = calloc(finder.nworkers, sizeof(struct worker));
+    if (finder.workers == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+
+    const char *io = getenv("FINDER_IO");
+    bool use_uring = io == NULL || strcmp(io, "threads") != 0;
+    int i;
+    for (i = 0; i < finder.nworkers; i++) {
+        struct worker *worker = &finder.workers[i];
+        worker->finder = &finder;
+        worker->index = i;
+        deque_init(&worker->deque);
+        worker->buffer = malloc(READ_BUFFER_SIZE);
+        if (worker->buffer == NULL) {
+            perror("malloc");
+            exit(1);
+        }
+        if (use_uring) {
+            worker->reader = malloc(sizeof(struct uring_reader));
+            int ret = ENOMEM;
+            if (worker->reader != NULL) {
+                ret = uring_reader_init(worker->reader, URING_DEPTH, URING_BUFFER_SIZE);
+            }
+            if (ret != 0) {
+                // the workers read their files themselves, only worth a word when io_uring was asked for
+                if (io != NULL) {
+                    fprintf(stderr, "finder: io_uring: %s, reading files directly\n", strerror(ret));
+                }
+                free(worker->reader);
+                worker->reader = NULL;
+                use_uring = false;
+            }
+        }
+    }
+
+    unsigned long files = 0;
+    unsigned long lines = 0;
+    if (use_index) {
+        files = run_indexed(&finder, filesdir);
+    } else {
+        // the root is queued before any worker runs, so none of them sees an empty search
+        struct dir_ref *root = dir_ref_new(filesdir, NULL);
+        struct task *task = root != NULL ? task_new(TASK_DIRECTORY, root) : NULL;
+        if (task == NULL || !submit(&finder.workers[0], task)) {
+            perror("malloc");
+            exit(1);
+        }
+        run_workers(&finder, worker_main);
+    }
+
+    for (i = 0; i < finder.nworkers; i++) {
+        files += finder.workers[i].files;
+        lines += finder.workers[i].lines;
+        free(finder.workers[i].buffer);
+        if (finder.workers[i].reader != NULL) {
+            uring_reader_destroy(finder.workers[i].reader);
+            free(finder.workers[i].reader);
+        }
+        free(finder.workers[i].deque.items);
+        pthread_mutex_destroy(&finder.workers[i].deque.lock);
+    }
+    free(finder.workers);
+
+    // Print the result
+    printf("The number of files are %lu and the number of matching lines are %lu\n", files, lines);
+    return 0;
+}
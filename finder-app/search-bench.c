@@ -0,0 +1,251 @@
+/**
+ * @file search-bench.c
+ * @brief Throughput of the search_count_lines implementations against memmem and grep
+ *
+ * Counts the lines containing a fixed string in synthetic corpora of random words, for
+ * several corpus sizes and fractions of lines holding the string, with each implementation
+ * supported by the CPU, with a memmem loop skipping to the end of each matching line, and
+ * with "grep -c -F" on the corpus written to a temporary file (process startup included).
+ * All of them must report the same count.
+ *
+ * Results are printed as CSV on stdout, one line per measurement:
+ *   implementation,corpus_size,density,iterations,lines,ns_per_byte,gb_per_s
+ *
+ * Usage: search-bench [-n iterations] [-s needle] [-G] [-H]
+ *   -n  number of scans of each corpus per measurement (default: 256 MiB worth, at least 1)
+ *   -s  string to search for (default "aesd_needle")
+ *   -G  do not run grep
+ *   -H  do not print the CSV header line
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "search.h"
+
+#define DEFAULT_NEEDLE "aesd_needle"
+#define BYTES_PER_MEASUREMENT (256UL * 1024 * 1024)
+
+static const size_t corpus_sizes[] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024, 64 * 1024 * 1024 };
+static const double densities[] = { 0.0, 0.001, 0.1, 1.0 };
+static const char *impl_names[] = { "avx2", "sse2", "scalar" };
+
+/* Keeps the compiler from discarding the measured calls */
+static volatile unsigned long sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void report(const char *impl, size_t size, double density, unsigned long iterations,
+            unsigned long lines, uint64_t elapsed_ns)
+{
+    double ns_per_byte = (double)elapsed_ns / ((double)iterations * size);
+    printf("%s,%zu,%g,%lu,%lu,%.4f,%.3f\n", impl, size, density, iterations, lines,
+            ns_per_byte, ns_per_byte > 0 ? 1.0 / ns_per_byte : 0.0);
+}
+
+/**
+ * Fills @param buf with lines of 20 to 100 random lowercase words and spaces, a fraction
+ * @param density of them holding @param needle at a random position
+ */
+static void fill_corpus(char *buf, size_t size, const char *needle, double density)
+{
+    size_t needle_len = strlen(needle);
+    size_t pos = 0;
+    while (pos < size) {
+        size_t line_len = 20 + rand() % 81;
+        size_t end = pos + line_len < size ? pos + line_len : size;
+        size_t i;
+        for (i = pos; i < end; i++) {
+            buf[i] = rand() % 6 == 0 ? ' ' : 'a' + rand() % 26;
+        }
+        if (end - pos > needle_len && (double)rand() / RAND_MAX < density) {
+            memcpy(buf + pos + rand() % (end - pos - needle_len), needle, needle_len);
+        }
+        if (end < size) {
+            buf[end++] = '\n';
+        }
+        pos = end;
+    }
+}
+
+static unsigned long count_memmem(const char *data, size_t len, const char *needle, size_t needle_len)
+{
+    unsigned long lines = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        const char *match = memmem(data + pos, len - pos, needle, needle_len);
+        if (match == NULL) {
+            break;
+        }
+        lines++;
+        const char *eol = memchr(match, '\n', data + len - match);
+        if (eol == NULL) {
+            break;
+        }
+        pos = eol + 1 - data;
+    }
+    return lines;
+}
+
+/**
+ * Runs grep -c -F on the corpus written to @param path
+ * @return its count, -1 on failure
+ */
+static long count_grep(const char *path, const char *needle)
+{
+    char command[512];
+    snprintf(command, sizeof(command), "grep -c -F -e '%s' '%s'", needle, path);
+    FILE *out = popen(command, "r");
+    if (out == NULL) {
+        return -1;
+    }
+    long count = -1;
+    if (fscanf(out, "%ld", &count) != 1) {
+        count = -1;
+    }
+    pclose(out);
+    return count;
+}
+
+static int write_corpus(const char *path, const char *buf, size_t size)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    size_t written = fwrite(buf, 1, size, file);
+    if (fclose(file) != 0 || written != size) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations_opt = 0;
+    const char *needle = DEFAULT_NEEDLE;
+    int run_grep = 1;
+    int header = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:GH")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations_opt = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            needle = optarg;
+            break;
+        case 'G':
+            run_grep = 0;
+            break;
+        case 'H':
+            header = 0;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-n iterations] [-s needle] [-G] [-H]\n", argv[0]);
+            return 1;
+        }
+    }
+    size_t needle_len = strlen(needle);
+    if (needle_len == 0 || strchr(needle, '\n') != NULL || strchr(needle, '\'') != NULL) {
+        fprintf(stderr, "The needle must be a non empty line without quotes\n");
+        return 1;
+    }
+
+    size_t max_size = corpus_sizes[sizeof(corpus_sizes) / sizeof(corpus_sizes[0]) - 1];
+    char *buf = malloc(max_size);
+    if (buf == NULL) {
+        perror("malloc");
+        return 1;
+    }
+    char path[] = "/tmp/search-bench-XXXXXX";
+    if (run_grep) {
+        int fd = mkstemp(path);
+        if (fd == -1) {
+            perror("mkstemp");
+            return 1;
+        }
+        close(fd);
+    }
+
+    struct search search;
+    search_init(&search, needle, needle_len);
+    if (header) {
+        printf("implementation,corpus_size,density,iterations,lines,ns_per_byte,gb_per_s\n");
+    }
+
+    int status = 0;
+    size_t s, d, k;
+    for (s = 0; s < sizeof(corpus_sizes) / sizeof(corpus_sizes[0]); s++) {
+        size_t size = corpus_sizes[s];
+        unsigned long iterations = iterations_opt;
+        if (iterations == 0) {
+            iterations = BYTES_PER_MEASUREMENT / size > 0 ? BYTES_PER_MEASUREMENT / size : 1;
+        }
+        for (d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+            srand(s * 16 + d + 1);
+            fill_corpus(buf, size, needle, densities[d]);
+            unsigned long expected = count_memmem(buf, size, needle, needle_len);
+            unsigned long i;
+
+            for (k = 0; k < sizeof(impl_names) / sizeof(impl_names[0]); k++) {
+                if (search_select(impl_names[k]) != 0) {
+                    continue;
+                }
+                unsigned long lines = search_count_lines(&search, buf, size);
+                if (lines != expected) {
+                    fprintf(stderr, "%s counted %lu lines instead of %lu (size %zu, density %g)\n",
+                            impl_names[k], lines, expected, size, densities[d]);
+                    status = 1;
+                }
+                uint64_t start = now_ns();
+                for (i = 0; i < iterations; i++) {
+                    sink = search_count_lines(&search, buf, size);
+                }
+                report(impl_names[k], size, densities[d], iterations, lines, now_ns() - start);
+            }
+
+            uint64_t start = now_ns();
+            for (i = 0; i < iterations; i++) {
+                sink = count_memmem(buf, size, needle, needle_len);
+            }
+            report("memmem", size, densities[d], iterations, expected, now_ns() - start);
+
+            if (run_grep && write_corpus(path, buf, size) == 0) {
+                // a few runs are enough to amortize nothing, grep pays its startup every time
+                unsigned long runs = iterations < 4 ? iterations : 4;
+                long lines = 0;
+                start = now_ns();
+                for (i = 0; i < runs; i++) {
+                    lines = count_grep(path, needle);
+                }
+                if (lines != (long)expected) {
+                    fprintf(stderr, "grep counted %ld lines instead of %lu (size %zu, density %g)\n",
+                            lines, expected, size, densities[d]);
+                    status = 1;
+                }
+                report("grep", size, densities[d], runs, lines < 0 ? 0 : lines, now_ns() - start);
+            }
+        }
+    }
+
+    if (run_grep) {
+        unlink(path);
+    }
+    free(buf);
+    return status;
+}
@@ -0,0 +1,247 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "search.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SEARCH_X86
+#include <immintrin.h>
+#endif
+
+typedef unsigned long (*search_count_fn)(const struct search *search, const char *data, size_t len,
+        size_t start, unsigned long lines);
+
+struct search_impl {
+    const char *name;
+    search_count_fn count;
+    int (*supported)(void);
+};
+
+void search_init(struct search *search, const char *needle, size_t len) {
+    search->needle = needle;
+    search->len = len;
+}
+
+// Whether the string of @param search is at @param at, whose first and last bytes already matched
+static inline int verify(const struct search *search, const char *at) {
+    return search->len <= 2 || memcmp(at + 1, search->needle + 1, search->len - 2) == 0;
+}
+
+/**
+ * Verifies the candidates of a block of @param width bytes at @param base, bit n of
+ * @param candidates and @param newlines standing for byte base + n, and counts the matching lines
+ * @return the offset to resume scanning from: the next block, or the start of the line following
+ * a match whose newline lies beyond the block (len if there is none)
+ */
+static inline size_t block_lines(const struct search *search, const char *data, size_t len, size_t base,
+        size_t width, uint64_t candidates, uint64_t newlines, unsigned long *lines) {
+    while (candidates != 0) {
+        unsigned bit = __builtin_ctzll(candidates);
+        if (!verify(search, data + base + bit)) {
+            candidates &= candidates - 1;
+            continue;
+        }
+        (*lines)++;
+        // skip the rest of the line, a line counts once
+        uint64_t after = newlines & (~0ULL << bit);
+        if (after == 0) {
+            const char *eol = memchr(data + base + width, '\n', len - base - width);
+            return eol != NULL ? (size_t)(eol - data) + 1 : len;
+        }
+        unsigned eol = __builtin_ctzll(after);
+        candidates &= eol + 1 < 64 ? ~0ULL << (eol + 1) : 0;
+    }
+    return base + width;
+}
+
+// Byte loop from @param start, for the tails of the block loops
+static unsigned long count_bytes(const struct search *search, const char *data, size_t len, size_t start,
+        unsigned long lines) {
+    const char first = search->needle[0];
+    const char last = search->needle[search->len - 1];
+    size_t i = start;
+    while (i + search->len <= len) {
+        if (data[i] == first && data[i + search->len - 1] == last && verify(search, data + i)) {
+            lines++;
+            const char *eol = memchr(data + i, '\n', len - i);
+            if (eol == NULL) {
+                break;
+            }
+            i = eol - data + 1;
+        } else {
+            i++;
+        }
+    }
+    return lines;
+}
+
+static inline uint64_t load_word(const char *at) {
+    uint64_t word;
+    memcpy(&word, at, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    // byte n of the block in bits 8n..8n+7 as on little endian
+    word = __builtin_bswap64(word);
+#endif
+    return word;
+}
+
+// Bit n set for each zero byte n of @param word: ~(((x & 0x7f..) + 0x7f..) | x | 0x7f..) is exact
+static inline uint64_t zero_bytes(uint64_t word) {
+    const uint64_t lows = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t high = ~(((word & lows) + lows) | word | lows);
+    uint64_t mask = 0;
+    while (high != 0) {
+        mask |= 1ULL << (__builtin_ctzll(high) / 8);
+        high &= high - 1;
+    }
+    return mask;
+}
+
+// Portable scan, 8 bytes at a time
+static unsigned long count_scalar(const struct search *search, const char *data, size_t len, size_t start,
+        unsigned long lines) {
+    const uint64_t ones = 0x0101010101010101ULL;
+    const uint64_t first = ones * (unsigned char)search->needle[0];
+    const uint64_t last = ones * (unsigned char)search->needle[search->len - 1];
+    const uint64_t newline = ones * '\n';
+    size_t i = start;
+
+    while (i + search->len - 1 + 8 <= len) {
+        uint64_t word = load_word(data + i);
+        uint64_t candidates = zero_bytes((word ^ first) | (load_word(data + i + search->len - 1) ^ last));
+        if (candidates == 0) {
+            i += 8;
+            continue;
+        }
+        i = block_lines(search, data, len, i, 8, candidates, zero_bytes(word ^ newline), &lines);
+    }
+    return count_bytes(search, data, len, i, lines);
+}
+
+static int scalar_supported(void) {
+    return 1;
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("sse2")))
+static unsigned long count_sse2(const struct search *search, const char *data, size_t len, size_t start,
+        unsigned long lines) {
+    const __m128i first = _mm_set1_epi8(search->needle[0]);
+    const __m128i last = _mm_set1_epi8(search->needle[search->len - 1]);
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = start;
+
+    // two blocks per iteration, the common no candidate case costs one test
+    while (i + search->len - 1 + 32 <= len) {
+        __m128i head0 = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i head1 = _mm_loadu_si128((const __m128i *)(data + i + 16));
+        __m128i tail0 = _mm_loadu_si128((const __m128i *)(data + i + search->len - 1));
+        __m128i tail1 = _mm_loadu_si128((const __m128i *)(data + i + search->len - 1 + 16));
+        uint64_t m0 = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head0, first),
+                _mm_cmpeq_epi8(tail0, last)));
+        uint64_t m1 = (unsigned)_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(head1, first),
+                _mm_cmpeq_epi8(tail1, last)));
+        uint64_t candidates = m0 | (m1 << 16);
+        if (candidates == 0) {
+            i += 32;
+            continue;
+        }
+        uint64_t newlines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(head0, newline)) |
+                ((uint64_t)(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(head1, newline)) << 16);
+        i = block_lines(search, data, len, i, 32, candidates, newlines, &lines);
+    }
+    return count_scalar(search, data, len, i, lines);
+}
+
+__attribute__((target("avx2")))
+static unsigned long count_avx2(const struct search *search, const char *data, size_t len, size_t start,
+        unsigned long lines) {
+    const __m256i first = _mm256_set1_epi8(search->needle[0]);
+    const __m256i last = _mm256_set1_epi8(search->needle[search->len - 1]);
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = start;
+
+    while (i + search->len - 1 + 64 <= len) {
+        __m256i head0 = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i head1 = _mm256_loadu_si256((const __m256i *)(data + i + 32));
+        __m256i tail0 = _mm256_loadu_si256((const __m256i *)(data + i + search->len - 1));
+        __m256i tail1 = _mm256_loadu_si256((const __m256i *)(data + i + search->len - 1 + 32));
+        uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head0, first),
+                _mm256_cmpeq_epi8(tail0, last)));
+        uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(head1, first),
+                _mm256_cmpeq_epi8(tail1, last)));
+        uint64_t candidates = lo | (hi << 32);
+        if (candidates == 0) {
+            i += 64;
+            continue;
+        }
+        uint64_t newlines = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(head0, newline)) |
+                ((uint64_t)(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(head1, newline)) << 32);
+        i = block_lines(search, data, len, i, 64, candidates, newlines, &lines);
+    }
+    return count_sse2(search, data, len, i, lines);
+}
+
+static int sse2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+// In order of preference
+static const struct search_impl impls[] = {
+#ifdef SEARCH_X86
+    { "avx2", count_avx2, avx2_supported },
+    { "sse2", count_sse2, sse2_supported },
+#endif
+    { "scalar", count_scalar, scalar_supported },
+};
+
+static const struct search_impl *current;
+
+static const struct search_impl *search_resolve(void) {
+    const struct search_impl *impl = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    size_t i;
+    for (i = 0; impl == NULL && i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (impls[i].supported()) {
+            impl = &impls[i];
+            // concurrent first calls all pick the same entry
+            __atomic_store_n(&current, impl, __ATOMIC_RELEASE);
+        }
+    }
+    return impl;
+}
+
+unsigned long search_count_lines(const struct search *search, const char *data, size_t len) {
+    if (search->len == 0) {
+        // every line matches the empty string
+        unsigned long lines = 0;
+        const char *end = data + len;
+        const char *eol;
+        for (eol = data; (eol = memchr(eol, '\n', end - eol)) != NULL; eol++) {
+            lines++;
+        }
+        return lines + (len > 0 && data[len - 1] != '\n');
+    }
+    return search_resolve()->count(search, data, len, 0, 0);
+}
+
+const char *search_impl(void) {
+    return search_resolve()->name;
+}
+
+int search_select(const char *name) {
+    size_t i;
+    for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+        if (strcmp(impls[i].name, name) == 0 && impls[i].supported()) {
+            __atomic_store_n(&current, &impls[i], __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
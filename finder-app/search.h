@@ -0,0 +1,45 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+/*
+* Counting of the lines containing a fixed string, the way finder.sh counts matching lines.
+*
+* Candidates are found a block at a time by comparing the block with the first byte of the
+* string and the block shifted by its length - 1 with its last byte, only positions where
+* both match are verified.  Newlines are located in the same block once a match is verified
+* so that the scan resumes on the next line and each line counts once.  The implementation
+* is picked at first use from what the CPU supports: AVX2, SSE2, or a portable word at a
+* time scalar loop.
+*/
+
+struct search {
+    const char *needle;
+    size_t len;
+};
+
+/**
+ * Prepares @param search to look for the @param len bytes at @param needle, which must
+ * outlive it
+ */
+void search_init(struct search *search, const char *needle, size_t len);
+
+/**
+ * @return the number of lines of the @param len bytes at @param data containing the string of
+ * @param search, a last line without newline included
+ */
+unsigned long search_count_lines(const struct search *search, const char *data, size_t len);
+
+/**
+ * @return the name of the implementation search_count_lines uses: "avx2", "sse2" or "scalar"
+ */
+const char *search_impl(void);
+
+/**
+ * Forces search_count_lines to use the implementation named @param name, for benchmarks
+ * @return 0 on success, -1 if it is unknown or not supported by this CPU
+ */
+int search_select(const char *name);
+
+#endif /* SEARCH_H */
@@ -0,0 +1,904 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trigram_index.h"
+
+#define TRIGRAM_SPACE (1U << 24)
+#define EXTRACT_CHUNK (1024 * 1024)
+#define NO_FILE UINT32_MAX
+
+// A regular file found by the walk, with its trigrams once read
+struct walk_file {
+    char *path;
+    uint64_t size;
+    int64_t mtime_ns;
+    // id in the previous index when unchanged since, -1 otherwise
+    int64_t old;
+    uint32_t flags;
+    uint32_t count;
+    uint32_t *trigrams;
+};
+
+struct walk {
+    struct walk_file *files;
+    size_t count;
+    size_t capacity;
+    // subdirectories relative to the root, for the watcher
+    char **dirs;
+    size_t dir_count;
+    size_t dir_capacity;
+};
+
+struct extractor {
+    int rootfd;
+    struct walk_file **jobs;
+    size_t count;
+    size_t next;
+    int error;
+};
+
+static int64_t mtime_ns(const struct stat *st) {
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static void walk_free(struct walk *walk) {
+    size_t i;
+    for (i = 0; i < walk->count; i++) {
+        free(walk->files[i].path);
+        free(walk->files[i].trigrams);
+    }
+    for (i = 0; i < walk->dir_count; i++) {
+        free(walk->dirs[i]);
+    }
+    free(walk->files);
+    free(walk->dirs);
+}
+
+static char *path_join(const char *dir, const char *name) {
+    size_t dir_len = strlen(dir);
+    size_t name_len = strlen(name);
+    char *path = malloc(dir_len + name_len + 2);
+    if (path == NULL) {
+        return NULL;
+    }
+    if (dir_len > 0) {
+        memcpy(path, dir, dir_len);
+        path[dir_len++] = '/';
+    }
+    memcpy(path + dir_len, name, name_len + 1);
+    return path;
+}
+
+/**
+ * @return whether @param name is an index, its lock or a temporary index being written:
+ *  "*.finder-index", "*.finder-index.lock" or "*.finder-index.<pid>.tmp"
+ */
+static bool is_index_file(const char *name) {
+    const char *suffix = strstr(name, TRIGRAM_INDEX_SUFFIX);
+    while (suffix != NULL) {
+        const char *rest = suffix + strlen(TRIGRAM_INDEX_SUFFIX);
+        if (*rest == '\0' || strcmp(rest, TRIGRAM_INDEX_LOCK_SUFFIX) == 0) {
+            return true;
+        }
+        if (*rest == '.') {
+            size_t digits = strspn(rest + 1, "0123456789");
+            if (digits > 0 && strcmp(rest + 1 + digits, ".tmp") == 0) {
+                return true;
+            }
+        }
+        suffix = strstr(suffix + 1, TRIGRAM_INDEX_SUFFIX);
+    }
+    return false;
+}
+
+/**
+ * Records every regular file and directory below the directory @param fd, at @param path relative
+ * to the root, like "find -type f": symbolic links are not followed, and the files of an index
+ * (is_index_file) are left out so an index kept inside the tree never indexes itself
+ * @return 0 on success, ENOMEM, unreadable subdirectories are reported and skipped
+ */
+static int walk_dir(struct walk *walk, int fd, const char *path) {
+    DIR *listing = fdopendir(fd);
+    if (listing == NULL) {
+        fprintf(stderr, "finder: %s: %s\n", path, strerror(errno));
+        close(fd);
+        return 0;
+    }
+    int ret = 0;
+    struct dirent *entry;
+    while (ret == 0 && (entry = readdir(listing)) != NULL) {
+        const char *name = entry->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+            continue;
+        }
+        if (entry->d_type != DT_UNKNOWN && entry->d_type != DT_DIR && entry->d_type != DT_REG) {
+            continue;
+        }
+        if (entry->d_type != DT_DIR && is_index_file(name)) {
+            continue;
+        }
+        struct stat st;
+        if (fstatat(dirfd(listing), name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            continue;
+        }
+        char *child = NULL;
+        if (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) {
+            child = path_join(path, name);
+            if (child == NULL) {
+                ret = ENOMEM;
+                break;
+            }
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            if (walk->dir_count == walk->dir_capacity) {
+                size_t capacity = walk->dir_capacity == 0 ? 64 : walk->dir_capacity * 2;
+                char **dirs = realloc(walk->dirs, capacity * sizeof(char *));
+                if (dirs == NULL) {
+                    free(child);
+                    ret = ENOMEM;
+                    break;
+                }
+                walk->dirs = dirs;
+                walk->dir_capacity = capacity;
+            }
+            walk->dirs[walk->dir_count++] = child;
+            int subfd = openat(dirfd(listing), name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (subfd == -1) {
+                fprintf(stderr, "finder: %s: %s\n", child, strerror(errno));
+                continue;
+            }
+            ret = walk_dir(walk, subfd, child);
+        } else if (S_ISREG(st.st_mode)) {
+            if (walk->count == walk->capacity) {
+                size_t capacity = walk->capacity == 0 ? 1024 : walk->capacity * 2;
+                struct walk_file *files = realloc(walk->files, capacity * sizeof(struct walk_file));
+                if (files == NULL) {
+                    free(child);
+                    ret = ENOMEM;
+                    break;
+                }
+                walk->files = files;
+                walk->capacity = capacity;
+            }
+            struct walk_file *file = &walk->files[walk->count++];
+            memset(file, 0, sizeof(struct walk_file));
+            file->path = child;
+            file->size = st.st_size;
+            file->mtime_ns = mtime_ns(&st);
+            file->old = -1;
+        }
+    }
+    closedir(listing);
+    return ret;
+}
+
+static int compare_files(const void *a, const void *b) {
+    return strcmp(((const struct walk_file *)a)->path, ((const struct walk_file *)b)->path);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/**
+ * Reads @param file and stores its distinct trigrams, those spanning a newline left out since a
+ * line never matches across it.  @param seen is a cleared bit per trigram, cleared again on return.
+ * @return 0 on success or if the file cannot be read (it then has no trigrams), ENOMEM
+ */
+static int extract_file(int rootfd, struct walk_file *file, uint8_t *seen, char *buffer) {
+    int fd = openat(rootfd, file->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "finder: %s: %s\n", file->path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        return 0;
+    }
+    // the index describes the content read from here on
+    file->size = st.st_size;
+    file->mtime_ns = mtime_ns(&st);
+
+    uint32_t *trigrams = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    uint32_t trigram = 0;
+    unsigned run = 0;
+    int ret = 0;
+    ssize_t len;
+    while (ret == 0 && (len = read(fd, buffer, EXTRACT_CHUNK)) != 0) {
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "finder: %s: %s\n", file->path, strerror(errno));
+            break;
+        }
+        if (memchr(buffer, '\0', len) != NULL) {
+            file->flags |= TRIGRAM_FILE_BINARY;
+            break;
+        }
+        ssize_t i;
+        for (i = 0; i < len; i++) {
+            unsigned char byte = buffer[i];
+            if (byte == '\n') {
+                run = 0;
+                continue;
+            }
+            trigram = ((trigram << 8) | byte) & (TRIGRAM_SPACE - 1);
+            if (++run < 3 || (seen[trigram >> 3] & (1 << (trigram & 7)))) {
+                continue;
+            }
+            seen[trigram >> 3] |= 1 << (trigram & 7);
+            if (count == capacity) {
+                capacity = capacity == 0 ? 256 : capacity * 2;
+                uint32_t *grown = realloc(trigrams, capacity * sizeof(uint32_t));
+                if (grown == NULL) {
+                    ret = ENOMEM;
+                    break;
+                }
+                trigrams = grown;
+            }
+            trigrams[count++] = trigram;
+        }
+    }
+    close(fd);
+
+    size_t i;
+    for (i = 0; i < count; i++) {
+        seen[trigrams[i] >> 3] = 0;
+    }
+    if (ret != 0 || (file->flags & TRIGRAM_FILE_BINARY)) {
+        free(trigrams);
+        return ret;
+    }
+    if (count > 0) {
+        qsort(trigrams, count, sizeof(uint32_t), compare_u32);
+    }
+    file->trigrams = trigrams;
+    file->count = count;
+    return 0;
+}
+
+static void *extract_main(void *arg) {
+    struct extractor *extractor = arg;
+    uint8_t *seen = calloc(TRIGRAM_SPACE / 8, 1);
+    char *buffer = malloc(EXTRACT_CHUNK);
+    if (seen == NULL || buffer == NULL) {
+        __atomic_store_n(&extractor->error, ENOMEM, __ATOMIC_RELAXED);
+    } else {
+        size_t i;
+        while ((i = __atomic_fetch_add(&extractor->next, 1, __ATOMIC_RELAXED)) < extractor->count) {
+            int ret = extract_file(extractor->rootfd, extractor->jobs[i], seen, buffer);
+            if (ret != 0) {
+                __atomic_store_n(&extractor->error, ret, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+    free(seen);
+    free(buffer);
+    return NULL;
+}
+
+/**
+ * Reads the @param count files of @param jobs with up to @param nthreads threads
+ * @return 0 on success, an errno value otherwise
+ */
+static int extract_files(int rootfd, struct walk_file **jobs, size_t count, int nthreads) {
+    struct extractor extractor = { rootfd, jobs, count, 0, 0 };
+    if ((size_t)nthreads > count) {
+        nthreads = count;
+    }
+    pthread_t *threads = malloc((nthreads > 0 ? nthreads : 1) * sizeof(pthread_t));
+    if (threads == NULL) {
+        return ENOMEM;
+    }
+    int started;
+    for (started = 0; started < nthreads; started++) {
+        if (pthread_create(&threads[started], NULL, extract_main, &extractor) != 0) {
+            break;
+        }
+    }
+    if (started == 0 && count > 0) {
+        extract_main(&extractor);
+    }
+    int i;
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    return extractor.error;
+}
+
+/**
+ * Points the sections of @param index into the @param size bytes at @param base, after checking
+ * that every offset and file id stays in bounds
+ * @return 0 on success, EINVAL if they do not describe a valid index
+ */
+static int index_attach(struct trigram_index *index, char *base, size_t size, bool mapped) {
+    const struct trigram_index_header *header = (const struct trigram_index_header *)base;
+    if (size < sizeof(struct trigram_index_header) || memcmp(header->magic, TRIGRAM_INDEX_MAGIC, 8) != 0 ||
+            header->version != TRIGRAM_INDEX_VERSION || header->size != size) {
+        return EINVAL;
+    }
+    if (header->files_offset > size ||
+            header->file_count > (size - header->files_offset) / sizeof(struct trigram_index_file) ||
+            header->table_offset > size ||
+            header->trigram_count > (size - header->table_offset) / sizeof(struct trigram_index_entry) ||
+            header->postings_offset > size ||
+            header->posting_count > (size - header->postings_offset) / sizeof(uint32_t) ||
+            header->strings_offset > size || header->strings_size > size - header->strings_offset ||
+            (header->strings_size > 0 && base[header->strings_offset + header->strings_size - 1] != '\0')) {
+        return EINVAL;
+    }
+    const struct trigram_index_file *files = (const void *)(base + header->files_offset);
+    const struct trigram_index_entry *table = (const void *)(base + header->table_offset);
+    const uint32_t *postings = (const void *)(base + header->postings_offset);
+    uint64_t i, j;
+    for (i = 0; i < header->file_count; i++) {
+        if (files[i].path >= header->strings_size) {
+            return EINVAL;
+        }
+    }
+    for (i = 0; i < header->trigram_count; i++) {
+        if (table[i].postings > header->posting_count || table[i].count > header->posting_count - table[i].postings) {
+            return EINVAL;
+        }
+        for (j = 0; j < table[i].count; j++) {
+            if (postings[table[i].postings + j] >= header->file_count) {
+                return EINVAL;
+            }
+        }
+    }
+
+    index->base = base;
+    index->size = size;
+    index->mapped = mapped;
+    index->file_count = header->file_count;
+    index->trigram_count = header->trigram_count;
+    index->files = files;
+    index->table = table;
+    index->postings = postings;
+    index->strings = base + header->strings_offset;
+    return 0;
+}
+
+int trigram_index_open(struct trigram_index *index, const char *path) {
+    memset(index, 0, sizeof(struct trigram_index));
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno == ENOENT ? 0 : errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int ret = errno;
+        close(fd);
+        return ret;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    char *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return errno;
+    }
+    if (index_attach(index, base, st.st_size, true) != 0) {
+        // rebuilt from scratch by the next update
+        fprintf(stderr, "finder: ignoring invalid index %s\n", path);
+        munmap(base, st.st_size);
+        memset(index, 0, sizeof(struct trigram_index));
+    }
+    return 0;
+}
+
+void trigram_index_close(struct trigram_index *index) {
+    if (index->mapped) {
+        munmap(index->base, index->size);
+    } else {
+        free(index->base);
+    }
+    memset(index, 0, sizeof(struct trigram_index));
+}
+
+const char *trigram_index_path(const struct trigram_index *index, uint32_t id) {
+    return index->strings + index->files[id].path;
+}
+
+/**
+ * Builds in @param out the index of the files of @param walk, sorted by path, taking the postings
+ * of the unchanged ones from @param old and those of the others from their trigrams
+ * @return 0 on success, ENOMEM
+ */
+static int index_build(struct trigram_index *out, const struct trigram_index *old, const struct walk *walk) {
+    int ret = ENOMEM;
+    uint32_t *remap = malloc((old->file_count > 0 ? old->file_count : 1) * sizeof(uint32_t));
+    uint64_t *pairs = NULL;
+    struct trigram_index_entry *table = NULL;
+    uint32_t *postings = NULL;
+    size_t npairs = 0;
+    size_t strings_size = 0;
+    size_t i;
+    if (remap == NULL) {
+        goto out;
+    }
+    for (i = 0; i < old->file_count; i++) {
+        remap[i] = NO_FILE;
+    }
+    for (i = 0; i < walk->count; i++) {
+        if (walk->files[i].old >= 0) {
+            remap[walk->files[i].old] = i;
+        } else {
+            npairs += walk->files[i].count;
+        }
+        strings_size += strlen(walk->files[i].path) + 1;
+    }
+
+    // (trigram, file) of the files read again, in the order of the table
+    pairs = malloc((npairs > 0 ? npairs : 1) * sizeof(uint64_t));
+    if (pairs == NULL) {
+        goto out;
+    }
+    size_t p = 0;
+    for (i = 0; i < walk->count; i++) {
+        uint32_t j;
+        for (j = 0; walk->files[i].old < 0 && j < walk->files[i].count; j++) {
+            pairs[p++] = (uint64_t)walk->files[i].trigrams[j] << 32 | i;
+        }
+    }
+    qsort(pairs, npairs, sizeof(uint64_t), compare_u64);
+
+    size_t max_postings = 0;
+    for (i = 0; i < old->trigram_count; i++) {
+        max_postings += old->table[i].count;
+    }
+    max_postings += npairs;
+    table = malloc((old->trigram_count + npairs + 1) * sizeof(struct trigram_index_entry));
+    postings = malloc((max_postings + 1) * sizeof(uint32_t));
+    if (table == NULL || postings == NULL) {
+        goto out;
+    }
+
+    // merge the postings still valid of each old trigram with the new ones, both sorted by file id
+    size_t trigram_count = 0;
+    size_t posting_count = 0;
+    size_t a = 0;
+    size_t b = 0;
+    while (a < old->trigram_count || b < npairs) {
+        uint32_t trigram;
+        if (b == npairs || (a < old->trigram_count && old->table[a].trigram <= (uint32_t)(pairs[b] >> 32))) {
+            trigram = old->table[a].trigram;
+        } else {
+            trigram = pairs[b] >> 32;
+        }
+        const uint32_t *old_ids = NULL;
+        size_t old_count = 0;
+        if (a < old->trigram_count && old->table[a].trigram == trigram) {
+            old_ids = old->postings + old->table[a].postings;
+            old_count = old->table[a].count;
+            a++;
+        }
+        size_t end = b;
+        while (end < npairs && (uint32_t)(pairs[end] >> 32) == trigram) {
+            end++;
+        }
+
+        size_t start = posting_count;
+        size_t k = 0;
+        while (1) {
+            while (k < old_count && remap[old_ids[k]] == NO_FILE) {
+                k++;
+            }
+            if (k == old_count && b == end) {
+                break;
+            }
+            if (b < end && (k == old_count || (uint32_t)pairs[b] < remap[old_ids[k]])) {
+                postings[posting_count++] = (uint32_t)pairs[b++];
+            } else {
+                postings[posting_count++] = remap[old_ids[k++]];
+            }
+        }
+        if (posting_count > start) {
+            table[trigram_count].trigram = trigram;
+            table[trigram_count].count = posting_count - start;
+            table[trigram_count].postings = start;
+            trigram_count++;
+        }
+    }
+
+    size_t files_offset = sizeof(struct trigram_index_header);
+    size_t table_offset = files_offset + walk->count * sizeof(struct trigram_index_file);
+    size_t postings_offset = table_offset + trigram_count * sizeof(struct trigram_index_entry);
+    size_t strings_offset = postings_offset + ((posting_count * sizeof(uint32_t) + 7) & ~(size_t)7);
+    size_t size = strings_offset + strings_size;
+    char *base = calloc(size, 1);
+    if (base == NULL) {
+        goto out;
+    }
+    struct trigram_index_header *header = (struct trigram_index_header *)base;
+    memcpy(header->magic, TRIGRAM_INDEX_MAGIC, 8);
+    header->version = TRIGRAM_INDEX_VERSION;
+    header->file_count = walk->count;
+    header->trigram_count = trigram_count;
+    header->posting_count = posting_count;
+    header->strings_size = strings_size;
+    header->files_offset = files_offset;
+    header->table_offset = table_offset;
+    header->postings_offset = postings_offset;
+    header->strings_offset = strings_offset;
+    header->size = size;
+
+    struct trigram_index_file *files = (struct trigram_index_file *)(base + files_offset);
+    size_t string = 0;
+    for (i = 0; i < walk->count; i++) {
+        size_t len = strlen(walk->files[i].path) + 1;
+        memcpy(base + strings_offset + string, walk->files[i].path, len);
+        files[i].path = string;
+        files[i].size = walk->files[i].size;
+        files[i].mtime_ns = walk->files[i].mtime_ns;
+        files[i].flags = walk->files[i].flags;
+        string += len;
+    }
+    memcpy(base + table_offset, table, trigram_count * sizeof(struct trigram_index_entry));
+    memcpy(base + postings_offset, postings, posting_count * sizeof(uint32_t));
+    ret = index_attach(out, base, size, false);
+    if (ret != 0) {
+        free(base);
+    }
+
+out:
+    free(remap);
+    free(pairs);
+    free(table);
+    free(postings);
+    return ret;
+}
+
+/**
+ * trigram_index_update, also listing the directories of the tree in @param walk when not NULL
+ */
+static int index_update(struct trigram_index *index, const char *root, int nthreads, bool *changed,
+        struct walk *dirs) {
+    *changed = false;
+    int rootfd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootfd == -1) {
+        return errno;
+    }
+    struct walk walk;
+    memset(&walk, 0, sizeof(walk));
+    int ret = walk_dir(&walk, dup(rootfd), "");
+    if (ret != 0) {
+        goto out;
+    }
+    if (walk.count > 0) {
+        qsort(walk.files, walk.count, sizeof(struct walk_file), compare_files);
+    }
+
+    // both lists are sorted by path, files of the same size and mtime keep their postings
+    size_t reused = 0;
+    size_t i;
+    uint32_t j = 0;
+    for (i = 0; i < walk.count; i++) {
+        struct walk_file *file = &walk.files[i];
+        int cmp = 1;
+        while (j < index->file_count && (cmp = strcmp(trigram_index_path(index, j), file->path)) < 0) {
+            j++;
+        }
+        if (cmp == 0 && index->files[j].size == file->size && index->files[j].mtime_ns == file->mtime_ns) {
+            file->old = j;
+            file->flags = index->files[j].flags;
+            reused++;
+        }
+    }
+
+    if (reused != walk.count || reused != index->file_count || index->base == NULL) {
+        struct walk_file **jobs = malloc((walk.count - reused + 1) * sizeof(struct walk_file *));
+        if (jobs == NULL) {
+            ret = ENOMEM;
+            goto out;
+        }
+        size_t count = 0;
+        for (i = 0; i < walk.count; i++) {
+            if (walk.files[i].old < 0) {
+                jobs[count++] = &walk.files[i];
+            }
+        }
+        ret = extract_files(rootfd, jobs, count, nthreads);
+        free(jobs);
+        struct trigram_index built;
+        if (ret == 0) {
+            ret = index_build(&built, index, &walk);
+        }
+        if (ret == 0) {
+            trigram_index_close(index);
+            *index = built;
+            *changed = true;
+        }
+    }
+
+out:
+    if (dirs != NULL && ret == 0) {
+        dirs->dirs = walk.dirs;
+        dirs->dir_count = walk.dir_count;
+        walk.dirs = NULL;
+        walk.dir_count = 0;
+    }
+    walk_free(&walk);
+    close(rootfd);
+    return ret;
+}
+
+int trigram_index_update(struct trigram_index *index, const char *root, int nthreads, bool *changed) {
+    return index_update(index, root, nthreads, changed, NULL);
+}
+
+int trigram_index_write(const struct trigram_index *index, const char *path) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid()) >= (int)sizeof(tmp)) {
+        return ENAMETOOLONG;
+    }
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        return errno;
+    }
+    size_t written = 0;
+    while (written < index->size) {
+        ssize_t ret = write(fd, index->base + written, index->size - written);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            int err = errno;
+            close(fd);
+            unlink(tmp);
+            return err;
+        }
+        written += ret;
+    }
+    if (close(fd) == -1 || rename(tmp, path) == -1) {
+        int err = errno;
+        unlink(tmp);
+        return err;
+    }
+    return 0;
+}
+
+static int compare_entry_count(const void *a, const void *b) {
+    uint32_t x = (*(const struct trigram_index_entry *const *)a)->count;
+    uint32_t y = (*(const struct trigram_index_entry *const *)b)->count;
+    return x < y ? -1 : x > y;
+}
+
+static int compare_entry_trigram(const void *key, const void *entry) {
+    uint32_t x = *(const uint32_t *)key;
+    uint32_t y = ((const struct trigram_index_entry *)entry)->trigram;
+    return x < y ? -1 : x > y;
+}
+
+long trigram_index_candidates(const struct trigram_index *index, const char *needle, size_t len, uint32_t **ids) {
+    *ids = NULL;
+    if (len < 3 || memchr(needle, '\n', len) != NULL) {
+        uint32_t *all = malloc((index->file_count + 1) * sizeof(uint32_t));
+        if (all == NULL) {
+            return -1;
+        }
+        long count = 0;
+        uint32_t i;
+        for (i = 0; i < index->file_count; i++) {
+            if (!(index->files[i].flags & TRIGRAM_FILE_BINARY)) {
+                all[count++] = i;
+            }
+        }
+        *ids = all;
+        return count;
+    }
+
+    // the postings of each distinct trigram of the needle, shortest first
+    const struct trigram_index_entry **entries = malloc((len - 2) * sizeof(struct trigram_index_entry *));
+    if (entries == NULL) {
+        return -1;
+    }
+    size_t nentries = 0;
+    size_t i, k;
+    for (i = 0; i + 3 <= len; i++) {
+        uint32_t trigram = (unsigned char)needle[i] << 16 | (unsigned char)needle[i + 1] << 8 |
+                (unsigned char)needle[i + 2];
+        const struct trigram_index_entry *entry = bsearch(&trigram, index->table, index->trigram_count,
+                sizeof(struct trigram_index_entry), compare_entry_trigram);
+        if (entry == NULL) {
+            free(entries);
+            return 0;
+        }
+        for (k = 0; k < nentries && entries[k] != entry; k++) {
+        }
+        if (k == nentries) {
+            entries[nentries++] = entry;
+        }
+    }
+    qsort(entries, nentries, sizeof(entries[0]), compare_entry_count);
+
+    uint32_t *result = malloc((entries[0]->count + 1) * sizeof(uint32_t));
+    if (result == NULL) {
+        free(entries);
+        return -1;
+    }
+    size_t count = entries[0]->count;
+    memcpy(result, index->postings + entries[0]->postings, count * sizeof(uint32_t));
+    for (k = 1; k < nentries && count > 0; k++) {
+        const uint32_t *other = index->postings + entries[k]->postings;
+        size_t other_count = entries[k]->count;
+        size_t kept = 0;
+        size_t j = 0;
+        for (i = 0; i < count; i++) {
+            while (j < other_count && other[j] < result[i]) {
+                j++;
+            }
+            if (j == other_count) {
+                break;
+            }
+            if (other[j] == result[i]) {
+                result[kept++] = result[i];
+            }
+        }
+        count = kept;
+    }
+    free(entries);
+    *ids = result;
+    return count;
+}
+
+bool trigram_index_live(const char *path) {
+    char lock_path[4096];
+    if (snprintf(lock_path, sizeof(lock_path), "%s%s", path, TRIGRAM_INDEX_LOCK_SUFFIX) >= (int)sizeof(lock_path)) {
+        return false;
+    }
+    int fd = open(lock_path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    bool live = flock(fd, LOCK_SH | LOCK_NB) == -1 && errno == EWOULDBLOCK;
+    close(fd);
+    return live;
+}
+
+static volatile sig_atomic_t watch_stopped;
+
+static void watch_signal(int signo) {
+    watch_stopped = 1;
+}
+
+/**
+ * Watches @param root and every directory of @param dirs
+ * @return whether a directory was not watched yet, changes in it may have been missed
+ */
+static bool watch_dirs(int inotify_fd, const char *root, struct walk *dirs, int *max_wd) {
+    const uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+            IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR | IN_DONT_FOLLOW;
+    bool added = false;
+    size_t i;
+    for (i = 0; i <= dirs->dir_count; i++) {
+        char *path = i < dirs->dir_count ? path_join(root, dirs->dirs[i]) : strdup(root);
+        if (path == NULL) {
+            continue;
+        }
+        int wd = inotify_add_watch(inotify_fd, path, mask);
+        if (wd == -1) {
+            fprintf(stderr, "finder: watching %s: %s\n", path, strerror(errno));
+        } else if (wd > *max_wd) {
+            *max_wd = wd;
+            added = true;
+        }
+        free(path);
+    }
+    return added;
+}
+
+int trigram_index_watch(const char *root, const char *path, int nthreads, int settle_ms) {
+    char lock_path[4096];
+    if (snprintf(lock_path, sizeof(lock_path), "%s%s", path, TRIGRAM_INDEX_LOCK_SUFFIX) >= (int)sizeof(lock_path)) {
+        return ENAMETOOLONG;
+    }
+    int lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock_fd == -1) {
+        return errno;
+    }
+    // the lock tells queries the index is current, it is only taken once it is
+    if (trigram_index_live(path)) {
+        close(lock_fd);
+        return EBUSY;
+    }
+    bool locked = false;
+    int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        int ret = errno;
+        close(lock_fd);
+        return ret;
+    }
+
+    struct sigaction action;
+    struct sigaction old_int;
+    struct sigaction old_term;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = watch_signal;
+    sigaction(SIGINT, &action, &old_int);
+    sigaction(SIGTERM, &action, &old_term);
+    watch_stopped = 0;
+
+    struct trigram_index index;
+    int ret = trigram_index_open(&index, path);
+    int max_wd = 0;
+    bool dirty = true;
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    while (ret == 0 && !watch_stopped) {
+        if (dirty) {
+            struct walk dirs;
+            memset(&dirs, 0, sizeof(dirs));
+            bool changed;
+            ret = index_update(&index, root, nthreads, &changed, &dirs);
+            if (ret != 0) {
+                break;
+            }
+            // directories watched for the first time may have changed during the walk, walk again
+            dirty = watch_dirs(inotify_fd, root, &dirs, &max_wd);
+            walk_free(&dirs);
+            if (changed) {
+                ret = trigram_index_write(&index, path);
+                printf("Indexed %u files of %s\n", index.file_count, root);
+                fflush(stdout);
+            }
+            if (ret == 0 && !dirty && !locked) {
+                if (flock(lock_fd, LOCK_EX | LOCK_NB) == -1) {
+                    ret = errno == EWOULDBLOCK ? EBUSY : errno;
+                    break;
+                }
+                locked = true;
+            }
+            continue;
+        }
+
+        struct pollfd pollfd = { inotify_fd, POLLIN, 0 };
+        if (poll(&pollfd, 1, -1) == -1) {
+            if (errno != EINTR) {
+                ret = errno;
+            }
+            continue;
+        }
+        // wait for the changes to settle, a file being written fires events until it is closed
+        do {
+            while (read(inotify_fd, events, sizeof(events)) > 0) {
+            }
+        } while (!watch_stopped && poll(&pollfd, 1, settle_ms) > 0);
+        dirty = true;
+    }
+
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGTERM, &old_term, NULL);
+    trigram_index_close(&index);
+    close(inotify_fd);
+    close(lock_fd);
+    return ret;
+}
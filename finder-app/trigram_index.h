@@ -0,0 +1,128 @@
+#ifndef TRIGRAM_INDEX_H
+#define TRIGRAM_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+* Persistent trigram index of a directory tree for the finder index mode.
+*
+* The index lives next to the directory, in <filesdir>.finder-index after making filesdir
+* canonical, and maps every three byte sequence found within a line to the sorted ids of the
+* files holding it.  A query only has to search the files holding all the trigrams of the
+* searched string.  Index files found in the tree, its own included when the tree is "/",
+* are never indexed.
+*
+* The file is used in place through mmap:
+*   header, files[file_count] sorted by path, table[trigram_count] sorted by trigram,
+*   postings[posting_count] file ids, then the NUL terminated paths relative to the root.
+* Updates rewrite it to a temporary file renamed over the old one, so readers never see a
+* partial index.  Files whose size and mtime did not change keep their postings, only new
+* and modified files are read again.
+*
+* A watcher (trigram_index_watch) keeps the index current through inotify while it holds
+* a lock on <filesdir>.finder-index.lock, queries then use the index without checking the
+* tree first.
+*/
+
+#define TRIGRAM_INDEX_MAGIC "FNDRTRI1"
+#define TRIGRAM_INDEX_VERSION 1
+#define TRIGRAM_INDEX_SUFFIX ".finder-index"
+// appended to the index path
+#define TRIGRAM_INDEX_LOCK_SUFFIX ".lock"
+
+// The file holds a NUL byte, it never has matching lines
+#define TRIGRAM_FILE_BINARY 0x1
+
+struct trigram_index_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t file_count;
+    uint64_t trigram_count;
+    uint64_t posting_count;
+    uint64_t strings_size;
+    uint64_t files_offset;
+    uint64_t table_offset;
+    uint64_t postings_offset;
+    uint64_t strings_offset;
+    uint64_t size;
+};
+
+struct trigram_index_file {
+    // offset of the path in the strings
+    uint64_t path;
+    uint64_t size;
+    int64_t mtime_ns;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct trigram_index_entry {
+    uint32_t trigram;
+    uint32_t count;
+    // index of the first file id in the postings
+    uint64_t postings;
+};
+
+struct trigram_index {
+    // the mapped index file, or the buffer of an index built in memory
+    char *base;
+    size_t size;
+    bool mapped;
+    uint32_t file_count;
+    uint64_t trigram_count;
+    const struct trigram_index_file *files;
+    const struct trigram_index_entry *table;
+    const uint32_t *postings;
+    const char *strings;
+};
+
+/**
+ * Maps the index at @param path into @param index, left empty when there is no valid index there
+ * @return 0 on success or when there is no index yet, an errno value otherwise
+ */
+int trigram_index_open(struct trigram_index *index, const char *path);
+
+/**
+ * Brings @param index up to date with the tree at @param root, reading the new and modified
+ * files with @param nthreads threads, and sets @param changed when anything changed
+ * @return 0 on success, an errno value otherwise, @param index is left as it was then
+ */
+int trigram_index_update(struct trigram_index *index, const char *root, int nthreads, bool *changed);
+
+/**
+ * Atomically replaces the index file at @param path with @param index
+ * @return 0 on success, an errno value otherwise
+ */
+int trigram_index_write(const struct trigram_index *index, const char *path);
+
+/**
+ * Lists in @param ids, to be freed, the files that may hold the @param len bytes at @param needle:
+ * the files holding all its trigrams, or every file when it is too short to have any.
+ * Binary files are left out.
+ * @return the number of files listed, -1 if out of memory
+ */
+long trigram_index_candidates(const struct trigram_index *index, const char *needle, size_t len, uint32_t **ids);
+
+/**
+ * @return the path of file @param id relative to the root
+ */
+const char *trigram_index_path(const struct trigram_index *index, uint32_t id);
+
+/**
+ * @return whether a watcher is keeping the index at @param path current
+ */
+bool trigram_index_live(const char *path);
+
+/**
+ * Keeps the index at @param path current with the tree at @param root until SIGINT or SIGTERM,
+ * writing it again @param settle_ms after the last change seen through inotify.  The lock that
+ * makes trigram_index_live true is only taken once the first index is written.
+ * @return 0 on success, EBUSY if another watcher holds the lock, an errno value otherwise
+ */
+int trigram_index_watch(const char *root, const char *path, int nthreads, int settle_ms);
+
+void trigram_index_close(struct trigram_index *index);
+
+#endif /* TRIGRAM_INDEX_H */
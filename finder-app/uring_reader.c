@@ -0,0 +1,317 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "uring_reader.h"
+
+// Requests of a file chain, in the low bits of the user data next to the slot
+enum uring_op {
+    OP_OPEN,
+    OP_READ,
+    OP_CLOSE,
+};
+
+#define OP_BITS 2
+#define OPS_PER_FILE 3
+
+struct uring_slot {
+    // index of the file in the names of the run
+    size_t index;
+    // completions still expected for the chain
+    int remaining;
+    int err;
+    size_t len;
+    // completions of an earlier run reader_fail gave up on, the slot is never reused
+    bool abandoned;
+};
+
+static int ring_setup(unsigned entries, struct io_uring_params *params) {
+    return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int ring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static struct io_uring_sqe *get_sqe(struct uring_reader *reader) {
+    unsigned tail = *reader->sq_tail;
+    struct io_uring_sqe *sqe = &reader->sqes[tail & *reader->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    reader->sq_array[tail & *reader->sq_mask] = tail & *reader->sq_mask;
+    // published to the kernel when the whole chain is queued
+    *reader->sq_tail = tail + 1;
+    return sqe;
+}
+
+static unsigned sq_space(struct uring_reader *reader) {
+    return reader->sq_entries - (*reader->sq_tail - __atomic_load_n(reader->sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Queues the open, read and close chain of file @param name into free slot @param slot
+static void queue_file(struct uring_reader *reader, unsigned slot, int dirfd, const char *name) {
+    unsigned tail = *reader->sq_tail;
+
+    struct io_uring_sqe *sqe = get_sqe(reader);
+    sqe->opcode = IORING_OP_OPENAT;
+    // a failed open cancels the read and close
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->fd = dirfd;
+    sqe->addr = (uintptr_t)name;
+    sqe->open_flags = O_RDONLY | O_NOFOLLOW;
+    sqe->file_index = slot + 1;
+    sqe->user_data = (uint64_t)slot << OP_BITS | OP_OPEN;
+
+    sqe = get_sqe(reader);
+    sqe->opcode = reader->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    // the close runs even when the read fails
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->fd = slot;
+    sqe->addr = (uintptr_t)(reader->buffers + (size_t)slot * reader->buffer_size);
+    sqe->len = reader->buffer_size;
+    sqe->off = 0;
+    sqe->buf_index = reader->fixed_buffers ? slot : 0;
+    sqe->user_data = (uint64_t)slot << OP_BITS | OP_READ;
+
+    sqe = get_sqe(reader);
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    sqe->user_data = (uint64_t)slot << OP_BITS | OP_CLOSE;
+
+    __atomic_store_n(reader->sq_tail, tail + OPS_PER_FILE, __ATOMIC_RELEASE);
+    reader->unsubmitted += OPS_PER_FILE;
+}
+
+/**
+ * Handles the completions available, calling @param done for the files whose chain is over
+ * @return the number of files completed
+ */
+static size_t reap(struct uring_reader *reader, uring_reader_fn done, void *arg) {
+    size_t completed = 0;
+    unsigned head = *reader->cq_head;
+    unsigned tail = __atomic_load_n(reader->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &reader->cqes[head & *reader->cq_mask];
+        unsigned index = cqe->user_data >> OP_BITS;
+        enum uring_op op = cqe->user_data & ((1 << OP_BITS) - 1);
+        struct uring_slot *slot = &reader->slots[index];
+
+        if (op == OP_OPEN && cqe->res < 0) {
+            slot->err = -cqe->res;
+        } else if (op == OP_READ && cqe->res >= 0) {
+            slot->len = cqe->res;
+        } else if (op == OP_READ && cqe->res != -ECANCELED) {
+            slot->err = -cqe->res;
+        }
+        if (--slot->remaining > 0 || slot->abandoned) {
+            continue;
+        }
+
+        int err = slot->err;
+        // a read of a regular file is only short at its end, a full buffer may hide more
+        if (err == 0 && slot->len == reader->buffer_size) {
+            err = EFBIG;
+        }
+        done(arg, slot->index, reader->buffers + (size_t)index * reader->buffer_size, slot->len, err);
+        reader->free_slots[reader->free_count++] = index;
+        completed++;
+    }
+    __atomic_store_n(reader->cq_head, head, __ATOMIC_RELEASE);
+    return completed;
+}
+
+// Gives up on the files in flight and the ones not queued yet, from @param next on
+static void reader_fail(struct uring_reader *reader, size_t next, size_t count, uring_reader_fn done, void *arg) {
+    unsigned i;
+    for (i = 0; i < reader->depth; i++) {
+        struct uring_slot *slot = &reader->slots[i];
+        if (slot->remaining > 0 && !slot->abandoned) {
+            slot->abandoned = true;
+            done(arg, slot->index, NULL, 0, ECANCELED);
+        }
+    }
+    // abandoned slots may still be written by the kernel, none is handed out again
+    reader->free_count = 0;
+    for (; next < count; next++) {
+        done(arg, next, NULL, 0, ECANCELED);
+    }
+}
+
+int uring_reader_run(struct uring_reader *reader, int dirfd, const char *const *names, size_t count,
+        uring_reader_fn done, void *arg) {
+    size_t next = 0;
+    size_t completed = 0;
+    while (completed < count) {
+        while (next < count && reader->free_count > 0 && sq_space(reader) >= OPS_PER_FILE) {
+            unsigned slot = reader->free_slots[--reader->free_count];
+            reader->slots[slot].index = next;
+            reader->slots[slot].remaining = OPS_PER_FILE;
+            reader->slots[slot].err = 0;
+            reader->slots[slot].len = 0;
+            queue_file(reader, slot, dirfd, names[next++]);
+        }
+
+        int ret = ring_enter(reader->ring_fd, reader->unsubmitted, 1, IORING_ENTER_GETEVENTS);
+        if (ret == -1) {
+            int err = errno;
+            if (err != EINTR && err != EAGAIN && err != EBUSY) {
+                reader_fail(reader, next, count, done, arg);
+                return err;
+            }
+        } else {
+            reader->unsubmitted -= ret;
+        }
+        completed += reap(reader, done, arg);
+    }
+    return 0;
+}
+
+// Checks that the kernel opens into direct descriptors: a directory opens, then fails to read
+static void probe_done(void *arg, size_t index, const char *data, size_t len, int err) {
+    (void)index;
+    (void)data;
+    (void)len;
+    *(int *)arg = err;
+}
+
+int uring_reader_init(struct uring_reader *reader, unsigned depth, size_t buffer_size) {
+    memset(reader, 0, sizeof(*reader));
+    reader->ring_fd = -1;
+    reader->depth = depth;
+    reader->buffer_size = buffer_size;
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    reader->ring_fd = ring_setup(depth * OPS_PER_FILE, &params);
+    if (reader->ring_fd == -1) {
+        return errno == EPERM || errno == EINVAL ? ENOSYS : errno;
+    }
+    int err = 0;
+
+    reader->sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    reader->cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (reader->cq_map_size > reader->sq_map_size) {
+            reader->sq_map_size = reader->cq_map_size;
+        }
+        reader->cq_map_size = 0;
+    }
+    reader->sq_map = mmap(NULL, reader->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            reader->ring_fd, IORING_OFF_SQ_RING);
+    if (reader->sq_map == MAP_FAILED) {
+        reader->sq_map = NULL;
+        goto fail;
+    }
+    reader->cq_map = reader->sq_map;
+    if (reader->cq_map_size > 0) {
+        reader->cq_map = mmap(NULL, reader->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                reader->ring_fd, IORING_OFF_CQ_RING);
+        if (reader->cq_map == MAP_FAILED) {
+            reader->cq_map = NULL;
+            goto fail;
+        }
+    }
+    reader->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    reader->sqes = mmap(NULL, reader->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            reader->ring_fd, IORING_OFF_SQES);
+    if (reader->sqes == MAP_FAILED) {
+        reader->sqes = NULL;
+        goto fail;
+    }
+
+    char *sq = reader->sq_map;
+    reader->sq_head = (unsigned *)(sq + params.sq_off.head);
+    reader->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    reader->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    reader->sq_array = (unsigned *)(sq + params.sq_off.array);
+    reader->sq_entries = params.sq_entries;
+    char *cq = reader->cq_map;
+    reader->cq_head = (unsigned *)(cq + params.cq_off.head);
+    reader->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    reader->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    reader->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    reader->buffers = mmap(NULL, (size_t)depth * buffer_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    reader->slots = calloc(depth, sizeof(struct uring_slot));
+    reader->free_slots = malloc(depth * sizeof(unsigned));
+    struct iovec *iovecs = malloc(depth * sizeof(struct iovec));
+    int *files = malloc(depth * sizeof(int));
+    if (reader->buffers == MAP_FAILED || reader->slots == NULL || reader->free_slots == NULL ||
+            iovecs == NULL || files == NULL) {
+        if (reader->buffers == MAP_FAILED) {
+            reader->buffers = NULL;
+        }
+        free(iovecs);
+        free(files);
+        errno = ENOMEM;
+        goto fail;
+    }
+
+    unsigned i;
+    for (i = 0; i < depth; i++) {
+        reader->free_slots[i] = depth - 1 - i;
+        iovecs[i].iov_base = reader->buffers + (size_t)i * buffer_size;
+        iovecs[i].iov_len = buffer_size;
+        // sparse table, the opens fill it
+        files[i] = -1;
+    }
+    reader->free_count = depth;
+    int ret = ring_register(reader->ring_fd, IORING_REGISTER_FILES, files, depth);
+    if (ret == 0) {
+        // without pinned buffers (RLIMIT_MEMLOCK) reads still work, copying a little more
+        reader->fixed_buffers = ring_register(reader->ring_fd, IORING_REGISTER_BUFFERS, iovecs, depth) == 0;
+    }
+    free(iovecs);
+    free(files);
+    if (ret == -1) {
+        errno = errno == EINVAL ? ENOSYS : errno;
+        goto fail;
+    }
+
+    const char *probe = "/";
+    int probe_err = 0;
+    if (uring_reader_run(reader, AT_FDCWD, &probe, 1, probe_done, &probe_err) != 0 || probe_err != EISDIR) {
+        errno = ENOSYS;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    err = errno;
+    uring_reader_destroy(reader);
+    return err;
+}
+
+void uring_reader_destroy(struct uring_reader *reader) {
+    if (reader->ring_fd != -1) {
+        close(reader->ring_fd);
+    }
+    if (reader->sqes != NULL) {
+        munmap(reader->sqes, reader->sqes_size);
+    }
+    if (reader->cq_map != NULL && reader->cq_map != reader->sq_map) {
+        munmap(reader->cq_map, reader->cq_map_size);
+    }
+    if (reader->sq_map != NULL) {
+        munmap(reader->sq_map, reader->sq_map_size);
+    }
+    if (reader->buffers != NULL) {
+        munmap(reader->buffers, (size_t)reader->depth * reader->buffer_size);
+    }
+    free(reader->slots);
+    free(reader->free_slots);
+    memset(reader, 0, sizeof(*reader));
+    reader->ring_fd = -1;
+}
@@ -0,0 +1,83 @@
+#ifndef URING_READER_H
+#define URING_READER_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+* Batched reading of small files through io_uring, for the finder scan of trees of many files.
+*
+* Each file is one chain of three linked requests: an open into a registered (direct) file
+* slot, a read of the whole file into the registered buffer of the slot, and a close of the
+* slot.  Up to depth chains are kept in flight, so a single thread waits on many files at once
+* instead of paying the latency of open, read and close one file after the other, and the
+* files never get a regular descriptor.
+*
+* A reader belongs to one thread.  The kernel must support io_uring and direct descriptors
+* (Linux 5.15), uring_reader_init fails otherwise and the caller reads files itself.
+*/
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+struct uring_slot;
+
+struct uring_reader {
+    int ring_fd;
+    // files in flight at most, each owns a slot: a direct descriptor and a buffer
+    unsigned depth;
+    size_t buffer_size;
+    char *buffers;
+    // the buffers are registered, reads use IORING_OP_READ_FIXED
+    bool fixed_buffers;
+    struct uring_slot *slots;
+    unsigned *free_slots;
+    unsigned free_count;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    // queued in the submission ring but not passed to the kernel yet
+    unsigned unsubmitted;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_map;
+    size_t sq_map_size;
+    void *cq_map;
+    size_t cq_map_size;
+    size_t sqes_size;
+};
+
+/**
+ * Called once per file read by uring_reader_run, with its index @param index in the names and the
+ * @param len bytes read at @param data when @param err is 0.  @param err is EFBIG when the file
+ * filled the buffer and may be larger, ECANCELED when the reader failed before reading it: the
+ * caller has to read it by itself then.  Other errors come from opening or reading the file.
+ */
+typedef void (*uring_reader_fn)(void *arg, size_t index, const char *data, size_t len, int err);
+
+/**
+ * Sets up @param reader to keep @param depth files of up to @param buffer_size bytes in flight
+ * @return 0 on success, an errno value otherwise, ENOSYS when io_uring or direct descriptors are
+ * not available
+ */
+int uring_reader_init(struct uring_reader *reader, unsigned depth, size_t buffer_size);
+
+/**
+ * Reads the @param count files @param names relative to directory @param dirfd, calling
+ * @param done with @param arg for each of them as its read completes, in any order
+ * @return 0 on success, an errno value if the ring failed: the reader can not be used anymore
+ * and the files it did not read were reported with ECANCELED
+ */
+int uring_reader_run(struct uring_reader *reader, int dirfd, const char *const *names, size_t count,
+        uring_reader_fn done, void *arg);
+
+void uring_reader_destroy(struct uring_reader *reader);
+
+#endif /* URING_READER_H */
@@ -1,10 +1,10 @@
-/* 
+/*
 * Accepts the following arguments: the first argument is a full path to a file (including filename) on the filesystem, referred to below as writefile;
  the second argument is a text string which will be written within this file, referred to below as writestr
 
 * Exits with value 1 error and print statements if any of the arguments above were not specified
 
-* Creates a new file with name and path writefile with content writestr, overwriting any existing file and creating the path if it doesn’t exist. 
+* Creates a new file with name and path writefile with content writestr, overwriting any existing file and creating the path if it doesn’t exist.
 Exits with value 1 and error print statement if the file could not be created.
 
 * Setup syslog logging for your utility using the LOG_USER facility.
@@ -12,36 +12,770 @@ Exits with value 1 and error print statement if the file could not be created.
 * Use the syslog capability to write a message “Writing <string> to <file>” where <string> is the text string written to file (second argument) and <file> is the file created by the script.  This should be written with LOG_DEBUG level.
 
 * Use the syslog capability to log any unexpected errors with LOG_ERR level.
+
+* Files are replaced atomically: the content is written to an anonymous or hidden temporary file which then takes the
+name, so readers see either the old file or the complete new one.  As with fopen, a symbolic link is written through
+and kept, an existing file keeps its mode and owner and a new one gets 0666 less the umask.  A file with several hard
+links, or one whose owner cannot be given to the replacement, is rewritten in place so every link sees the new
+content, without the atomicity.  So is a writable file in a directory that takes no new files (read only
+permissions, pseudo file systems).  "-s none|file|file+dir" selects what is synced
+to disk: nothing (the default), the file before it is named, or the file and then its directory, once per
+directory in batch mode.
+
+* Batch mode: "writer -m <manifest>" (or "-m -" for stdin) creates every file listed in the manifest from a single
+process, one line per file or group of files:
+    <path>\t<content>
+    <path template>\t<content>\t<count>
+  A template holds %d in its file name, replaced by 1 to count to create count files ("%%" is a literal %).
+  Content may use the escapes \n, \t and \\.  Empty lines and lines starting with # are skipped.
+  Missing parent directories are created, each directory is opened once and its files are created relative to it
+  with openat, by WRITER_THREADS threads (default one per online CPU).  A single syslog line sums the batch up.
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+// Files claimed at once by a batch thread
+#define BATCH_CLAIM 64
+#define DIR_TABLE_INITIAL_SIZE 64
+
+// Durability asked of each write, see the -s option
+enum fsync_policy {
+    FSYNC_NONE,
+    // the content is on disk before it is renamed to its name
+    FSYNC_FILE,
+    // and so is the name, the directory is synced as well
+    FSYNC_DIR,
+};
+
+static const char *fsync_policy_names[] = { "none", "file", "file+dir" };
+
+struct batch_dir {
+    char *path;
+    // -1 when it could not be opened, its files are then opened by path
+    int fd;
+    // a file was written in it, it needs syncing under FSYNC_DIR
+    bool written;
+};
+
+struct batch_entry {
+    size_t dir;
+    // file name, a template holding %d when count > 1
+    char *name;
+    char *content;
+    size_t len;
+    unsigned long count;
+    // index of its first file among all the files of the batch
+    unsigned long first;
+};
+
+struct batch {
+    struct batch_dir *dirs;
+    size_t dir_count;
+    size_t dir_capacity;
+    // open addressing table of dir indexes + 1 by path, 0 for free slots
+    size_t *dir_table;
+    size_t dir_table_size;
+
+    struct batch_entry *entries;
+    size_t entry_count;
+    size_t entry_capacity;
+    unsigned long files;
+    enum fsync_policy policy;
+
+    // claimed and updated by the threads
+    unsigned long next;
+    unsigned long written;
+    unsigned long failed;
+    unsigned long long bytes;
+};
+
+static size_t hash_path(const char *path) {
+    size_t hash = 5381;
+    while (*path != '\0') {
+        hash = hash * 33 + (unsigned char)*path++;
+    }
+    return hash;
+}
+
+// Creates @param path and its missing parents, like mkdir -p
+static int make_dirs(char *path) {
+    char *slash = path;
+    while (1) {
+        slash = strchr(slash + 1, '/');
+        if (slash != NULL) {
+            *slash = '\0';
+        }
+        int ret = mkdir(path, 0755);
+        int err = errno;
+        if (slash != NULL) {
+            *slash = '/';
+        }
+        if (ret == -1 && err != EEXIST) {
+            errno = err;
+            return -1;
+        }
+        if (slash == NULL) {
+            return 0;
+        }
+    }
+}
+
+/**
+ * @return the index of directory @param path, created and opened on first use, or -1 if out of memory
+ */
+static long batch_dir(struct batch *batch, const char *path) {
+    if (batch->dir_count * 2 >= batch->dir_table_size) {
+        size_t size = batch->dir_table_size == 0 ? DIR_TABLE_INITIAL_SIZE : batch->dir_table_size * 2;
+        size_t *table = calloc(size, sizeof(size_t));
+        if (table == NULL) {
+            return -1;
+        }
+        size_t i;
+        for (i = 0; i < batch->dir_count; i++) {
+            size_t slot = hash_path(batch->dirs[i].path) & (size - 1);
+            while (table[slot] != 0) {
+                slot = (slot + 1) & (size - 1);
+            }
+            table[slot] = i + 1;
+        }
+        free(batch->dir_table);
+        batch->dir_table = table;
+        batch->dir_table_size = size;
+    }
+
+    size_t slot = hash_path(path) & (batch->dir_table_size - 1);
+    while (batch->dir_table[slot] != 0) {
+        size_t index = batch->dir_table[slot] - 1;
+        if (strcmp(batch->dirs[index].path, path) == 0) {
+            return index;
+        }
+        slot = (slot + 1) & (batch->dir_table_size - 1);
+    }
+
+    if (batch->dir_count == batch->dir_capacity) {
+        size_t capacity = batch->dir_capacity == 0 ? DIR_TABLE_INITIAL_SIZE : batch->dir_capacity * 2;
+        struct batch_dir *dirs = realloc(batch->dirs, capacity * sizeof(struct batch_dir));
+        if (dirs == NULL) {
+            return -1;
+        }
+        batch->dirs = dirs;
+        batch->dir_capacity = capacity;
+    }
+    struct batch_dir *dir = &batch->dirs[batch->dir_count];
+    dir->path = strdup(path);
+    if (dir->path == NULL) {
+        return -1;
+    }
+    if (make_dirs(dir->path) == -1) {
+        fprintf(stderr, "Error creating directory %s: %s\n", path, strerror(errno));
+        syslog(LOG_ERR, "Error creating directory %s: %s", path, strerror(errno));
+    }
+    dir->fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir->written = false;
+    batch->dir_table[slot] = ++batch->dir_count;
+    return batch->dir_count - 1;
+}
+
+// Decodes the escapes of @param text in place @return its decoded length
+static size_t unescape(char *text) {
+    char *out = text;
+    char *in = text;
+    while (*in != '\0') {
+        if (*in == '\\' && in[1] != '\0') {
+            in++;
+            *out++ = *in == 'n' ? '\n' : *in == 't' ? '\t' : *in;
+            in++;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+    return out - text;
+}
+
+// @return whether @param name holds exactly one %d, and no other % than %%
+static bool valid_template(const char *name) {
+    int fields = 0;
+    for (; *name != '\0'; name++) {
+        if (*name != '%') {
+            continue;
+        }
+        name++;
+        if (*name == 'd') {
+            fields++;
+        } else if (*name != '%') {
+            return false;
+        }
+    }
+    return fields == 1;
+}
+
+/**
+ * Parses manifest line @param line, number @param lineno, into a new entry of @param batch
+ * @return 0 on success or for skipped lines, -1 on a malformed line or if out of memory
+ */
+static int batch_add(struct batch *batch, char *line, unsigned long lineno) {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] == '\0' || line[0] == '#') {
+        return 0;
+    }
+    char *path = line;
+    char *content = strchr(path, '\t');
+    if (content == NULL || content == path) {
+        fprintf(stderr, "Error: manifest line %lu: expected <path>\\t<content>[\\t<count>]\n", lineno);
+        return -1;
+    }
+    *content++ = '\0';
+    unsigned long count = 1;
+    char *count_field = strchr(content, '\t');
+    if (count_field != NULL) {
+        *count_field++ = '\0';
+        char *end;
+        errno = 0;
+        count = strtoul(count_field, &end, 10);
+        if (errno != 0 || *end != '\0' || count == 0) {
+            fprintf(stderr, "Error: manifest line %lu: invalid count %s\n", lineno, count_field);
+            return -1;
+        }
+    }
+
+    char *slash = strrchr(path, '/');
+    char *name = slash != NULL ? slash + 1 : path;
+    if (*name == '\0' || (count_field != NULL && !valid_template(name))) {
+        fprintf(stderr, "Error: manifest line %lu: %s is not a valid %s\n", lineno, path,
+                count_field != NULL ? "template, it needs one %d in the file name" : "file name");
+        return -1;
+    }
+
+    long dir;
+    if (slash == path) {
+        dir = batch_dir(batch, "/");
+    } else if (slash != NULL) {
+        *slash = '\0';
+        dir = batch_dir(batch, path);
+    } else {
+        dir = batch_dir(batch, ".");
+    }
+    if (dir == -1) {
+        perror("malloc");
+        return -1;
+    }
+
+    if (batch->entry_count == batch->entry_capacity) {
+        size_t capacity = batch->entry_capacity == 0 ? 256 : batch->entry_capacity * 2;
+        struct batch_entry *entries = realloc(batch->entries, capacity * sizeof(struct batch_entry));
+        if (entries == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        batch->entries = entries;
+        batch->entry_capacity = capacity;
+    }
+    struct batch_entry *entry = &batch->entries[batch->entry_count];
+    entry->dir = dir;
+    entry->name = strdup(name);
+    entry->len = unescape(content);
+    entry->content = malloc(entry->len + 1);
+    if (entry->name == NULL || entry->content == NULL) {
+        free(entry->name);
+        free(entry->content);
+        perror("malloc");
+        return -1;
+    }
+    memcpy(entry->content, content, entry->len + 1);
+    entry->count = count_field != NULL ? count : 0;
+    entry->first = batch->files;
+    batch->files += count;
+    batch->entry_count++;
+    return 0;
+}
+
+// Expands template @param name with @param number into @param out of @param size bytes
+static void expand_template(const char *name, unsigned long number, char *out, size_t size) {
+    size_t used = 0;
+    for (; *name != '\0' && used + 1 < size; name++) {
+        if (*name == '%' && name[1] == 'd') {
+            used += snprintf(out + used, size - used, "%lu", number);
+            name++;
+        } else {
+            if (*name == '%' && name[1] == '%') {
+                name++;
+            }
+            out[used++] = *name;
+        }
+    }
+    out[used < size ? used : size - 1] = '\0';
+}
+
+// Numbers the temporary names of the process
+static unsigned long temp_sequence;
+
+/**
+ * Resolves @param name of directory @param dir for the *at calls, into @param buf of 4096 bytes
+ * when the directory is not open
+ * @return the path to use relative to @param dirfd, NULL if it is too long
+ */
+static const char *dir_entry(const struct batch_dir *dir, const char *name, char *buf, int *dirfd) {
+    if (dir->fd != -1) {
+        *dirfd = dir->fd;
+        return name;
+    }
+    *dirfd = AT_FDCWD;
+    return (size_t)snprintf(buf, 4096, "%s/%s", dir->path, name) < 4096 ? buf : NULL;
+}
+
+// Fills @param buf of 256 bytes with a hidden name unique to the process, next to @param name
+static void temp_name(const char *name, char *buf) {
+    unsigned long sequence = __atomic_fetch_add(&temp_sequence, 1, __ATOMIC_RELAXED);
+    snprintf(buf, 256, ".%.200s.%d.%lu.tmp", name, (int)getpid(), sequence);
+}
+
+static int write_all(int fd, const char *content, size_t len) {
+    size_t written = 0;
+    while (written < len) {
+        ssize_t ret = write(fd, content + written, len - written);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        written += ret;
+    }
+    return 0;
+}
+
+// Syncs directory @param dir so the names written in it are on disk @return 0 or an errno value
+static int sync_dir(const struct batch_dir *dir) {
+    int fd = dir->fd != -1 ? dir->fd : open(dir->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno;
+    }
+    int err = fsync(fd) == -1 ? errno : 0;
+    if (fd != dir->fd) {
+        close(fd);
+    }
+    return err;
+}
+
+/**
+ * Writes the @param len bytes of @param content over file @param target relative to @param dirfd,
+ * in place as fopen(target, "w") would: not atomic, but the inode is kept, and with it the links,
+ * owner and mode of the file
+ * @return 0 on success, an errno value otherwise
+ */
+static int write_in_place(int dirfd, const char *target, const char *content, size_t len,
+        enum fsync_policy policy) {
+    int fd = openat(dirfd, target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd == -1) {
+        return errno;
+    }
+    int err = write_all(fd, content, len);
+    if (err == 0 && policy != FSYNC_NONE && fsync(fd) == -1) {
+        err = errno;
+    }
+    if (close(fd) == -1 && err == 0) {
+        err = errno;
+    }
+    return err;
+}
+
+static int write_file(const struct batch_dir *dir, const char *name, const char *content, size_t len,
+        enum fsync_policy policy);
+
+/**
+ * Writes to the file the symbolic link @param name of directory @param dir points to, the link
+ * itself is kept.  A dangling link creates its target, as fopen would.
+ * @return 0 on success, an errno value otherwise
+ */
+static int write_through_link(const struct batch_dir *dir, const char *name, const char *content,
+        size_t len, enum fsync_policy policy) {
+    char link_path[4096];
+    if ((size_t)snprintf(link_path, sizeof(link_path), "%s/%s", dir->path, name) >= sizeof(link_path)) {
+        return ENAMETOOLONG;
+    }
+    char *resolved = realpath(link_path, NULL);
+    if (resolved == NULL) {
+        return write_in_place(AT_FDCWD, link_path, content, len, policy);
+    }
+    char *slash = strrchr(resolved, '/');
+    *slash = '\0';
+    struct batch_dir target_dir = { .path = slash == resolved ? "/" : resolved, .fd = -1 };
+    target_dir.fd = open(target_dir.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int err = target_dir.fd == -1 ? errno : write_file(&target_dir, slash + 1, content, len, policy);
+    if (err == 0 && policy == FSYNC_DIR) {
+        err = sync_dir(&target_dir);
+    }
+    if (target_dir.fd != -1) {
+        close(target_dir.fd);
+    }
+    free(resolved);
+    return err;
+}
+
+// Whether creating a file failed because the directory takes no new entries, rather than for good
+static bool no_new_entries(int err) {
+    return err == EACCES || err == EPERM || err == EROFS || err == EOPNOTSUPP;
+}
+
+/**
+ * Writes the content to a new file that then takes the name @param target relative to @param dirfd,
+ * an anonymous O_TMPFILE file when @param anonymous, a hidden temporary file otherwise.  The new
+ * file takes the owner and mode of @param old, the replaced file, unless it is NULL.  Falls back
+ * to the hidden temporary file where O_TMPFILE files cannot be opened or linked (without /proc),
+ * and to write_in_place when no file can be created in the directory or given the old owner.
+ * @return 0 on success, an errno value otherwise
+ */
+static int replace_file(const struct batch_dir *dir, const char *name, int dirfd, const char *target,
+        const struct stat *old, const char *content, size_t len, enum fsync_policy policy, bool anonymous) {
+    char temp_buf[4096];
+    char temp[256];
+    const char *temp_path = NULL;
+    int fd;
+    if (anonymous) {
+        fd = openat(dirfd, dir->fd != -1 ? "." : dir->path, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            return replace_file(dir, name, dirfd, target, old, content, len, policy, false);
+        }
+    } else {
+        temp_name(name, temp);
+        temp_path = dir_entry(dir, temp, temp_buf, &dirfd);
+        if (temp_path == NULL) {
+            return ENAMETOOLONG;
+        }
+        fd = openat(dirfd, temp_path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd == -1) {
+            // e.g. a writable file in a read only directory, fopen would still write it
+            return no_new_entries(errno) ? write_in_place(dirfd, target, content, len, policy) : errno;
+        }
+    }
+
+    // the replacement takes over the owner and mode, chown first as it may clear set-id bits
+    if (old != NULL && (fchown(fd, old->st_uid, old->st_gid) == -1 || fchmod(fd, old->st_mode & 07777) == -1)) {
+        if (temp_path != NULL) {
+            unlinkat(dirfd, temp_path, 0);
+        }
+        close(fd);
+        return write_in_place(dirfd, target, content, len, policy);
+    }
+
+    int err = write_all(fd, content, len);
+    if (err == 0 && policy != FSYNC_NONE && fsync(fd) == -1) {
+        err = errno;
+    }
+    if (err == 0 && anonymous) {
+        char proc[64];
+        snprintf(proc, sizeof(proc), "/proc/self/fd/%d", fd);
+        if (linkat(AT_FDCWD, proc, dirfd, target, AT_SYMLINK_FOLLOW) == 0) {
+            close(fd);
+            return 0;
+        }
+        if (errno == ENOENT && access("/proc/self/fd", F_OK) == -1) {
+            // /proc is not mounted, the file cannot be named
+            close(fd);
+            return replace_file(dir, name, dirfd, target, old, content, len, policy, false);
+        }
+        // linkat does not replace, an existing file is replaced through a temporary name
+        if (errno == EEXIST) {
+            temp_name(name, temp);
+            temp_path = dir_entry(dir, temp, temp_buf, &dirfd);
+            if (temp_path == NULL) {
+                err = ENAMETOOLONG;
+            } else if (linkat(AT_FDCWD, proc, dirfd, temp_path, AT_SYMLINK_FOLLOW) == -1) {
+                err = errno;
+                temp_path = NULL;
+            }
+        } else {
+            err = errno;
+        }
+    }
+    if (err == 0 && temp_path != NULL && renameat(dirfd, temp_path, dirfd, target) == -1) {
+        err = errno;
+    }
+    if (err != 0 && temp_path != NULL) {
+        unlinkat(dirfd, temp_path, 0);
+    }
+    if (close(fd) == -1 && err == 0) {
+        err = errno;
+    }
+    return err;
+}
+
+/**
+ * Replaces file @param name of directory @param dir with the @param len bytes of @param content.
+ * The content goes to an anonymous O_TMPFILE file, or to a hidden temporary file where the file
+ * system lacks them, which then takes the name at once: readers see the old file or the whole new
+ * one, never a partial write.  The file is synced before it gets its name unless @param policy
+ * is FSYNC_NONE, syncing the directory is left to the caller.
+ *
+ * As with fopen(name, "w"), a new file gets mode 0666 less the umask, an existing one keeps its
+ * mode and owner, and a symbolic link is written through.  A file with hard links, which would
+ * keep the old content, or that cannot be given its owner back, or that is not a regular file is
+ * written in place instead, without the atomicity, and so is a file in a directory where no
+ * new file can be created.
+ * @return 0 on success, an errno value otherwise
+ */
+static int write_file(const struct batch_dir *dir, const char *name, const char *content, size_t len,
+        enum fsync_policy policy) {
+    char target_buf[4096];
+    int dirfd;
+    const char *target = dir_entry(dir, name, target_buf, &dirfd);
+    if (target == NULL) {
+        return ENAMETOOLONG;
+    }
+
+    struct stat st;
+    bool exists = fstatat(dirfd, target, &st, AT_SYMLINK_NOFOLLOW) == 0;
+    if (exists && S_ISLNK(st.st_mode)) {
+        return write_through_link(dir, name, content, len, policy);
+    }
+    if (exists && (!S_ISREG(st.st_mode) || st.st_nlink > 1)) {
+        return write_in_place(dirfd, target, content, len, policy);
+    }
+    return replace_file(dir, name, dirfd, target, exists ? &st : NULL, content, len, policy, true);
+}
+
+static void *batch_main(void *arg) {
+    struct batch *batch = arg;
+    unsigned long written = 0;
+    unsigned long failed = 0;
+    unsigned long long bytes = 0;
+    size_t entry = 0;
+    char name[4096];
+
+    while (1) {
+        unsigned long first = __atomic_fetch_add(&batch->next, BATCH_CLAIM, __ATOMIC_RELAXED);
+        if (first >= batch->files) {
+            break;
+        }
+        unsigned long last = first + BATCH_CLAIM < batch->files ? first + BATCH_CLAIM : batch->files;
+        unsigned long file;
+        for (file = first; file < last; file++) {
+            // claims move forward, so does the entry holding them
+            if (entry >= batch->entry_count || batch->entries[entry].first > file) {
+                entry = 0;
+            }
+            while (entry + 1 < batch->entry_count && batch->entries[entry + 1].first <= file) {
+                entry++;
+            }
+            const struct batch_entry *current = &batch->entries[entry];
+            const char *filename = current->name;
+            if (current->count > 0) {
+                expand_template(current->name, file - current->first + 1, name, sizeof(name));
+                filename = name;
+            }
+            const struct batch_dir *dir = &batch->dirs[current->dir];
+            int ret = write_file(dir, filename, current->content, current->len, batch->policy);
+            if (ret != 0) {
+                fprintf(stderr, "Error creating file %s/%s: %s\n", dir->path, filename, strerror(ret));
+                syslog(LOG_ERR, "Error creating file %s/%s: %s", dir->path, filename, strerror(ret));
+                failed++;
+            } else {
+                written++;
+                bytes += current->len;
+                if (!__atomic_load_n(&dir->written, __ATOMIC_RELAXED)) {
+                    __atomic_store_n(&batch->dirs[current->dir].written, true, __ATOMIC_RELAXED);
+                }
+            }
+        }
+    }
+    __atomic_add_fetch(&batch->written, written, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&batch->failed, failed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&batch->bytes, bytes, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static int thread_count(void) {
+    const char *env = getenv("WRITER_THREADS");
+    long count = env != NULL ? strtol(env, NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) {
+        count = 1;
+    }
+    return count > 256 ? 256 : (int)count;
+}
+
+static int write_batch(const char *manifest, enum fsync_policy policy) {
+    FILE *input = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (input == NULL) {
+        fprintf(stderr, "Error opening manifest %s: %s\n", manifest, strerror(errno));
+        syslog(LOG_ERR, "Error opening manifest %s: %s", manifest, strerror(errno));
+        return 1;
+    }
+
+    // every directory of the batch stays open
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct batch batch;
+    memset(&batch, 0, sizeof(batch));
+    batch.policy = policy;
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned long lineno = 0;
+    int status = 0;
+    while (getline(&line, &capacity, input) != -1) {
+        if (batch_add(&batch, line, ++lineno) != 0) {
+            status = 1;
+            break;
+        }
+    }
+    free(line);
+    if (input != stdin) {
+        fclose(input);
+    }
+
+    if (status == 0) {
+        int nthreads = thread_count();
+        if ((unsigned long)nthreads > batch.files / BATCH_CLAIM + 1) {
+            nthreads = batch.files / BATCH_CLAIM + 1;
+        }
+        pthread_t threads[256];
+        int started;
+        for (started = 0; started < nthreads; started++) {
+            if (pthread_create(&threads[started], NULL, batch_main, &batch) != 0) {
+                break;
+            }
+        }
+        if (started == 0) {
+            batch_main(&batch);
+        }
+        int i;
+        for (i = 0; i < started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+
+        // one sync per directory rather than per file
+        size_t d;
+        for (d = 0; policy == FSYNC_DIR && d < batch.dir_count; d++) {
+            int ret = batch.dirs[d].written ? sync_dir(&batch.dirs[d]) : 0;
+            if (ret != 0) {
+                fprintf(stderr, "Error syncing directory %s: %s\n", batch.dirs[d].path, strerror(ret));
+                syslog(LOG_ERR, "Error syncing directory %s: %s", batch.dirs[d].path, strerror(ret));
+                batch.failed++;
+            }
+        }
+
+        struct timespec end;
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long elapsed_ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+        syslog(LOG_DEBUG, "Wrote %lu files (%llu bytes) in %zu directories from %s in %ld ms, fsync %s, %lu failed",
+                batch.written, batch.bytes, batch.dir_count, manifest, elapsed_ms, fsync_policy_names[policy],
+                batch.failed);
+        if (batch.failed > 0) {
+            status = 1;
+        }
+    }
+
+    size_t i;
+    for (i = 0; i < batch.entry_count; i++) {
+        free(batch.entries[i].name);
+        free(batch.entries[i].content);
+    }
+    for (i = 0; i < batch.dir_count; i++) {
+        if (batch.dirs[i].fd != -1) {
+            close(batch.dirs[i].fd);
+        }
+        free(batch.dirs[i].path);
+    }
+    free(batch.entries);
+    free(batch.dirs);
+    free(batch.dir_table);
+    return status;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s none|file|file+dir] <writefile> <writestr>\n"
+            "       %s [-s none|file|file+dir] -m <manifest|->\n", name, name);
+}
 
 int main(int argc, char *argv[]) {
+    enum fsync_policy policy = FSYNC_NONE;
+    const char *manifest = NULL;
+    int opt;
+
+    // options only come first, writestr may start with a dash
+    while ((opt = getopt(argc, argv, "+m:s:")) != -1) {
+        switch (opt) {
+        case 'm':
+            manifest = optarg;
+            break;
+        case 's':
+            for (policy = FSYNC_NONE; policy <= FSYNC_DIR; policy++) {
+                if (strcmp(optarg, fsync_policy_names[policy]) == 0) {
+                    break;
+                }
+            }
+            if (policy > FSYNC_DIR) {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    if (manifest != NULL) {
+        openlog("writer", LOG_PID | LOG_CONS, LOG_USER);
+        int status = write_batch(manifest, policy);
+        closelog();
+        return status;
+    }
+
     // Check if the required arguments are specified
-    if (argc < 3) {
+    if (argc - optind < 2) {
         fprintf(stderr, "Error: Insufficient arguments\n");
         syslog(LOG_ERR, "Error: Insufficient arguments");
         exit(1);
     }
 
     // Extract the arguments
-    char *writefile = argv[1];
-    char *writestr = argv[2];
+    char *writefile = argv[optind];
+    char *writestr = argv[optind + 1];
 
-    // Create the file
-    FILE *file = fopen(writefile, "w");
-    if (file == NULL) {
-        syslog(LOG_ERR, "Error creating file: %s", writefile);
+    // Create the file, replacing any existing one at once
+    char *slash = strrchr(writefile, '/');
+    struct batch_dir dir = { .path = ".", .fd = -1 };
+    char *name = writefile;
+    if (slash != NULL) {
+        *slash = '\0';
+        dir.path = slash == writefile ? "/" : writefile;
+        name = slash + 1;
+    }
+    dir.fd = open(dir.path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    int ret = dir.fd == -1 ? errno : write_file(&dir, name, writestr, strlen(writestr), policy);
+    if (ret == 0 && policy == FSYNC_DIR) {
+        ret = sync_dir(&dir);
+    }
+    if (dir.fd != -1) {
+        close(dir.fd);
+    }
+    if (slash != NULL) {
+        *slash = '/';
+    }
+    if (ret != 0) {
+        syslog(LOG_ERR, "Error creating file: %s: %s", writefile, strerror(ret));
         exit(1);
     }
 
-    // Write the string to the file
-    fprintf(file, "%s", writestr);
-    fclose(file);
-
     // Setup syslog logging
     openlog("writer", LOG_PID | LOG_CONS, LOG_USER);
 
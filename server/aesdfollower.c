@@ -0,0 +1,452 @@
+/**
+ * Follower of the aesdsocket replication feed (see protocol.h): keeps a copy of
+ * the log up to date from the Unix socket given to aesdsocket -R, acknowledges
+ * what it has written and reports its replication lag.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+
+#define DEFAULT_OUTPUT "/var/tmp/aesdsocketdata.follower"
+#define DEFAULT_REPORT_INTERVAL 1
+#define RECONNECT_DELAY_SEC 1
+#define RECEIVE_CHUNK (64 * 1024)
+
+static volatile sig_atomic_t stopping;
+
+struct follower
+{
+    int out_fd;
+    bool sync_writes;
+    /**
+     * Last record written and log offset past it, offset only known after a snapshot
+     */
+    uint64_t applied_seq;
+    uint64_t applied_offset;
+    /**
+     * Whether the next batch must follow applied_seq, resp. applied_offset, reset on
+     * reconnect as the leader may have restarted
+     */
+    bool continuous;
+    bool synced;
+    uint64_t acked_seq;
+
+    char *buffer;
+    size_t used;
+    size_t capacity;
+
+    /* Since the last report */
+    uint64_t batches;
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t lag_max_ns;
+    uint64_t lag_last_ns;
+};
+
+static void sig_handler(int signo)
+{
+    stopping = 1;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t read_be32(const char *in)
+{
+    const unsigned char *p = (const unsigned char *)in;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static uint64_t read_be64(const char *in)
+{
+    return ((uint64_t)read_be32(in) << 32) | read_be32(in + 4);
+}
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t ret = write(fd, data, len);
+        if(ret == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("write");
+            return false;
+        }
+        data += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static void report(struct follower *follower)
+{
+    printf("seq %llu offset %llu batches %llu records %llu bytes %llu lag_ms %.3f lag_max_ms %.3f\n",
+            (unsigned long long)follower->applied_seq, (unsigned long long)follower->applied_offset,
+            (unsigned long long)follower->batches, (unsigned long long)follower->records,
+            (unsigned long long)follower->bytes, follower->lag_last_ns / 1e6, follower->lag_max_ns / 1e6);
+    fflush(stdout);
+    follower->batches = 0;
+    follower->records = 0;
+    follower->bytes = 0;
+    follower->lag_max_ns = 0;
+}
+
+/**
+ * Replaces the copy with the snapshot in @param payload
+ */
+static bool apply_snapshot(struct follower *follower, uint64_t seq, uint64_t offset, const char *payload,
+            size_t length)
+{
+    if(ftruncate(follower->out_fd, 0) == -1)
+    {
+        perror("ftruncate");
+        return false;
+    }
+    if(!write_all(follower->out_fd, payload, length))
+    {
+        return false;
+    }
+    follower->applied_seq = seq;
+    follower->applied_offset = offset + length;
+    follower->continuous = true;
+    follower->synced = true;
+    printf("Synchronized %zu bytes at offset %llu, seq %llu\n", length, (unsigned long long)offset,
+            (unsigned long long)seq);
+    return true;
+}
+
+/**
+ * Appends the @param count records of the batch in @param payload
+ */
+static bool apply_batch(struct follower *follower, uint64_t seq, uint64_t offset, uint32_t count,
+            char *payload, size_t length, uint64_t commit_ns)
+{
+    if(follower->continuous && seq != follower->applied_seq + 1)
+    {
+        fprintf(stderr, "Batch starts at seq %llu, expected %llu\n", (unsigned long long)seq,
+                (unsigned long long)follower->applied_seq + 1);
+        return false;
+    }
+    if(follower->synced && offset != follower->applied_offset)
+    {
+        fprintf(stderr, "Batch starts at offset %llu, expected %llu\n", (unsigned long long)offset,
+                (unsigned long long)follower->applied_offset);
+        return false;
+    }
+
+    // Strip the record lengths in place, the batch goes out with one write
+    size_t pos = 0;
+    size_t bytes = 0;
+    uint32_t i;
+    for(i = 0; i < count; i++)
+    {
+        if(length - pos < 4 || length - pos - 4 < read_be32(payload + pos))
+        {
+            fprintf(stderr, "Malformed batch at seq %llu\n", (unsigned long long)seq);
+            return false;
+        }
+        size_t len = read_be32(payload + pos);
+        memmove(payload + bytes, payload + pos + 4, len);
+        pos += 4 + len;
+        bytes += len;
+    }
+    if(!write_all(follower->out_fd, payload, bytes))
+    {
+        return false;
+    }
+
+    follower->applied_seq = seq + count - 1;
+    follower->applied_offset = offset + bytes;
+    follower->continuous = true;
+    follower->batches++;
+    follower->records += count;
+    follower->bytes += bytes;
+    uint64_t now = now_ns();
+    follower->lag_last_ns = now > commit_ns ? now - commit_ns : 0;
+    if(follower->lag_last_ns > follower->lag_max_ns)
+    {
+        follower->lag_max_ns = follower->lag_last_ns;
+    }
+    return true;
+}
+
+/**
+ * Applies every complete message in the receive buffer
+ * @return false on a malformed message or a write error
+ */
+static bool apply_messages(struct follower *follower)
+{
+    size_t pos = 0;
+    while(follower->used - pos >= AESD_REPL_HEADER_SIZE)
+    {
+        char *header = follower->buffer + pos;
+        uint32_t type = read_be32(header);
+        uint32_t count = read_be32(header + 4);
+        size_t length = read_be32(header + 8);
+        uint64_t seq = read_be64(header + 16);
+        uint64_t offset = read_be64(header + 24);
+        uint64_t commit_ns = read_be64(header + 32);
+
+        if(follower->used - pos - AESD_REPL_HEADER_SIZE < length)
+        {
+            break;
+        }
+
+        char *payload = header + AESD_REPL_HEADER_SIZE;
+        bool success;
+        if(type == AESD_REPL_SNAPSHOT)
+        {
+            success = apply_snapshot(follower, seq, offset, payload, length);
+        }
+        else if(type == AESD_REPL_BATCH)
+        {
+            success = apply_batch(follower, seq, offset, count, payload, length, commit_ns);
+        }
+        else
+        {
+            fprintf(stderr, "Unknown message type %u\n", type);
+            success = false;
+        }
+        if(!success)
+        {
+            return false;
+        }
+        pos += AESD_REPL_HEADER_SIZE + length;
+    }
+    memmove(follower->buffer, follower->buffer + pos, follower->used - pos);
+    follower->used -= pos;
+    return true;
+}
+
+/**
+ * Acknowledges everything applied so far, once it is on disk if requested
+ */
+static bool acknowledge(struct follower *follower, int sockfd)
+{
+    if(follower->applied_seq == follower->acked_seq)
+    {
+        return true;
+    }
+    if(follower->sync_writes && fdatasync(follower->out_fd) == -1)
+    {
+        perror("fdatasync");
+        return false;
+    }
+    char ack[AESD_REPL_ACK_SIZE];
+    int i;
+    for(i = 0; i < AESD_REPL_ACK_SIZE; i++)
+    {
+        ack[i] = (char)(follower->applied_seq >> (56 - 8 * i));
+    }
+    if(send(sockfd, ack, sizeof(ack), MSG_NOSIGNAL) != sizeof(ack))
+    {
+        perror("send");
+        return false;
+    }
+    follower->acked_seq = follower->applied_seq;
+    return true;
+}
+
+static int connect_leader(const char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sockfd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    if(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Follows the leader on @param sockfd until it disconnects or a signal arrives
+ */
+static void follow(struct follower *follower, int sockfd, int report_interval)
+{
+    uint64_t next_report = now_ns() + (uint64_t)report_interval * 1000000000ULL;
+    follower->used = 0;
+    follower->continuous = false;
+    follower->synced = false;
+    follower->acked_seq = follower->applied_seq;
+
+    while(!stopping)
+    {
+        int timeout = -1;
+        if(report_interval > 0)
+        {
+            uint64_t now = now_ns();
+            if(now >= next_report)
+            {
+                report(follower);
+                next_report = now + (uint64_t)report_interval * 1000000000ULL;
+            }
+            timeout = (int)((next_report - now) / 1000000) + 1;
+        }
+        struct pollfd pollfd = { .fd = sockfd, .events = POLLIN };
+        int ret = poll(&pollfd, 1, timeout);
+        if(ret <= 0)
+        {
+            continue;
+        }
+
+        // The buffer ends up about twice the largest message
+        if(follower->capacity - follower->used < RECEIVE_CHUNK)
+        {
+            size_t capacity = follower->capacity * 2;
+            if(capacity < follower->used + RECEIVE_CHUNK)
+            {
+                capacity = follower->used + RECEIVE_CHUNK;
+            }
+            char *grown = realloc(follower->buffer, capacity);
+            if(grown == NULL)
+            {
+                perror("realloc");
+                return;
+            }
+            follower->buffer = grown;
+            follower->capacity = capacity;
+        }
+        ssize_t received = recv(sockfd, follower->buffer + follower->used,
+                follower->capacity - follower->used, 0);
+        if(received == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(received <= 0)
+        {
+            if(received == -1)
+            {
+                perror("recv");
+            }
+            printf("Leader disconnected\n");
+            return;
+        }
+        follower->used += received;
+        if(!apply_messages(follower) || !acknowledge(follower, sockfd))
+        {
+            return;
+        }
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-o output] [-i report_sec] [-s] replication_socket\n", name);
+    fprintf(stderr, "  -o  file holding the copy of the log (default %s)\n", DEFAULT_OUTPUT);
+    fprintf(stderr, "  -i  seconds between lag reports (default %d, 0: on exit only)\n",
+            DEFAULT_REPORT_INTERVAL);
+    fprintf(stderr, "  -s  sync the copy to disk before acknowledging\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *output = DEFAULT_OUTPUT;
+    int report_interval = DEFAULT_REPORT_INTERVAL;
+    struct follower follower;
+    memset(&follower, 0, sizeof(follower));
+
+    int opt;
+    while((opt = getopt(argc, argv, "o:i:s")) != -1)
+    {
+        switch(opt)
+        {
+            case 'o':
+                output = optarg;
+                break;
+            case 'i':
+                report_interval = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                follower.sync_writes = true;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if(optind != argc - 1)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+    const char *path = argv[optind];
+
+    openlog("aesdfollower", LOG_PID | LOG_CONS, LOG_USER);
+
+    // no SA_RESTART, blocking calls return EINTR so the loops notice the signal
+    struct sigaction act;
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sig_handler;
+    sigemptyset(&act.sa_mask);
+    if(sigaction(SIGINT, &act, NULL) == -1 || sigaction(SIGTERM, &act, NULL) == -1)
+    {
+        perror("sigaction");
+        return 1;
+    }
+
+    follower.out_fd = open(output, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(follower.out_fd == -1)
+    {
+        perror(output);
+        return 1;
+    }
+
+    bool waiting = false;
+    while(!stopping)
+    {
+        int sockfd = connect_leader(path);
+        if(sockfd == -1)
+        {
+            if(!waiting)
+            {
+                printf("Waiting for the leader at %s\n", path);
+                fflush(stdout);
+                waiting = true;
+            }
+            sleep(RECONNECT_DELAY_SEC);
+            continue;
+        }
+        waiting = false;
+        printf("Following %s\n", path);
+        syslog(LOG_INFO, "Following %s\n", path);
+        follow(&follower, sockfd, report_interval);
+        close(sockfd);
+    }
+
+    report(&follower);
+    free(follower.buffer);
+    close(follower.out_fd);
+    closelog();
+    return 0;
+}
@@ -0,0 +1,177 @@
+/**
+ * @file framing-bench.c
+ * @brief Throughput of framing_scan implementations against a memchr loop
+ *
+ * Finds every newline of a buffer filled with packets of a fixed length, for
+ * each implementation supported by the CPU and for repeated memchr calls, and
+ * checks that they all report the same boundaries.
+ *
+ * Results are printed as CSV on stdout, one line per measurement:
+ *   implementation,packet_size,buffer_size,iterations,delimiters,ns_per_byte,gb_per_s
+ *
+ * Usage: framing-bench [-n iterations] [-H]
+ *   -n  number of scans of the buffer per measurement (default 200)
+ *   -H  do not print the CSV header line
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "framing.h"
+
+#define DEFAULT_ITERATIONS 200UL
+#define BUFFER_SIZE (4 * 1024 * 1024)
+#define ENDS_BATCH 64
+
+static const size_t packet_sizes[] = { 8, 64, 512, 4096, 65536, BUFFER_SIZE * 2 };
+static const char *impl_names[] = { "avx2", "sse2", "scalar" };
+
+/* Keeps the compiler from discarding the measured calls */
+static volatile size_t sink;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void report(const char *impl, size_t packet_size, unsigned long iterations,
+            size_t delimiters, uint64_t elapsed_ns)
+{
+    double ns_per_byte = (double)elapsed_ns / ((double)iterations * BUFFER_SIZE);
+    printf("%s,%zu,%d,%lu,%zu,%.4f,%.3f\n", impl, packet_size, BUFFER_SIZE, iterations,
+            delimiters, ns_per_byte, ns_per_byte > 0 ? 1.0 / ns_per_byte : 0.0);
+}
+
+/**
+ * Sums the boundaries found by framing_scan, so that every one of them is consumed
+ * @return the number of delimiters found, their offset sum in @param checksum
+ */
+static size_t scan_all(const char *buf, size_t len, size_t *checksum)
+{
+    size_t ends[ENDS_BATCH];
+    size_t pos = 0;
+    size_t total = 0;
+    size_t found;
+    *checksum = 0;
+    do {
+        found = framing_scan(buf + pos, len - pos, '\n', ends, ENDS_BATCH);
+        size_t i;
+        for(i = 0; i < found; i++)
+        {
+            *checksum += pos + ends[i];
+        }
+        total += found;
+        if(found > 0)
+        {
+            pos += ends[found - 1];
+        }
+    } while(found == ENDS_BATCH);
+    return total;
+}
+
+static size_t memchr_all(const char *buf, size_t len, size_t *checksum)
+{
+    const char *pos = buf;
+    const char *end = buf + len;
+    size_t total = 0;
+    *checksum = 0;
+    while((pos = memchr(pos, '\n', end - pos)) != NULL)
+    {
+        pos++;
+        *checksum += pos - buf;
+        total++;
+    }
+    return total;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long iterations = DEFAULT_ITERATIONS;
+    int header = 1;
+    int opt;
+    while((opt = getopt(argc, argv, "n:H")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                iterations = strtoul(optarg, NULL, 0);
+                break;
+            case 'H':
+                header = 0;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n iterations] [-H]\n", argv[0]);
+                return 1;
+        }
+    }
+    if(iterations == 0)
+    {
+        iterations = 1;
+    }
+
+    char *buf = malloc(BUFFER_SIZE);
+    if(buf == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    if(header)
+    {
+        printf("implementation,packet_size,buffer_size,iterations,delimiters,ns_per_byte,gb_per_s\n");
+    }
+
+    int status = 0;
+    size_t p;
+    for(p = 0; p < sizeof(packet_sizes) / sizeof(packet_sizes[0]); p++)
+    {
+        size_t packet_size = packet_sizes[p];
+        size_t i;
+        for(i = 0; i < BUFFER_SIZE; i++)
+        {
+            buf[i] = (i + 1) % packet_size == 0 ? '\n' : 'a' + i % 26;
+        }
+
+        size_t expected_sum;
+        size_t expected = memchr_all(buf, BUFFER_SIZE, &expected_sum);
+        unsigned long n;
+        size_t checksum;
+        uint64_t start = now_ns();
+        for(n = 0; n < iterations; n++)
+        {
+            sink += memchr_all(buf, BUFFER_SIZE, &checksum);
+        }
+        report("memchr", packet_size, iterations, expected, now_ns() - start);
+
+        size_t k;
+        for(k = 0; k < sizeof(impl_names) / sizeof(impl_names[0]); k++)
+        {
+            if(framing_select(impl_names[k]) != 0)
+            {
+                continue;
+            }
+            if(scan_all(buf, BUFFER_SIZE, &checksum) != expected || checksum != expected_sum)
+            {
+                fprintf(stderr, "%s: wrong boundaries for packets of %zu bytes\n",
+                        impl_names[k], packet_size);
+                status = 1;
+            }
+            start = now_ns();
+            for(n = 0; n < iterations; n++)
+            {
+                sink += scan_all(buf, BUFFER_SIZE, &checksum);
+            }
+            report(impl_names[k], packet_size, iterations, expected, now_ns() - start);
+        }
+    }
+
+    free(buf);
+    return status;
+}
@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "framing.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FRAMING_X86
+#include <immintrin.h>
+#endif
+
+typedef size_t (*framing_scan_fn)(const char *buf, size_t len, char delim, size_t *ends, size_t max);
+
+struct framing_impl
+{
+    const char *name;
+    framing_scan_fn scan;
+    int (*supported)(void);
+};
+
+/**
+ * Byte loop over buf[start, len), for the tails of the vector loops
+ */
+static size_t scan_bytes(const char *buf, size_t start, size_t len, char delim,
+            size_t *ends, size_t count, size_t max)
+{
+    size_t i;
+    for(i = start; i < len && count < max; i++)
+    {
+        if(buf[i] == delim)
+        {
+            ends[count++] = i + 1;
+        }
+    }
+    return count;
+}
+
+/**
+ * Portable scan, 8 bytes at a time: in the word xored with the repeated delimiter,
+ * the high bit of ~(((x & 0x7f..) + 0x7f..) | x | 0x7f..) is set exactly for the zero bytes
+ */
+static size_t scan_scalar(const char *buf, size_t len, char delim, size_t *ends, size_t max)
+{
+    const uint64_t lows = 0x7f7f7f7f7f7f7f7fULL;
+    uint64_t pattern = 0x0101010101010101ULL * (unsigned char)delim;
+    size_t count = 0;
+    size_t i;
+
+    for(i = 0; i + 8 <= len; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        word ^= pattern;
+        uint64_t mask = ~(((word & lows) + lows) | word | lows);
+        while(mask != 0)
+        {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+            size_t byte = __builtin_ctzll(mask) / 8;
+            mask &= mask - 1;
+#else
+            size_t byte = __builtin_clzll(mask) / 8;
+            mask &= ~(0x8000000000000000ULL >> (byte * 8));
+#endif
+            ends[count++] = i + byte + 1;
+            if(count == max)
+            {
+                return count;
+            }
+        }
+    }
+    return scan_bytes(buf, i, len, delim, ends, count, max);
+}
+
+static int scalar_supported(void)
+{
+    return 1;
+}
+
+#ifdef FRAMING_X86
+/**
+ * Stores the offsets of the set bits of @param mask, block relative to @param base
+ * @return the updated count
+ */
+static inline size_t emit_mask(uint64_t mask, size_t base, size_t *ends, size_t count, size_t max)
+{
+    while(mask != 0 && count < max)
+    {
+        ends[count++] = base + __builtin_ctzll(mask) + 1;
+        mask &= mask - 1;
+    }
+    return count;
+}
+
+__attribute__((target("sse2")))
+static size_t scan_sse2(const char *buf, size_t len, char delim, size_t *ends, size_t max)
+{
+    const __m128i pattern = _mm_set1_epi8(delim);
+    size_t count = 0;
+    size_t i;
+
+    // 64 bytes per iteration, the common no delimiter case costs one test
+    for(i = 0; i + 64 <= len; i += 64)
+    {
+        uint64_t m0 = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)(buf + i)), pattern));
+        uint64_t m1 = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)(buf + i + 16)), pattern));
+        uint64_t m2 = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)(buf + i + 32)), pattern));
+        uint64_t m3 = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)(buf + i + 48)), pattern));
+        uint64_t mask = m0 | (m1 << 16) | (m2 << 32) | (m3 << 48);
+        if(mask != 0)
+        {
+            count = emit_mask(mask, i, ends, count, max);
+            if(count == max)
+            {
+                return count;
+            }
+        }
+    }
+    for(; i + 16 <= len; i += 16)
+    {
+        uint64_t mask = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_loadu_si128((const __m128i *)(buf + i)), pattern));
+        count = emit_mask(mask, i, ends, count, max);
+        if(count == max)
+        {
+            return count;
+        }
+    }
+    return scan_bytes(buf, i, len, delim, ends, count, max);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_avx2(const char *buf, size_t len, char delim, size_t *ends, size_t max)
+{
+    const __m256i pattern = _mm256_set1_epi8(delim);
+    size_t count = 0;
+    size_t i;
+
+    for(i = 0; i + 64 <= len; i += 64)
+    {
+        uint64_t lo = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(buf + i)), pattern));
+        uint64_t hi = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(buf + i + 32)), pattern));
+        uint64_t mask = lo | (hi << 32);
+        if(mask != 0)
+        {
+            count = emit_mask(mask, i, ends, count, max);
+            if(count == max)
+            {
+                return count;
+            }
+        }
+    }
+    for(; i + 32 <= len; i += 32)
+    {
+        uint64_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(
+                _mm256_loadu_si256((const __m256i *)(buf + i)), pattern));
+        count = emit_mask(mask, i, ends, count, max);
+        if(count == max)
+        {
+            return count;
+        }
+    }
+    return scan_bytes(buf, i, len, delim, ends, count, max);
+}
+
+static int sse2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int avx2_supported(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/**
+ * In order of preference
+ */
+static const struct framing_impl impls[] = {
+#ifdef FRAMING_X86
+    { "avx2", scan_avx2, avx2_supported },
+    { "sse2", scan_sse2, sse2_supported },
+#endif
+    { "scalar", scan_scalar, scalar_supported },
+};
+
+static const struct framing_impl *current;
+
+static const struct framing_impl *framing_resolve(void)
+{
+    const struct framing_impl *impl = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+    size_t i;
+    for(i = 0; impl == NULL && i < sizeof(impls) / sizeof(impls[0]); i++)
+    {
+        if(impls[i].supported())
+        {
+            impl = &impls[i];
+            // concurrent first calls all pick the same entry
+            __atomic_store_n(&current, impl, __ATOMIC_RELEASE);
+        }
+    }
+    return impl;
+}
+
+size_t framing_scan(const char *buf, size_t len, char delim, size_t *ends, size_t max)
+{
+    if(max == 0)
+    {
+        return 0;
+    }
+    return framing_resolve()->scan(buf, len, delim, ends, max);
+}
+
+const char *framing_impl(void)
+{
+    return framing_resolve()->name;
+}
+
+int framing_select(const char *name)
+{
+    size_t i;
+    for(i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+    {
+        if(strcmp(impls[i].name, name) == 0 && impls[i].supported())
+        {
+            __atomic_store_n(&current, &impls[i], __ATOMIC_RELEASE);
+            return 0;
+        }
+    }
+    return -1;
+}
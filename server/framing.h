@@ -0,0 +1,36 @@
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+
+/**
+ * Delimiter scanning for newline framed packets.
+ *
+ * framing_scan finds every delimiter of a buffer in a single pass and reports
+ * packet boundaries as offsets into the caller's buffer, nothing is copied.
+ * The implementation is picked at first use from what the CPU supports:
+ * AVX2, SSE2, or a portable word at a time scalar loop.
+ *
+ * Shared by aesdsocket and the aesdchar userspace stress harness.
+ */
+
+/**
+ * Scans the @param len bytes of @param buf for @param delim and stores, for each one
+ * found, the offset just past it in @param ends, stopping once @param max offsets are
+ * stored.  When the return value is @param max, scanning may resume at ends[max - 1].
+ * @return the number of offsets stored in ends
+ */
+size_t framing_scan(const char *buf, size_t len, char delim, size_t *ends, size_t max);
+
+/**
+ * @return the name of the implementation framing_scan uses: "avx2", "sse2" or "scalar"
+ */
+const char *framing_impl(void);
+
+/**
+ * Forces framing_scan to use the implementation named @param name, for benchmarks
+ * @return 0 on success, -1 if it is unknown or not supported by this CPU
+ */
+int framing_select(const char *name);
+
+#endif /* FRAMING_H */
@@ -0,0 +1,310 @@
+#ifndef LOCKPROF_DISABLE
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "lockprof.h"
+#include "percpu.h"
+
+struct lockprof_counts
+{
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+    uint64_t wait[LOCKPROF_BUCKETS];
+    uint64_t hold[LOCKPROF_BUCKETS];
+};
+
+struct lockprof_shard
+{
+    struct lockprof_counts sites[LOCKPROF_MAX_SITES];
+} __attribute__((aligned(PERCPU_CACHE_LINE)));
+
+/**
+ * A lock the thread holds, the start of its hold and the site that took it
+ */
+struct lockprof_held
+{
+    pthread_mutex_t *mutex;
+    int site;
+    uint64_t start_ns;
+};
+
+static struct lockprof_site *sites[LOCKPROF_MAX_SITES];
+static int site_count;
+
+/**
+ * Protects site registration, never taken on the locking path except once per site
+ */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+/**
+ * One shard per CPU, allocated on first use, NULL if that failed
+ */
+static struct lockprof_shard *shards;
+static int shard_count;
+static __thread struct lockprof_held held[LOCKPROF_MAX_HELD];
+static __thread int held_count;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t load(const uint64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/* Threads on the same CPU, or migrating, may share a shard */
+static void bump(uint64_t *value, uint64_t delta)
+{
+    __atomic_fetch_add(value, delta, __ATOMIC_RELAXED);
+}
+
+static int bucket(uint64_t ns)
+{
+    int i = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+    return i < LOCKPROF_BUCKETS ? i : LOCKPROF_BUCKETS - 1;
+}
+
+static void add_counts(struct lockprof_counts *total, const struct lockprof_counts *counts)
+{
+    int j;
+    total->acquisitions += load(&counts->acquisitions);
+    total->contended += load(&counts->contended);
+    total->wait_ns += load(&counts->wait_ns);
+    total->hold_ns += load(&counts->hold_ns);
+    for(j = 0; j < LOCKPROF_BUCKETS; j++)
+    {
+        total->wait[j] += load(&counts->wait[j]);
+        total->hold[j] += load(&counts->hold[j]);
+    }
+}
+
+static void lockprof_shards_alloc(void)
+{
+    int count = percpu_count();
+    void *memory;
+    if(posix_memalign(&memory, PERCPU_CACHE_LINE, count * sizeof(struct lockprof_shard)) != 0)
+    {
+        return;
+    }
+    memset(memory, 0, count * sizeof(struct lockprof_shard));
+    shard_count = count;
+    shards = memory;
+}
+
+/**
+ * @return the shard of the calling thread's CPU, NULL if they could not be allocated
+ */
+static struct lockprof_shard *lockprof_shard_get(void)
+{
+    pthread_once(&shards_once, lockprof_shards_alloc);
+    return shards != NULL ? &shards[percpu_current(shard_count)] : NULL;
+}
+
+/**
+ * @return the index of @param site in the site table, registering it on first use, -1 if it is full
+ */
+static int site_index(struct lockprof_site *site)
+{
+    int id = __atomic_load_n(&site->id, __ATOMIC_ACQUIRE);
+    if(id != 0)
+    {
+        return id > 0 ? id - 1 : -1;
+    }
+    pthread_mutex_lock(&registry_lock);
+    id = site->id;
+    if(id == 0)
+    {
+        id = -1;
+        if(site_count < LOCKPROF_MAX_SITES)
+        {
+            sites[site_count++] = site;
+            id = site_count;
+        }
+        __atomic_store_n(&site->id, id, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return id > 0 ? id - 1 : -1;
+}
+
+/**
+ * Starts the hold of @param mutex by @param site, from @param start_ns
+ */
+static void hold_start(pthread_mutex_t *mutex, int site, uint64_t start_ns)
+{
+    if(held_count < LOCKPROF_MAX_HELD)
+    {
+        held[held_count].mutex = mutex;
+        held[held_count].site = site;
+        held[held_count].start_ns = start_ns;
+    }
+    held_count++;
+}
+
+/**
+ * Ends the hold of @param mutex by the calling thread, if it started one
+ */
+static void hold_end(pthread_mutex_t *mutex)
+{
+    int i;
+    int count = held_count < LOCKPROF_MAX_HELD ? held_count : LOCKPROF_MAX_HELD;
+    // locks are mostly released in reverse order
+    for(i = count - 1; i >= 0; i--)
+    {
+        if(held[i].mutex == mutex)
+        {
+            break;
+        }
+    }
+    if(i < 0)
+    {
+        // taken beyond LOCKPROF_MAX_HELD, or by another thread
+        if(held_count > LOCKPROF_MAX_HELD)
+        {
+            held_count--;
+        }
+        return;
+    }
+
+    struct lockprof_held entry = held[i];
+    memmove(&held[i], &held[i + 1], (count - i - 1) * sizeof(struct lockprof_held));
+    held_count--;
+    struct lockprof_shard *shard = lockprof_shard_get();
+    if(shard != NULL && entry.site >= 0)
+    {
+        struct lockprof_counts *counts = &shard->sites[entry.site];
+        uint64_t hold_ns = now_ns() - entry.start_ns;
+        bump(&counts->hold_ns, hold_ns);
+        bump(&counts->hold[bucket(hold_ns)], 1);
+    }
+}
+
+int lockprof_lock_at(pthread_mutex_t *mutex, struct lockprof_site *site)
+{
+    int index = site_index(site);
+    uint64_t wait_ns = 0;
+    uint64_t start_ns;
+    bool contended = false;
+
+    int ret = pthread_mutex_trylock(mutex);
+    if(ret == 0)
+    {
+        start_ns = now_ns();
+    }
+    else if(ret == EBUSY)
+    {
+        contended = true;
+        uint64_t wait_start = now_ns();
+        ret = pthread_mutex_lock(mutex);
+        start_ns = now_ns();
+        wait_ns = start_ns - wait_start;
+    }
+    else
+    {
+        // e.g. EDEADLK on an error checking mutex, the result pthread_mutex_lock would give
+        ret = pthread_mutex_lock(mutex);
+        start_ns = now_ns();
+    }
+    if(ret != 0)
+    {
+        return ret;
+    }
+
+    struct lockprof_shard *shard = lockprof_shard_get();
+    if(shard != NULL && index >= 0)
+    {
+        struct lockprof_counts *counts = &shard->sites[index];
+        bump(&counts->acquisitions, 1);
+        bump(&counts->wait[bucket(wait_ns)], 1);
+        if(contended)
+        {
+            bump(&counts->contended, 1);
+            bump(&counts->wait_ns, wait_ns);
+        }
+    }
+    hold_start(mutex, index, start_ns);
+    return 0;
+}
+
+int lockprof_unlock(pthread_mutex_t *mutex)
+{
+    hold_end(mutex);
+    return pthread_mutex_unlock(mutex);
+}
+
+int lockprof_cond_wait_at(pthread_cond_t *cond, pthread_mutex_t *mutex, struct lockprof_site *site)
+{
+    int index = site_index(site);
+    hold_end(mutex);
+    int ret = pthread_cond_wait(cond, mutex);
+    // the time until the wakeup is not contention, only the new hold is recorded
+    hold_start(mutex, index, now_ns());
+    return ret;
+}
+
+static void report_histogram(FILE *out, const char *name, const char *labels, const uint64_t *histogram)
+{
+    int j, last = -1;
+    for(j = 0; j < LOCKPROF_BUCKETS; j++)
+    {
+        if(histogram[j] != 0)
+        {
+            last = j;
+        }
+    }
+    uint64_t cumulative = 0;
+    // the last bucket has no upper bound, it is only reported as the +Inf one
+    for(j = 0; j <= last && j < LOCKPROF_BUCKETS - 1; j++)
+    {
+        cumulative += histogram[j];
+        fprintf(out, "%s_bucket{%s,le=\"%llu\"} %llu\n", name, labels,
+                j == 0 ? 0ULL : (1ULL << j) - 1, (unsigned long long)cumulative);
+    }
+    cumulative += histogram[LOCKPROF_BUCKETS - 1];
+    fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, (unsigned long long)cumulative);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)cumulative);
+}
+
+void lockprof_report(FILE *out)
+{
+    struct lockprof_site *report_sites[LOCKPROF_MAX_SITES];
+    int count, i, j;
+
+    pthread_mutex_lock(&registry_lock);
+    count = site_count;
+    memcpy(report_sites, sites, sizeof(sites));
+    pthread_mutex_unlock(&registry_lock);
+    pthread_once(&shards_once, lockprof_shards_alloc);
+
+    for(i = 0; i < count; i++)
+    {
+        const struct lockprof_site *site = report_sites[i];
+        struct lockprof_counts total = { 0 };
+        for(j = 0; shards != NULL && j < shard_count; j++)
+        {
+            add_counts(&total, &shards[j].sites[i]);
+        }
+        const char *file = strrchr(site->file, '/');
+        char labels[256];
+        snprintf(labels, sizeof(labels), "site=\"%s:%d\",lock=\"%s\"", file != NULL ? file + 1 : site->file,
+                site->line, site->lock);
+        fprintf(out, "lock_acquisitions{%s} %llu\n", labels, (unsigned long long)total.acquisitions);
+        fprintf(out, "lock_contended{%s} %llu\n", labels, (unsigned long long)total.contended);
+        fprintf(out, "lock_wait_ns_sum{%s} %llu\n", labels, (unsigned long long)total.wait_ns);
+        fprintf(out, "lock_hold_ns_sum{%s} %llu\n", labels, (unsigned long long)total.hold_ns);
+        report_histogram(out, "lock_wait_ns", labels, total.wait);
+        report_histogram(out, "lock_hold_ns", labels, total.hold);
+    }
+}
+
+#endif /* LOCKPROF_DISABLE */
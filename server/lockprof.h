@@ -0,0 +1,92 @@
+#ifndef LOCKPROF_H
+#define LOCKPROF_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/**
+ * Lock contention profiler for pthread mutexes.
+ *
+ * lockprof_mutex_lock, lockprof_mutex_unlock and lockprof_cond_wait replace the
+ * pthread calls on the same pthread_mutex_t, so a lock can be profiled without
+ * changing its type.  Each call site of lockprof_mutex_lock is a site, named after
+ * its file, line and lock expression, with two histograms: the time spent waiting to
+ * acquire the lock and the time it is held afterwards (a condition wait ends the hold
+ * and the wakeup starts a new one).  An uncontended acquisition is a successful
+ * trylock and reads the clock once, to start the hold.
+ *
+ * As with stats.h, counts go to the shard of the CPU the thread runs on, allocated
+ * once on first use, so threads come and go without setup or teardown;
+ * lockprof_report sums the shards on demand.  Building with -DLOCKPROF_DISABLE turns the calls back into the plain
+ * pthread ones.
+ */
+
+#define LOCKPROF_MAX_SITES 32
+/**
+ * Histogram bucket i counts durations d in ns with 2^(i-1) <= d < 2^i, bucket 0 counts
+ * d == 0, the last one everything from 2^30 ns (about 1.07 s) up and is reported as le="+Inf"
+ */
+#define LOCKPROF_BUCKETS 32
+/**
+ * Locks one thread may hold at once and still get hold times for
+ */
+#define LOCKPROF_MAX_HELD 8
+
+struct lockprof_site
+{
+    const char *file;
+    int line;
+    const char *lock;
+    /**
+     * Index in the site table + 1 once registered, -1 if the table was full
+     */
+    int id;
+};
+
+#ifdef LOCKPROF_DISABLE
+
+#define lockprof_mutex_lock(mutex) pthread_mutex_lock(mutex)
+#define lockprof_mutex_unlock(mutex) pthread_mutex_unlock(mutex)
+#define lockprof_cond_wait(cond, mutex) pthread_cond_wait((cond), (mutex))
+
+static inline void lockprof_report(FILE *out)
+{
+    (void)out;
+}
+
+#else
+
+#define LOCKPROF_SITE(lock) \
+    ({ static struct lockprof_site lockprof_site_ = { __FILE__, __LINE__, lock, 0 }; &lockprof_site_; })
+
+#define lockprof_mutex_lock(mutex) lockprof_lock_at((mutex), LOCKPROF_SITE(#mutex))
+#define lockprof_mutex_unlock(mutex) lockprof_unlock(mutex)
+#define lockprof_cond_wait(cond, mutex) lockprof_cond_wait_at((cond), (mutex), LOCKPROF_SITE(#mutex))
+
+/**
+ * Locks @param mutex as pthread_mutex_lock, recording the wait and starting the hold of @param site
+ * @return the pthread_mutex_lock result
+ */
+int lockprof_lock_at(pthread_mutex_t *mutex, struct lockprof_site *site);
+
+/**
+ * Unlocks @param mutex as pthread_mutex_unlock, recording how long it was held by the calling thread
+ * @return the pthread_mutex_unlock result
+ */
+int lockprof_unlock(pthread_mutex_t *mutex);
+
+/**
+ * Waits on @param cond as pthread_cond_wait, ending the hold of @param mutex meanwhile
+ * @return the pthread_cond_wait result
+ */
+int lockprof_cond_wait_at(pthread_cond_t *cond, pthread_mutex_t *mutex, struct lockprof_site *site);
+
+/**
+ * Writes the acquisition counts and the wait and hold histograms of every site to @param out
+ */
+void lockprof_report(FILE *out);
+
+#endif /* LOCKPROF_DISABLE */
+
+#endif /* LOCKPROF_H */
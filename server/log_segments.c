@@ -0,0 +1,650 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+#include <syslog.h>
+#include <sys/stat.h>
+
+#include "log_segments.h"
+#include "lz.h"
+#include "protocol.h"
+
+#define LOG_SEGMENTS_INITIAL_CAPACITY 16
+
+static void log_segments_sealed_path(const struct log_segments *segments, uint64_t seq,
+            char *path, size_t len)
+{
+    snprintf(path, len, "%s.%06llu", segments->path, (unsigned long long)seq);
+}
+
+/**
+ * Path of @param segment, the active segment lives at the log path itself
+ */
+static void log_segments_path(const struct log_segments *segments, const struct log_segment *segment,
+            char *path, size_t len)
+{
+    if(segment == &segments->index[segments->count - 1])
+    {
+        snprintf(path, len, "%s", segments->path);
+    }
+    else
+    {
+        log_segments_sealed_path(segments, segment->seq, path, len);
+    }
+}
+
+/**
+ * Removes "<path>.<digits>" files, and their ".tmp" compression leftovers, left in
+ * the log directory by a previous run
+ */
+static void log_segments_remove_stale(const struct log_segments *segments)
+{
+    char dirpath[PATH_MAX];
+    snprintf(dirpath, sizeof(dirpath), "%s", segments->path);
+    char *slash = strrchr(dirpath, '/');
+    const char *base = segments->path;
+    if(slash != NULL)
+    {
+        base = segments->path + (slash - dirpath) + 1;
+        *(slash == dirpath ? slash + 1 : slash) = '\0';
+    }
+    else
+    {
+        snprintf(dirpath, sizeof(dirpath), ".");
+    }
+
+    DIR *dir = opendir(dirpath);
+    if(dir == NULL)
+    {
+        return;
+    }
+    size_t baselen = strlen(base);
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL)
+    {
+        const char *name = entry->d_name;
+        if(strncmp(name, base, baselen) != 0 || name[baselen] != '.' || name[baselen + 1] == '\0')
+        {
+            continue;
+        }
+        size_t digits = strspn(name + baselen + 1, "0123456789");
+        const char *suffix = name + baselen + 1 + digits;
+        if(*suffix != '\0' && strcmp(suffix, ".tmp") != 0)
+        {
+            continue;
+        }
+        char path[PATH_MAX];
+        if(snprintf(path, sizeof(path), "%s/%s", dirpath, name) >= (int)sizeof(path))
+        {
+            continue;
+        }
+        if(unlink(path) == -1)
+        {
+            perror("unlink");
+        }
+    }
+    closedir(dir);
+}
+
+static int log_segments_push(struct log_segments *segments, uint64_t offset, size_t size)
+{
+    if(segments->count == segments->capacity)
+    {
+        size_t capacity = segments->capacity ? segments->capacity * 2 : LOG_SEGMENTS_INITIAL_CAPACITY;
+        struct log_segment *index = realloc(segments->index, capacity * sizeof(struct log_segment));
+        if(index == NULL)
+        {
+            return ENOMEM;
+        }
+        segments->index = index;
+        segments->capacity = capacity;
+    }
+    struct log_segment *segment = &segments->index[segments->count++];
+    segment->seq = segments->next_seq++;
+    segment->offset = offset;
+    segment->size = size;
+    segment->stored_size = size;
+    segment->created = time(NULL);
+    segment->blocks = NULL;
+    segment->block_count = 0;
+    segments->retained_bytes += size;
+    return 0;
+}
+
+/**
+ * @return the index of the last segment starting at or before @param offset, which
+ *  must be inside the window.  Called with lock held.
+ */
+static size_t log_segments_lookup(const struct log_segments *segments, uint64_t offset)
+{
+    size_t low = 0;
+    size_t high = segments->count - 1;
+    while(low < high)
+    {
+        size_t mid = (low + high + 1) / 2;
+        if(segments->index[mid].offset <= offset)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+    return low;
+}
+
+static bool write_all(int fd, const char *buf, size_t len)
+{
+    while(len > 0)
+    {
+        ssize_t ret = write(fd, buf, len);
+        if(ret == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+/**
+ * Reads @param len bytes at @param offset, short only at the end of the file
+ * @return the number of bytes read, -1 on error
+ */
+static ssize_t pread_all(int fd, char *buf, size_t len, off_t offset)
+{
+    size_t done = 0;
+    while(done < len)
+    {
+        ssize_t ret = pread(fd, buf + done, len - done, offset + done);
+        if(ret == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if(ret == 0)
+        {
+            break;
+        }
+        done += ret;
+    }
+    return done;
+}
+
+/**
+ * Rewrites the sealed segment @param seq as a block stream next to it, then renames
+ * it over the raw file and installs its block index under the lock.  Readers keep
+ * using the raw file until then.  Called by the compressor thread, without lock held.
+ * @return 0 on success, an errno value otherwise
+ */
+static int log_segments_compress(struct log_segments *segments, uint64_t seq)
+{
+    char sealed[PATH_MAX];
+    char tmp[PATH_MAX];
+    log_segments_sealed_path(segments, seq, sealed, sizeof(sealed));
+    if(snprintf(tmp, sizeof(tmp), "%s.tmp", sealed) >= (int)sizeof(tmp))
+    {
+        return ENAMETOOLONG;
+    }
+    int in = open(sealed, O_RDONLY);
+    if(in == -1)
+    {
+        // retired before the compressor got to it
+        return errno == ENOENT ? 0 : errno;
+    }
+    int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(out == -1)
+    {
+        int ret = errno;
+        close(in);
+        return ret;
+    }
+
+    char *raw = malloc(AESD_BLOCK_MAX_SIZE);
+    char *encoded = malloc(lz_block_bound(AESD_BLOCK_MAX_SIZE));
+    struct log_block *blocks = NULL;
+    size_t count = 0;
+    size_t capacity = 0;
+    size_t offset = 0;
+    off_t file_offset = 0;
+    int ret = raw != NULL && encoded != NULL ? 0 : ENOMEM;
+    while(ret == 0)
+    {
+        ssize_t len = pread_all(in, raw, AESD_BLOCK_MAX_SIZE, offset);
+        if(len <= 0)
+        {
+            ret = len == 0 ? 0 : errno;
+            break;
+        }
+        if(count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : LOG_SEGMENTS_INITIAL_CAPACITY;
+            struct log_block *grown = realloc(blocks, capacity * sizeof(struct log_block));
+            if(grown == NULL)
+            {
+                ret = ENOMEM;
+                break;
+            }
+            blocks = grown;
+        }
+        size_t encoded_len = lz_block_encode(raw, len, encoded);
+        if(!write_all(out, encoded, encoded_len))
+        {
+            ret = errno;
+            break;
+        }
+        struct log_block *block = &blocks[count++];
+        block->offset = offset;
+        block->file_offset = file_offset;
+        block->raw_len = len;
+        block->stored_len = encoded_len - AESD_BLOCK_HEADER_SIZE;
+        offset += len;
+        file_offset += encoded_len;
+    }
+    free(raw);
+    free(encoded);
+    close(in);
+    if(close(out) == -1 && ret == 0)
+    {
+        ret = errno;
+    }
+
+    pthread_mutex_lock(&segments->lock);
+    struct log_segment *segment = NULL;
+    size_t i;
+    for(i = 0; ret == 0 && i + 1 < segments->count; i++)
+    {
+        if(segments->index[i].seq == seq)
+        {
+            segment = &segments->index[i];
+            break;
+        }
+    }
+    // retired while compressing, or not the size indexed, then keep it as is
+    if(segment != NULL && offset == segment->size && rename(tmp, sealed) == 0)
+    {
+        segment->blocks = blocks;
+        segment->block_count = count;
+        segments->retained_bytes = segments->retained_bytes - segment->stored_size + file_offset;
+        segment->stored_size = file_offset;
+        blocks = NULL;
+        syslog(LOG_DEBUG, "Compressed log segment %s from %zu to %zu bytes\n", sealed, offset,
+                (size_t)file_offset);
+    }
+    pthread_mutex_unlock(&segments->lock);
+
+    if(blocks != NULL || ret != 0)
+    {
+        unlink(tmp);
+        free(blocks);
+    }
+    return ret;
+}
+
+/**
+ * Renames the active segment to its sealed name and starts a new one.  Called with lock held.
+ */
+static int log_segments_rotate(struct log_segments *segments)
+{
+    struct log_segment *active = &segments->index[segments->count - 1];
+    char sealed[PATH_MAX];
+    log_segments_sealed_path(segments, active->seq, sealed, sizeof(sealed));
+    if(rename(segments->path, sealed) == -1)
+    {
+        return errno;
+    }
+    syslog(LOG_DEBUG, "Sealed log segment %s (%zu bytes)\n", sealed, active->size);
+    segments->sealed_seq = active->seq + 1;
+    return log_segments_push(segments, active->offset + active->size, 0);
+}
+
+/**
+ * Compressor thread, compresses sealed segments in order until log_segments_destroy
+ */
+static void *log_segments_compressor(void *param)
+{
+    struct log_segments *segments = (struct log_segments *) param;
+
+    pthread_mutex_lock(&segments->lock);
+    while(!segments->stopping)
+    {
+        if(segments->compress_seq == segments->sealed_seq)
+        {
+            pthread_cond_wait(&segments->compress_cond, &segments->lock);
+            continue;
+        }
+        uint64_t seq = segments->compress_seq++;
+        if(seq < segments->index[0].seq)
+        {
+            // already retired
+            continue;
+        }
+        pthread_mutex_unlock(&segments->lock);
+        int ret = log_segments_compress(segments, seq);
+        if(ret != 0)
+        {
+            syslog(LOG_ERR, "Failed to compress log segment %llu: %s\n",
+                    (unsigned long long)seq, strerror(ret));
+        }
+        pthread_mutex_lock(&segments->lock);
+    }
+    pthread_mutex_unlock(&segments->lock);
+    return NULL;
+}
+
+/**
+ * Deletes the oldest sealed segments beyond the retention limits.  Called with lock held.
+ */
+static void log_segments_retire(struct log_segments *segments)
+{
+    const struct log_segments_config *config = &segments->config;
+    size_t retire = 0;
+    size_t retained = segments->retained_bytes;
+
+    while(segments->count - retire > 1)
+    {
+        const struct log_segment *oldest = &segments->index[retire];
+        bool over_count = config->max_segments && segments->count - retire > config->max_segments;
+        bool over_bytes = config->max_retained_bytes && retained > config->max_retained_bytes;
+        if(!over_count && !over_bytes)
+        {
+            break;
+        }
+        char path[PATH_MAX];
+        log_segments_sealed_path(segments, oldest->seq, path, sizeof(path));
+        if(unlink(path) == -1 && errno != ENOENT)
+        {
+            perror("unlink");
+        }
+        syslog(LOG_DEBUG, "Retired log segment %s\n", path);
+        retained -= oldest->stored_size;
+        free(oldest->blocks);
+        retire++;
+    }
+
+    if(retire > 0)
+    {
+        memmove(segments->index, segments->index + retire,
+                (segments->count - retire) * sizeof(struct log_segment));
+        segments->count -= retire;
+        segments->retained_bytes = retained;
+    }
+}
+
+int log_segments_init(struct log_segments *segments, const char *path, const struct log_segments_config *config)
+{
+    int ret = pthread_mutex_init(&segments->lock, NULL);
+    if(ret != 0)
+    {
+        return ret;
+    }
+    segments->path = path;
+    segments->config = *config;
+    segments->index = NULL;
+    segments->count = 0;
+    segments->capacity = 0;
+    segments->next_seq = 0;
+    segments->retained_bytes = 0;
+    segments->compress_seq = 0;
+    segments->sealed_seq = 0;
+    segments->compressor_running = false;
+    segments->stopping = false;
+
+    log_segments_remove_stale(segments);
+
+    struct stat st;
+    size_t size = 0;
+    if(stat(path, &st) == 0)
+    {
+        size = st.st_size;
+    }
+    ret = log_segments_push(segments, 0, size);
+    if(ret == 0)
+    {
+        ret = pthread_cond_init(&segments->compress_cond, NULL);
+        if(ret != 0)
+        {
+            free(segments->index);
+        }
+    }
+    if(ret != 0)
+    {
+        pthread_mutex_destroy(&segments->lock);
+        return ret;
+    }
+    if(config->compress)
+    {
+        ret = pthread_create(&segments->compressor, NULL, log_segments_compressor, segments);
+        if(ret != 0)
+        {
+            pthread_cond_destroy(&segments->compress_cond);
+            pthread_mutex_destroy(&segments->lock);
+            free(segments->index);
+            return ret;
+        }
+        segments->compressor_running = true;
+    }
+    return 0;
+}
+
+void log_segments_destroy(struct log_segments *segments, bool remove_files)
+{
+    size_t i;
+    if(segments->compressor_running)
+    {
+        pthread_mutex_lock(&segments->lock);
+        segments->stopping = true;
+        pthread_cond_signal(&segments->compress_cond);
+        pthread_mutex_unlock(&segments->lock);
+        pthread_join(segments->compressor, NULL);
+        segments->compressor_running = false;
+    }
+    pthread_mutex_lock(&segments->lock);
+    for(i = 0; i < segments->count; i++)
+    {
+        if(remove_files)
+        {
+            char path[PATH_MAX];
+            log_segments_path(segments, &segments->index[i], path, sizeof(path));
+            if(unlink(path) == -1 && errno != ENOENT)
+            {
+                perror("unlink");
+            }
+        }
+        free(segments->index[i].blocks);
+    }
+    free(segments->index);
+    segments->index = NULL;
+    segments->count = 0;
+    pthread_mutex_unlock(&segments->lock);
+    pthread_cond_destroy(&segments->compress_cond);
+    pthread_mutex_destroy(&segments->lock);
+}
+
+int log_segments_commit(struct log_segments *segments)
+{
+    const struct log_segments_config *config = &segments->config;
+    struct stat st;
+    size_t size = 0;
+    int ret = 0;
+
+    if(stat(segments->path, &st) == 0)
+    {
+        size = st.st_size;
+    }
+    else if(errno != ENOENT)
+    {
+        return errno;
+    }
+
+    pthread_mutex_lock(&segments->lock);
+    struct log_segment *active = &segments->index[segments->count - 1];
+    if(size >= active->size)
+    {
+        segments->retained_bytes += size - active->size;
+        active->size = size;
+        active->stored_size = size;
+    }
+
+    bool full = config->max_segment_size && active->size >= config->max_segment_size;
+    bool old = config->max_segment_age && active->size > 0
+        && time(NULL) - active->created >= config->max_segment_age;
+    if(full || old)
+    {
+        ret = log_segments_rotate(segments);
+        if(ret == 0 && segments->compressor_running)
+        {
+            pthread_cond_signal(&segments->compress_cond);
+        }
+    }
+    log_segments_retire(segments);
+    pthread_mutex_unlock(&segments->lock);
+    return ret;
+}
+
+void log_segments_window(struct log_segments *segments, uint64_t *start, uint64_t *end)
+{
+    pthread_mutex_lock(&segments->lock);
+    const struct log_segment *active = &segments->index[segments->count - 1];
+    *start = segments->index[0].offset;
+    *end = active->offset + active->size;
+    pthread_mutex_unlock(&segments->lock);
+}
+
+ssize_t log_segments_read(struct log_segments *segments, char *buf, size_t len, uint64_t offset)
+{
+    pthread_mutex_lock(&segments->lock);
+    const struct log_segment *active = &segments->index[segments->count - 1];
+    if(offset < segments->index[0].offset)
+    {
+        pthread_mutex_unlock(&segments->lock);
+        errno = ERANGE;
+        return -1;
+    }
+    if(offset >= active->offset + active->size)
+    {
+        pthread_mutex_unlock(&segments->lock);
+        return 0;
+    }
+
+    const struct log_segment *segment = &segments->index[log_segments_lookup(segments, offset)];
+    off_t segment_offset = offset - segment->offset;
+    size_t available = segment->size - segment_offset;
+    struct log_block block = { 0 };
+    bool compressed = segment->blocks != NULL;
+    if(compressed)
+    {
+        /* Only the block holding offset is decoded, the caller reads on from its end */
+        size_t low = 0;
+        size_t high = segment->block_count - 1;
+        while(low < high)
+        {
+            size_t mid = (low + high + 1) / 2;
+            if(segment->blocks[mid].offset <= (size_t)segment_offset)
+            {
+                low = mid;
+            }
+            else
+            {
+                high = mid - 1;
+            }
+        }
+        block = segment->blocks[low];
+        available = block.offset + block.raw_len - segment_offset;
+    }
+    char path[PATH_MAX];
+    log_segments_path(segments, segment, path, sizeof(path));
+    /* Opened under the lock so that retention cannot delete it in between */
+    int fd = open(path, O_RDONLY);
+    pthread_mutex_unlock(&segments->lock);
+    if(fd == -1)
+    {
+        return -1;
+    }
+
+    if(len > available)
+    {
+        len = available;
+    }
+    ssize_t bytes_read;
+    if(!compressed)
+    {
+        bytes_read = pread_all(fd, buf, len, segment_offset);
+    }
+    else if(block.stored_len == block.raw_len)
+    {
+        bytes_read = pread_all(fd, buf, len, block.file_offset + AESD_BLOCK_HEADER_SIZE
+                + (segment_offset - block.offset));
+    }
+    else
+    {
+        size_t skip = segment_offset - block.offset;
+        bool direct = skip == 0 && len == block.raw_len;
+        char *stored = malloc(block.stored_len);
+        char *decoded = direct ? buf : malloc(block.raw_len);
+        bytes_read = -1;
+        errno = ENOMEM;
+        if(stored != NULL && decoded != NULL &&
+                pread_all(fd, stored, block.stored_len, block.file_offset + AESD_BLOCK_HEADER_SIZE)
+                    == (ssize_t)block.stored_len)
+        {
+            errno = EIO;
+            if(lz_block_decode(stored, block.stored_len, decoded, block.raw_len) == 0)
+            {
+                if(!direct)
+                {
+                    memcpy(buf, decoded + skip, len);
+                }
+                bytes_read = len;
+            }
+        }
+        free(stored);
+        if(!direct)
+        {
+            free(decoded);
+        }
+    }
+    int saved_errno = errno;
+    close(fd);
+    errno = saved_errno;
+    return bytes_read;
+}
+
+int log_segments_open_blocks(struct log_segments *segments, uint64_t offset, size_t *stored_size,
+            size_t *raw_size)
+{
+    *raw_size = 0;
+    pthread_mutex_lock(&segments->lock);
+    const struct log_segment *active = &segments->index[segments->count - 1];
+    if(offset < segments->index[0].offset || offset >= active->offset + active->size)
+    {
+        pthread_mutex_unlock(&segments->lock);
+        return -1;
+    }
+    const struct log_segment *segment = &segments->index[log_segments_lookup(segments, offset)];
+    *raw_size = segment->offset + segment->size - offset;
+    if(segment->blocks == NULL || segment->offset != offset)
+    {
+        pthread_mutex_unlock(&segments->lock);
+        return -1;
+    }
+    *stored_size = segment->stored_size;
+    char path[PATH_MAX];
+    log_segments_path(segments, segment, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    pthread_mutex_unlock(&segments->lock);
+    return fd;
+}
@@ -0,0 +1,167 @@
+#ifndef LOG_SEGMENTS_H
+#define LOG_SEGMENTS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/**
+ * Segmented storage for the file backend.
+ *
+ * Appends always go to the active segment, stored at the log path itself so
+ * writers keep using fopen(path, "a").  When the active segment exceeds the
+ * configured size or age it is sealed by renaming it to "<path>.<seq>" and a
+ * new, empty active segment starts.  The oldest sealed segments are deleted
+ * once the retention limits are exceeded.
+ *
+ * Every byte ever appended has a logical offset, the in-memory index maps
+ * offsets to segments so a reader can start anywhere in the retained window
+ * without touching the segments before it.
+ *
+ * With compression enabled, a sealed segment is rewritten as a sequence of
+ * blocks (see protocol.h) by a background compressor thread, so rotation never
+ * delays a commit.  Readers use the raw segment until its compressed file and
+ * block index are swapped in under the index lock.  The block index is kept in
+ * memory so reads only decode the blocks covering the requested range, one at
+ * a time.
+ */
+
+struct log_segments_config
+{
+    /**
+     * Seal the active segment once it holds at least this many bytes, 0 to disable
+     */
+    size_t max_segment_size;
+    /**
+     * Seal the active segment once it is older than this many seconds, 0 to disable
+     */
+    time_t max_segment_age;
+    /**
+     * Keep at most this many segments, the active one included, 0 for no limit
+     */
+    size_t max_segments;
+    /**
+     * Delete sealed segments while the retained total exceeds this, 0 for no limit
+     */
+    size_t max_retained_bytes;
+    /**
+     * Store sealed segments block compressed
+     */
+    bool compress;
+};
+
+/**
+ * One block of a compressed segment
+ */
+struct log_block
+{
+    /**
+     * Offset of the decoded data inside the segment, and of the block header in the file
+     */
+    size_t offset;
+    off_t file_offset;
+    size_t raw_len;
+    size_t stored_len;
+};
+
+struct log_segment
+{
+    uint64_t seq;
+    /**
+     * Logical offset of the first byte of the segment
+     */
+    uint64_t offset;
+    size_t size;
+    /**
+     * Bytes used on disk, equal to size unless the segment is compressed
+     */
+    size_t stored_size;
+    time_t created;
+    /**
+     * Block index of a compressed segment, NULL while it is stored as is
+     */
+    struct log_block *blocks;
+    size_t block_count;
+};
+
+struct log_segments
+{
+    /**
+     * Protects the index, held while a segment is opened so it cannot be deleted
+     * between lookup and open
+     */
+    pthread_mutex_t lock;
+    const char *path;
+    struct log_segments_config config;
+    /**
+     * Oldest segment first, the last one is the active segment
+     */
+    struct log_segment *index;
+    size_t count;
+    size_t capacity;
+    uint64_t next_seq;
+    /**
+     * Bytes used on disk by the retained segments
+     */
+    size_t retained_bytes;
+    /**
+     * Sealed segments with sequence numbers from compress_seq up to sealed_seq wait for
+     * the compressor thread, woken through compress_cond
+     */
+    uint64_t compress_seq;
+    uint64_t sealed_seq;
+    pthread_cond_t compress_cond;
+    pthread_t compressor;
+    bool compressor_running;
+    bool stopping;
+};
+
+/**
+ * Initializes @param segments with the active segment at @param path, and starts the
+ * compressor thread when enabled.  Sealed segments left over from a previous run are
+ * removed.
+ * @return 0 on success, an errno value otherwise
+ */
+int log_segments_init(struct log_segments *segments, const char *path, const struct log_segments_config *config);
+
+/**
+ * Stops the compressor thread, leaving segments it did not get to uncompressed, then
+ * releases the index, and deletes every segment file when @param remove_files is set
+ */
+void log_segments_destroy(struct log_segments *segments, bool remove_files);
+
+/**
+ * Records data appended to the active segment and applies rotation and retention.
+ * Must be called with the log append lock held, after the appended data was closed
+ * or flushed, and only between complete packets.
+ * @return 0 on success, an errno value otherwise
+ */
+int log_segments_commit(struct log_segments *segments);
+
+/**
+ * Reports the retained window of logical offsets [@param start, @param end)
+ */
+void log_segments_window(struct log_segments *segments, uint64_t *start, uint64_t *end);
+
+/**
+ * Reads up to @param len bytes at logical @param offset, never crossing a segment boundary
+ * @return the number of bytes read, 0 at the end of the window, -1 on error with errno
+ *  set to ERANGE when @param offset is no longer retained
+ */
+ssize_t log_segments_read(struct log_segments *segments, char *buf, size_t len, uint64_t offset);
+
+/**
+ * Opens the block stream of the compressed segment starting at logical @param offset,
+ * to send its blocks without decoding them
+ * @return a descriptor to read @param stored_size bytes from, holding the @param raw_size
+ *  bytes of the segment, or -1 when the segment is not compressed or does not start at
+ *  @param offset, in which case @param raw_size is the number of bytes from @param offset
+ *  to the end of its segment (0 outside of the window)
+ */
+int log_segments_open_blocks(struct log_segments *segments, uint64_t offset, size_t *stored_size,
+            size_t *raw_size);
+
+#endif /* LOG_SEGMENTS_H */
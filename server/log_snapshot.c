@@ -0,0 +1,487 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "log_snapshot.h"
+#include "lz.h"
+#include "protocol.h"
+#include "stats.h"
+#include "lockprof.h"
+
+#define LOG_BUFFER_MIN_CAPACITY 4096
+#define LOG_READ_CHUNK 4096
+#define LOG_SNAPSHOT_BUILD_ATTEMPTS 3
+
+static struct log_buffer *log_buffer_new(size_t capacity)
+{
+    struct log_buffer *buffer = malloc(sizeof(struct log_buffer));
+    if(buffer == NULL)
+    {
+        return NULL;
+    }
+    buffer->data = NULL;
+    if(capacity > 0)
+    {
+        buffer->data = malloc(capacity);
+        if(buffer->data == NULL)
+        {
+            free(buffer);
+            return NULL;
+        }
+    }
+    buffer->used = 0;
+    buffer->capacity = capacity;
+    buffer->refcount = 1;
+    return buffer;
+}
+
+static void log_buffer_put(struct log_buffer *buffer)
+{
+    if(__atomic_sub_fetch(&buffer->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(buffer->data);
+        free(buffer);
+    }
+}
+
+/**
+ * Makes sure @param buffer can take @param extra more bytes past buffer->used.
+ * Buffers are never reallocated in place since snapshots may be reading them,
+ * a bigger copy of the bytes from @param keep onwards is made instead, @param keep
+ * is reset to 0 and the caller's reference is moved to the copy.
+ * @return the buffer to append to, or NULL on allocation failure (the reference
+ *  on @param buffer is released in that case)
+ */
+static struct log_buffer *log_buffer_reserve(struct log_buffer *buffer, size_t *keep, size_t extra)
+{
+    if(buffer->used + extra <= buffer->capacity)
+    {
+        return buffer;
+    }
+    size_t kept = buffer->used - *keep;
+    size_t capacity = buffer->capacity * 2;
+    if(capacity < kept + extra)
+    {
+        capacity = kept + extra;
+    }
+    if(capacity < LOG_BUFFER_MIN_CAPACITY)
+    {
+        capacity = LOG_BUFFER_MIN_CAPACITY;
+    }
+    struct log_buffer *grown = log_buffer_new(capacity);
+    if(grown != NULL)
+    {
+        if(kept > 0)
+        {
+            memcpy(grown->data, buffer->data + *keep, kept);
+        }
+        grown->used = kept;
+        *keep = 0;
+    }
+    log_buffer_put(buffer);
+    return grown;
+}
+
+/**
+ * Appends everything readable from the char device at @param path to the buffer
+ * @return the buffer holding the data (possibly a new one), NULL on error
+ */
+static struct log_buffer *log_buffer_fill_path(struct log_buffer *buffer, const char *path)
+{
+    size_t keep = 0;
+    int fd = open(path, O_RDONLY);
+    if(fd == -1)
+    {
+        if(errno == ENOENT)
+        {
+            /* Nothing logged yet */
+            return buffer;
+        }
+        perror("open");
+        log_buffer_put(buffer);
+        return NULL;
+    }
+    while(1)
+    {
+        buffer = log_buffer_reserve(buffer, &keep, LOG_READ_CHUNK);
+        if(buffer == NULL)
+        {
+            break;
+        }
+        ssize_t bytes_read = read(fd, buffer->data + buffer->used, buffer->capacity - buffer->used);
+        if(bytes_read == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("read");
+            log_buffer_put(buffer);
+            buffer = NULL;
+            break;
+        }
+        if(bytes_read == 0)
+        {
+            break;
+        }
+        buffer->used += bytes_read;
+    }
+    close(fd);
+    return buffer;
+}
+
+/**
+ * Appends logical range [@param offset, @param end) of the segmented log to the
+ * buffer, keeping the bytes from @param keep onwards
+ * @return the buffer holding the data (possibly a new one), NULL on error with
+ *  errno set to ERANGE if the range was retired while reading
+ */
+static struct log_buffer *log_buffer_fill_segments(struct log_buffer *buffer, size_t *keep,
+            struct log_segments *segments, uint64_t offset, uint64_t end)
+{
+    while(offset < end)
+    {
+        buffer = log_buffer_reserve(buffer, keep, end - offset);
+        if(buffer == NULL)
+        {
+            errno = ENOMEM;
+            return NULL;
+        }
+        ssize_t bytes_read = log_segments_read(segments, buffer->data + buffer->used, end - offset, offset);
+        if(bytes_read == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            int saved_errno = errno;
+            log_buffer_put(buffer);
+            errno = saved_errno;
+            return NULL;
+        }
+        if(bytes_read == 0)
+        {
+            /* Segment shorter than indexed, e.g. removed on shutdown */
+            break;
+        }
+        buffer->used += bytes_read;
+        offset += bytes_read;
+    }
+    return buffer;
+}
+
+/**
+ * Reads the retained window of the segmented log into a new snapshot, reusing
+ * the buffer of @param previous when the window only moved forward.
+ * @return the new snapshot, NULL on error
+ */
+static struct log_snapshot *log_snapshot_build_segments(struct log_snapshot_cache *cache,
+            struct log_snapshot *previous, struct log_snapshot *snapshot)
+{
+    int attempt;
+    for(attempt = 0; attempt < LOG_SNAPSHOT_BUILD_ATTEMPTS; attempt++)
+    {
+        uint64_t start, end;
+        log_segments_window(cache->segments, &start, &end);
+
+        struct log_buffer *buffer;
+        size_t keep = 0;
+        uint64_t read_from = start;
+        uint64_t previous_end = previous ? previous->offset + previous->size : 0;
+        if(previous != NULL && previous->offset <= start && start <= previous_end && previous_end <= end)
+        {
+            /* Share the previous buffer, dropping retired bytes from the front of the view */
+            buffer = previous->buffer;
+            __atomic_add_fetch(&buffer->refcount, 1, __ATOMIC_RELAXED);
+            size_t view = previous->data - buffer->data;
+            buffer->used = view + previous->size;
+            keep = view + (start - previous->offset);
+            read_from = previous_end;
+        }
+        else
+        {
+            buffer = log_buffer_new(0);
+            if(buffer == NULL)
+            {
+                return NULL;
+            }
+        }
+
+        buffer = log_buffer_fill_segments(buffer, &keep, cache->segments, read_from, end);
+        if(buffer != NULL)
+        {
+            snapshot->buffer = buffer;
+            snapshot->data = buffer->data + keep;
+            snapshot->size = buffer->used - keep;
+            snapshot->offset = start;
+            return snapshot;
+        }
+        if(errno != ERANGE)
+        {
+            perror("log_segments_read");
+            return NULL;
+        }
+        /* The window moved while reading, start over from the new one */
+        previous = NULL;
+    }
+    return NULL;
+}
+
+/**
+ * Reads the backend into a new snapshot.  Called with cache->lock held.
+ */
+static struct log_snapshot *log_snapshot_build(struct log_snapshot_cache *cache,
+            struct log_snapshot *previous, uint64_t generation)
+{
+    struct log_snapshot *snapshot = malloc(sizeof(struct log_snapshot));
+    if(snapshot == NULL)
+    {
+        perror("malloc");
+        return NULL;
+    }
+
+    if(cache->segments != NULL)
+    {
+        if(log_snapshot_build_segments(cache, previous, snapshot) == NULL)
+        {
+            free(snapshot);
+            return NULL;
+        }
+    }
+    else
+    {
+        struct log_buffer *buffer = log_buffer_new(0);
+        if(buffer != NULL)
+        {
+            buffer = log_buffer_fill_path(buffer, cache->path);
+        }
+        if(buffer == NULL)
+        {
+            free(snapshot);
+            return NULL;
+        }
+        snapshot->buffer = buffer;
+        snapshot->data = buffer->data;
+        snapshot->size = buffer->used;
+        snapshot->offset = 0;
+    }
+
+    snapshot->generation = generation;
+    snapshot->refcount = 1;
+    snapshot->compressed = NULL;
+    snapshot->compressed_size = 0;
+    snapshot->segments = cache->segments;
+    pthread_mutex_init(&snapshot->compress_lock, NULL);
+    return snapshot;
+}
+
+int log_snapshot_cache_init(struct log_snapshot_cache *cache, const char *path, struct log_segments *segments)
+{
+    int ret = pthread_mutex_init(&cache->lock, NULL);
+    if(ret != 0)
+    {
+        return ret;
+    }
+    cache->generation = 0;
+    cache->current = NULL;
+    cache->path = path;
+    cache->segments = segments;
+    return 0;
+}
+
+void log_snapshot_cache_destroy(struct log_snapshot_cache *cache)
+{
+    lockprof_mutex_lock(&cache->lock);
+    if(cache->current != NULL)
+    {
+        log_snapshot_put(cache->current);
+        cache->current = NULL;
+    }
+    lockprof_mutex_unlock(&cache->lock);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+void log_snapshot_cache_invalidate(struct log_snapshot_cache *cache)
+{
+    __atomic_add_fetch(&cache->generation, 1, __ATOMIC_RELEASE);
+}
+
+struct log_snapshot *log_snapshot_get(struct log_snapshot_cache *cache)
+{
+    uint64_t lock_start = stats_now_ns();
+    lockprof_mutex_lock(&cache->lock);
+    stats_lock_acquired(lock_start);
+    /* Sampled before reading the backend, so a concurrent append forces the next rebuild */
+    uint64_t generation = __atomic_load_n(&cache->generation, __ATOMIC_ACQUIRE);
+    struct log_snapshot *snapshot = cache->current;
+
+    if(snapshot == NULL || snapshot->generation != generation)
+    {
+        snapshot = log_snapshot_build(cache, cache->current, generation);
+        if(snapshot == NULL)
+        {
+            lockprof_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        if(cache->current != NULL)
+        {
+            log_snapshot_put(cache->current);
+        }
+        cache->current = snapshot;
+    }
+
+    __atomic_add_fetch(&snapshot->refcount, 1, __ATOMIC_RELAXED);
+    lockprof_mutex_unlock(&cache->lock);
+    return snapshot;
+}
+
+/**
+ * Growable output of log_snapshot_compress
+ */
+struct block_stream
+{
+    char *data;
+    size_t used;
+    size_t capacity;
+};
+
+static bool block_stream_reserve(struct block_stream *stream, size_t extra)
+{
+    if(stream->used + extra <= stream->capacity)
+    {
+        return true;
+    }
+    size_t capacity = stream->capacity * 2;
+    if(capacity < stream->used + extra)
+    {
+        capacity = stream->used + extra;
+    }
+    char *data = realloc(stream->data, capacity);
+    if(data == NULL)
+    {
+        return false;
+    }
+    stream->data = data;
+    stream->capacity = capacity;
+    return true;
+}
+
+/**
+ * Appends @param len bytes of @param data to @param stream as compressed blocks
+ */
+static bool block_stream_encode(struct block_stream *stream, const char *data, size_t len)
+{
+    while(len > 0)
+    {
+        size_t chunk = len < AESD_BLOCK_MAX_SIZE ? len : AESD_BLOCK_MAX_SIZE;
+        if(!block_stream_reserve(stream, lz_block_bound(chunk)))
+        {
+            return false;
+        }
+        stream->used += lz_block_encode(data, chunk, stream->data + stream->used);
+        data += chunk;
+        len -= chunk;
+    }
+    return true;
+}
+
+/**
+ * Appends the @param stored_size bytes of block stream of @param fd to @param stream
+ * @return false on error or if the file is shorter, @param stream is unchanged then
+ */
+static bool block_stream_copy(struct block_stream *stream, int fd, size_t stored_size)
+{
+    if(!block_stream_reserve(stream, stored_size))
+    {
+        return false;
+    }
+    size_t done = 0;
+    while(done < stored_size)
+    {
+        ssize_t ret = pread(fd, stream->data + stream->used + done, stored_size - done, done);
+        if(ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ret <= 0)
+        {
+            return false;
+        }
+        done += ret;
+    }
+    stream->used += stored_size;
+    return true;
+}
+
+/**
+ * Builds the block stream of @param snapshot, passing the blocks of compressed
+ * segments through and compressing everything else from the snapshot data
+ */
+static bool log_snapshot_compress(struct log_snapshot *snapshot)
+{
+    struct block_stream stream = { NULL, 0, 0 };
+    uint64_t pos = snapshot->offset;
+    uint64_t end = snapshot->offset + snapshot->size;
+
+    while(pos < end)
+    {
+        size_t raw_size = end - pos;
+        if(snapshot->segments != NULL)
+        {
+            size_t stored_size;
+            int fd = log_segments_open_blocks(snapshot->segments, pos, &stored_size, &raw_size);
+            if(fd != -1)
+            {
+                bool copied = pos + raw_size <= end && block_stream_copy(&stream, fd, stored_size);
+                close(fd);
+                if(copied)
+                {
+                    pos += raw_size;
+                    continue;
+                }
+            }
+            /* Raw or retired segment, compress up to its end from memory */
+            if(raw_size == 0 || raw_size > end - pos)
+            {
+                raw_size = end - pos;
+            }
+        }
+        if(!block_stream_encode(&stream, snapshot->data + (pos - snapshot->offset), raw_size))
+        {
+            free(stream.data);
+            return false;
+        }
+        pos += raw_size;
+    }
+
+    snapshot->compressed = stream.data;
+    snapshot->compressed_size = stream.used;
+    return true;
+}
+
+const char *log_snapshot_compressed(struct log_snapshot *snapshot, size_t *len)
+{
+    pthread_mutex_lock(&snapshot->compress_lock);
+    if(snapshot->compressed == NULL && snapshot->size > 0 && !log_snapshot_compress(snapshot))
+    {
+        pthread_mutex_unlock(&snapshot->compress_lock);
+        return NULL;
+    }
+    pthread_mutex_unlock(&snapshot->compress_lock);
+    *len = snapshot->compressed_size;
+    return snapshot->compressed != NULL ? snapshot->compressed : "";
+}
+
+void log_snapshot_put(struct log_snapshot *snapshot)
+{
+    if(__atomic_sub_fetch(&snapshot->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        log_buffer_put(snapshot->buffer);
+        pthread_mutex_destroy(&snapshot->compress_lock);
+        free(snapshot->compressed);
+        free(snapshot);
+    }
+}
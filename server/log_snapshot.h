@@ -0,0 +1,108 @@
+#ifndef LOG_SNAPSHOT_H
+#define LOG_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "log_segments.h"
+
+/**
+ * Backing storage shared by successive snapshots.  Snapshots are views on a
+ * range of a buffer, the cache only ever appends past the end of every view
+ * handed out so far, so readers never see the bytes changing under them.
+ */
+struct log_buffer
+{
+    char *data;
+    size_t used;
+    size_t capacity;
+    int refcount;
+};
+
+/**
+ * An immutable, reference counted copy of the log contents as of
+ * @param generation.  Obtain with log_snapshot_get, release with log_snapshot_put.
+ */
+struct log_snapshot
+{
+    const char *data;
+    size_t size;
+    /**
+     * Logical offset of data[0] in the segmented log, always 0 for the char device
+     */
+    uint64_t offset;
+    uint64_t generation;
+    int refcount;
+    struct log_buffer *buffer;
+    /**
+     * Block stream form of data for compressed replies, built on first use by
+     * log_snapshot_compressed and shared by every reply of this snapshot
+     */
+    pthread_mutex_t compress_lock;
+    char *compressed;
+    size_t compressed_size;
+    struct log_segments *segments;
+};
+
+struct log_snapshot_cache
+{
+    /**
+     * Serializes snapshot rebuilds, never held while sending to a client
+     */
+    pthread_mutex_t lock;
+    /**
+     * Bumped by log_snapshot_cache_invalidate after every append to the log
+     */
+    uint64_t generation;
+    struct log_snapshot *current;
+    const char *path;
+    /**
+     * Segment store of the file backend, which only ever grows by appending, in
+     * which case only the bytes past the previous snapshot are read on refresh and
+     * retired segments are dropped from the front.  NULL for the char device, which
+     * drops old entries by itself and is re-read in full from @param path.
+     */
+    struct log_segments *segments;
+};
+
+/**
+ * Initializes @param cache for the log stored in @param segments, or at @param path
+ * when @param segments is NULL
+ * @return 0 on success, an errno value otherwise
+ */
+int log_snapshot_cache_init(struct log_snapshot_cache *cache, const char *path, struct log_segments *segments);
+
+/**
+ * Releases the cached snapshot.  Snapshots still referenced by callers stay valid
+ * until they are put.
+ */
+void log_snapshot_cache_destroy(struct log_snapshot_cache *cache);
+
+/**
+ * Marks the cached snapshot as stale.  Must be called after the appended data is
+ * visible to readers of the backend (file closed or write returned).
+ */
+void log_snapshot_cache_invalidate(struct log_snapshot_cache *cache);
+
+/**
+ * @return a referenced snapshot at least as recent as the last invalidate call which
+ *  completed before this call, or NULL if the backend could not be read
+ */
+struct log_snapshot *log_snapshot_get(struct log_snapshot_cache *cache);
+
+/**
+ * Returns the contents of @param snapshot as a block stream (see protocol.h).  The
+ * blocks of compressed segments are copied from their files as they are, only
+ * the rest is compressed.
+ * @return the stream, valid until the snapshot is put, NULL on error
+ */
+const char *log_snapshot_compressed(struct log_snapshot *snapshot, size_t *len);
+
+/**
+ * Drops the reference on @param snapshot obtained from log_snapshot_get
+ */
+void log_snapshot_put(struct log_snapshot *snapshot);
+
+#endif /* LOG_SNAPSHOT_H */
@@ -0,0 +1,331 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "log_writer.h"
+#include "stats.h"
+#include "lockprof.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+/**
+ * Writes all @param count buffers of @param iov, resuming after partial writes
+ * @return the number of bytes written, short on error
+ */
+static size_t writev_all(int fd, struct iovec *iov, int count)
+{
+    size_t written = 0;
+    while(count > 0)
+    {
+        ssize_t ret = writev(fd, iov, count);
+        if(ret == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            perror("writev");
+            break;
+        }
+        written += ret;
+        while(count > 0 && (size_t)ret >= iov->iov_len)
+        {
+            ret -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+    return written;
+}
+
+/**
+ * Appends the @param count records starting at @param batch and publishes them, or
+ * as much of them as reached the log when the write fails part way
+ * @return true on success
+ */
+static bool log_writer_commit(struct log_writer *writer, struct log_record *batch, int count)
+{
+    struct iovec iov[IOV_MAX];
+    struct log_record *record = batch;
+    size_t len = 0;
+    int i;
+    for(i = 0; i < count; i++, record = record->next)
+    {
+        iov[i].iov_base = (void *)record->data;
+        iov[i].iov_len = record->len;
+        len += record->len;
+    }
+
+    // Appends to file path, creating this file if it doesn’t exist.
+    int fd = open(writer->path, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fd == -1)
+    {
+        perror("open");
+        return false;
+    }
+    size_t landed = writev_all(fd, iov, count);
+    bool success = landed == len;
+    close(fd);
+
+    // The batch is now visible to readers of the log: index it, then drop the cached copy
+    if(writer->segments != NULL)
+    {
+        int ret = log_segments_commit(writer->segments);
+        if(ret != 0)
+        {
+            fprintf(stderr, "log_segments_commit: %s\n", strerror(ret));
+            syslog(LOG_ERR, "log_segments_commit: %s\n", strerror(ret));
+        }
+        uint64_t start;
+        log_segments_window(writer->segments, &start, &writer->offset);
+    }
+    else
+    {
+        writer->offset += landed;
+    }
+    log_snapshot_cache_invalidate(writer->snapshots);
+    // even a failed batch, followers must see the bytes that landed to stay in sync
+    if(writer->replication != NULL)
+    {
+        replication_publish(writer->replication, batch, count, landed, writer->offset);
+    }
+    return success;
+}
+
+/**
+ * Fills a batch of at most IOV_MAX records and LOG_WRITER_BATCH_BYTES (unless a single
+ * record is larger) by deficit round robin over the active flows.  Called with the lock held.
+ * @return the records in commit order, @param count of them
+ */
+static struct log_record *log_writer_take(struct log_writer *writer, int *count)
+{
+    struct log_record *batch = NULL;
+    struct log_record **tail = &batch;
+    size_t bytes = 0;
+    bool full = false;
+    *count = 0;
+
+    while(writer->active != NULL && !full)
+    {
+        struct log_flow *flow = writer->active;
+        flow->deficit += LOG_WRITER_QUANTUM;
+        while(flow->head != NULL && flow->head->len <= flow->deficit)
+        {
+            struct log_record *record = flow->head;
+            if(*count == IOV_MAX || (*count > 0 && bytes + record->len > LOG_WRITER_BATCH_BYTES))
+            {
+                full = true;
+                break;
+            }
+            flow->head = record->next;
+            if(flow->head == NULL)
+            {
+                flow->tail = &flow->head;
+            }
+            record->next = NULL;
+            *tail = record;
+            tail = &record->next;
+            flow->deficit -= record->len;
+            bytes += record->len;
+            (*count)++;
+        }
+        if(full)
+        {
+            // The flow resumes its turn first in the next batch
+            break;
+        }
+
+        writer->active = flow->next;
+        if(writer->active == NULL)
+        {
+            writer->active_tail = &writer->active;
+        }
+        if(flow->head == NULL)
+        {
+            flow->active = false;
+            flow->deficit = 0;
+        }
+        else
+        {
+            flow->next = NULL;
+            *writer->active_tail = flow;
+            writer->active_tail = &flow->next;
+        }
+    }
+    return batch;
+}
+
+static void *log_writer_thread(void *param)
+{
+    struct log_writer *writer = (struct log_writer *) param;
+
+    lockprof_mutex_lock(&writer->lock);
+    while(1)
+    {
+        while(writer->active == NULL && !writer->stopping)
+        {
+            lockprof_cond_wait(&writer->pending_cond, &writer->lock);
+        }
+        if(writer->active == NULL)
+        {
+            break;
+        }
+
+        int count;
+        struct log_record *batch = log_writer_take(writer, &count);
+        lockprof_mutex_unlock(&writer->lock);
+
+        bool success = log_writer_commit(writer, batch, count);
+
+        lockprof_mutex_lock(&writer->lock);
+        while(batch != NULL)
+        {
+            // Waiters own their record, it must not be touched once done is set
+            struct log_record *next = batch->next;
+            if(batch->owned)
+            {
+                free(batch);
+            }
+            else
+            {
+                batch->success = success;
+                batch->done = true;
+            }
+            batch = next;
+        }
+        writer->batches++;
+        writer->records += count;
+        stats_add(STATS_PACKETS_COMMITTED, count);
+        stats_add(STATS_BATCHES_COMMITTED, 1);
+        pthread_cond_broadcast(&writer->done_cond);
+    }
+    lockprof_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+int log_writer_start(struct log_writer *writer, const char *path, struct log_segments *segments,
+            struct log_snapshot_cache *snapshots, struct replication *replication)
+{
+    memset(writer, 0, sizeof(struct log_writer));
+    writer->path = path;
+    writer->segments = segments;
+    writer->snapshots = snapshots;
+    writer->replication = replication;
+    writer->active_tail = &writer->active;
+    log_flow_init(&writer->local_flow);
+
+    int ret = pthread_mutex_init(&writer->lock, NULL);
+    if(ret != 0)
+    {
+        return ret;
+    }
+    pthread_cond_init(&writer->pending_cond, NULL);
+    pthread_cond_init(&writer->done_cond, NULL);
+    ret = pthread_create(&writer->thread, NULL, log_writer_thread, writer);
+    if(ret != 0)
+    {
+        pthread_cond_destroy(&writer->done_cond);
+        pthread_cond_destroy(&writer->pending_cond);
+        pthread_mutex_destroy(&writer->lock);
+    }
+    return ret;
+}
+
+void log_flow_init(struct log_flow *flow)
+{
+    memset(flow, 0, sizeof(struct log_flow));
+    flow->tail = &flow->head;
+}
+
+static void log_writer_enqueue(struct log_writer *writer, struct log_flow *flow, struct log_record *record)
+{
+    record->next = NULL;
+    *flow->tail = record;
+    flow->tail = &record->next;
+    if(!flow->active)
+    {
+        flow->active = true;
+        flow->next = NULL;
+        *writer->active_tail = flow;
+        writer->active_tail = &flow->next;
+    }
+    pthread_cond_signal(&writer->pending_cond);
+}
+
+bool log_writer_append(struct log_writer *writer, struct log_flow *flow, const char *data, size_t len)
+{
+    struct log_record record = { .data = data, .len = len };
+
+    uint64_t lock_start = stats_now_ns();
+    lockprof_mutex_lock(&writer->lock);
+    stats_lock_acquired(lock_start);
+    if(writer->stopping)
+    {
+        lockprof_mutex_unlock(&writer->lock);
+        return false;
+    }
+    log_writer_enqueue(writer, flow != NULL ? flow : &writer->local_flow, &record);
+    while(!record.done)
+    {
+        lockprof_cond_wait(&writer->done_cond, &writer->lock);
+    }
+    lockprof_mutex_unlock(&writer->lock);
+    return record.success;
+}
+
+bool log_writer_append_async(struct log_writer *writer, const char *data, size_t len)
+{
+    struct log_record *record = malloc(sizeof(struct log_record) + len);
+    if(record == NULL)
+    {
+        perror("malloc");
+        return false;
+    }
+    memcpy(record + 1, data, len);
+    record->data = (const char *)(record + 1);
+    record->len = len;
+    record->owned = true;
+
+    uint64_t lock_start = stats_now_ns();
+    lockprof_mutex_lock(&writer->lock);
+    stats_lock_acquired(lock_start);
+    if(writer->stopping)
+    {
+        lockprof_mutex_unlock(&writer->lock);
+        free(record);
+        return false;
+    }
+    log_writer_enqueue(writer, &writer->local_flow, record);
+    lockprof_mutex_unlock(&writer->lock);
+    return true;
+}
+
+void log_writer_stop(struct log_writer *writer)
+{
+    lockprof_mutex_lock(&writer->lock);
+    writer->stopping = true;
+    pthread_cond_signal(&writer->pending_cond);
+    lockprof_mutex_unlock(&writer->lock);
+
+    pthread_join(writer->thread, NULL);
+    syslog(LOG_DEBUG, "Log writer committed %llu records in %llu batches\n",
+            (unsigned long long)writer->records, (unsigned long long)writer->batches);
+
+    pthread_cond_destroy(&writer->done_cond);
+    pthread_cond_destroy(&writer->pending_cond);
+    pthread_mutex_destroy(&writer->lock);
+}
@@ -0,0 +1,131 @@
+#ifndef LOG_WRITER_H
+#define LOG_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "log_segments.h"
+#include "log_snapshot.h"
+#include "replication.h"
+
+/**
+ * Single writer thread appending records to the log in batches.
+ *
+ * Client threads and the timestamp tick queue complete records, the writer
+ * thread takes what is queued and appends it with one writev(), then
+ * publishes it (segment index, snapshot generation) once for the whole batch.
+ * Records are never split, so packets cannot interleave in the log.
+ *
+ * Records are queued per flow (one per client source address) and batches are
+ * filled by deficit round robin over the flows with queued records: each turn
+ * grants a flow LOG_WRITER_QUANTUM bytes, so a source with many connections or
+ * large packets cannot crowd the others out of a batch bounded by IOV_MAX
+ * records and LOG_WRITER_BATCH_BYTES.
+ */
+
+#define LOG_WRITER_QUANTUM (64 * 1024)
+#define LOG_WRITER_BATCH_BYTES (1024 * 1024)
+
+struct log_record
+{
+    const char *data;
+    size_t len;
+    /**
+     * Set for records queued with log_writer_append_async, data is then freed by the writer
+     */
+    bool owned;
+    bool done;
+    bool success;
+    struct log_record *next;
+};
+
+/**
+ * Queue of the records of one source, owned by the caller and protected by the writer lock
+ */
+struct log_flow
+{
+    struct log_record *head;
+    struct log_record **tail;
+    /**
+     * Bytes the flow may still add to batches in its current turn
+     */
+    size_t deficit;
+    bool active;
+    /**
+     * Next flow with queued records
+     */
+    struct log_flow *next;
+};
+
+struct log_writer
+{
+    pthread_mutex_t lock;
+    /**
+     * Signalled when records are queued or on stop
+     */
+    pthread_cond_t pending_cond;
+    /**
+     * Broadcast after each batch is committed
+     */
+    pthread_cond_t done_cond;
+    /**
+     * Flows with queued records, in round robin order
+     */
+    struct log_flow *active;
+    struct log_flow **active_tail;
+    /**
+     * Flow of the records appended without one, e.g. timestamps
+     */
+    struct log_flow local_flow;
+    bool stopping;
+    pthread_t thread;
+
+    const char *path;
+    struct log_segments *segments;
+    struct log_snapshot_cache *snapshots;
+    struct replication *replication;
+    /**
+     * Logical end of the log, from the segment index when there is one
+     */
+    uint64_t offset;
+
+    uint64_t batches;
+    uint64_t records;
+};
+
+/**
+ * Starts the writer thread appending to @param path.  @param segments may be NULL
+ * (char device), @param snapshots is invalidated after every batch, which is then
+ * published to @param replication unless it is NULL.
+ * @return 0 on success, an errno value otherwise
+ */
+int log_writer_start(struct log_writer *writer, const char *path, struct log_segments *segments,
+            struct log_snapshot_cache *snapshots, struct replication *replication);
+
+/**
+ * Initializes the empty @param flow
+ */
+void log_flow_init(struct log_flow *flow);
+
+/**
+ * Appends the @param len bytes at @param data and waits until they are written and
+ * visible to snapshots.  @param data must stay valid until this returns.
+ * @param flow is the queue of the source of the data, NULL for the local flow.
+ * @return true on success
+ */
+bool log_writer_append(struct log_writer *writer, struct log_flow *flow, const char *data, size_t len);
+
+/**
+ * Queues a copy of the @param len bytes at @param data without waiting
+ * @return true if the record was queued
+ */
+bool log_writer_append_async(struct log_writer *writer, const char *data, size_t len);
+
+/**
+ * Writes everything still queued, then stops and joins the writer thread
+ */
+void log_writer_stop(struct log_writer *writer);
+
+#endif /* LOG_WRITER_H */
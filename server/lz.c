@@ -0,0 +1,298 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+#include "protocol.h"
+
+#define LZ_MIN_MATCH 4
+/**
+ * The last 5 bytes are always literals and the last match starts 12 bytes before the end
+ */
+#define LZ_LAST_LITERALS 5
+#define LZ_MFLIMIT 12
+#define LZ_MAX_DISTANCE 65535
+#define LZ_HASH_BITS 12
+/**
+ * Probe every byte for the first 64 misses, then skip further and further ahead
+ * through incompressible data
+ */
+#define LZ_SKIP_TRIGGER 6
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32_t lz_hash(uint32_t value)
+{
+    return (value * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Writes the 255 continued extension of a 4 bit length field
+ */
+static uint8_t *write_length(uint8_t *op, size_t len)
+{
+    while(len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+/**
+ * Emits one sequence: @param literals bytes from @param anchor, then a match of
+ * @param match_len bytes at @param distance unless match_len is 0 (last sequence)
+ * @return the new output position, NULL if it does not fit before @param oend
+ */
+static uint8_t *emit_sequence(uint8_t *op, uint8_t *oend, const uint8_t *anchor, size_t literals,
+            size_t distance, size_t match_len)
+{
+    size_t needed = 1 + literals / 255 + 1 + literals + 2 + match_len / 255 + 1;
+    if(needed > (size_t)(oend - op))
+    {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    if(literals >= 15)
+    {
+        *token = 15 << 4;
+        op = write_length(op, literals - 15);
+    }
+    else
+    {
+        *token = (uint8_t)(literals << 4);
+    }
+    memcpy(op, anchor, literals);
+    op += literals;
+    if(match_len == 0)
+    {
+        return op;
+    }
+
+    *op++ = (uint8_t)(distance & 0xff);
+    *op++ = (uint8_t)(distance >> 8);
+    size_t extra = match_len - LZ_MIN_MATCH;
+    if(extra >= 15)
+    {
+        *token |= 15;
+        op = write_length(op, extra - 15);
+    }
+    else
+    {
+        *token |= (uint8_t)extra;
+    }
+    return op;
+}
+
+size_t lz_compress(const char *src, size_t len, char *dst, size_t capacity)
+{
+    const uint8_t *base = (const uint8_t *)src;
+    const uint8_t *ip = base;
+    const uint8_t *anchor = base;
+    const uint8_t *end = base + len;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + capacity;
+    uint32_t table[1 << LZ_HASH_BITS];
+
+    if(len >= LZ_MFLIMIT + 1)
+    {
+        const uint8_t *mflimit = end - LZ_MFLIMIT;
+        const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+        unsigned misses = 0;
+        memset(table, 0, sizeof(table));
+
+        ip++;
+        while(ip <= mflimit)
+        {
+            uint32_t sequence = read32(ip);
+            uint32_t hash = lz_hash(sequence);
+            const uint8_t *ref = base + table[hash];
+            table[hash] = (uint32_t)(ip - base);
+
+            if(ref >= ip || ip - ref > LZ_MAX_DISTANCE || read32(ref) != sequence)
+            {
+                ip += 1 + (misses++ >> LZ_SKIP_TRIGGER);
+                continue;
+            }
+            misses = 0;
+
+            // extend backwards into the pending literals, then forwards
+            while(ip > anchor && ref > base && ip[-1] == ref[-1])
+            {
+                ip--;
+                ref--;
+            }
+            const uint8_t *match_end = ip + LZ_MIN_MATCH;
+            const uint8_t *ref_end = ref + LZ_MIN_MATCH;
+            while(match_end < matchlimit && *match_end == *ref_end)
+            {
+                match_end++;
+                ref_end++;
+            }
+
+            op = emit_sequence(op, oend, anchor, ip - anchor, ip - ref, match_end - ip);
+            if(op == NULL)
+            {
+                return 0;
+            }
+            ip = match_end;
+            anchor = ip;
+            if(ip - 2 > base)
+            {
+                // remember a position inside the match, repeated runs then chain cheaply
+                table[lz_hash(read32(ip - 2))] = (uint32_t)(ip - 2 - base);
+            }
+        }
+    }
+
+    op = emit_sequence(op, oend, anchor, end - anchor, 0, 0);
+    if(op == NULL)
+    {
+        return 0;
+    }
+    return op - (uint8_t *)dst;
+}
+
+/**
+ * Reads the 255 continued extension of a 4 bit length field
+ * @return false if the input ends first
+ */
+static int read_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+    uint8_t byte;
+    do
+    {
+        if(*ip >= iend)
+        {
+            return 0;
+        }
+        byte = *(*ip)++;
+        *len += byte;
+    } while(byte == 255);
+    return 1;
+}
+
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t capacity)
+{
+    const uint8_t *ip = (const uint8_t *)src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = (uint8_t *)dst;
+    uint8_t *oend = op + capacity;
+
+    while(ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if(literals == 15 && !read_length(&ip, iend, &literals))
+        {
+            return -1;
+        }
+        if(literals > (size_t)(iend - ip) || literals > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        memcpy(op, ip, literals);
+        op += literals;
+        ip += literals;
+        if(ip == iend)
+        {
+            // the last sequence has no match
+            break;
+        }
+
+        if(iend - ip < 2)
+        {
+            return -1;
+        }
+        size_t distance = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(distance == 0 || distance > (size_t)(op - (uint8_t *)dst))
+        {
+            return -1;
+        }
+        size_t match_len = token & 15;
+        if(match_len == 15 && !read_length(&ip, iend, &match_len))
+        {
+            return -1;
+        }
+        match_len += LZ_MIN_MATCH;
+        if(match_len > (size_t)(oend - op))
+        {
+            return -1;
+        }
+        const uint8_t *ref = op - distance;
+        if(distance >= match_len)
+        {
+            memcpy(op, ref, match_len);
+            op += match_len;
+        }
+        else
+        {
+            // overlapping match, repeats the last distance bytes
+            while(match_len-- > 0)
+            {
+                *op++ = *ref++;
+            }
+        }
+    }
+    return op - (uint8_t *)dst;
+}
+
+static void write_be32(char *out, uint32_t value)
+{
+    out[0] = (char)(value >> 24);
+    out[1] = (char)(value >> 16);
+    out[2] = (char)(value >> 8);
+    out[3] = (char)value;
+}
+
+static uint32_t read_be32(const char *in)
+{
+    const uint8_t *p = (const uint8_t *)in;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+size_t lz_block_bound(size_t len)
+{
+    return AESD_BLOCK_HEADER_SIZE + lz_compress_bound(len);
+}
+
+size_t lz_block_encode(const char *src, size_t len, char *out)
+{
+    char *payload = out + AESD_BLOCK_HEADER_SIZE;
+    size_t stored = lz_compress(src, len, payload, len > 0 ? len - 1 : 0);
+    if(stored == 0)
+    {
+        memcpy(payload, src, len);
+        stored = len;
+    }
+    write_be32(out, (uint32_t)len);
+    write_be32(out + 4, (uint32_t)stored);
+    return AESD_BLOCK_HEADER_SIZE + stored;
+}
+
+int lz_block_header(const char *in, size_t *raw_len, size_t *stored_len)
+{
+    *raw_len = read_be32(in);
+    *stored_len = read_be32(in + 4);
+    if(*raw_len > AESD_BLOCK_MAX_SIZE || *stored_len > *raw_len)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+int lz_block_decode(const char *payload, size_t stored_len, char *dst, size_t raw_len)
+{
+    if(stored_len == raw_len)
+    {
+        memcpy(dst, payload, raw_len);
+        return 0;
+    }
+    return lz_decompress(payload, stored_len, dst, raw_len) == (ssize_t)raw_len ? 0 : -1;
+}
@@ -0,0 +1,64 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * LZ77 block codec producing the LZ4 block format: a sequence of tokens, each
+ * made of a literal run and a match of at least 4 bytes within the last 64 KiB,
+ * so blocks can be decoded by any LZ4 implementation.  Greedy single hash probe
+ * compressor, bounds checked decompressor.
+ *
+ * lz_block_encode/lz_block_decode wrap a buffer in the block header described
+ * in protocol.h, used both for stored log segments and compressed replies.
+ */
+
+/**
+ * @return the largest compressed size of @param len input bytes
+ */
+static inline size_t lz_compress_bound(size_t len)
+{
+    return len + len / 255 + 16;
+}
+
+/**
+ * Compresses the @param len bytes of @param src into @param dst
+ * @return the compressed size, 0 if it does not fit in @param capacity bytes
+ */
+size_t lz_compress(const char *src, size_t len, char *dst, size_t capacity);
+
+/**
+ * Decompresses the @param len bytes of @param src into @param dst
+ * @return the decompressed size, -1 if the input is malformed or does not fit in
+ *  @param capacity bytes
+ */
+ssize_t lz_decompress(const char *src, size_t len, char *dst, size_t capacity);
+
+/**
+ * @return the largest encoded size of a block of @param len bytes
+ */
+size_t lz_block_bound(size_t len);
+
+/**
+ * Encodes @param len bytes (at most AESD_BLOCK_MAX_SIZE) as one block in @param out,
+ * which must hold lz_block_bound(len) bytes.  The block is stored uncompressed when
+ * compression does not make it smaller.
+ * @return the encoded size, header included
+ */
+size_t lz_block_encode(const char *src, size_t len, char *out);
+
+/**
+ * Reads the block header at @param in
+ * @return 0 on success, -1 if it is malformed
+ */
+int lz_block_header(const char *in, size_t *raw_len, size_t *stored_len);
+
+/**
+ * Decodes the payload of a block with the given header into @param dst, which must
+ * hold @param raw_len bytes
+ * @return 0 on success, -1 if the payload is malformed
+ */
+int lz_block_decode(const char *payload, size_t stored_len, char *dst, size_t raw_len);
+
+#endif /* LZ_H */
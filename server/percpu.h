@@ -0,0 +1,40 @@
+#ifndef PERCPU_H
+#define PERCPU_H
+
+#include <sched.h>
+#include <unistd.h>
+
+/**
+ * Per CPU slots for data every thread updates.
+ *
+ * A thread picks the slot of the CPU it runs on, so threads running at the same time
+ * mostly touch different slots and no per thread state has to be set up or torn down.
+ * A thread may migrate between picking a slot and using it, so slots are still shared:
+ * updates must be atomic or take the slot's lock, they are just rarely contended.
+ * Users of this header must define _GNU_SOURCE for sched_getcpu().
+ */
+
+/**
+ * Cache line size slots are aligned to, so neighbouring slots do not false share
+ */
+#define PERCPU_CACHE_LINE 64
+
+/**
+ * @return the number of slots to allocate, one per configured CPU
+ */
+static inline int percpu_count(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    return count > 0 ? (int)count : 1;
+}
+
+/**
+ * @return the slot of the calling thread's current CPU among @param count slots
+ */
+static inline int percpu_current(int count)
+{
+    int cpu = sched_getcpu();
+    return cpu > 0 ? cpu % count : 0;
+}
+
+#endif /* PERCPU_H */
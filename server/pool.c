@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <sys/mman.h>
+
+#include "pool.h"
+#include "percpu.h"
+
+#define POOL_ALIGN 64
+#define POOL_HUGEPAGE_SIZE (2UL * 1024 * 1024)
+
+/**
+ * Free objects of one pool cached for one CPU, linked through their first word
+ */
+struct pool_cache
+{
+    /**
+     * Protects everything below, taken before pool->lock
+     */
+    pthread_mutex_t lock;
+    void *head;
+    size_t count;
+    uint64_t allocs;
+    uint64_t frees;
+} __attribute__((aligned(PERCPU_CACHE_LINE)));
+
+/**
+ * Protects the pool registry, taken before any pool lock
+ */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct pool *pools[POOL_MAX];
+
+static uint64_t load(const uint64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/* Written under the cache lock, read without it by pool_report, which just needs untorn values */
+static void bump(uint64_t *value)
+{
+    __atomic_store_n(value, load(value) + 1, __ATOMIC_RELAXED);
+}
+
+static void *next_free(void *object)
+{
+    return *(void **)object;
+}
+
+static void set_next_free(void *object, void *next)
+{
+    *(void **)object = next;
+}
+
+/**
+ * @return the locked cache of @param pool for the current CPU
+ */
+static struct pool_cache *pool_cache_lock(struct pool *pool)
+{
+    struct pool_cache *cache = &pool->caches[percpu_current(pool->cache_count)];
+    pthread_mutex_lock(&cache->lock);
+    return cache;
+}
+
+/**
+ * Maps a new slab and pushes all its objects to the depot, called with pool->lock held
+ * @return true on success
+ */
+static bool pool_grow(struct pool *pool)
+{
+    if(pool->slab_count == pool->slab_capacity)
+    {
+        size_t capacity = pool->slab_capacity == 0 ? 16 : pool->slab_capacity * 2;
+        void **slabs = realloc(pool->slabs, capacity * sizeof(void *));
+        if(slabs == NULL)
+        {
+            return false;
+        }
+        pool->slabs = slabs;
+        pool->slab_capacity = capacity;
+    }
+
+    void *slab = MAP_FAILED;
+    if(pool->hugepages)
+    {
+        slab = mmap(NULL, pool->slab_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if(slab != MAP_FAILED)
+        {
+            pool->hugepage_slabs++;
+        }
+    }
+    if(slab == MAP_FAILED)
+    {
+        slab = mmap(NULL, pool->slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(slab == MAP_FAILED)
+        {
+            return false;
+        }
+        if(pool->hugepages)
+        {
+            // no reserved huge pages, transparent ones may still back the slab
+            madvise(slab, pool->slab_size, MADV_HUGEPAGE);
+        }
+    }
+    pool->slabs[pool->slab_count++] = slab;
+
+    size_t count = pool->slab_size / pool->object_size;
+    size_t i;
+    for(i = count; i > 0; i--)
+    {
+        void *object = (char *)slab + (i - 1) * pool->object_size;
+        set_next_free(object, pool->depot);
+        pool->depot = object;
+    }
+    pool->depot_count += count;
+    pool->objects += count;
+    return true;
+}
+
+static void pool_caches_free(struct pool *pool)
+{
+    int i;
+    for(i = 0; i < pool->cache_count; i++)
+    {
+        pthread_mutex_destroy(&pool->caches[i].lock);
+    }
+    free(pool->caches);
+    pool->caches = NULL;
+    pool->cache_count = 0;
+}
+
+int pool_init(struct pool *pool, const char *name, size_t object_size, size_t slab_size, bool hugepages)
+{
+    memset(pool, 0, sizeof(struct pool));
+    pool->name = name;
+    pool->object_size = (object_size + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+    pool->hugepages = hugepages;
+    if(hugepages)
+    {
+        slab_size = (slab_size + POOL_HUGEPAGE_SIZE - 1) & ~(POOL_HUGEPAGE_SIZE - 1);
+    }
+    pool->slab_size = slab_size;
+    if(pool->object_size > slab_size)
+    {
+        return EINVAL;
+    }
+
+    int count = percpu_count();
+    void *caches;
+    int ret = posix_memalign(&caches, PERCPU_CACHE_LINE, count * sizeof(struct pool_cache));
+    if(ret != 0)
+    {
+        return ret;
+    }
+    memset(caches, 0, count * sizeof(struct pool_cache));
+    pool->caches = caches;
+    for(pool->cache_count = 0; pool->cache_count < count; pool->cache_count++)
+    {
+        pthread_mutex_init(&pool->caches[pool->cache_count].lock, NULL);
+    }
+
+    ret = pthread_mutex_init(&pool->lock, NULL);
+    if(ret != 0)
+    {
+        pool_caches_free(pool);
+        return ret;
+    }
+    pthread_mutex_lock(&registry_lock);
+    for(pool->index = 0; pool->index < POOL_MAX; pool->index++)
+    {
+        if(pools[pool->index] == NULL)
+        {
+            pools[pool->index] = pool;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    if(pool->index == POOL_MAX)
+    {
+        pthread_mutex_destroy(&pool->lock);
+        pool_caches_free(pool);
+        return ENOSPC;
+    }
+    return 0;
+}
+
+void *pool_alloc(struct pool *pool)
+{
+    struct pool_cache *cache = pool_cache_lock(pool);
+    if(cache->head == NULL)
+    {
+        // refill half of the cache from the depot
+        pthread_mutex_lock(&pool->lock);
+        if(pool->depot == NULL && !pool_grow(pool))
+        {
+            pthread_mutex_unlock(&pool->lock);
+            pthread_mutex_unlock(&cache->lock);
+            return NULL;
+        }
+        while(pool->depot != NULL && cache->count < POOL_BATCH)
+        {
+            void *object = pool->depot;
+            pool->depot = next_free(object);
+            pool->depot_count--;
+            set_next_free(object, cache->head);
+            cache->head = object;
+            cache->count++;
+        }
+        pool->refills++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    void *object = cache->head;
+    cache->head = next_free(object);
+    cache->count--;
+    bump(&cache->allocs);
+    pthread_mutex_unlock(&cache->lock);
+    return object;
+}
+
+void pool_free(struct pool *pool, void *object)
+{
+    struct pool_cache *cache = pool_cache_lock(pool);
+    if(cache->count == POOL_CACHE_SIZE)
+    {
+        // flush half of the cache to the depot
+        pthread_mutex_lock(&pool->lock);
+        while(cache->count > POOL_CACHE_SIZE - POOL_BATCH)
+        {
+            void *flushed = cache->head;
+            cache->head = next_free(flushed);
+            cache->count--;
+            set_next_free(flushed, pool->depot);
+            pool->depot = flushed;
+            pool->depot_count++;
+        }
+        pool->flushes++;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    set_next_free(object, cache->head);
+    cache->head = object;
+    cache->count++;
+    bump(&cache->frees);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void pool_destroy(struct pool *pool)
+{
+    pthread_mutex_lock(&registry_lock);
+    pools[pool->index] = NULL;
+    pthread_mutex_unlock(&registry_lock);
+
+    size_t i;
+    for(i = 0; i < pool->slab_count; i++)
+    {
+        munmap(pool->slabs[i], pool->slab_size);
+    }
+    free(pool->slabs);
+    pool_caches_free(pool);
+    pthread_mutex_destroy(&pool->lock);
+}
+
+void pool_report(FILE *out)
+{
+    int i, j;
+
+    pthread_mutex_lock(&registry_lock);
+    for(i = 0; i < POOL_MAX; i++)
+    {
+        struct pool *pool = pools[i];
+        if(pool == NULL)
+        {
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        uint64_t allocs = 0;
+        uint64_t frees = 0;
+        for(j = 0; j < pool->cache_count; j++)
+        {
+            allocs += load(&pool->caches[j].allocs);
+            frees += load(&pool->caches[j].frees);
+        }
+        fprintf(out, "pool_object_bytes{pool=\"%s\"} %zu\n", pool->name, pool->object_size);
+        fprintf(out, "pool_slabs{pool=\"%s\"} %zu\n", pool->name, pool->slab_count);
+        fprintf(out, "pool_hugepage_slabs{pool=\"%s\"} %llu\n", pool->name,
+                (unsigned long long)pool->hugepage_slabs);
+        fprintf(out, "pool_objects{pool=\"%s\"} %llu\n", pool->name, (unsigned long long)pool->objects);
+        fprintf(out, "pool_objects_in_use{pool=\"%s\"} %llu\n", pool->name,
+                (unsigned long long)(allocs - frees));
+        fprintf(out, "pool_depot_objects{pool=\"%s\"} %zu\n", pool->name, pool->depot_count);
+        fprintf(out, "pool_allocations{pool=\"%s\"} %llu\n", pool->name, (unsigned long long)allocs);
+        fprintf(out, "pool_depot_refills{pool=\"%s\"} %llu\n", pool->name, (unsigned long long)pool->refills);
+        fprintf(out, "pool_depot_flushes{pool=\"%s\"} %llu\n", pool->name, (unsigned long long)pool->flushes);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,82 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+/**
+ * Fixed size object pools.
+ *
+ * Objects are carved from large mmap slabs, optionally backed by huge pages, and
+ * never returned to the system before pool_destroy.  Each pool keeps a small cache
+ * of free objects per CPU (percpu.h), refilled from and flushed to a locked depot
+ * in batches, so the depot lock is only taken once every POOL_BATCH operations.
+ * Threads take the cache of the CPU they run on under its own lock, which is only
+ * contended when a thread migrates mid operation, so short lived connection threads
+ * allocate without any per thread setup or teardown.
+ */
+
+#define POOL_MAX 8
+#define POOL_CACHE_SIZE 32
+#define POOL_BATCH (POOL_CACHE_SIZE / 2)
+
+struct pool_cache;
+
+struct pool
+{
+    const char *name;
+    size_t object_size;
+    size_t slab_size;
+    bool hugepages;
+    int index;
+    struct pool_cache *caches;
+    int cache_count;
+
+    /**
+     * Protects everything below
+     */
+    pthread_mutex_t lock;
+    void *depot;
+    size_t depot_count;
+    void **slabs;
+    size_t slab_count;
+    size_t slab_capacity;
+    uint64_t hugepage_slabs;
+    uint64_t objects;
+    uint64_t refills;
+    uint64_t flushes;
+};
+
+/**
+ * Sets up @param pool of objects of @param object_size bytes, rounded up to a cache line,
+ * carved from slabs of @param slab_size bytes.  With @param hugepages slabs are first
+ * requested from the huge page pool, falling back to normal pages.
+ * @return 0 on success, an errno value otherwise
+ */
+int pool_init(struct pool *pool, const char *name, size_t object_size, size_t slab_size, bool hugepages);
+
+/**
+ * @return an object of @param pool, NULL if no memory is left
+ */
+void *pool_alloc(struct pool *pool);
+
+/**
+ * Returns @param object to @param pool, any thread may free any object
+ */
+void pool_free(struct pool *pool, void *object);
+
+/**
+ * Releases all slabs of @param pool, every object must have been freed and no other
+ * thread may use it anymore
+ */
+void pool_destroy(struct pool *pool);
+
+/**
+ * Writes the allocation statistics of every pool to @param out
+ */
+void pool_report(FILE *out);
+
+#endif /* POOL_H */
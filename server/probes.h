@@ -0,0 +1,61 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/**
+ * Static USDT probes of aesdsocket, provider "aesdsocket".
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) available at build time each probe is a
+ * nop plus an ELF note, behind a test of the probe's semaphore: a counter in the
+ * .probes section that tracers increment while they are attached.  Until then the
+ * probe costs a load and a not taken branch and its arguments are not computed.
+ * AESD_PROBE_ENABLED guards work done only to feed a probe.  Without <sys/sdt.h>,
+ * or with -DAESD_NO_PROBES, the probes compile to nothing.
+ *
+ *   accept        (fd, client address in network order)
+ *   recv          (fd, bytes)
+ *   commit_start  (fd, bytes)
+ *   commit_done   (fd, bytes, success, latency ns)
+ *   reply_start   (fd, bytes, compressed)
+ *   reply_done    (fd, bytes, success, latency ns)
+ *   close         (fd, session ns)
+ *
+ * List them with `perf list sdt_aesdsocket:*` after `perf buildid-cache --add aesdsocket`,
+ * or trace them directly, e.g.
+ *   bpftrace -e 'usdt:./aesdsocket:commit_done { @commit_us = hist(arg3 / 1000); }'
+ */
+
+#if !defined(AESD_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define AESD_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef AESD_HAVE_PROBES
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+/*
+ * Semaphores named as <sys/sdt.h> expects, provider_name_semaphore, weak so that
+ * every file including this header shares one per probe
+ */
+#define AESD_PROBE_SEMAPHORE(name) \
+    __extension__ unsigned short aesdsocket_##name##_semaphore \
+    __attribute__((weak, used, section(".probes"), visibility("hidden")))
+AESD_PROBE_SEMAPHORE(accept);
+AESD_PROBE_SEMAPHORE(recv);
+AESD_PROBE_SEMAPHORE(commit_start);
+AESD_PROBE_SEMAPHORE(commit_done);
+AESD_PROBE_SEMAPHORE(reply_start);
+AESD_PROBE_SEMAPHORE(reply_done);
+AESD_PROBE_SEMAPHORE(close);
+
+#define AESD_PROBE_ENABLED(name) \
+    __builtin_expect(__atomic_load_n(&aesdsocket_##name##_semaphore, __ATOMIC_RELAXED) != 0, 0)
+#define AESD_PROBE(name, ...) \
+    do { if (AESD_PROBE_ENABLED(name)) { STAP_PROBEV(aesdsocket, name, __VA_ARGS__); } } while (0)
+#else
+#define AESD_PROBE_ENABLED(name) 0
+#define AESD_PROBE(name, ...) do { } while (0)
+#endif
+
+#endif /* PROBES_H */
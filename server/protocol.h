@@ -0,0 +1,70 @@
+#ifndef AESD_PROTOCOL_H
+#define AESD_PROTOCOL_H
+
+/**
+ * Wire protocols accepted by aesdsocket on port 9000.
+ *
+ * Text mode (default): the client sends newline terminated packets.  Each
+ * complete packet is appended to the log and the full log is sent back as soon
+ * as it is, packets completed by the same receive get a single reply.  Once
+ * everything received ends on a packet boundary the connection is closed,
+ * otherwise the server keeps reading the next packet and replies again.  A
+ * packet is at most AESD_FRAME_MAX_SIZE bytes long, a longer one is dropped and
+ * the connection closed.
+ *
+ * Binary mode: selected when the first byte of the connection is
+ * AESD_BINARY_MAGIC.  After the magic byte the client sends frames made of a
+ * 4 byte big endian payload length followed by that many bytes of arbitrary
+ * data.  Each frame is appended to the log as is and answered with a frame
+ * carrying the full log.  A zero length frame or closing the connection ends
+ * the session.  The text mode can never start with this byte since it is not
+ * valid ASCII.
+ *
+ * Compressed binary mode: selected by AESD_COMPRESSED_MAGIC, the same as the
+ * binary mode except that the payload of every reply frame is the log as a
+ * sequence of blocks.  Each block is an AESD_BLOCK_HEADER_SIZE header holding
+ * the big endian decoded size (at most AESD_BLOCK_MAX_SIZE) and the big endian
+ * stored size, followed by the stored bytes: an LZ4 block when the stored size
+ * is smaller than the decoded size, the data itself when they are equal.
+ * Compressed log segments are stored in the same format and sent as they are.
+ */
+
+#define AESD_BINARY_MAGIC 0xA5
+#define AESD_COMPRESSED_MAGIC 0xA6
+#define AESD_FRAME_HEADER_SIZE 4
+/**
+ * Frames, and text packets, larger than this are rejected and the connection closed
+ */
+#define AESD_FRAME_MAX_SIZE (16 * 1024 * 1024)
+
+#define AESD_BLOCK_HEADER_SIZE 8
+#define AESD_BLOCK_MAX_SIZE (64 * 1024)
+
+/**
+ * Replication feed served on the Unix socket given with -R.
+ *
+ * The leader sends messages made of an AESD_REPL_HEADER_SIZE header followed by
+ * length bytes of payload.  All header fields are big endian:
+ *   0  uint32 type         AESD_REPL_SNAPSHOT or AESD_REPL_BATCH
+ *   4  uint32 count        number of records in a batch, 0 for a snapshot
+ *   8  uint32 length       payload bytes following the header
+ *  12  uint32 reserved
+ *  16  uint64 seq          first record of a batch, last record included in a snapshot
+ *  24  uint64 offset       log offset of the first payload byte
+ *  32  uint64 commit_ns    CLOCK_MONOTONIC time the batch was committed
+ *
+ * Records are numbered from 1 in commit order.  On the file backend a follower
+ * first gets a snapshot of the retained log, then every batch committed after
+ * it, each record as a 4 byte big endian length followed by its bytes.  The
+ * char device keeps no addressable history, followers of it only get batches
+ * committed after they connect.
+ *
+ * The follower acknowledges with the 8 byte big endian seq of the last record
+ * it has written, the leader measures its lag from these.
+ */
+#define AESD_REPL_HEADER_SIZE 40
+#define AESD_REPL_ACK_SIZE 8
+#define AESD_REPL_SNAPSHOT 1
+#define AESD_REPL_BATCH 2
+
+#endif /* AESD_PROTOCOL_H */
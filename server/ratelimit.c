@@ -0,0 +1,266 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "ratelimit.h"
+#include "stats.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ratelimit *active;
+
+static uint64_t load(const uint64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static void bump(uint64_t *value, uint64_t amount)
+{
+    __atomic_add_fetch(value, amount, __ATOMIC_RELAXED);
+}
+
+static unsigned source_hash(struct in_addr addr)
+{
+    return (addr.s_addr * 2654435761U) >> (32 - RATELIMIT_TABLE_BITS);
+}
+
+/**
+ * Adds the tokens accumulated since the last refill of @param bucket, up to the burst
+ */
+static void bucket_refill(struct ratelimit *ratelimit, struct token_bucket *bucket,
+            enum ratelimit_direction direction, uint64_t now)
+{
+    double tokens = bucket->tokens + (double)(now - bucket->refill_ns) * ratelimit->rate[direction] / NS_PER_SEC;
+    bucket->tokens = tokens < ratelimit->burst[direction] ? tokens : ratelimit->burst[direction];
+    bucket->refill_ns = now;
+}
+
+int ratelimit_init(struct ratelimit *ratelimit, uint64_t ingest_rate, uint64_t reply_rate)
+{
+    memset(ratelimit, 0, sizeof(struct ratelimit));
+    ratelimit->rate[RATELIMIT_INGEST] = ingest_rate;
+    ratelimit->rate[RATELIMIT_REPLY] = reply_rate;
+    int i;
+    for(i = 0; i < RATELIMIT_DIRECTIONS; i++)
+    {
+        ratelimit->burst[i] = ratelimit->rate[i] > RATELIMIT_MIN_BURST ? ratelimit->rate[i] : RATELIMIT_MIN_BURST;
+    }
+    ratelimit->sweep_at = RATELIMIT_SWEEP_THRESHOLD;
+    int ret = pthread_mutex_init(&ratelimit->lock, NULL);
+    if(ret != 0)
+    {
+        return ret;
+    }
+    pthread_mutex_lock(&registry_lock);
+    active = ratelimit;
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+
+/**
+ * Frees the idle sources whose buckets have refilled, a new source would start
+ * out the same.  Called with the table lock held.
+ */
+static void ratelimit_sweep(struct ratelimit *ratelimit)
+{
+    uint64_t now = stats_now_ns();
+    int i, j;
+    for(i = 0; i < RATELIMIT_TABLE_SIZE; i++)
+    {
+        struct client_source **link = &ratelimit->table[i];
+        while(*link != NULL)
+        {
+            struct client_source *source = *link;
+            bool full = source->refcount == 0;
+            for(j = 0; j < RATELIMIT_DIRECTIONS && full; j++)
+            {
+                if(ratelimit->rate[j] != 0)
+                {
+                    bucket_refill(ratelimit, &source->buckets[j], j, now);
+                    full = source->buckets[j].tokens >= ratelimit->burst[j];
+                }
+            }
+            if(!full)
+            {
+                link = &source->next;
+                continue;
+            }
+            for(j = 0; j < RATELIMIT_DIRECTIONS; j++)
+            {
+                ratelimit->retired_bytes[j] += load(&source->bytes[j]);
+                ratelimit->retired_throttled[j] += load(&source->throttled[j]);
+                ratelimit->retired_throttled_ns[j] += load(&source->throttled_ns[j]);
+            }
+            *link = source->next;
+            pthread_mutex_destroy(&source->lock);
+            free(source);
+            ratelimit->count--;
+        }
+    }
+    // sweep again once the table doubled, so a table of busy sources is not rescanned on every connection
+    ratelimit->sweep_at = ratelimit->count * 2 > RATELIMIT_SWEEP_THRESHOLD ?
+            ratelimit->count * 2 : RATELIMIT_SWEEP_THRESHOLD;
+}
+
+struct client_source *ratelimit_acquire(struct ratelimit *ratelimit, struct in_addr addr)
+{
+    unsigned hash = source_hash(addr);
+    struct client_source *source;
+
+    pthread_mutex_lock(&ratelimit->lock);
+    for(source = ratelimit->table[hash]; source != NULL; source = source->next)
+    {
+        if(source->addr.s_addr == addr.s_addr)
+        {
+            break;
+        }
+    }
+    if(source == NULL)
+    {
+        if(ratelimit->count >= ratelimit->sweep_at)
+        {
+            ratelimit_sweep(ratelimit);
+        }
+        source = calloc(1, sizeof(struct client_source));
+        if(source == NULL)
+        {
+            pthread_mutex_unlock(&ratelimit->lock);
+            perror("calloc");
+            return NULL;
+        }
+        source->addr = addr;
+        pthread_mutex_init(&source->lock, NULL);
+        log_flow_init(&source->flow);
+        int i;
+        for(i = 0; i < RATELIMIT_DIRECTIONS; i++)
+        {
+            source->buckets[i].tokens = ratelimit->burst[i];
+            source->buckets[i].refill_ns = stats_now_ns();
+        }
+        source->next = ratelimit->table[hash];
+        ratelimit->table[hash] = source;
+        ratelimit->count++;
+    }
+    source->refcount++;
+    pthread_mutex_unlock(&ratelimit->lock);
+    bump(&source->connections, 1);
+    return source;
+}
+
+void ratelimit_release(struct ratelimit *ratelimit, struct client_source *source)
+{
+    pthread_mutex_lock(&ratelimit->lock);
+    source->refcount--;
+    pthread_mutex_unlock(&ratelimit->lock);
+}
+
+uint64_t ratelimit_charge(struct ratelimit *ratelimit, struct client_source *source,
+            enum ratelimit_direction direction, size_t bytes)
+{
+    bump(&source->bytes[direction], bytes);
+    if(ratelimit->rate[direction] == 0)
+    {
+        return 0;
+    }
+
+    struct token_bucket *bucket = &source->buckets[direction];
+    pthread_mutex_lock(&source->lock);
+    bucket_refill(ratelimit, bucket, direction, stats_now_ns());
+    bucket->tokens -= bytes;
+    double debt = -bucket->tokens;
+    pthread_mutex_unlock(&source->lock);
+    if(debt <= 0)
+    {
+        return 0;
+    }
+
+    // Every connection of the source waits out the debt it sees, so they share the rate
+    uint64_t wait_ns = (uint64_t)(debt * NS_PER_SEC / ratelimit->rate[direction]);
+    bump(&source->throttled[direction], 1);
+    bump(&source->throttled_ns[direction], wait_ns);
+    return wait_ns;
+}
+
+void ratelimit_destroy(struct ratelimit *ratelimit)
+{
+    pthread_mutex_lock(&registry_lock);
+    active = NULL;
+    pthread_mutex_unlock(&registry_lock);
+
+    int i;
+    for(i = 0; i < RATELIMIT_TABLE_SIZE; i++)
+    {
+        while(ratelimit->table[i] != NULL)
+        {
+            struct client_source *source = ratelimit->table[i];
+            ratelimit->table[i] = source->next;
+            pthread_mutex_destroy(&source->lock);
+            free(source);
+        }
+    }
+    pthread_mutex_destroy(&ratelimit->lock);
+}
+
+void ratelimit_report(FILE *out)
+{
+    static const char *names[RATELIMIT_DIRECTIONS] = {
+        [RATELIMIT_INGEST] = "ingest",
+        [RATELIMIT_REPLY] = "reply",
+    };
+    uint64_t bytes[RATELIMIT_DIRECTIONS];
+    uint64_t throttled[RATELIMIT_DIRECTIONS];
+    uint64_t throttled_ns[RATELIMIT_DIRECTIONS];
+    int i, j;
+
+    pthread_mutex_lock(&registry_lock);
+    struct ratelimit *ratelimit = active;
+    if(ratelimit == NULL)
+    {
+        pthread_mutex_unlock(&registry_lock);
+        return;
+    }
+    pthread_mutex_lock(&ratelimit->lock);
+    for(j = 0; j < RATELIMIT_DIRECTIONS; j++)
+    {
+        bytes[j] = ratelimit->retired_bytes[j];
+        throttled[j] = ratelimit->retired_throttled[j];
+        throttled_ns[j] = ratelimit->retired_throttled_ns[j];
+        fprintf(out, "client_%s_rate_bytes %llu\n", names[j], (unsigned long long)ratelimit->rate[j]);
+    }
+    fprintf(out, "client_sources %zu\n", ratelimit->count);
+    for(i = 0; i < RATELIMIT_TABLE_SIZE; i++)
+    {
+        struct client_source *source;
+        for(source = ratelimit->table[i]; source != NULL; source = source->next)
+        {
+            char ip[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &source->addr, ip, sizeof(ip));
+            fprintf(out, "client_connections{client=\"%s\"} %llu\n", ip,
+                    (unsigned long long)load(&source->connections));
+            fprintf(out, "client_connections_active{client=\"%s\"} %d\n", ip, source->refcount);
+            for(j = 0; j < RATELIMIT_DIRECTIONS; j++)
+            {
+                uint64_t transferred = load(&source->bytes[j]);
+                uint64_t count = load(&source->throttled[j]);
+                uint64_t ns = load(&source->throttled_ns[j]);
+                bytes[j] += transferred;
+                throttled[j] += count;
+                throttled_ns[j] += ns;
+                fprintf(out, "client_%s_bytes{client=\"%s\"} %llu\n", names[j], ip, (unsigned long long)transferred);
+                fprintf(out, "client_%s_throttled{client=\"%s\"} %llu\n", names[j], ip, (unsigned long long)count);
+                fprintf(out, "client_%s_throttled_us{client=\"%s\"} %llu\n", names[j], ip,
+                        (unsigned long long)(ns / 1000));
+            }
+        }
+    }
+    for(j = 0; j < RATELIMIT_DIRECTIONS; j++)
+    {
+        fprintf(out, "client_%s_bytes_total %llu\n", names[j], (unsigned long long)bytes[j]);
+        fprintf(out, "client_%s_throttled_total %llu\n", names[j], (unsigned long long)throttled[j]);
+        fprintf(out, "client_%s_throttled_us_total %llu\n", names[j], (unsigned long long)(throttled_ns[j] / 1000));
+    }
+    pthread_mutex_unlock(&ratelimit->lock);
+    pthread_mutex_unlock(&registry_lock);
+}
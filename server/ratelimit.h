@@ -0,0 +1,124 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+#include "log_writer.h"
+
+/**
+ * Per source address state of aesdsocket clients: token buckets limiting the
+ * ingest and reply bandwidth of each source, its log writer flow and its
+ * throttling counters.
+ *
+ * Sources outlive their connections, since most clients open one connection per
+ * packet, and are only dropped once idle with full buckets, when forgetting
+ * them changes nothing but the per source counters (which are kept in totals).
+ */
+
+enum ratelimit_direction
+{
+    RATELIMIT_INGEST,
+    RATELIMIT_REPLY,
+    RATELIMIT_DIRECTIONS
+};
+
+#define RATELIMIT_TABLE_BITS 8
+#define RATELIMIT_TABLE_SIZE (1 << RATELIMIT_TABLE_BITS)
+/**
+ * Smallest burst, a bucket can always take at least this much at once
+ */
+#define RATELIMIT_MIN_BURST (64 * 1024)
+/**
+ * Idle sources are swept once the table holds this many sources
+ */
+#define RATELIMIT_SWEEP_THRESHOLD 1024
+
+struct token_bucket
+{
+    /**
+     * Available bytes, negative while a charge is being waited out
+     */
+    double tokens;
+    uint64_t refill_ns;
+};
+
+struct client_source
+{
+    struct client_source *next;
+    struct in_addr addr;
+    /**
+     * Open connections, under the table lock
+     */
+    int refcount;
+    /**
+     * Protects buckets
+     */
+    pthread_mutex_t lock;
+    struct token_bucket buckets[RATELIMIT_DIRECTIONS];
+    struct log_flow flow;
+
+    /* Updated with atomics */
+    uint64_t connections;
+    uint64_t bytes[RATELIMIT_DIRECTIONS];
+    uint64_t throttled[RATELIMIT_DIRECTIONS];
+    uint64_t throttled_ns[RATELIMIT_DIRECTIONS];
+};
+
+struct ratelimit
+{
+    pthread_mutex_t lock;
+    /**
+     * Bytes per second of each direction, 0 for unlimited, and bucket sizes
+     */
+    uint64_t rate[RATELIMIT_DIRECTIONS];
+    uint64_t burst[RATELIMIT_DIRECTIONS];
+    struct client_source *table[RATELIMIT_TABLE_SIZE];
+    size_t count;
+    size_t sweep_at;
+
+    /* Counters of the sources swept so far */
+    uint64_t retired_bytes[RATELIMIT_DIRECTIONS];
+    uint64_t retired_throttled[RATELIMIT_DIRECTIONS];
+    uint64_t retired_throttled_ns[RATELIMIT_DIRECTIONS];
+};
+
+/**
+ * Initializes @param ratelimit with @param ingest_rate and @param reply_rate bytes
+ * per second per source (0: unlimited), each with a burst of one second
+ * @return 0 on success, an errno value otherwise
+ */
+int ratelimit_init(struct ratelimit *ratelimit, uint64_t ingest_rate, uint64_t reply_rate);
+
+/**
+ * @return the referenced state of source @param addr, created on first use, NULL
+ *  if out of memory
+ */
+struct client_source *ratelimit_acquire(struct ratelimit *ratelimit, struct in_addr addr);
+
+/**
+ * Drops the reference of a connection on @param source
+ */
+void ratelimit_release(struct ratelimit *ratelimit, struct client_source *source);
+
+/**
+ * Charges @param bytes transferred in @param direction to @param source
+ * @return how long to wait, in ns, before the source is back within its rate
+ */
+uint64_t ratelimit_charge(struct ratelimit *ratelimit, struct client_source *source,
+            enum ratelimit_direction direction, size_t bytes);
+
+/**
+ * Frees every source, none may be referenced anymore
+ */
+void ratelimit_destroy(struct ratelimit *ratelimit);
+
+/**
+ * Writes the throttling counters of every known source and their totals to @param out
+ */
+void ratelimit_report(FILE *out);
+
+#endif /* RATELIMIT_H */
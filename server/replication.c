@@ -0,0 +1,741 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "replication.h"
+#include "log_writer.h"
+#include "stats.h"
+
+/**
+ * Messages gathered into one sendmsg() per follower
+ */
+#define REPLICATION_IOV_MAX 64
+#define REPLICATION_STOP_TIMEOUT_NS 1000000000ULL
+#define REPLICATION_STOP_POLL_MS 50
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct replication *active;
+
+static void write_be32(char *out, uint32_t value)
+{
+    out[0] = (char)(value >> 24);
+    out[1] = (char)(value >> 16);
+    out[2] = (char)(value >> 8);
+    out[3] = (char)value;
+}
+
+static void write_be64(char *out, uint64_t value)
+{
+    write_be32(out, (uint32_t)(value >> 32));
+    write_be32(out + 4, (uint32_t)value);
+}
+
+static uint64_t read_be64(const char *in)
+{
+    const unsigned char *p = (const unsigned char *)in;
+    uint64_t value = 0;
+    int i;
+    for(i = 0; i < 8; i++)
+    {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static void encode_header(char *out, uint32_t type, uint32_t count, uint32_t length, uint64_t seq,
+            uint64_t offset, uint64_t commit_ns)
+{
+    write_be32(out, type);
+    write_be32(out + 4, count);
+    write_be32(out + 8, length);
+    write_be32(out + 12, 0);
+    write_be64(out + 16, seq);
+    write_be64(out + 24, offset);
+    write_be64(out + 32, commit_ns);
+}
+
+/**
+ * @return true if @param follower has something to send.  Called with the lock held.
+ */
+static bool follower_ready(struct replication *replication, struct replication_follower *follower)
+{
+    if(follower->syncing)
+    {
+        // wait until every batch in the snapshot is published to know where it ends
+        return replication->published_offset >= follower->snapshot->offset + follower->snapshot->size;
+    }
+    return follower->snapshot != NULL || follower->pending != NULL;
+}
+
+static void follower_free(struct replication_follower *follower)
+{
+    if(follower->snapshot != NULL)
+    {
+        log_snapshot_put(follower->snapshot);
+    }
+    close(follower->fd);
+    free(follower);
+}
+
+/**
+ * Unlinks @param follower from the follower list.  Called with the lock held.
+ */
+static void follower_unlink(struct replication *replication, struct replication_follower *follower)
+{
+    struct replication_follower **link = &replication->followers;
+    while(*link != follower)
+    {
+        link = &(*link)->next;
+    }
+    *link = follower->next;
+    replication->follower_count--;
+}
+
+/**
+ * Accepts a follower and, on the file backend, takes the snapshot it starts from
+ */
+static void replication_accept(struct replication *replication)
+{
+    int fd = accept4(replication->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd == -1)
+    {
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        {
+            perror("accept replication");
+        }
+        return;
+    }
+    struct replication_follower *follower = calloc(1, sizeof(struct replication_follower));
+    if(follower == NULL)
+    {
+        perror("calloc");
+        close(fd);
+        return;
+    }
+    follower->fd = fd;
+    follower->connected_ns = stats_now_ns();
+
+    // Register first: every batch published from now on is queued for the follower
+    pthread_mutex_lock(&replication->lock);
+    follower->id = ++replication->next_id;
+    follower->acked_seq = replication->next_seq - 1;
+    follower->next = replication->followers;
+    replication->followers = follower;
+    replication->follower_count++;
+    pthread_mutex_unlock(&replication->lock);
+
+    if(replication->segments != NULL)
+    {
+        // Covers at least everything published before registering, overlapping batches are skipped
+        struct log_snapshot *snapshot = log_snapshot_get(replication->snapshots);
+        pthread_mutex_lock(&replication->lock);
+        if(snapshot == NULL)
+        {
+            follower_unlink(replication, follower);
+            pthread_mutex_unlock(&replication->lock);
+            fprintf(stderr, "No snapshot for follower %u\n", follower->id);
+            follower_free(follower);
+            return;
+        }
+        follower->snapshot = snapshot;
+        follower->syncing = true;
+        pthread_mutex_unlock(&replication->lock);
+    }
+    syslog(LOG_INFO, "Follower %u connected\n", follower->id);
+    printf("Follower %u connected\n", follower->id);
+}
+
+/**
+ * Reads the acknowledgements available from @param follower
+ * @return false if the follower disconnected
+ */
+static bool follower_read_acks(struct replication *replication, struct replication_follower *follower)
+{
+    while(1)
+    {
+        ssize_t ret = recv(follower->fd, follower->ack + follower->ack_used,
+                AESD_REPL_ACK_SIZE - follower->ack_used, MSG_DONTWAIT);
+        if(ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ret == -1)
+        {
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        }
+        if(ret == 0)
+        {
+            return false;
+        }
+        follower->ack_used += ret;
+        if(follower->ack_used < AESD_REPL_ACK_SIZE)
+        {
+            continue;
+        }
+        follower->ack_used = 0;
+        uint64_t seq = read_be64(follower->ack);
+
+        pthread_mutex_lock(&replication->lock);
+        // never beyond what was sent, the batches past it must stay retained
+        uint64_t sent_seq = follower->pending != NULL ? follower->pending->first_seq - 1 :
+                replication->next_seq - 1;
+        if(seq > sent_seq)
+        {
+            seq = sent_seq;
+        }
+        if(seq > follower->acked_seq)
+        {
+            follower->acked_seq = seq;
+        }
+        pthread_mutex_unlock(&replication->lock);
+    }
+}
+
+/**
+ * Sends as much of the snapshot and pending batches of @param follower as the socket takes
+ * @return false if the follower has to be disconnected
+ */
+static bool follower_send(struct replication *replication, struct replication_follower *follower)
+{
+    struct iovec iov[REPLICATION_IOV_MAX];
+    int count = 0;
+    struct replication_batch *batch;
+
+    pthread_mutex_lock(&replication->lock);
+    if(!follower_ready(replication, follower))
+    {
+        pthread_mutex_unlock(&replication->lock);
+        return true;
+    }
+    struct log_snapshot *snapshot = follower->snapshot;
+    if(follower->syncing)
+    {
+        // Skip the batches the snapshot already holds, it ends on a batch boundary
+        uint64_t end = snapshot->offset + snapshot->size;
+        while(follower->pending != NULL && follower->pending->end_offset <= end)
+        {
+            follower->pending = follower->pending->next;
+        }
+        uint64_t seq = follower->pending != NULL ? follower->pending->first_seq - 1 :
+                replication->next_seq - 1;
+        encode_header(follower->snapshot_header, AESD_REPL_SNAPSHOT, 0, (uint32_t)snapshot->size, seq,
+                snapshot->offset, stats_now_ns());
+        follower->syncing = false;
+        follower->sent = 0;
+    }
+    if(snapshot != NULL)
+    {
+        iov[count].iov_base = follower->snapshot_header;
+        iov[count++].iov_len = AESD_REPL_HEADER_SIZE;
+        if(snapshot->size > 0)
+        {
+            iov[count].iov_base = (void *)snapshot->data;
+            iov[count++].iov_len = snapshot->size;
+        }
+    }
+    for(batch = follower->pending; batch != NULL && count < REPLICATION_IOV_MAX; batch = batch->next)
+    {
+        iov[count].iov_base = batch->data;
+        iov[count++].iov_len = batch->size;
+    }
+    size_t skip = follower->sent;
+    pthread_mutex_unlock(&replication->lock);
+
+    // Resume the partially sent first message
+    struct iovec *first = iov;
+    while(skip >= first->iov_len)
+    {
+        skip -= first->iov_len;
+        first++;
+        count--;
+    }
+    first->iov_base = (char *)first->iov_base + skip;
+    first->iov_len -= skip;
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = first;
+    msg.msg_iovlen = count;
+    ssize_t ret = sendmsg(follower->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+    if(ret == -1)
+    {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    }
+
+    pthread_mutex_lock(&replication->lock);
+    size_t done = follower->sent + ret;
+    if(snapshot != NULL)
+    {
+        size_t total = AESD_REPL_HEADER_SIZE + snapshot->size;
+        if(done < total)
+        {
+            follower->sent = done;
+            pthread_mutex_unlock(&replication->lock);
+            return true;
+        }
+        done -= total;
+        follower->snapshot = NULL;
+        log_snapshot_put(snapshot);
+    }
+    while(follower->pending != NULL && done >= follower->pending->size)
+    {
+        done -= follower->pending->size;
+        follower->pending = follower->pending->next;
+    }
+    follower->sent = done;
+    pthread_mutex_unlock(&replication->lock);
+    return true;
+}
+
+/**
+ * Frees the batches acknowledged by every follower, then disconnects the slowest
+ * followers while the rest is over the backlog limit
+ */
+static void replication_trim(struct replication *replication)
+{
+    pthread_mutex_lock(&replication->lock);
+    while(1)
+    {
+        struct replication_follower *slowest = NULL;
+        struct replication_follower *follower;
+        for(follower = replication->followers; follower != NULL; follower = follower->next)
+        {
+            if(slowest == NULL || follower->acked_seq < slowest->acked_seq)
+            {
+                slowest = follower;
+            }
+        }
+        uint64_t acked_seq = slowest != NULL ? slowest->acked_seq : replication->next_seq - 1;
+        while(replication->head != NULL && replication->head->last_seq <= acked_seq)
+        {
+            struct replication_batch *batch = replication->head;
+            replication->head = batch->next;
+            replication->backlog_bytes -= batch->size;
+            free(batch);
+        }
+        if(replication->head == NULL)
+        {
+            replication->tail = NULL;
+        }
+        if(replication->backlog_bytes <= replication->backlog_max || slowest == NULL)
+        {
+            break;
+        }
+        follower_unlink(replication, slowest);
+        replication->evicted++;
+        syslog(LOG_WARNING, "Follower %u is more than %zu bytes behind, disconnecting\n",
+                slowest->id, replication->backlog_max);
+        follower_free(slowest);
+    }
+    pthread_mutex_unlock(&replication->lock);
+}
+
+static void *replication_thread(void *param)
+{
+    struct replication *replication = (struct replication *) param;
+    struct pollfd *fds = NULL;
+    size_t fds_capacity = 0;
+    uint64_t stop_deadline = 0;
+
+    while(1)
+    {
+        pthread_mutex_lock(&replication->lock);
+        if(replication->resync)
+        {
+            // The stream has a gap, followers reconnect and start over from a snapshot
+            while(replication->followers != NULL)
+            {
+                struct replication_follower *follower = replication->followers;
+                follower_unlink(replication, follower);
+                syslog(LOG_WARNING, "Follower %u disconnected to resynchronize\n", follower->id);
+                follower_free(follower);
+            }
+            replication->resync = false;
+        }
+        size_t needed = 2 + replication->follower_count;
+        if(needed > fds_capacity)
+        {
+            struct pollfd *grown = realloc(fds, needed * 2 * sizeof(struct pollfd));
+            if(grown == NULL)
+            {
+                pthread_mutex_unlock(&replication->lock);
+                perror("realloc");
+                break;
+            }
+            fds = grown;
+            fds_capacity = needed * 2;
+        }
+
+        bool busy = false;
+        nfds_t nfds = 2;
+        struct replication_follower *follower;
+        for(follower = replication->followers; follower != NULL; follower = follower->next)
+        {
+            bool ready = follower_ready(replication, follower);
+            busy = busy || ready;
+            fds[nfds].fd = follower->fd;
+            fds[nfds++].events = POLLIN | (ready ? POLLOUT : 0);
+        }
+        if(replication->stopping)
+        {
+            // Give followers a last chance to receive everything published
+            if(stop_deadline == 0)
+            {
+                stop_deadline = stats_now_ns() + REPLICATION_STOP_TIMEOUT_NS;
+            }
+            if(!busy || stats_now_ns() >= stop_deadline)
+            {
+                pthread_mutex_unlock(&replication->lock);
+                break;
+            }
+        }
+        fds[0].fd = replication->wake_pipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = replication->stopping ? -1 : replication->listen_fd;
+        fds[1].events = POLLIN;
+        replication->sleeping = true;
+        replication->woken = false;
+        pthread_mutex_unlock(&replication->lock);
+
+        int ret = poll(fds, nfds, replication->stopping ? REPLICATION_STOP_POLL_MS : -1);
+
+        pthread_mutex_lock(&replication->lock);
+        replication->sleeping = false;
+        pthread_mutex_unlock(&replication->lock);
+        if(ret == -1 && errno != EINTR)
+        {
+            perror("poll");
+            break;
+        }
+        if(fds[0].revents & POLLIN)
+        {
+            char drain[64];
+            while(read(replication->wake_pipe[0], drain, sizeof(drain)) > 0)
+            {
+            }
+        }
+
+        // Followers only ever leave the list from this thread, it still matches fds
+        nfds_t i = 2;
+        follower = replication->followers;
+        while(follower != NULL)
+        {
+            struct replication_follower *next = follower->next;
+            bool alive = true;
+            if(i < nfds && fds[i].fd == follower->fd)
+            {
+                if(fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+                {
+                    alive = follower_read_acks(replication, follower);
+                }
+                i++;
+            }
+            if(alive)
+            {
+                alive = follower_send(replication, follower);
+            }
+            if(!alive)
+            {
+                pthread_mutex_lock(&replication->lock);
+                follower_unlink(replication, follower);
+                pthread_mutex_unlock(&replication->lock);
+                syslog(LOG_INFO, "Follower %u disconnected\n", follower->id);
+                printf("Follower %u disconnected\n", follower->id);
+                follower_free(follower);
+            }
+            follower = next;
+        }
+        replication_trim(replication);
+
+        if(fds[1].fd != -1 && (fds[1].revents & POLLIN))
+        {
+            replication_accept(replication);
+        }
+    }
+
+    free(fds);
+    pthread_mutex_lock(&replication->lock);
+    while(replication->followers != NULL)
+    {
+        struct replication_follower *follower = replication->followers;
+        follower_unlink(replication, follower);
+        follower_free(follower);
+    }
+    pthread_mutex_unlock(&replication->lock);
+    return NULL;
+}
+
+int replication_start(struct replication *replication, const char *path, size_t backlog_max,
+            struct log_snapshot_cache *snapshots, struct log_segments *segments)
+{
+    memset(replication, 0, sizeof(struct replication));
+    replication->path = path;
+    replication->backlog_max = backlog_max;
+    replication->snapshots = snapshots;
+    replication->segments = segments;
+    replication->next_seq = 1;
+
+    replication->listen_fd = stats_listen(path);
+    if(replication->listen_fd == -1)
+    {
+        return errno != 0 ? errno : EINVAL;
+    }
+    if(fcntl(replication->listen_fd, F_SETFL, O_NONBLOCK) == -1 ||
+            pipe2(replication->wake_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        int ret = errno;
+        close(replication->listen_fd);
+        unlink(path);
+        return ret;
+    }
+    int ret = pthread_mutex_init(&replication->lock, NULL);
+    if(ret == 0)
+    {
+        ret = pthread_create(&replication->thread, NULL, replication_thread, replication);
+        if(ret != 0)
+        {
+            pthread_mutex_destroy(&replication->lock);
+        }
+    }
+    if(ret != 0)
+    {
+        close(replication->wake_pipe[0]);
+        close(replication->wake_pipe[1]);
+        close(replication->listen_fd);
+        unlink(path);
+        return ret;
+    }
+
+    pthread_mutex_lock(&registry_lock);
+    active = replication;
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+
+/**
+ * @return true if the replication thread has to be woken up, by replication_wake once
+ *  the lock is released.  One wakeup per poll() no matter how many requests meanwhile.
+ *  Called with the lock held.
+ */
+static bool replication_wake_needed(struct replication *replication)
+{
+    bool wake = replication->sleeping && !replication->woken;
+    if(wake)
+    {
+        replication->woken = true;
+    }
+    return wake;
+}
+
+static void replication_wake(struct replication *replication)
+{
+    if(write(replication->wake_pipe[1], "", 1) == -1 && errno != EAGAIN)
+    {
+        perror("write");
+    }
+}
+
+/**
+ * Advances the published stream past @param records records up to @param end_offset
+ * without queuing them, and has the replication thread disconnect every follower so
+ * that they resynchronize instead of silently missing data
+ */
+static void replication_skip(struct replication *replication, int records, uint64_t end_offset)
+{
+    pthread_mutex_lock(&replication->lock);
+    replication->next_seq += records;
+    replication->published_offset = end_offset;
+    bool wake = false;
+    if(replication->follower_count > 0 && !replication->resync)
+    {
+        replication->resync = true;
+        wake = replication_wake_needed(replication);
+        syslog(LOG_WARNING, "Replication stream interrupted at offset %llu, followers resynchronize\n",
+                (unsigned long long)end_offset);
+    }
+    pthread_mutex_unlock(&replication->lock);
+    if(wake)
+    {
+        replication_wake(replication);
+    }
+}
+
+void replication_publish(struct replication *replication, const struct log_record *batch, int count,
+            size_t landed, uint64_t end_offset)
+{
+    uint64_t commit_ns = stats_now_ns();
+    const struct log_record *record;
+    size_t length = 0;
+    size_t remaining = landed;
+    int records;
+    // a failed write may have stopped inside a record, that record is published truncated
+    for(records = 0, record = batch; records < count && remaining > 0; records++, record = record->next)
+    {
+        size_t len = record->len < remaining ? record->len : remaining;
+        length += 4 + len;
+        remaining -= len;
+    }
+
+    pthread_mutex_lock(&replication->lock);
+    bool gap = end_offset != replication->published_offset + landed;
+    if(replication->follower_count == 0 || replication->resync)
+    {
+        // Nobody to send to, followers connecting later start from a snapshot
+        replication->next_seq += records;
+        replication->published_offset = end_offset;
+        pthread_mutex_unlock(&replication->lock);
+        return;
+    }
+    pthread_mutex_unlock(&replication->lock);
+    if(gap)
+    {
+        replication_skip(replication, records, end_offset);
+        return;
+    }
+    if(records == 0)
+    {
+        return;
+    }
+
+    // Only this thread publishes, the message can be encoded without the lock
+    struct replication_batch *message = malloc(sizeof(struct replication_batch) + AESD_REPL_HEADER_SIZE + length);
+    if(message == NULL)
+    {
+        perror("malloc");
+        replication_skip(replication, records, end_offset);
+        return;
+    }
+    char *out = message->data + AESD_REPL_HEADER_SIZE;
+    remaining = landed;
+    int i;
+    for(i = 0, record = batch; i < records; i++, record = record->next)
+    {
+        size_t len = record->len < remaining ? record->len : remaining;
+        write_be32(out, (uint32_t)len);
+        memcpy(out + 4, record->data, len);
+        out += 4 + len;
+        remaining -= len;
+    }
+    message->next = NULL;
+    message->size = AESD_REPL_HEADER_SIZE + length;
+    message->commit_ns = commit_ns;
+    message->end_offset = end_offset;
+
+    pthread_mutex_lock(&replication->lock);
+    message->first_seq = replication->next_seq;
+    message->last_seq = replication->next_seq + records - 1;
+    message->start_offset = replication->published_offset;
+    encode_header(message->data, AESD_REPL_BATCH, records, (uint32_t)length, message->first_seq,
+            message->start_offset, commit_ns);
+    replication->next_seq += records;
+    replication->published_offset = end_offset;
+    replication->batches++;
+    if(replication->tail != NULL)
+    {
+        replication->tail->next = message;
+    }
+    else
+    {
+        replication->head = message;
+    }
+    replication->tail = message;
+    replication->backlog_bytes += message->size;
+
+    struct replication_follower *follower;
+    for(follower = replication->followers; follower != NULL; follower = follower->next)
+    {
+        if(follower->pending == NULL)
+        {
+            follower->pending = message;
+        }
+    }
+    bool wake = replication_wake_needed(replication);
+    pthread_mutex_unlock(&replication->lock);
+    if(wake)
+    {
+        replication_wake(replication);
+    }
+}
+
+void replication_stop(struct replication *replication)
+{
+    pthread_mutex_lock(&registry_lock);
+    active = NULL;
+    pthread_mutex_unlock(&registry_lock);
+
+    pthread_mutex_lock(&replication->lock);
+    replication->stopping = true;
+    pthread_mutex_unlock(&replication->lock);
+    if(write(replication->wake_pipe[1], "", 1) == -1 && errno != EAGAIN)
+    {
+        perror("write");
+    }
+    pthread_join(replication->thread, NULL);
+    syslog(LOG_DEBUG, "Replicated %llu batches, %llu followers evicted\n",
+            (unsigned long long)replication->batches, (unsigned long long)replication->evicted);
+
+    while(replication->head != NULL)
+    {
+        struct replication_batch *batch = replication->head;
+        replication->head = batch->next;
+        free(batch);
+    }
+    close(replication->wake_pipe[0]);
+    close(replication->wake_pipe[1]);
+    close(replication->listen_fd);
+    unlink(replication->path);
+    pthread_mutex_destroy(&replication->lock);
+}
+
+void replication_report(FILE *out)
+{
+    pthread_mutex_lock(&registry_lock);
+    struct replication *replication = active;
+    if(replication == NULL)
+    {
+        pthread_mutex_unlock(&registry_lock);
+        return;
+    }
+    uint64_t now = stats_now_ns();
+    pthread_mutex_lock(&replication->lock);
+    fprintf(out, "replication_followers %u\n", replication->follower_count);
+    fprintf(out, "replication_published_seq %llu\n", (unsigned long long)(replication->next_seq - 1));
+    fprintf(out, "replication_published_offset %llu\n", (unsigned long long)replication->published_offset);
+    fprintf(out, "replication_batches %llu\n", (unsigned long long)replication->batches);
+    fprintf(out, "replication_backlog_bytes %zu\n", replication->backlog_bytes);
+    fprintf(out, "replication_evicted %llu\n", (unsigned long long)replication->evicted);
+
+    struct replication_follower *follower;
+    for(follower = replication->followers; follower != NULL; follower = follower->next)
+    {
+        // The oldest batch not acknowledged yet gives the byte and time lag
+        struct replication_batch *batch = replication->head;
+        while(batch != NULL && batch->last_seq <= follower->acked_seq)
+        {
+            batch = batch->next;
+        }
+        unsigned id = follower->id;
+        fprintf(out, "replication_follower_acked_seq{follower=\"%u\"} %llu\n", id,
+                (unsigned long long)follower->acked_seq);
+        fprintf(out, "replication_follower_lag_records{follower=\"%u\"} %llu\n", id,
+                (unsigned long long)(replication->next_seq - 1 - follower->acked_seq));
+        fprintf(out, "replication_follower_lag_bytes{follower=\"%u\"} %llu\n", id,
+                (unsigned long long)(batch != NULL ? replication->published_offset - batch->start_offset : 0));
+        fprintf(out, "replication_follower_lag_us{follower=\"%u\"} %llu\n", id,
+                (unsigned long long)(batch != NULL ? (now - batch->commit_ns) / 1000 : 0));
+        fprintf(out, "replication_follower_syncing{follower=\"%u\"} %d\n", id,
+                follower->syncing || follower->snapshot != NULL);
+        fprintf(out, "replication_follower_connected_sec{follower=\"%u\"} %llu\n", id,
+                (unsigned long long)((now - follower->connected_ns) / 1000000000ULL));
+    }
+    pthread_mutex_unlock(&replication->lock);
+    pthread_mutex_unlock(&registry_lock);
+}
@@ -0,0 +1,140 @@
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include "log_segments.h"
+#include "log_snapshot.h"
+#include "protocol.h"
+
+struct log_record;
+
+/**
+ * Replication feed of the committed log to followers on a Unix socket, see protocol.h.
+ *
+ * The log writer publishes every committed batch, encoded once into a message
+ * shared by all followers.  A single thread accepts followers and sends them
+ * the batches they have not received yet with non blocking gathered writes,
+ * so a slow follower never holds up commits.  Batches are retained until every
+ * follower has acknowledged them, a follower falling more than backlog_max
+ * bytes behind is disconnected and has to resynchronize.
+ */
+
+/**
+ * One published batch, in publish order
+ */
+struct replication_batch
+{
+    struct replication_batch *next;
+    uint64_t first_seq;
+    uint64_t last_seq;
+    uint64_t start_offset;
+    uint64_t end_offset;
+    uint64_t commit_ns;
+    size_t size;
+    /**
+     * The whole message, header included
+     */
+    char data[];
+};
+
+struct replication_follower
+{
+    struct replication_follower *next;
+    int fd;
+    unsigned id;
+    /**
+     * Next batch to send, NULL when caught up.  Set by the publisher for caught
+     * up followers, otherwise only moved by the replication thread.
+     */
+    struct replication_batch *pending;
+    /**
+     * Bytes of the first message to send already sent
+     */
+    size_t sent;
+    /**
+     * Snapshot to send before any batch, with its header, until it is sent
+     */
+    struct log_snapshot *snapshot;
+    char snapshot_header[AESD_REPL_HEADER_SIZE];
+    bool syncing;
+    uint64_t acked_seq;
+    char ack[AESD_REPL_ACK_SIZE];
+    size_t ack_used;
+    uint64_t connected_ns;
+};
+
+struct replication
+{
+    pthread_mutex_t lock;
+    const char *path;
+    int listen_fd;
+    /**
+     * Wakes the replication thread out of poll(), written only while it sleeps
+     */
+    int wake_pipe[2];
+    bool sleeping;
+    bool woken;
+    bool stopping;
+    /**
+     * Set when the published stream has a gap, the replication thread then disconnects
+     * every follower and nothing is queued until it did
+     */
+    bool resync;
+    pthread_t thread;
+
+    struct log_snapshot_cache *snapshots;
+    struct log_segments *segments;
+
+    struct replication_batch *head;
+    struct replication_batch *tail;
+    struct replication_follower *followers;
+    unsigned follower_count;
+    unsigned next_id;
+    size_t backlog_bytes;
+    size_t backlog_max;
+    /**
+     * Seq of the next record published and log offset past the last one
+     */
+    uint64_t next_seq;
+    uint64_t published_offset;
+
+    uint64_t batches;
+    uint64_t evicted;
+};
+
+/**
+ * Starts serving the replication feed on a Unix socket at @param path, replacing
+ * any stale socket file.  Snapshots for new followers come from @param snapshots
+ * when @param segments is not NULL.
+ * @return 0 on success, an errno value otherwise
+ */
+int replication_start(struct replication *replication, const char *path, size_t backlog_max,
+            struct log_snapshot_cache *snapshots, struct log_segments *segments);
+
+/**
+ * Publishes the first @param landed bytes of the @param count records starting at
+ * @param batch, committed to the log up to offset @param end_offset.  When they do not
+ * account for all of the log up to @param end_offset, or cannot be queued, the offsets
+ * still advance and every follower is disconnected to resynchronize from a snapshot.
+ * Called by the log writer only.
+ */
+void replication_publish(struct replication *replication, const struct log_record *batch, int count,
+            size_t landed, uint64_t end_offset);
+
+/**
+ * Gives followers a short while to receive everything published, then disconnects
+ * them and stops the replication thread.  Call after the log writer is stopped.
+ */
+void replication_stop(struct replication *replication);
+
+/**
+ * Writes the follower count and the lag of each follower to @param out
+ */
+void replication_report(FILE *out);
+
+#endif /* REPLICATION_H */
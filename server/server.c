@@ -1,4 +1,5 @@
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
@@ -12,12 +13,30 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include <pthread.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+#include <stddef.h>
 
 #include "queue.h"
 #include "threading.h"
+#include "protocol.h"
+#include "log_writer.h"
+#include "stats.h"
+#include "timer_wheel.h"
+#include "pool.h"
+#include "framing.h"
+#include "ratelimit.h"
+#include "probes.h"
+#include "lockprof.h"
 
-bool aborted = false;
+/**
+ * Number of SIGINT/SIGTERM received, the first one starts a drain, the second one cuts it short
+ */
+volatile sig_atomic_t aborted = 0;
+volatile sig_atomic_t caught_signal = 0;
 
 #ifdef USE_AESD_CHAR_DEVICE
 #define LOG_FILE "/dev/aesdchar"
@@ -27,7 +46,37 @@ bool aborted = false;
 #define REMOVE_FILE remove(LOG_FILE)
 #endif
 
-#define RW_BUFFER_SIZE 1024
+#define RW_BUFFER_SIZE 4096
+#define CONNECTION_SLAB_SIZE (64 * 1024)
+#define BUFFER_SLAB_SIZE (2 * 1024 * 1024)
+#define FRAMING_BATCH 64
+#define TIMESTAMP_RECORD_SIZE 128
+#define DEFAULT_TIMESTAMP_INTERVAL 10
+#define DEFAULT_TIMESTAMP_FORMAT "%a, %d %b %Y %T %z"
+#define DEFAULT_COMPRESSED_SEGMENT_SIZE (1024 * 1024)
+#define DEFAULT_IDLE_TIMEOUT 60
+#define DEFAULT_READ_TIMEOUT 30
+#define DEFAULT_WRITE_TIMEOUT 30
+#define TIMER_WHEEL_TICK_NS 100000000ULL
+#define DEFAULT_DRAIN_TIMEOUT 10
+#define DRAIN_POLL_MS 50
+#define REPLICATION_BACKLOG_MAX (64 * 1024 * 1024)
+/**
+ * Throttled connections sleep in slices of this much, to notice timeouts and draining
+ */
+#define THROTTLE_SLICE_NS 100000000ULL
+/**
+ * Largest send while replies are rate limited, so they are paced rather than bursty
+ */
+#define THROTTLE_SEND_CHUNK (16 * 1024)
+
+#ifdef USE_AESD_CHAR_DEVICE
+#define SERVER_OPTIONS "dHm:R:i:r:w:g:I:O:"
+#else
+#define SERVER_OPTIONS "dHm:R:i:r:w:g:I:O:s:a:k:b:t:f:z"
+#endif
+
+#define NS_PER_SEC 1000000000ULL
 
 
 // The data type for the node
@@ -35,51 +84,155 @@ struct ThreadListNode
 {
     pthread_t thread;
     thread_data *thread_data;
+    // deadline check of the connection, owned by the main loop
+    struct timer_entry timer;
+    // in the main loop's queue of connections to check, guarded by the queue lock
+    bool queued;
+    STAILQ_ENTRY(ThreadListNode) pending;
     // This macro does the magic to point to other nodes
     TAILQ_ENTRY(ThreadListNode) nodes;
 };
 
+TAILQ_HEAD(thread_list, ThreadListNode);
+STAILQ_HEAD(pending_list, ThreadListNode);
+
+/**
+ * Per connection state, allocated in one piece from connection_pool
+ */
+struct client_connection
+{
+    struct ThreadListNode node;
+    struct thread_data data;
+};
+
+/**
+ * Connection states and RW_BUFFER_SIZE receive buffers, recycled across connections
+ */
+static struct pool connection_pool;
+static struct pool buffer_pool;
+
+/**
+ * Connection deadlines enforced by the main loop, a zero timeout is disabled
+ */
+struct client_timeouts
+{
+    uint64_t idle_ns;
+    uint64_t read_ns;
+    uint64_t write_ns;
+    uint64_t now_ns;
+    /**
+     * Every connection timer is armed at the connection's deadline, or not at all
+     * while its phase has none
+     */
+    struct timer_wheel wheel;
+    struct thread_list *threads;
+    /**
+     * Connections whose deadline moved earlier or that were closed, pushed by their
+     * threads, with eventfd signalled when the queue becomes non empty
+     */
+    pthread_mutex_t queue_lock;
+    struct pending_list pending;
+    int eventfd;
+};
+
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-d] [-H] [-m stats_socket] [-R replication_socket]"
+            " [-i idle_sec] [-r read_sec] [-w write_sec] [-g drain_sec]"
+            " [-I ingest_bytes_per_sec] [-O reply_bytes_per_sec]"
+#ifndef USE_AESD_CHAR_DEVICE
+            " [-s segment_bytes] [-a segment_age_sec] [-k max_segments] [-b max_retained_bytes]"
+            " [-t timestamp_interval_sec] [-f timestamp_format] [-z]"
+#endif
+            "\n", name);
+    fprintf(stderr, "  -d  run as a daemon\n");
+    fprintf(stderr, "  -H  back receive buffers with huge pages when available\n");
+    fprintf(stderr, "  -m  serve runtime metrics on this Unix socket path\n");
+    fprintf(stderr, "  -R  stream committed appends to followers on this Unix socket path\n");
+    fprintf(stderr, "  -i  close connections idle between packets this long (default %d, 0: never)\n",
+            DEFAULT_IDLE_TIMEOUT);
+    fprintf(stderr, "  -r  close connections taking longer to send a packet (default %d, 0: never)\n",
+            DEFAULT_READ_TIMEOUT);
+    fprintf(stderr, "  -w  close connections not reading their reply for this long (default %d, 0: never)\n",
+            DEFAULT_WRITE_TIMEOUT);
+    fprintf(stderr, "  -g  on SIGINT/SIGTERM, wait this long for connections to finish (default %d)\n",
+            DEFAULT_DRAIN_TIMEOUT);
+    fprintf(stderr, "  -I  limit the bytes received from each client address per second (0: no limit)\n");
+    fprintf(stderr, "  -O  limit the bytes sent to each client address per second (0: no limit)\n");
+#ifndef USE_AESD_CHAR_DEVICE
+    fprintf(stderr, "  -s  rotate the log segment once it reaches this size (0: never)\n");
+    fprintf(stderr, "  -a  rotate the log segment once it is this old (0: never)\n");
+    fprintf(stderr, "  -k  keep at most this many log segments (0: no limit)\n");
+    fprintf(stderr, "  -b  delete old log segments beyond this many bytes (0: no limit)\n");
+    fprintf(stderr, "  -t  seconds between timestamp records (default %d, 0: disabled)\n",
+            DEFAULT_TIMESTAMP_INTERVAL);
+    fprintf(stderr, "  -f  strftime format of timestamp records (default \"%s\")\n",
+            DEFAULT_TIMESTAMP_FORMAT);
+    fprintf(stderr, "  -z  compress sealed log segments (default segment size %d bytes)\n",
+            DEFAULT_COMPRESSED_SEGMENT_SIZE);
+#endif
+}
 
 static void sig_handler(int signo)
 {
+    // only async-signal-safe work here, the main loop drains and removes the log
     if (signo == SIGINT || signo == SIGTERM)
     {
-        printf("Received SIGINT or SIGTERM (%d)\n", signo);
-        syslog(LOG_DEBUG, "Caught signal %d, exiting\n", signo);
-        aborted = true;
-        REMOVE_FILE;
+        caught_signal = signo;
+        aborted = aborted < 2 ? aborted + 1 : aborted;
     }
 }
 
 #ifndef USE_AESD_CHAR_DEVICE
-static void timer_thread(union sigval sigval)
+/**
+ * Last formatted timestamp record, only reformatted when the second changes
+ */
+struct timestamp_cache
 {
-    pthread_mutex_t *mutex = (pthread_mutex_t *) sigval.sival_ptr;
-    printf("Timer thread\n");
-    syslog(LOG_DEBUG, "Timer thread\n");
+    const char *format;
+    time_t second;
+    char record[TIMESTAMP_RECORD_SIZE];
+    size_t len;
+};
 
-    if(pthread_mutex_lock(mutex) != 0)
-    {
-        perror("pthread_mutex_lock");
-        return;
-    }
-    else
-    {
-        FILE *file = fopen(LOG_FILE, "a");
-        if (file == NULL) {
-            perror("fopen");
-            // pthread_mutex_unlock(mutex);
-            return;
+/**
+ * @return the "timestamp:<time>\n" record for @param now, formatted with cache->format
+ */
+static const char *timestamp_record(struct timestamp_cache *cache, time_t now, size_t *len)
+{
+    if (cache->len == 0 || cache->second != now) {
+        struct tm tm;
+        char timestr[TIMESTAMP_RECORD_SIZE - 16];
+        localtime_r(&now, &tm);
+        if (strftime(timestr, sizeof(timestr), cache->format, &tm) == 0) {
+            timestr[0] = '\0';
         }
-        time_t t = time(NULL);
-        char timestr[100];
-        strftime(timestr, 100, "%a, %d %b %Y %T %z", localtime(&t));
-        fprintf(file, "timestamp:%s\n", timestr);
-        printf("timestamp:%s\n", timestr);
-        fclose(file);
-        pthread_mutex_unlock(mutex);
+        cache->len = snprintf(cache->record, sizeof(cache->record), "timestamp:%s\n", timestr);
+        cache->second = now;
     }
+    *len = cache->len;
+    return cache->record;
+}
 
+/**
+ * Appends a timestamp for each expiration of @param timerfd through the log writer
+ */
+static void timestamp_tick(int timerfd, struct timestamp_cache *cache, struct log_writer *writer)
+{
+    uint64_t expirations;
+    if (read(timerfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        if (errno != EAGAIN && errno != EINTR) {
+            perror("read timerfd");
+        }
+        return;
+    }
+    size_t len;
+    const char *record = timestamp_record(cache, time(NULL), &len);
+    printf("%s", record);
+    if (!log_writer_append_async(writer, record, len)) {
+        syslog(LOG_ERR, "Failed to queue timestamp\n");
+    }
 }
 #endif
 
@@ -147,124 +300,688 @@ void demonize()
     }
 }
 
-void* handle_client(void* thread_param)
+/**
+ * @return the timeout of @param phase, 0 if it has none
+ */
+static uint64_t phase_timeout_ns(const struct client_timeouts *timeouts, int phase)
 {
-    struct thread_data* thread_func_args = (struct thread_data *) thread_param;
+    switch (phase) {
+        case CLIENT_IDLE:
+            return timeouts->idle_ns;
+        case CLIENT_READING:
+            return timeouts->read_ns;
+        case CLIENT_WRITING:
+            return timeouts->write_ns;
+        default:
+            return 0;
+    }
+}
 
-    struct sockaddr_in client_addr = thread_func_args->client_addr;
-    socklen_t client_sockfd = thread_func_args->client_sockfd;
+/**
+ * Queues the connection of @param thread_func_args for a check by the main loop, waking it up
+ * if the queue was empty
+ */
+static void client_notify(struct thread_data *thread_func_args)
+{
+    struct client_timeouts *timeouts = thread_func_args->timeouts;
+    struct client_connection *connection = (struct client_connection *)
+            ((char *)thread_func_args - offsetof(struct client_connection, data));
+    bool wake = false;
 
+    lockprof_mutex_lock(&timeouts->queue_lock);
+    if (!connection->node.queued) {
+        connection->node.queued = true;
+        wake = STAILQ_EMPTY(&timeouts->pending);
+        STAILQ_INSERT_TAIL(&timeouts->pending, &connection->node, pending);
+    }
+    lockprof_mutex_unlock(&timeouts->queue_lock);
+    if (wake) {
+        uint64_t one = 1;
+        if (write(timeouts->eventfd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            perror("write eventfd");
+        }
+    }
+}
 
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
-    // Log the message
-    syslog(LOG_DEBUG, "Accepted connection from %s\n", client_ip);
-    printf("Accepted connection from %s\n", client_ip);
+/**
+ * Records a transition of the connection to @param phase, which restarts its deadline.  The main
+ * loop is only told when the new deadline comes before the one its timer is armed for, a later
+ * one is found when the timer fires.
+ */
+static void client_phase(struct thread_data *thread_func_args, enum client_phase phase)
+{
+    uint64_t now = stats_now_ns();
+    uint64_t timeout = phase_timeout_ns(thread_func_args->timeouts, phase);
+
+    lockprof_mutex_lock(&thread_func_args->lock);
+    __atomic_store_n(&thread_func_args->phase_start_ns, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread_func_args->last_activity_ns, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&thread_func_args->phase, phase, __ATOMIC_RELAXED);
+    bool earlier = timeout != 0 && now + timeout < thread_func_args->armed_deadline_ns;
+    lockprof_mutex_unlock(&thread_func_args->lock);
+    if (earlier) {
+        client_notify(thread_func_args);
+    }
+}
 
-    pthread_mutex_t *mutex = thread_func_args->mutex;
-    pthread_mutex_lock(mutex);
+/**
+ * Records progress on the connection socket
+ */
+static void client_activity(struct thread_data *thread_func_args)
+{
+    __atomic_store_n(&thread_func_args->last_activity_ns, stats_now_ns(), __ATOMIC_RELAXED);
+}
 
-    // Receive data over the connection and appends to file LOG_FILE, creating this file if it doesn’t exist.
-    FILE *file = fopen(LOG_FILE, "a+");
-    if (file == NULL) {
-        perror("fopen");
-        pthread_mutex_unlock(mutex);
-        pthread_exit(NULL);
+/**
+ * Charges @param bytes in @param direction to the client address and sleeps while it is
+ * over its rate.  The connection has no deadline meanwhile, its phase is restored after.
+ * @return false if the connection was shut down while throttled
+ */
+static bool client_throttle(struct thread_data *thread_func_args, enum ratelimit_direction direction,
+        size_t bytes)
+{
+    if (thread_func_args->source == NULL) {
+        return true;
+    }
+    uint64_t wait_ns = ratelimit_charge(thread_func_args->limits, thread_func_args->source, direction, bytes);
+    if (wait_ns == 0) {
+        return true;
+    }
+    enum client_phase phase = __atomic_load_n(&thread_func_args->phase, __ATOMIC_RELAXED);
+    client_phase(thread_func_args, CLIENT_BUSY);
+    while (wait_ns > 0 && !__atomic_load_n(&thread_func_args->timed_out, __ATOMIC_ACQUIRE)) {
+        uint64_t slice = wait_ns < THROTTLE_SLICE_NS ? wait_ns : THROTTLE_SLICE_NS;
+        struct timespec ts = { .tv_sec = slice / NS_PER_SEC, .tv_nsec = slice % NS_PER_SEC };
+        nanosleep(&ts, NULL);
+        wait_ns -= slice;
     }
-    char* rwbuffer = (char*)malloc(sizeof(char)*RW_BUFFER_SIZE);
+    client_phase(thread_func_args, phase);
+    return !__atomic_load_n(&thread_func_args->timed_out, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Receives exactly @param len bytes from the client
+ * @return true on success, false on error or if the peer closed the connection first
+ */
+static bool recv_all(struct thread_data *thread_func_args, char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t ret = recv(thread_func_args->client_sockfd, buf, len, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv");
+            return false;
+        }
+        if (ret == 0) {
+            return false;
+        }
+        AESD_PROBE(recv, thread_func_args->client_sockfd, ret);
+        client_activity(thread_func_args);
+        stats_add(STATS_BYTES_IN, ret);
+        buf += ret;
+        len -= ret;
+        if (!client_throttle(thread_func_args, RATELIMIT_INGEST, ret)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Sends the @param len bytes of @param buf to the client
+ * @return true on success
+ */
+static bool send_all(struct thread_data *thread_func_args, const char *buf, size_t len)
+{
+    bool paced = thread_func_args->source != NULL && thread_func_args->limits->rate[RATELIMIT_REPLY] != 0;
+    while (len > 0) {
+        size_t chunk = paced && len > THROTTLE_SEND_CHUNK ? THROTTLE_SEND_CHUNK : len;
+        ssize_t ret = send(thread_func_args->client_sockfd, buf, chunk, MSG_NOSIGNAL);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("send");
+            return false;
+        }
+        client_activity(thread_func_args);
+        stats_add(STATS_BYTES_OUT, ret);
+        buf += ret;
+        len -= ret;
+        if (!client_throttle(thread_func_args, RATELIMIT_REPLY, ret)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Appends one or more complete packets to LOG_FILE through the batched log writer
+ * @return true once the packets are written and visible to replies
+ */
+static bool commit_packet(struct thread_data *thread_func_args, const char *data, size_t len)
+{
+    uint64_t start = stats_now_ns();
+    AESD_PROBE(commit_start, thread_func_args->client_sockfd, len);
+    client_phase(thread_func_args, CLIENT_BUSY);
+    struct client_source *source = thread_func_args->source;
+    bool success = log_writer_append(thread_func_args->writer, source != NULL ? &source->flow : NULL, data, len);
+    uint64_t elapsed = stats_now_ns() - start;
+    AESD_PROBE(commit_done, thread_func_args->client_sockfd, len, success, elapsed);
+    stats_observe(STATS_COMMIT_LATENCY_US, elapsed / 1000);
+    return success;
+}
+
+/**
+ * Sends the full content of LOG_FILE to the client, preceded by a frame header when @param framed,
+ * as a block stream when @param compressed.
+ * Concurrent replies share the same cached snapshot, only new data is read from LOG_FILE.
+ * @return true on success
+ */
+static bool send_log(struct thread_data *thread_func_args, bool framed, bool compressed)
+{
+    uint64_t start = stats_now_ns();
+    struct log_snapshot *snapshot = log_snapshot_get(thread_func_args->snapshots);
+    if (snapshot == NULL) {
+        fprintf(stderr, "Failed to read %s\n", LOG_FILE);
+        syslog(LOG_ERR, "Failed to read %s\n", LOG_FILE);
+        return false;
+    }
+
+    const char *data = snapshot->data;
+    size_t size = snapshot->size;
+    if (compressed) {
+        data = log_snapshot_compressed(snapshot, &size);
+        if (data == NULL) {
+            fprintf(stderr, "Failed to compress %s\n", LOG_FILE);
+            syslog(LOG_ERR, "Failed to compress %s\n", LOG_FILE);
+            log_snapshot_put(snapshot);
+            return false;
+        }
+    }
+
+    printf("Sending %zu bytes\n", size);
+    AESD_PROBE(reply_start, thread_func_args->client_sockfd, size, compressed);
+    client_phase(thread_func_args, CLIENT_WRITING);
+    bool success = true;
+    if (framed) {
+        uint32_t header = htonl((uint32_t)size);
+        success = send_all(thread_func_args, (const char *)&header, sizeof(header));
+    }
+    if (success) {
+        success = send_all(thread_func_args, data, size);
+    }
+    stats_observe(STATS_REPLY_BYTES, size);
+    log_snapshot_put(snapshot);
+    uint64_t elapsed = stats_now_ns() - start;
+    AESD_PROBE(reply_done, thread_func_args->client_sockfd, size, success, elapsed);
+    stats_observe(STATS_REPLY_LATENCY_US, elapsed / 1000);
+    return success;
+}
+
+/**
+ * Newline protocol: scans every received byte for packet boundaries, commits the complete
+ * packets of each receive and replies with the log right after.  The connection is closed once
+ * the received data ends on a packet boundary, otherwise the next packet is read.  A partial packet is
+ * buffered up to AESD_FRAME_MAX_SIZE bytes, past that it is dropped and the connection closed.
+ */
+static void handle_text_client(struct thread_data *thread_func_args)
+{
+    int client_sockfd = thread_func_args->client_sockfd;
+    size_t capacity = RW_BUFFER_SIZE;
+    size_t used = 0;
+    size_t scanned = 0;
+    // starts in a pooled buffer, only packets outgrowing it move to the heap
+    char* rwbuffer = (char*)pool_alloc(&buffer_pool);
     if(rwbuffer == NULL)
     {
-        perror("malloc");
-        pthread_mutex_unlock(mutex);
-        pthread_exit(NULL);
+        perror("pool_alloc");
+        return;
     }
+
     ssize_t bytes_received;
-    while ((bytes_received = recv(client_sockfd, rwbuffer, RW_BUFFER_SIZE, 0)) > 0) {
-        fwrite(rwbuffer, sizeof(char), bytes_received, file);
-        printf("Received %ld bytes\n", bytes_received);
-        fwrite(rwbuffer, sizeof(char), bytes_received, stdout);
-        printf("\n");
-        if(bytes_received > RW_BUFFER_SIZE)
-        {
-            printf("Buffer overflow\n");
-            syslog(LOG_ERR, "Buffer overflow\n");
+    while ((bytes_received = recv(client_sockfd, rwbuffer + used, capacity - used, 0)) != 0) {
+        if (bytes_received == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv");
             break;
         }
-        // char * str = (char*) malloc(bytes_received + 1);
-        // memcpy(str, rwbuffer, bytes_received);
-        // str[bytes_received] = '\0';
-        // syslog(LOG_DEBUG, "%s", str);
-        // free(str);
-        // if line break is received, break the loop
-        if (rwbuffer[bytes_received - 1] == '\n') {
+        printf("Received %ld bytes\n", bytes_received);
+        AESD_PROBE(recv, client_sockfd, bytes_received);
+        stats_add(STATS_BYTES_IN, bytes_received);
+        if (used == 0) {
+            // first bytes of a packet, it must now complete within the read timeout
+            client_phase(thread_func_args, CLIENT_READING);
+        } else {
+            client_activity(thread_func_args);
+        }
+        used += bytes_received;
+        if (!client_throttle(thread_func_args, RATELIMIT_INGEST, bytes_received)) {
             break;
         }
+
+        // find every packet boundary in the new bytes, the newline may be anywhere in the chunk
+        size_t ends[FRAMING_BATCH];
+        size_t packet_end = 0;
+        size_t found;
+        do {
+            found = framing_scan(rwbuffer + scanned, used - scanned, '\n', ends, FRAMING_BATCH);
+            if (found > 0) {
+                stats_add(STATS_PACKETS_RECEIVED, found);
+                scanned += ends[found - 1];
+                packet_end = scanned;
+            }
+        } while (found == FRAMING_BATCH);
+        scanned = used;
+
+        // commit all complete packets at once
+        if (packet_end > 0) {
+            size_t packet_len = packet_end;
+            if (!commit_packet(thread_func_args, rwbuffer, packet_len)) {
+                break;
+            }
+            memmove(rwbuffer, rwbuffer + packet_len, used - packet_len);
+            used -= packet_len;
+            scanned = used;
+            // Return the full content of LOG_FILE to the client as soon as the received data packet completes.
+            if (!send_log(thread_func_args, false, false) || used == 0) {
+                break;
+            }
+            // the rest of the chunk starts the next packet
+            client_phase(thread_func_args, CLIENT_READING);
+        }
+
+        if (used == capacity) {
+            if (capacity >= AESD_FRAME_MAX_SIZE) {
+                // same bound as binary frames, a client never sending a newline cannot exhaust memory
+                fprintf(stderr, "Packet exceeds the maximum size of %d bytes\n", AESD_FRAME_MAX_SIZE);
+                syslog(LOG_ERR, "Packet exceeds the maximum size of %d bytes\n", AESD_FRAME_MAX_SIZE);
+                used = 0;
+                break;
+            }
+            char *grown;
+            if (capacity == RW_BUFFER_SIZE) {
+                grown = malloc(capacity * 2);
+                if (grown != NULL) {
+                    memcpy(grown, rwbuffer, used);
+                    pool_free(&buffer_pool, rwbuffer);
+                }
+            } else {
+                grown = realloc(rwbuffer, capacity * 2);
+            }
+            if (grown == NULL) {
+                perror("realloc");
+                break;
+            }
+            rwbuffer = grown;
+            capacity *= 2;
+        }
     }
-    if (bytes_received == -1) {
-        perror("recv");
+    if (bytes_received == 0 && used > 0 && !__atomic_load_n(&thread_func_args->timed_out, __ATOMIC_ACQUIRE)) {
+        // connection closed in the middle of a packet, keep what was received unless it timed out
+        if (commit_packet(thread_func_args, rwbuffer, used)) {
+            send_log(thread_func_args, false, false);
+        }
     }
-    fclose(file);
-    file = NULL;
-    pthread_mutex_unlock(mutex);
-
-
-    // Return the full content of LOG_FILE to the client as soon as the received data packet completes.
-    int fid = open(LOG_FILE, O_RDONLY);
-    if (fid == -1) {
-        perror("fopen");
-        // free(rwbuffer);
-        pthread_exit(NULL);
-    }
-    
-    // bytes_received = fread(rwbuffer, sizeof(char), RW_BUFFER_SIZE/2, file);
-    printf("Sending %ld bytes\n", bytes_received);
-    printf("sizeof char %ld, buffersize %d\n", sizeof(char), RW_BUFFER_SIZE);
-    while ((bytes_received = read(fid, rwbuffer, RW_BUFFER_SIZE)) > 0) {
-        printf("Sending %ld bytes\n", bytes_received);
-        // fwrite(rwbuffer, sizeof(char), bytes_received, stdout);
-        printf("\n");
-        // char * str = (char*) malloc(bytes_received + 1);
-        // memcpy(str, rwbufferRead, bytes_received);
-        // str[bytes_received] = '\0';
-        // syslog(LOG_DEBUG, "%s\n", str);
-        // free(str);
-
-        if(bytes_received > RW_BUFFER_SIZE)
-        {
-            printf("Buffer overflow\n");
-            syslog(LOG_ERR, "Buffer overflow\n");
+    if (capacity == RW_BUFFER_SIZE) {
+        pool_free(&buffer_pool, rwbuffer);
+    } else {
+        free(rwbuffer);
+    }
+}
+
+/**
+ * Binary protocol, see protocol.h: length prefixed frames received into buffers of the exact size,
+ * each answered with a frame holding the full log, as a block stream when @param compressed.
+ */
+static void handle_binary_client(struct thread_data *thread_func_args, bool compressed)
+{
+    uint32_t header;
+
+    while (1) {
+        client_phase(thread_func_args, CLIENT_IDLE);
+        if (!recv_all(thread_func_args, (char *)&header, sizeof(header))) {
             break;
         }
-        if(send(client_sockfd, rwbuffer, bytes_received, 0) == -1) {
-            perror("send");
+        client_phase(thread_func_args, CLIENT_READING);
+        size_t frame_len = ntohl(header);
+        if (frame_len == 0) {
+            break;
+        }
+        if (frame_len > AESD_FRAME_MAX_SIZE) {
+            fprintf(stderr, "Frame of %zu bytes exceeds the maximum size\n", frame_len);
+            syslog(LOG_ERR, "Frame of %zu bytes exceeds the maximum size\n", frame_len);
+            break;
+        }
+        bool pooled = frame_len <= RW_BUFFER_SIZE;
+        char *frame = pooled ? pool_alloc(&buffer_pool) : malloc(frame_len);
+        if (frame == NULL) {
+            perror("malloc");
+            break;
+        }
+        bool success = recv_all(thread_func_args, frame, frame_len);
+        printf("Received frame of %zu bytes\n", frame_len);
+        if (success) {
+            success = commit_packet(thread_func_args, frame, frame_len);
+        }
+        if (pooled) {
+            pool_free(&buffer_pool, frame);
+        } else {
+            free(frame);
+        }
+        if (!success || !send_log(thread_func_args, true, compressed)) {
             break;
         }
     }
-    if (bytes_received == -1) {
-        perror("fread");
-    }
-    int ret = close(fid);
-    if(ret < 0)
-    {
-        perror("close");
+}
+
+void* handle_client(void* thread_param)
+{
+    struct thread_data* thread_func_args = (struct thread_data *) thread_param;
+    uint64_t session_start = stats_now_ns();
+
+    struct sockaddr_in client_addr = thread_func_args->client_addr;
+    int client_sockfd = thread_func_args->client_sockfd;
+
+
+    char client_ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &(client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+    // Log the message
+    syslog(LOG_DEBUG, "Accepted connection from %s\n", client_ip);
+    printf("Accepted connection from %s\n", client_ip);
+    thread_func_args->source = ratelimit_acquire(thread_func_args->limits, client_addr.sin_addr);
+
+    // The first byte selects the protocol, it is only consumed for the binary mode
+    unsigned char first;
+    ssize_t ret;
+    do {
+        ret = recv(client_sockfd, &first, 1, MSG_PEEK);
+    } while (ret == -1 && errno == EINTR);
+    if (ret == 1 && first == AESD_BINARY_MAGIC) {
+        recv(client_sockfd, &first, 1, 0);
+        syslog(LOG_DEBUG, "Binary protocol selected by %s\n", client_ip);
+        handle_binary_client(thread_func_args, false);
+    } else if (ret == 1 && first == AESD_COMPRESSED_MAGIC) {
+        recv(client_sockfd, &first, 1, 0);
+        syslog(LOG_DEBUG, "Compressed binary protocol selected by %s\n", client_ip);
+        handle_binary_client(thread_func_args, true);
+    } else if (ret == 1) {
+        handle_text_client(thread_func_args);
+    } else if (ret == -1) {
+        perror("recv");
     }
 
-    // Close the connection
-    shutdown(client_sockfd, 2);
+    // Close the connection, the main loop must not shut it down anymore and reaps it once told.
+    // Queuing under the lock makes this the last notification once closed can be seen.
+    lockprof_mutex_lock(&thread_func_args->lock);
+    thread_func_args->closed = true;
+    shutdown(client_sockfd, SHUT_RDWR);
+    close(client_sockfd);
+    client_notify(thread_func_args);
+    lockprof_mutex_unlock(&thread_func_args->lock);
     // Logs message to the syslog “Closed connection from XXX” where XXX is the IP address of the connected client.
     // Log the message
     printf("Closed connection from %s\n", client_ip);
     syslog(LOG_DEBUG, "Closed connection from %s\n", client_ip);
-    
+    if (thread_func_args->source != NULL) {
+        ratelimit_release(thread_func_args->limits, thread_func_args->source);
+    }
+    uint64_t session_ns = stats_now_ns() - session_start;
+    AESD_PROBE(close, client_sockfd, session_ns);
+    stats_add(STATS_CONNECTIONS_CLOSED, 1);
+    stats_observe(STATS_SESSION_LATENCY_US, session_ns / 1000);
 
     thread_func_args->thread_complete_success = true;
-    free(rwbuffer);
     pthread_exit(NULL);
 }
 
+/**
+ * Frees a finished connection, joining its thread
+ */
+static void reap_client(struct thread_list *threads, struct ThreadListNode *threadlistnode)
+{
+    pthread_join(threadlistnode->thread, NULL);
+    TAILQ_REMOVE(threads, threadlistnode, nodes);
+    pthread_mutex_destroy(&threadlistnode->thread_data->lock);
+    pool_free(&connection_pool, threadlistnode);
+}
+
+/**
+ * Shuts the connection of @param threadlistnode down once the deadline of its current phase has
+ * passed, otherwise arms its timer for that deadline, if the phase has one
+ * @return false if the connection thread closed the connection, it is then left to the queue
+ */
+static bool client_check(struct client_timeouts *timeouts, struct ThreadListNode *threadlistnode)
+{
+    struct thread_data *thread_data = threadlistnode->thread_data;
+    uint64_t now = timeouts->now_ns;
+
+    lockprof_mutex_lock(&thread_data->lock);
+    if (thread_data->closed) {
+        lockprof_mutex_unlock(&thread_data->lock);
+        return false;
+    }
+
+    uint64_t deadline = UINT64_MAX;
+    enum stats_counter reason = STATS_TIMEOUTS_IDLE;
+    switch (__atomic_load_n(&thread_data->phase, __ATOMIC_RELAXED)) {
+        case CLIENT_IDLE:
+            if (timeouts->idle_ns != 0) {
+                deadline = __atomic_load_n(&thread_data->last_activity_ns, __ATOMIC_RELAXED)
+                        + timeouts->idle_ns;
+            }
+            break;
+        case CLIENT_READING:
+            if (timeouts->read_ns != 0) {
+                deadline = __atomic_load_n(&thread_data->phase_start_ns, __ATOMIC_RELAXED)
+                        + timeouts->read_ns;
+                reason = STATS_TIMEOUTS_READ;
+            }
+            break;
+        case CLIENT_WRITING:
+            if (timeouts->write_ns != 0) {
+                deadline = __atomic_load_n(&thread_data->last_activity_ns, __ATOMIC_RELAXED)
+                        + timeouts->write_ns;
+                reason = STATS_TIMEOUTS_WRITE;
+            }
+            break;
+    }
+
+    if (now >= deadline) {
+        // wakes up the connection thread, which closes the socket and exits
+        char client_ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(thread_data->client_addr.sin_addr), client_ip, INET_ADDRSTRLEN);
+        syslog(LOG_DEBUG, "Timeout of connection from %s\n", client_ip);
+        printf("Timeout of connection from %s\n", client_ip);
+        __atomic_store_n(&thread_data->timed_out, true, __ATOMIC_RELEASE);
+        shutdown(thread_data->client_sockfd, SHUT_RDWR);
+        stats_add(reason, 1);
+        deadline = UINT64_MAX;
+    }
+    thread_data->armed_deadline_ns = deadline;
+    lockprof_mutex_unlock(&thread_data->lock);
+
+    timer_wheel_cancel(&timeouts->wheel, &threadlistnode->timer);
+    if (deadline != UINT64_MAX) {
+        timer_wheel_schedule(&timeouts->wheel, &threadlistnode->timer, deadline);
+    }
+    return true;
+}
+
+/**
+ * Timer wheel callback of a connection, its deadline may have moved later since it was armed
+ */
+static void client_timer_expired(struct timer_entry *entry, void *context)
+{
+    struct ThreadListNode *threadlistnode = (struct ThreadListNode *)
+            ((char *)entry - offsetof(struct ThreadListNode, timer));
+    client_check((struct client_timeouts *) context, threadlistnode);
+}
+
+/**
+ * Checks the connections queued by their threads, reaping the closed ones
+ */
+static void client_queue_process(struct client_timeouts *timeouts)
+{
+    // reset the eventfd before taking the queue, a push after that wakes the next poll
+    uint64_t count;
+    if (read(timeouts->eventfd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read eventfd");
+    }
+
+    struct pending_list batch;
+    struct ThreadListNode *threadlistnode;
+    lockprof_mutex_lock(&timeouts->queue_lock);
+    STAILQ_INIT(&batch);
+    STAILQ_CONCAT(&batch, &timeouts->pending);
+    lockprof_mutex_unlock(&timeouts->queue_lock);
+
+    while (!STAILQ_EMPTY(&batch)) {
+        // a node may only be queued again once its link is out of the batch
+        lockprof_mutex_lock(&timeouts->queue_lock);
+        threadlistnode = STAILQ_FIRST(&batch);
+        STAILQ_REMOVE_HEAD(&batch, pending);
+        threadlistnode->queued = false;
+        lockprof_mutex_unlock(&timeouts->queue_lock);
+        if (client_check(timeouts, threadlistnode)) {
+            continue;
+        }
+        // closed, its close notification is the last one: reap it unless that one is queued again
+        lockprof_mutex_lock(&timeouts->queue_lock);
+        bool queued = threadlistnode->queued;
+        lockprof_mutex_unlock(&timeouts->queue_lock);
+        if (!queued) {
+            timer_wheel_cancel(&timeouts->wheel, &threadlistnode->timer);
+            reap_client(timeouts->threads, threadlistnode);
+        }
+    }
+}
+
+/**
+ * Graceful shutdown, once the listening socket is closed: connections waiting between
+ * packets are shut down right away, the others may complete their packet and reply for
+ * @param drain_ns, after which, or on a second signal, they are shut down without
+ * committing partial packets.  Returns once every connection thread is reaped.
+ */
+static void drain_clients(struct client_timeouts *timeouts, uint64_t drain_ns)
+{
+    uint64_t deadline = stats_now_ns() + drain_ns;
+    struct pollfd pollfd = { .fd = timeouts->eventfd, .events = POLLIN };
+
+    while (!TAILQ_EMPTY(timeouts->threads)) {
+        bool force = aborted > 1 || stats_now_ns() >= deadline;
+        struct ThreadListNode *threadlistnode = TAILQ_FIRST(timeouts->threads);
+        while (threadlistnode != NULL) {
+            struct ThreadListNode *next = TAILQ_NEXT(threadlistnode, nodes);
+            struct thread_data *thread_data = threadlistnode->thread_data;
+
+            lockprof_mutex_lock(&thread_data->lock);
+            if (!thread_data->closed && !thread_data->timed_out &&
+                    (force || __atomic_load_n(&thread_data->phase, __ATOMIC_RELAXED) == CLIENT_IDLE)) {
+                __atomic_store_n(&thread_data->timed_out, true, __ATOMIC_RELEASE);
+                shutdown(thread_data->client_sockfd, SHUT_RDWR);
+                if (force) {
+                    stats_add(STATS_DRAIN_FORCED, 1);
+                }
+            }
+            lockprof_mutex_unlock(&thread_data->lock);
+            threadlistnode = next;
+        }
+        // closed connections are reaped from the queue
+        if (poll(&pollfd, 1, DRAIN_POLL_MS) > 0) {
+            timeouts->now_ns = stats_now_ns();
+            client_queue_process(timeouts);
+        }
+    }
+}
 
 int main(int argc, char *argv[])
 {
+    bool daemon = false;
+    bool hugepages = false;
+    const char *stats_path = NULL;
+    const char *replication_path = NULL;
+    uint64_t ingest_rate = 0;
+    uint64_t reply_rate = 0;
+    long idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    long read_timeout = DEFAULT_READ_TIMEOUT;
+    long write_timeout = DEFAULT_WRITE_TIMEOUT;
+    long drain_timeout = DEFAULT_DRAIN_TIMEOUT;
+    struct log_segments *segments = NULL;
+#ifndef USE_AESD_CHAR_DEVICE
+    struct log_segments file_segments;
+    struct log_segments_config segments_config;
+    memset(&segments_config, 0, sizeof(segments_config));
+    long timestamp_interval = DEFAULT_TIMESTAMP_INTERVAL;
+    struct timestamp_cache timestamps = { .format = DEFAULT_TIMESTAMP_FORMAT };
+#endif
+
+    int opt;
+    while ((opt = getopt(argc, argv, SERVER_OPTIONS)) != -1) {
+        switch (opt) {
+            case 'd':
+                daemon = true;
+                break;
+            case 'H':
+                hugepages = true;
+                break;
+            case 'm':
+                stats_path = optarg;
+                break;
+            case 'R':
+                replication_path = optarg;
+                break;
+            case 'I':
+                ingest_rate = strtoull(optarg, NULL, 0);
+                break;
+            case 'O':
+                reply_rate = strtoull(optarg, NULL, 0);
+                break;
+            case 'i':
+                idle_timeout = strtol(optarg, NULL, 0);
+                break;
+            case 'r':
+                read_timeout = strtol(optarg, NULL, 0);
+                break;
+            case 'w':
+                write_timeout = strtol(optarg, NULL, 0);
+                break;
+            case 'g':
+                drain_timeout = strtol(optarg, NULL, 0);
+                break;
+#ifndef USE_AESD_CHAR_DEVICE
+            case 's':
+                segments_config.max_segment_size = strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                segments_config.max_segment_age = strtol(optarg, NULL, 0);
+                break;
+            case 'k':
+                segments_config.max_segments = strtoul(optarg, NULL, 0);
+                break;
+            case 'b':
+                segments_config.max_retained_bytes = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                timestamp_interval = strtol(optarg, NULL, 0);
+                break;
+            case 'f':
+                timestamps.format = optarg;
+                break;
+            case 'z':
+                segments_config.compress = true;
+                break;
+#endif
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
     printf("Hello, World!\n");
     // Logs message to the syslog “Accepted connection from xxx” where XXXX is the IP address of the connected client. 
     // Setup syslog logging
@@ -273,11 +990,42 @@ int main(int argc, char *argv[])
     // remove LOG_FILE if exists
     REMOVE_FILE;
 
-    // create a mutex for the log file
-    pthread_mutex_t mutex;
-    if(pthread_mutex_init(&mutex, NULL) != 0) {
-        perror("pthread_mutex_init");
-        return 1; // or appropriate error handling
+    if(stats_init() != 0) {
+        perror("stats_init");
+        return 1;
+    }
+    if(pool_init(&connection_pool, "connections", sizeof(struct client_connection),
+                CONNECTION_SLAB_SIZE, false) != 0 ||
+            pool_init(&buffer_pool, "buffers", RW_BUFFER_SIZE, BUFFER_SLAB_SIZE, hugepages) != 0) {
+        perror("pool_init");
+        return 1;
+    }
+    // per client address bandwidth limits and log writer flows
+    struct ratelimit limits;
+    if(ratelimit_init(&limits, ingest_rate, reply_rate) != 0) {
+        perror("ratelimit_init");
+        return 1;
+    }
+
+#ifndef USE_AESD_CHAR_DEVICE
+    // segment index of the log file, handles rotation and retention
+    if(segments_config.compress && segments_config.max_segment_size == 0 &&
+            segments_config.max_segment_age == 0) {
+        // only sealed segments are compressed, make sure there are some
+        segments_config.max_segment_size = DEFAULT_COMPRESSED_SEGMENT_SIZE;
+    }
+    if(log_segments_init(&file_segments, LOG_FILE, &segments_config) != 0) {
+        perror("log_segments_init");
+        return 1;
+    }
+    segments = &file_segments;
+#endif
+
+    // cache of the log contents shared by client replies
+    struct log_snapshot_cache snapshots;
+    if(log_snapshot_cache_init(&snapshots, LOG_FILE, segments) != 0) {
+        perror("log_snapshot_cache_init");
+        return 1;
     }
 
     //setup sigaction
@@ -290,6 +1038,13 @@ int main(int argc, char *argv[])
         perror("Failed to set signal handler");
         return 1;
     }
+    // a peer that went away must fail the write with EPIPE, not kill the server
+    act.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &act, NULL) == -1)
+    {
+        perror("Failed to ignore SIGPIPE");
+        return 1;
+    }
  
 
     // Open a stream socket bound to port 9000, failing and returning -1 if any of the socket connection steps fail.
@@ -320,49 +1075,142 @@ int main(int argc, char *argv[])
     }
 
     // add argument -d
-    if (argc > 1 && strcmp(argv[1], "-d") == 0)
+    if (daemon)
     {
         demonize();
     }
 
-#ifndef USE_AESD_CHAR_DEVICE
-    struct  sigevent sev;
-    memset(&sev, 0, sizeof(sev));
-    sev.sigev_notify = SIGEV_THREAD;
-    sev.sigev_notify_function = timer_thread;
-    sev.sigev_value.sival_ptr = &mutex;
-    timer_t timer;
-    if(timer_create(CLOCK_MONOTONIC, &sev, &timer) != 0)
-    {
-        perror("timer_create");
+    // threads only from here on, they would not survive the fork above
+    struct replication replication;
+    if (replication_path != NULL) {
+        int ret = replication_start(&replication, replication_path, REPLICATION_BACKLOG_MAX,
+                &snapshots, segments);
+        if (ret != 0) {
+            fprintf(stderr, "replication_start: %s\n", strerror(ret));
+            return 1;
+        }
+    }
+
+    // single writer thread appending client packets and timestamps to the log in batches
+    struct log_writer writer;
+    if(log_writer_start(&writer, LOG_FILE, segments, &snapshots,
+                replication_path != NULL ? &replication : NULL) != 0) {
+        perror("log_writer_start");
         return 1;
     }
-    else
+
+    // the main loop waits on the listening socket, the connection queue and, for the file backend,
+    // the timestamp timerfd
+    struct pollfd pollfds[4];
+    nfds_t npollfds = 1;
+    pollfds[0].fd = sockfd;
+    pollfds[0].events = POLLIN;
+
+    // optional metrics socket, answered from the main loop
+    int stats_sockfd = -1;
+    nfds_t stats_pollidx = 0;
+    if (stats_path != NULL)
+    {
+        stats_sockfd = stats_listen(stats_path);
+        if (stats_sockfd == -1)
+        {
+            return 1;
+        }
+        stats_pollidx = npollfds;
+        pollfds[npollfds].fd = stats_sockfd;
+        pollfds[npollfds].events = POLLIN;
+        npollfds++;
+    }
+
+#ifndef USE_AESD_CHAR_DEVICE
+    int timerfd = -1;
+    nfds_t timer_pollidx = 0;
+    if (timestamp_interval > 0)
     {
-        printf("timer created\n");
+        timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if(timerfd == -1)
+        {
+            perror("timerfd_create");
+            return 1;
+        }
         struct itimerspec timerSpec;
-        timerSpec.it_value.tv_sec = 10;
+        timerSpec.it_value.tv_sec = timestamp_interval;
         timerSpec.it_value.tv_nsec = 0;
-        timerSpec.it_interval.tv_sec = 10;  // Interval for periodicity
+        timerSpec.it_interval.tv_sec = timestamp_interval;  // Interval for periodicity
         timerSpec.it_interval.tv_nsec = 0;
         // Start the timer
-        if(timer_settime(timer, 0, &timerSpec, NULL))
+        if(timerfd_settime(timerfd, 0, &timerSpec, NULL) == -1)
         {
-            perror("timer_settime");
+            perror("timerfd_settime");
             return 1;
         }
+        printf("timer created\n");
+        timer_pollidx = npollfds;
+        pollfds[npollfds].fd = timerfd;
+        pollfds[npollfds].events = POLLIN;
+        npollfds++;
     }
 #endif //USE_AESD_CHAR_DEVICE
 
     // declare the head
-    TAILQ_HEAD(head_s, ThreadListNode) head;
+    struct thread_list head;
     // Initialize the head before use
     TAILQ_INIT(&head);
 
+    // connection deadlines, armed on a timer wheel driven by the poll timeout
+    static struct client_timeouts timeouts;
+    timeouts.idle_ns = idle_timeout > 0 ? idle_timeout * NS_PER_SEC : 0;
+    timeouts.read_ns = read_timeout > 0 ? read_timeout * NS_PER_SEC : 0;
+    timeouts.write_ns = write_timeout > 0 ? write_timeout * NS_PER_SEC : 0;
+    timeouts.threads = &head;
+    timer_wheel_init(&timeouts.wheel, TIMER_WHEEL_TICK_NS, stats_now_ns());
+    pthread_mutex_init(&timeouts.queue_lock, NULL);
+    STAILQ_INIT(&timeouts.pending);
+    timeouts.eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (timeouts.eventfd == -1) {
+        perror("eventfd");
+        return 1;
+    }
+    nfds_t queue_pollidx = npollfds;
+    pollfds[npollfds].fd = timeouts.eventfd;
+    pollfds[npollfds].events = POLLIN;
+    npollfds++;
+
     while(!aborted)
     {
         struct ThreadListNode * threadlistnode;
 
+        int ret = poll(pollfds, npollfds, timer_wheel_timeout_ms(&timeouts.wheel, stats_now_ns()));
+        if (ret == -1) {
+            if (errno == EINTR) {
+                // Interrupted by signal
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+
+        timeouts.now_ns = stats_now_ns();
+        timer_wheel_advance(&timeouts.wheel, timeouts.now_ns, client_timer_expired, &timeouts);
+        if (ret == 0) {
+            continue;
+        }
+        if (pollfds[queue_pollidx].revents & POLLIN) {
+            client_queue_process(&timeouts);
+        }
+
+#ifndef USE_AESD_CHAR_DEVICE
+        if (timerfd != -1 && (pollfds[timer_pollidx].revents & POLLIN)) {
+            timestamp_tick(timerfd, &timestamps, &writer);
+        }
+#endif
+        if (stats_sockfd != -1 && (pollfds[stats_pollidx].revents & POLLIN)) {
+            stats_serve(stats_sockfd, sockfd);
+        }
+        if (!(pollfds[0].revents & POLLIN)) {
+            continue;
+        }
+
         // Listens for and accepts a connection
         struct sockaddr_in client_addr;
         socklen_t client_addr_len = sizeof(client_addr);
@@ -374,65 +1222,100 @@ int main(int argc, char *argv[])
             }
 
             perror("accept");
+            stats_add(STATS_ACCEPT_ERRORS, 1);
             return -1;
         }
+        stats_add(STATS_CONNECTIONS_ACCEPTED, 1);
+        AESD_PROBE(accept, client_sockfd, client_addr.sin_addr.s_addr);
 
-        // create a new threadlistnode
-        threadlistnode = malloc(sizeof(struct ThreadListNode));
-        if (threadlistnode == NULL)
+        // create a new threadlistnode and its thread data from the connection pool
+        struct client_connection *connection = pool_alloc(&connection_pool);
+        if (connection == NULL)
         {
-            fprintf(stderr, "malloc failed");
-            syslog(LOG_ERR, "malloc failed");
+            fprintf(stderr, "pool_alloc failed");
+            syslog(LOG_ERR, "pool_alloc failed");
             break;
         }
+        threadlistnode = &connection->node;
 
         // create a new thread to handle the client
-        struct thread_data * thread_data = malloc(sizeof(struct thread_data));
-        if (thread_data == NULL)
-        {
-            fprintf(stderr, "malloc failed");
-            syslog(LOG_ERR, "malloc failed");
-            free(threadlistnode);
-            break;
-        }
-        thread_data->mutex = &mutex;
+        struct thread_data * thread_data = &connection->data;
+        thread_data->writer = &writer;
+        thread_data->snapshots = &snapshots;
+        thread_data->limits = &limits;
         thread_data->client_addr = client_addr;
         thread_data->client_sockfd = client_sockfd;
         thread_data->thread_complete_success = false;
+        uint64_t now = stats_now_ns();
+        thread_data->phase = CLIENT_IDLE;
+        thread_data->phase_start_ns = now;
+        thread_data->last_activity_ns = now;
+        pthread_mutex_init(&thread_data->lock, NULL);
+        thread_data->closed = false;
+        thread_data->timed_out = false;
+        thread_data->timeouts = &timeouts;
+        thread_data->armed_deadline_ns = timeouts.idle_ns != 0 ? now + timeouts.idle_ns : UINT64_MAX;
         threadlistnode->thread_data = thread_data;
+        threadlistnode->timer.next = NULL;
+        threadlistnode->queued = false;
 
         if(pthread_create(&(threadlistnode->thread), NULL, (void *(*)(void *))handle_client, (void *) thread_data) != 0)
         {
             fprintf(stderr, "pthread_create failed");
             syslog(LOG_ERR, "pthread_create failed");
-            free(threadlistnode->thread_data);
-            free(threadlistnode);
+            pthread_mutex_destroy(&threadlistnode->thread_data->lock);
+            pool_free(&connection_pool, connection);
             break;
         }
 
         //add the thread to the list
         TAILQ_INSERT_TAIL(&head, threadlistnode, nodes);
+        if (thread_data->armed_deadline_ns != UINT64_MAX) {
+            timer_wheel_schedule(&timeouts.wheel, &threadlistnode->timer, thread_data->armed_deadline_ns);
+        }
         threadlistnode = NULL;
         
     }
 
-    printf("Cleaning up\n");
-    // Clean up the threads
-    struct ThreadListNode * threadlistnode = NULL;
-    while (!TAILQ_EMPTY(&head))
-    {
-        threadlistnode = TAILQ_FIRST(&head);
-        pthread_join(threadlistnode->thread, NULL);
-        TAILQ_REMOVE(&head, threadlistnode, nodes);
-        free(threadlistnode->thread_data);
-        free(threadlistnode);
-        threadlistnode = NULL;
+    if (caught_signal != 0) {
+        printf("Received SIGINT or SIGTERM (%d)\n", (int)caught_signal);
+        syslog(LOG_DEBUG, "Caught signal %d, exiting\n", (int)caught_signal);
     }
-    
+
+    // Stop accepting, new connections are refused while the current ones drain
+    close(sockfd);
+    printf("Draining %s connections\n", TAILQ_EMPTY(&head) ? "no" : "active");
+    drain_clients(&timeouts, drain_timeout > 0 ? drain_timeout * NS_PER_SEC : 0);
+    close(timeouts.eventfd);
+    pthread_mutex_destroy(&timeouts.queue_lock);
+
+    printf("Cleaning up\n");
+
     #ifndef USE_AESD_CHAR_DEVICE
-    timer_delete(timer);
+    if (timerfd != -1) {
+        close(timerfd);
+    }
     #endif
 
+    if (stats_sockfd != -1) {
+        close(stats_sockfd);
+        unlink(stats_path);
+    }
+
+    // every packet is queued by now, flush them before the log goes away
+    log_writer_stop(&writer);
+    if (replication_path != NULL) {
+        replication_stop(&replication);
+    }
+    pool_destroy(&buffer_pool);
+    pool_destroy(&connection_pool);
+    ratelimit_destroy(&limits);
+    log_snapshot_cache_destroy(&snapshots);
+    if (segments != NULL) {
+        log_segments_destroy(segments, true);
+    }
+    REMOVE_FILE;
+
     // Clean up syslog
     closelog();
 
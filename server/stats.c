@@ -0,0 +1,329 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "stats.h"
+#include "percpu.h"
+#include "pool.h"
+#include "replication.h"
+#include "ratelimit.h"
+#include "lockprof.h"
+
+struct stats_shard
+{
+    uint64_t counters[STATS_COUNTER_MAX];
+    uint64_t histograms[STATS_HISTOGRAM_MAX][STATS_HISTOGRAM_BUCKETS];
+    uint64_t histogram_sums[STATS_HISTOGRAM_MAX];
+} __attribute__((aligned(PERCPU_CACHE_LINE)));
+
+/**
+ * How long a stats client gets to read the report before it is cut off
+ */
+#define STATS_SEND_TIMEOUT_MS 200
+
+static const char *counter_names[STATS_COUNTER_MAX] = {
+    [STATS_CONNECTIONS_ACCEPTED] = "connections_total",
+    [STATS_CONNECTIONS_CLOSED] = "connections_closed",
+    [STATS_ACCEPT_ERRORS] = "accept_errors",
+    [STATS_BYTES_IN] = "bytes_in",
+    [STATS_BYTES_OUT] = "bytes_out",
+    [STATS_PACKETS_RECEIVED] = "packets_received",
+    [STATS_PACKETS_COMMITTED] = "packets_committed",
+    [STATS_BATCHES_COMMITTED] = "batches_committed",
+    [STATS_LOCK_ACQUISITIONS] = "lock_acquisitions",
+    [STATS_LOCK_WAIT_NS] = "lock_wait_ns",
+    [STATS_TIMEOUTS_IDLE] = "timeouts_idle",
+    [STATS_TIMEOUTS_READ] = "timeouts_read",
+    [STATS_TIMEOUTS_WRITE] = "timeouts_write",
+    [STATS_DRAIN_FORCED] = "drain_forced",
+};
+
+static const char *histogram_names[STATS_HISTOGRAM_MAX] = {
+    [STATS_REPLY_BYTES] = "reply_bytes",
+    [STATS_COMMIT_LATENCY_US] = "commit_latency_us",
+    [STATS_REPLY_LATENCY_US] = "reply_latency_us",
+    [STATS_SESSION_LATENCY_US] = "session_latency_us",
+};
+
+/**
+ * One shard per CPU, allocated once by stats_init, updated with relaxed atomic adds
+ * since threads on the same CPU, or migrating off it, may share a shard
+ */
+static struct stats_shard *shards;
+static int shard_count;
+
+static uint64_t load(const uint64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+static void bump(uint64_t *value, uint64_t delta)
+{
+    __atomic_fetch_add(value, delta, __ATOMIC_RELAXED);
+}
+
+static struct stats_shard *stats_shard_get(void)
+{
+    return shards != NULL ? &shards[percpu_current(shard_count)] : NULL;
+}
+
+int stats_init(void)
+{
+    int count = percpu_count();
+    void *memory;
+    int ret = posix_memalign(&memory, PERCPU_CACHE_LINE, count * sizeof(struct stats_shard));
+    if(ret != 0)
+    {
+        errno = ret;
+        return ret;
+    }
+    memset(memory, 0, count * sizeof(struct stats_shard));
+    shards = memory;
+    shard_count = count;
+    return 0;
+}
+
+void stats_add(enum stats_counter counter, uint64_t value)
+{
+    struct stats_shard *shard = stats_shard_get();
+    if(shard != NULL)
+    {
+        bump(&shard->counters[counter], value);
+    }
+}
+
+void stats_observe(enum stats_histogram histogram, uint64_t value)
+{
+    struct stats_shard *shard = stats_shard_get();
+    if(shard != NULL)
+    {
+        int bucket = value == 0 ? 0 : 64 - __builtin_clzll(value);
+        if(bucket >= STATS_HISTOGRAM_BUCKETS)
+        {
+            bucket = STATS_HISTOGRAM_BUCKETS - 1;
+        }
+        bump(&shard->histograms[histogram][bucket], 1);
+        bump(&shard->histogram_sums[histogram], value);
+    }
+}
+
+void stats_lock_acquired(uint64_t start_ns)
+{
+    struct stats_shard *shard = stats_shard_get();
+    if(shard != NULL)
+    {
+        bump(&shard->counters[STATS_LOCK_ACQUISITIONS], 1);
+        bump(&shard->counters[STATS_LOCK_WAIT_NS], stats_now_ns() - start_ns);
+    }
+}
+
+int stats_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    if(strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "Stats socket path too long: %s\n", path);
+        return -1;
+    }
+    int sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sockfd == -1)
+    {
+        perror("socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    if(bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sockfd, 4) == -1)
+    {
+        perror(path);
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/**
+ * Reads the host wide TcpExt ListenOverflows and ListenDrops counters
+ */
+static void read_listen_drops(uint64_t *overflows, uint64_t *drops)
+{
+    *overflows = 0;
+    *drops = 0;
+    FILE *file = fopen("/proc/net/netstat", "r");
+    if(file == NULL)
+    {
+        return;
+    }
+    char names[4096];
+    char values[4096];
+    while(fgets(names, sizeof(names), file) != NULL && fgets(values, sizeof(values), file) != NULL)
+    {
+        if(strncmp(names, "TcpExt:", 7) != 0)
+        {
+            continue;
+        }
+        char *name_save, *value_save;
+        char *name = strtok_r(names, " \n", &name_save);
+        char *value = strtok_r(values, " \n", &value_save);
+        while(name != NULL && value != NULL)
+        {
+            if(strcmp(name, "ListenOverflows") == 0)
+            {
+                *overflows = strtoull(value, NULL, 10);
+            }
+            else if(strcmp(name, "ListenDrops") == 0)
+            {
+                *drops = strtoull(value, NULL, 10);
+            }
+            name = strtok_r(NULL, " \n", &name_save);
+            value = strtok_r(NULL, " \n", &value_save);
+        }
+        break;
+    }
+    fclose(file);
+}
+
+/**
+ * Sends @param len bytes of @param buf to the non blocking @param clientfd, giving up
+ * after STATS_SEND_TIMEOUT_MS so a client that does not read cannot stall the caller
+ */
+static void send_report(int clientfd, const char *buf, size_t len)
+{
+    uint64_t deadline = stats_now_ns() + STATS_SEND_TIMEOUT_MS * 1000000ULL;
+    while(len > 0)
+    {
+        ssize_t ret = send(clientfd, buf, len, MSG_NOSIGNAL);
+        if(ret > 0)
+        {
+            buf += ret;
+            len -= ret;
+            continue;
+        }
+        if(ret == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            uint64_t now = stats_now_ns();
+            if(now >= deadline)
+            {
+                syslog(LOG_WARNING, "Stats client not reading, report truncated");
+                return;
+            }
+            struct pollfd pollfd = { .fd = clientfd, .events = POLLOUT };
+            poll(&pollfd, 1, (int)((deadline - now + 999999) / 1000000));
+            continue;
+        }
+        // EPIPE or ECONNRESET, the client is gone
+        return;
+    }
+}
+
+void stats_serve(int stats_sockfd, int data_sockfd)
+{
+    int clientfd = accept4(stats_sockfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(clientfd == -1)
+    {
+        perror("accept stats");
+        return;
+    }
+    // the report is built in memory first, the client only gets what it reads in time
+    char *report = NULL;
+    size_t report_len = 0;
+    FILE *out = open_memstream(&report, &report_len);
+    if(out == NULL)
+    {
+        perror("open_memstream");
+        close(clientfd);
+        return;
+    }
+
+    struct stats_shard sum;
+    struct stats_shard *total = &sum;
+    memset(total, 0, sizeof(sum));
+    int i, j, k;
+    for(k = 0; k < shard_count; k++)
+    {
+        for(i = 0; i < STATS_COUNTER_MAX; i++)
+        {
+            total->counters[i] += load(&shards[k].counters[i]);
+        }
+        for(i = 0; i < STATS_HISTOGRAM_MAX; i++)
+        {
+            total->histogram_sums[i] += load(&shards[k].histogram_sums[i]);
+            for(j = 0; j < STATS_HISTOGRAM_BUCKETS; j++)
+            {
+                total->histograms[i][j] += load(&shards[k].histograms[i][j]);
+            }
+        }
+    }
+
+    fprintf(out, "connections_active %llu\n", (unsigned long long)
+            (total->counters[STATS_CONNECTIONS_ACCEPTED] - total->counters[STATS_CONNECTIONS_CLOSED]));
+    for(i = 0; i < STATS_COUNTER_MAX; i++)
+    {
+        fprintf(out, "%s %llu\n", counter_names[i], (unsigned long long)total->counters[i]);
+    }
+
+    struct tcp_info info;
+    socklen_t info_len = sizeof(info);
+    if(getsockopt(data_sockfd, IPPROTO_TCP, TCP_INFO, &info, &info_len) == 0)
+    {
+        /* For a listening socket these hold the current and maximum accept queue length */
+        fprintf(out, "accept_queue_length %u\n", info.tcpi_unacked);
+        fprintf(out, "accept_queue_max %u\n", info.tcpi_sacked);
+    }
+    uint64_t overflows, drops;
+    read_listen_drops(&overflows, &drops);
+    fprintf(out, "host_listen_overflows %llu\n", (unsigned long long)overflows);
+    fprintf(out, "host_listen_drops %llu\n", (unsigned long long)drops);
+
+    pool_report(out);
+    replication_report(out);
+    ratelimit_report(out);
+    lockprof_report(out);
+
+    /* Cumulative buckets up to the highest non empty one, the last one has no upper bound and is always +Inf */
+    for(i = 0; i < STATS_HISTOGRAM_MAX; i++)
+    {
+        int last = -1;
+        for(j = 0; j < STATS_HISTOGRAM_BUCKETS; j++)
+        {
+            if(total->histograms[i][j] != 0)
+            {
+                last = j;
+            }
+        }
+        uint64_t cumulative = 0;
+        for(j = 0; j <= last && j < STATS_HISTOGRAM_BUCKETS - 1; j++)
+        {
+            cumulative += total->histograms[i][j];
+            fprintf(out, "%s_bucket{le=\"%llu\"} %llu\n", histogram_names[i],
+                    j == 0 ? 0ULL : (1ULL << j) - 1, (unsigned long long)cumulative);
+        }
+        cumulative += total->histograms[i][STATS_HISTOGRAM_BUCKETS - 1];
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", histogram_names[i], (unsigned long long)cumulative);
+        fprintf(out, "%s_sum %llu\n", histogram_names[i], (unsigned long long)total->histogram_sums[i]);
+        fprintf(out, "%s_count %llu\n", histogram_names[i], (unsigned long long)cumulative);
+    }
+
+    if(fclose(out) == 0)
+    {
+        send_report(clientfd, report, report_len);
+    }
+    free(report);
+    close(clientfd);
+}
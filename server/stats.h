@@ -0,0 +1,91 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Runtime metrics of aesdsocket.
+ *
+ * Counters and histograms are sharded per CPU (percpu.h): a thread updates the
+ * shard of the CPU it runs on with a relaxed atomic add, so connection threads
+ * neither allocate nor register anything and no lock is taken on the data path.
+ * A report sums all shards.
+ */
+
+enum stats_counter
+{
+    STATS_CONNECTIONS_ACCEPTED,
+    STATS_CONNECTIONS_CLOSED,
+    STATS_ACCEPT_ERRORS,
+    STATS_BYTES_IN,
+    STATS_BYTES_OUT,
+    STATS_PACKETS_RECEIVED,
+    STATS_PACKETS_COMMITTED,
+    STATS_BATCHES_COMMITTED,
+    STATS_LOCK_ACQUISITIONS,
+    STATS_LOCK_WAIT_NS,
+    STATS_TIMEOUTS_IDLE,
+    STATS_TIMEOUTS_READ,
+    STATS_TIMEOUTS_WRITE,
+    STATS_DRAIN_FORCED,
+    STATS_COUNTER_MAX
+};
+
+enum stats_histogram
+{
+    STATS_REPLY_BYTES,
+    STATS_COMMIT_LATENCY_US,
+    STATS_REPLY_LATENCY_US,
+    STATS_SESSION_LATENCY_US,
+    STATS_HISTOGRAM_MAX
+};
+
+/**
+ * Histogram bucket i counts values v with 2^(i-1) <= v < 2^i, bucket 0 counts v == 0, the
+ * last one everything from 2^38 up and is reported as le="+Inf"
+ */
+#define STATS_HISTOGRAM_BUCKETS 40
+
+static inline uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Allocates the per CPU shards, must be called before any other thread starts
+ * @return 0 on success, an errno value otherwise
+ */
+int stats_init(void);
+
+/**
+ * Adds @param value to @param counter in the current CPU's shard
+ */
+void stats_add(enum stats_counter counter, uint64_t value);
+
+/**
+ * Records @param value in @param histogram in the current CPU's shard
+ */
+void stats_observe(enum stats_histogram histogram, uint64_t value);
+
+/**
+ * Accounts the time spent waiting for a lock, from @param start_ns (stats_now_ns) to now
+ */
+void stats_lock_acquired(uint64_t start_ns);
+
+/**
+ * Opens a Unix stream socket listening at @param path, any stale socket file is replaced
+ * @return the listening descriptor, -1 on error
+ */
+int stats_listen(const char *path);
+
+/**
+ * Accepts one client on @param stats_sockfd and sends it the aggregated report, built
+ * in memory and sent without blocking for more than a short deadline.
+ * @param data_sockfd is the listening data socket, used to report its accept queue.
+ */
+void stats_serve(int stats_sockfd, int data_sockfd);
+
+#endif /* STATS_H */
@@ -1,7 +1,25 @@
 #include <stdbool.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <netinet/in.h>
 
+#include "log_snapshot.h"
+#include "log_writer.h"
+#include "ratelimit.h"
+
+struct client_timeouts;
+
+/**
+ * What a connection thread is waiting for, selects the deadline the main loop enforces
+ */
+enum client_phase
+{
+    CLIENT_IDLE,        // waiting for the first byte of a packet
+    CLIENT_READING,     // in the middle of a packet
+    CLIENT_WRITING,     // sending a reply
+    CLIENT_BUSY         // waiting on the server, no deadline
+};
+
 /**
  * This structure should be dynamically allocated and passed as
  * an argument to your thread using pthread_create.
@@ -10,10 +28,46 @@
  */
 struct thread_data{
 
-    pthread_mutex_t *mutex;
+    struct log_writer *writer;
+    struct log_snapshot_cache *snapshots;
     struct sockaddr_in client_addr;
-    socklen_t client_sockfd;
-    
+    int client_sockfd;
+    struct ratelimit *limits;
+    /**
+     * State of the client address, NULL if it could not be allocated
+     */
+    struct client_source *source;
+
+    /**
+     * Timeout state, written by the connection thread and read by the main loop
+     * with atomic loads.  Times are stats_now_ns() values.
+     */
+    int phase;
+    uint64_t phase_start_ns;
+    uint64_t last_activity_ns;
+    /**
+     * Timeouts of the phases and the queue of the main loop, which is told about
+     * phase changes bringing the deadline before armed_deadline_ns and about the close
+     */
+    struct client_timeouts *timeouts;
+    /**
+     * Deadline the main loop armed the connection's timer for, UINT64_MAX if none,
+     * guarded by lock
+     */
+    uint64_t armed_deadline_ns;
+
+    /**
+     * Serializes closing client_sockfd with a timeout shutdown from the main loop,
+     * which must never hit a descriptor number reused after the close.
+     */
+    pthread_mutex_t lock;
+    bool closed;
+    /**
+     * Set by the main loop when it shut the connection down on a deadline or
+     * while draining, a partial packet is then dropped instead of committed
+     */
+    bool timed_out;
+
 
     /**
      * Set to true if the thread completed with success, false
@@ -0,0 +1,127 @@
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static void timer_list_init(struct timer_entry *head)
+{
+    head->prev = head;
+    head->next = head;
+}
+
+static void timer_list_insert(struct timer_entry *head, struct timer_entry *entry)
+{
+    entry->prev = head->prev;
+    entry->next = head;
+    head->prev->next = entry;
+    head->prev = entry;
+}
+
+static void timer_list_remove(struct timer_entry *entry)
+{
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t tick_ns, uint64_t now_ns)
+{
+    int i;
+    for(i = 0; i < TIMER_WHEEL_SLOTS; i++)
+    {
+        timer_list_init(&wheel->slots[i]);
+    }
+    wheel->tick_ns = tick_ns;
+    wheel->start_ns = now_ns;
+    wheel->current_tick = 0;
+    wheel->count = 0;
+}
+
+void timer_wheel_schedule(struct timer_wheel *wheel, struct timer_entry *entry, uint64_t expires_ns)
+{
+    uint64_t tick = 0;
+    if(expires_ns > wheel->start_ns)
+    {
+        /* Round up, an entry never fires before its deadline */
+        tick = (expires_ns - wheel->start_ns + wheel->tick_ns - 1) / wheel->tick_ns;
+    }
+    if(tick <= wheel->current_tick)
+    {
+        tick = wheel->current_tick + 1;
+    }
+    entry->expires_tick = tick;
+    timer_list_insert(&wheel->slots[tick & TIMER_WHEEL_MASK], entry);
+    wheel->count++;
+}
+
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer_entry *entry)
+{
+    if(timer_entry_armed(entry))
+    {
+        timer_list_remove(entry);
+        wheel->count--;
+    }
+}
+
+int timer_wheel_timeout_ms(const struct timer_wheel *wheel, uint64_t now_ns)
+{
+    if(wheel->count == 0)
+    {
+        return -1;
+    }
+    uint64_t next_ns = wheel->start_ns + (wheel->current_tick + 1) * wheel->tick_ns;
+    if(next_ns <= now_ns)
+    {
+        return 0;
+    }
+    return (int)((next_ns - now_ns + 999999) / 1000000);
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ns, timer_wheel_callback callback,
+            void *context)
+{
+    if(now_ns < wheel->start_ns)
+    {
+        return;
+    }
+    uint64_t target = (now_ns - wheel->start_ns) / wheel->tick_ns;
+    /* After a long stall every bucket is visited once, comparing against the target tick */
+    uint64_t tick = wheel->current_tick;
+    if(target - tick > TIMER_WHEEL_SLOTS)
+    {
+        tick = target - TIMER_WHEEL_SLOTS;
+    }
+
+    while(tick < target)
+    {
+        tick++;
+        struct timer_entry *head = &wheel->slots[tick & TIMER_WHEEL_MASK];
+        if(head->next == head)
+        {
+            continue;
+        }
+        /* Detach the bucket first, callbacks may schedule entries back into it */
+        struct timer_entry pending;
+        pending.next = head->next;
+        pending.prev = head->prev;
+        pending.next->prev = &pending;
+        pending.prev->next = &pending;
+        timer_list_init(head);
+        wheel->current_tick = tick;
+
+        while(pending.next != &pending)
+        {
+            struct timer_entry *entry = pending.next;
+            timer_list_remove(entry);
+            if(entry->expires_tick > target)
+            {
+                /* Due in a later round */
+                timer_list_insert(head, entry);
+                continue;
+            }
+            wheel->count--;
+            callback(entry, context);
+        }
+    }
+    wheel->current_tick = target;
+}
@@ -0,0 +1,80 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/**
+ * Hashed timer wheel: TIMER_WHEEL_SLOTS buckets of tick_ns each, an entry goes
+ * in the bucket of its expiry tick modulo the wheel size and is only fired once
+ * that absolute tick is reached, so deadlines further than one revolution just
+ * stay in their bucket for more rounds.  Scheduling and cancelling are O(1),
+ * advancing one tick only visits one bucket.
+ *
+ * Not thread safe, owned by the server main loop.
+ */
+
+#define TIMER_WHEEL_SLOTS 1024
+
+struct timer_entry
+{
+    struct timer_entry *prev;
+    struct timer_entry *next;
+    uint64_t expires_tick;
+};
+
+struct timer_wheel
+{
+    /**
+     * Sentinel heads of the circular bucket lists
+     */
+    struct timer_entry slots[TIMER_WHEEL_SLOTS];
+    uint64_t tick_ns;
+    uint64_t start_ns;
+    /**
+     * Last tick processed by timer_wheel_advance
+     */
+    uint64_t current_tick;
+    size_t count;
+};
+
+typedef void (*timer_wheel_callback)(struct timer_entry *entry, void *context);
+
+/**
+ * Initializes an empty wheel with @param tick_ns granularity, starting at @param now_ns
+ */
+void timer_wheel_init(struct timer_wheel *wheel, uint64_t tick_ns, uint64_t now_ns);
+
+/**
+ * Arms @param entry to fire at @param expires_ns or the first tick after it.
+ * The entry must not be armed already.
+ */
+void timer_wheel_schedule(struct timer_wheel *wheel, struct timer_entry *entry, uint64_t expires_ns);
+
+/**
+ * Disarms @param entry if it is armed
+ */
+void timer_wheel_cancel(struct timer_wheel *wheel, struct timer_entry *entry);
+
+/**
+ * @return true if @param entry is armed
+ */
+static inline bool timer_entry_armed(const struct timer_entry *entry)
+{
+    return entry->next != NULL;
+}
+
+/**
+ * @return milliseconds until the next tick to process, -1 if the wheel is empty
+ */
+int timer_wheel_timeout_ms(const struct timer_wheel *wheel, uint64_t now_ns);
+
+/**
+ * Processes all ticks up to @param now_ns, calling @param callback for each expired
+ * entry after disarming it.  The callback may schedule the entry again.
+ */
+void timer_wheel_advance(struct timer_wheel *wheel, uint64_t now_ns, timer_wheel_callback callback,
+            void *context);
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,130 @@
+#include "unity.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../finder-app/search.h"
+
+/**
+* Checks search_count_lines against a naive line by line count, for every implementation the CPU
+* supports, on random text of every length up to a few AVX2 blocks (so every tail length of the
+* 16, 32 and 64 byte block loops is covered) at every alignment of a word.
+*/
+
+#define MAX_LEN 300
+#define MAX_SHIFT 8
+
+static const char *impl_names[] = { "avx2", "sse2", "scalar" };
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Random bytes over a small alphabet so that matches, near misses and newlines are all frequent
+static void random_text(char *buf, size_t len, const char *alphabet)
+{
+    size_t i;
+    size_t count = strlen(alphabet);
+    for (i = 0; i < len; i++) {
+        buf[i] = alphabet[rng_next() % count];
+    }
+}
+
+static unsigned long naive_count_lines(const char *needle, size_t needle_len, const char *data, size_t len)
+{
+    unsigned long lines = 0;
+    size_t start = 0;
+    while (start < len) {
+        size_t end = start;
+        while (end < len && data[end] != '\n') {
+            end++;
+        }
+        size_t i;
+        for (i = start; i + needle_len <= end; i++) {
+            if (memcmp(data + i, needle, needle_len) == 0) {
+                lines++;
+                break;
+            }
+        }
+        start = end + 1;
+    }
+    return lines;
+}
+
+static void check_needle(const char *needle, const char *alphabet)
+{
+    static char buf[MAX_LEN + MAX_SHIFT];
+    char message[128];
+    struct search search;
+    size_t len, shift, i;
+    search_init(&search, needle, strlen(needle));
+
+    for (i = 0; i < sizeof(impl_names) / sizeof(impl_names[0]); i++) {
+        if (search_select(impl_names[i]) != 0) {
+            continue;
+        }
+        for (len = 0; len <= MAX_LEN; len++) {
+            for (shift = 0; shift < MAX_SHIFT; shift++) {
+                random_text(buf + shift, len, alphabet);
+                snprintf(message, sizeof(message), "%s, needle \"%s\", len %zu, shift %zu", impl_names[i],
+                        needle, len, shift);
+                TEST_ASSERT_EQUAL_UINT64_MESSAGE(naive_count_lines(needle, strlen(needle), buf + shift, len),
+                        search_count_lines(&search, buf + shift, len), message);
+            }
+        }
+    }
+}
+
+void test_search_single_byte()
+{
+    check_needle("a", "ab\n");
+}
+
+void test_search_two_bytes()
+{
+    check_needle("ab", "abc\n");
+}
+
+void test_search_repeated_bytes()
+{
+    check_needle("aaa", "ab\n");
+}
+
+void test_search_long_needle()
+{
+    // longer than an SSE2 block, so the last byte compare reaches into the next block
+    check_needle("abacabadabacabab", "abcd\n");
+}
+
+void test_search_empty_needle()
+{
+    check_needle("", "a\n");
+}
+
+void test_search_matches_across_blocks()
+{
+    // a match straddling every block boundary, on one long line and on one line per match
+    static char buf[MAX_LEN];
+    struct search search;
+    size_t offset, i;
+    search_init(&search, "needle", 6);
+    for (i = 0; i < sizeof(impl_names) / sizeof(impl_names[0]); i++) {
+        if (search_select(impl_names[i]) != 0) {
+            continue;
+        }
+        for (offset = 0; offset + 6 <= sizeof(buf); offset++) {
+            memset(buf, 'x', sizeof(buf));
+            memcpy(buf + offset, "needle", 6);
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(1, search_count_lines(&search, buf, sizeof(buf)), impl_names[i]);
+            if (offset > 0) {
+                buf[offset - 1] = '\n';
+            }
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(1, search_count_lines(&search, buf, sizeof(buf)), impl_names[i]);
+        }
+    }
+}
@@ -0,0 +1,127 @@
+#include "unity.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../server/framing.h"
+
+/**
+* Checks framing_scan against a naive byte loop, for every implementation the CPU supports,
+* on random buffers of every length up to a few AVX2 blocks at every alignment of a word,
+* and with room for fewer offsets than there are delimiters.
+*/
+
+#define MAX_LEN 300
+#define MAX_SHIFT 8
+
+static const char *impl_names[] = { "avx2", "sse2", "scalar" };
+
+static uint64_t rng_state = 0x243f6a8885a308d3ULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Random bytes, one in @param one_in of them the delimiter
+static void random_buffer(char *buf, size_t len, char delim, unsigned one_in)
+{
+    size_t i;
+    for (i = 0; i < len; i++) {
+        char c = (char)rng_next();
+        buf[i] = rng_next() % one_in == 0 ? delim : (c == delim ? c + 1 : c);
+    }
+}
+
+static size_t naive_scan(const char *buf, size_t len, char delim, size_t *ends, size_t max)
+{
+    size_t count = 0;
+    size_t i;
+    for (i = 0; i < len && count < max; i++) {
+        if (buf[i] == delim) {
+            ends[count++] = i + 1;
+        }
+    }
+    return count;
+}
+
+static void check_scan(char delim, unsigned one_in)
+{
+    static char buf[MAX_LEN + MAX_SHIFT];
+    size_t expected[MAX_LEN];
+    size_t ends[MAX_LEN];
+    char message[128];
+    size_t len, shift, i;
+
+    for (i = 0; i < sizeof(impl_names) / sizeof(impl_names[0]); i++) {
+        if (framing_select(impl_names[i]) != 0) {
+            continue;
+        }
+        for (len = 0; len <= MAX_LEN; len++) {
+            for (shift = 0; shift < MAX_SHIFT; shift++) {
+                random_buffer(buf + shift, len, delim, one_in);
+                snprintf(message, sizeof(message), "%s, delim 0x%02x, len %zu, shift %zu", impl_names[i],
+                        (unsigned char)delim, len, shift);
+                size_t count = naive_scan(buf + shift, len, delim, expected, MAX_LEN);
+                TEST_ASSERT_EQUAL_UINT64_MESSAGE(count, framing_scan(buf + shift, len, delim, ends, MAX_LEN),
+                        message);
+                if (count > 0) {
+                    TEST_ASSERT_EQUAL_UINT64_ARRAY_MESSAGE(expected, ends, count, message);
+                }
+            }
+        }
+    }
+}
+
+void test_framing_newlines()
+{
+    check_scan('\n', 8);
+}
+
+void test_framing_dense_delimiters()
+{
+    check_scan('\n', 2);
+}
+
+void test_framing_high_byte_delimiter()
+{
+    // sign extension of the compared bytes must not matter
+    check_scan((char)0xff, 5);
+}
+
+void test_framing_resume_when_full()
+{
+    // scanning with room for a few offsets at a time and resuming at the last one finds them all
+    static char buf[MAX_LEN];
+    size_t expected[MAX_LEN];
+    size_t ends[3];
+    size_t i, max;
+
+    for (i = 0; i < sizeof(impl_names) / sizeof(impl_names[0]); i++) {
+        if (framing_select(impl_names[i]) != 0) {
+            continue;
+        }
+        for (max = 1; max <= 3; max++) {
+            random_buffer(buf, sizeof(buf), '\n', 4);
+            size_t count = naive_scan(buf, sizeof(buf), '\n', expected, MAX_LEN);
+            size_t found = 0;
+            size_t start = 0;
+            size_t n;
+            do {
+                n = framing_scan(buf + start, sizeof(buf) - start, '\n', ends, max);
+                size_t j;
+                for (j = 0; j < n; j++) {
+                    TEST_ASSERT_LESS_THAN_UINT64_MESSAGE(count + 1, found + 1, impl_names[i]);
+                    TEST_ASSERT_EQUAL_UINT64_MESSAGE(expected[found], start + ends[j], impl_names[i]);
+                    found++;
+                }
+                if (n > 0) {
+                    start += ends[n - 1];
+                }
+            } while (n == max);
+            TEST_ASSERT_EQUAL_UINT64_MESSAGE(count, found, impl_names[i]);
+        }
+    }
+}
@@ -0,0 +1,182 @@
+#include "unity.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../server/lz.h"
+#include "../../server/protocol.h"
+
+/**
+* Round trips random data of every compressibility through lz_compress and lz_decompress, and
+* decodes the compressed blocks with a naive LZ4 block decoder too, so the output stays readable
+* by any LZ4 implementation.  Lengths cover every size up to a few match limits and the block
+* sizes around AESD_BLOCK_MAX_SIZE.
+*/
+
+#define MAX_SMALL_LEN 300
+
+static uint64_t rng_state = 0x13198a2e03707344ULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+// Random bytes drawn from @param symbols values, with runs copied from earlier in the buffer
+static void random_data(char *buf, size_t len, unsigned symbols)
+{
+    size_t i = 0;
+    while (i < len) {
+        if (i >= 4 && rng_next() % 4 == 0) {
+            size_t distance = 1 + rng_next() % (i < 70000 ? i : 70000);
+            size_t run = 4 + rng_next() % 40;
+            for (; run > 0 && i < len; run--, i++) {
+                buf[i] = buf[i - distance];
+            }
+        } else {
+            buf[i++] = (char)(rng_next() % symbols);
+        }
+    }
+}
+
+// Reference LZ4 block decoder, written from the format description, no bounds shortcuts
+static long naive_decode(const uint8_t *src, size_t len, uint8_t *dst, size_t capacity)
+{
+    size_t ip = 0, op = 0;
+    while (ip < len) {
+        uint8_t token = src[ip++];
+        size_t literals = token >> 4;
+        if (literals == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) {
+                    return -1;
+                }
+                b = src[ip++];
+                literals += b;
+            } while (b == 255);
+        }
+        if (literals > len - ip || literals > capacity - op) {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == len) {
+            break;
+        }
+        if (len - ip < 2) {
+            return -1;
+        }
+        size_t distance = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15) {
+            uint8_t b;
+            do {
+                if (ip >= len) {
+                    return -1;
+                }
+                b = src[ip++];
+                match += b;
+            } while (b == 255);
+        }
+        match += 4;
+        if (distance == 0 || distance > op || match > capacity - op) {
+            return -1;
+        }
+        for (; match > 0; match--, op++) {
+            dst[op] = dst[op - distance];
+        }
+    }
+    return (long)op;
+}
+
+static void check_round_trip(const char *src, size_t len, const char *message)
+{
+    static char compressed[AESD_BLOCK_MAX_SIZE + AESD_BLOCK_MAX_SIZE / 255 + 16];
+    static char decompressed[AESD_BLOCK_MAX_SIZE];
+    static char block[AESD_BLOCK_MAX_SIZE + AESD_BLOCK_MAX_SIZE / 255 + 16 + AESD_BLOCK_HEADER_SIZE];
+
+    size_t size = lz_compress(src, len, compressed, lz_compress_bound(len));
+    TEST_ASSERT_TRUE_MESSAGE(len == 0 || size > 0, message);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT64_MESSAGE(lz_compress_bound(len), size, message);
+
+    memset(decompressed, 0, len);
+    TEST_ASSERT_EQUAL_INT64_MESSAGE((int64_t)len, (int64_t)lz_decompress(compressed, size, decompressed, len),
+            message);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(src, decompressed, len, message);
+
+    memset(decompressed, 0, len);
+    TEST_ASSERT_EQUAL_INT64_MESSAGE((int64_t)len, naive_decode((const uint8_t *)compressed, size,
+            (uint8_t *)decompressed, len), message);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(src, decompressed, len, message);
+
+    if (len > 0) {
+        // one byte short of room must be refused, not overrun
+        TEST_ASSERT_EQUAL_INT64_MESSAGE(-1, (int64_t)lz_decompress(compressed, size, decompressed, len - 1),
+                message);
+    }
+
+    size_t raw_len, stored_len;
+    size_t encoded = lz_block_encode(src, len, block);
+    TEST_ASSERT_LESS_OR_EQUAL_UINT64_MESSAGE(lz_block_bound(len), encoded, message);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, lz_block_header(block, &raw_len, &stored_len), message);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(len, raw_len, message);
+    TEST_ASSERT_EQUAL_UINT64_MESSAGE(encoded, AESD_BLOCK_HEADER_SIZE + stored_len, message);
+    memset(decompressed, 0, len);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, lz_block_decode(block + AESD_BLOCK_HEADER_SIZE, stored_len,
+            decompressed, raw_len), message);
+    TEST_ASSERT_EQUAL_MEMORY_MESSAGE(src, decompressed, len, message);
+}
+
+void test_lz_small_lengths()
+{
+    static char buf[MAX_SMALL_LEN];
+    static const unsigned symbols[] = { 1, 2, 4, 256 };
+    char message[64];
+    size_t len, i;
+    for (i = 0; i < sizeof(symbols) / sizeof(symbols[0]); i++) {
+        for (len = 0; len <= MAX_SMALL_LEN; len++) {
+            random_data(buf, len, symbols[i]);
+            snprintf(message, sizeof(message), "len %zu, %u symbols", len, symbols[i]);
+            check_round_trip(buf, len, message);
+        }
+    }
+}
+
+void test_lz_block_sizes()
+{
+    static char buf[AESD_BLOCK_MAX_SIZE];
+    static const size_t lens[] = { 4095, 4096, 4097, 65535 - 1, 65535, AESD_BLOCK_MAX_SIZE };
+    static const unsigned symbols[] = { 1, 3, 256 };
+    char message[64];
+    size_t i, j;
+    for (i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        for (j = 0; j < sizeof(symbols) / sizeof(symbols[0]); j++) {
+            random_data(buf, lens[i], symbols[j]);
+            snprintf(message, sizeof(message), "len %zu, %u symbols", lens[i], symbols[j]);
+            check_round_trip(buf, lens[i], message);
+        }
+    }
+}
+
+void test_lz_truncated_input()
+{
+    // every prefix of a valid stream is either rejected or decodes to a prefix of the input
+    static char buf[2048];
+    static char compressed[2048 + 2048 / 255 + 16];
+    static char decompressed[2048];
+    random_data(buf, sizeof(buf), 4);
+    size_t size = lz_compress(buf, sizeof(buf), compressed, sizeof(compressed));
+    size_t cut;
+    for (cut = 0; cut < size; cut++) {
+        ssize_t ret = lz_decompress(compressed, cut, decompressed, sizeof(decompressed));
+        TEST_ASSERT_TRUE(ret >= -1 && ret <= (ssize_t)sizeof(buf));
+        if (ret > 0) {
+            TEST_ASSERT_EQUAL_MEMORY(buf, decompressed, ret);
+        }
+    }
+}
@@ -0,0 +1,206 @@
+#include "unity.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../server/timer_wheel.h"
+
+/**
+* Checks the timer wheel against the deadlines it was given: every entry fires exactly once,
+* on the first tick at or after its deadline and never before, including deadlines several
+* revolutions of the wheel away, cancelled entries never fire, and entries rescheduled from
+* their callback fire again.
+*/
+
+#define TICK_NS 1000ULL
+#define ENTRIES 512
+
+struct test_timer
+{
+    struct timer_entry entry;
+    uint64_t deadline_ns;
+    uint64_t fired_ns;
+    int fired;
+    // rescheduled this much later from the callback while non zero
+    uint64_t repeat_ns;
+};
+
+static uint64_t rng_state = 0xa4093822299f31d0ULL;
+
+static uint64_t rng_next(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+struct test_context
+{
+    struct timer_wheel *wheel;
+    uint64_t now_ns;
+};
+
+static void timer_fired(struct timer_entry *entry, void *param)
+{
+    struct test_context *context = (struct test_context *) param;
+    struct test_timer *timer = (struct test_timer *) entry;
+    TEST_ASSERT_FALSE(timer_entry_armed(entry));
+    timer->fired++;
+    timer->fired_ns = context->now_ns;
+    if (timer->repeat_ns != 0) {
+        timer->deadline_ns += timer->repeat_ns;
+        timer->repeat_ns = 0;
+        timer_wheel_schedule(context->wheel, entry, timer->deadline_ns);
+    }
+}
+
+static void init_timer(struct test_timer *timer, uint64_t deadline_ns)
+{
+    memset(timer, 0, sizeof(*timer));
+    timer->deadline_ns = deadline_ns;
+}
+
+/**
+ * Advances @param wheel from @param start_ns to @param end_ns in steps of up to @param max_step_ns
+ */
+static void run_wheel(struct timer_wheel *wheel, uint64_t start_ns, uint64_t end_ns, uint64_t max_step_ns)
+{
+    struct test_context context = { wheel, start_ns };
+    while (context.now_ns < end_ns) {
+        context.now_ns += 1 + rng_next() % max_step_ns;
+        timer_wheel_advance(wheel, context.now_ns, timer_fired, &context);
+    }
+}
+
+static void check_fired(const struct test_timer *timer, uint64_t max_step_ns)
+{
+    char message[96];
+    snprintf(message, sizeof(message), "deadline %llu fired at %llu", (unsigned long long)timer->deadline_ns,
+            (unsigned long long)timer->fired_ns);
+    TEST_ASSERT_EQUAL_INT_MESSAGE(1, timer->fired, message);
+    TEST_ASSERT_TRUE_MESSAGE(timer->fired_ns >= timer->deadline_ns, message);
+    // the first advance at or past the tick following the deadline fires it
+    TEST_ASSERT_TRUE_MESSAGE(timer->fired_ns < timer->deadline_ns + TICK_NS + max_step_ns, message);
+}
+
+void test_timer_wheel_fires_across_rounds()
+{
+    static struct timer_wheel wheel;
+    static struct test_timer timers[ENTRIES];
+    const uint64_t start = 5 * TICK_NS;
+    // up to four revolutions ahead
+    const uint64_t horizon = 4 * TIMER_WHEEL_SLOTS * TICK_NS;
+    size_t i;
+
+    timer_wheel_init(&wheel, TICK_NS, start);
+    TEST_ASSERT_EQUAL_INT(-1, timer_wheel_timeout_ms(&wheel, start));
+    for (i = 0; i < ENTRIES; i++) {
+        init_timer(&timers[i], start + rng_next() % horizon);
+        timer_wheel_schedule(&wheel, &timers[i].entry, timers[i].deadline_ns);
+        TEST_ASSERT_TRUE(timer_entry_armed(&timers[i].entry));
+    }
+    TEST_ASSERT_EQUAL_UINT64(ENTRIES, wheel.count);
+    TEST_ASSERT_EQUAL_INT(0, timer_wheel_timeout_ms(&wheel, start + horizon));
+
+    run_wheel(&wheel, start, start + horizon + 2 * TICK_NS, TICK_NS / 3);
+    for (i = 0; i < ENTRIES; i++) {
+        check_fired(&timers[i], TICK_NS / 3);
+    }
+    TEST_ASSERT_EQUAL_UINT64(0, wheel.count);
+}
+
+void test_timer_wheel_cancel()
+{
+    static struct timer_wheel wheel;
+    static struct test_timer timers[ENTRIES];
+    const uint64_t horizon = 3 * TIMER_WHEEL_SLOTS * TICK_NS;
+    size_t i;
+
+    timer_wheel_init(&wheel, TICK_NS, 0);
+    for (i = 0; i < ENTRIES; i++) {
+        init_timer(&timers[i], rng_next() % horizon);
+        timer_wheel_schedule(&wheel, &timers[i].entry, timers[i].deadline_ns);
+    }
+    // cancel every other entry, twice to check cancelling a disarmed entry does nothing
+    for (i = 0; i < ENTRIES; i += 2) {
+        timer_wheel_cancel(&wheel, &timers[i].entry);
+        timer_wheel_cancel(&wheel, &timers[i].entry);
+        TEST_ASSERT_FALSE(timer_entry_armed(&timers[i].entry));
+    }
+    TEST_ASSERT_EQUAL_UINT64(ENTRIES / 2, wheel.count);
+
+    run_wheel(&wheel, 0, horizon + 2 * TICK_NS, TICK_NS);
+    for (i = 0; i < ENTRIES; i++) {
+        if (i % 2 == 0) {
+            TEST_ASSERT_EQUAL_INT(0, timers[i].fired);
+        } else {
+            check_fired(&timers[i], TICK_NS);
+        }
+    }
+    TEST_ASSERT_EQUAL_UINT64(0, wheel.count);
+}
+
+void test_timer_wheel_reschedule_from_callback()
+{
+    static struct timer_wheel wheel;
+    static struct test_timer timers[ENTRIES];
+    size_t i;
+
+    timer_wheel_init(&wheel, TICK_NS, 0);
+    for (i = 0; i < ENTRIES; i++) {
+        init_timer(&timers[i], rng_next() % (TIMER_WHEEL_SLOTS * TICK_NS));
+        // back into the same bucket a revolution later for some, anywhere ahead for the others
+        timers[i].repeat_ns = TIMER_WHEEL_SLOTS * TICK_NS;
+        if (i % 2 != 0) {
+            timers[i].repeat_ns = 2 * TICK_NS + rng_next() % (2 * TIMER_WHEEL_SLOTS * TICK_NS);
+        }
+        timer_wheel_schedule(&wheel, &timers[i].entry, timers[i].deadline_ns);
+    }
+    run_wheel(&wheel, 0, 4 * TIMER_WHEEL_SLOTS * TICK_NS, TICK_NS / 2);
+    for (i = 0; i < ENTRIES; i++) {
+        TEST_ASSERT_EQUAL_INT(2, timers[i].fired);
+        TEST_ASSERT_TRUE(timers[i].fired_ns >= timers[i].deadline_ns);
+        TEST_ASSERT_TRUE(timers[i].fired_ns < timers[i].deadline_ns + TICK_NS + TICK_NS / 2);
+    }
+    TEST_ASSERT_EQUAL_UINT64(0, wheel.count);
+}
+
+void test_timer_wheel_long_stall()
+{
+    // a single advance far past every deadline, more than a revolution late, fires them all once
+    static struct timer_wheel wheel;
+    static struct test_timer timers[ENTRIES];
+    struct test_context context = { &wheel, 0 };
+    size_t i;
+
+    timer_wheel_init(&wheel, TICK_NS, 0);
+    for (i = 0; i < ENTRIES; i++) {
+        init_timer(&timers[i], rng_next() % (2 * TIMER_WHEEL_SLOTS * TICK_NS));
+        timer_wheel_schedule(&wheel, &timers[i].entry, timers[i].deadline_ns);
+    }
+    context.now_ns = 5 * TIMER_WHEEL_SLOTS * TICK_NS;
+    timer_wheel_advance(&wheel, context.now_ns, timer_fired, &context);
+    for (i = 0; i < ENTRIES; i++) {
+        TEST_ASSERT_EQUAL_INT(1, timers[i].fired);
+    }
+    TEST_ASSERT_EQUAL_UINT64(0, wheel.count);
+}
+
+void test_timer_wheel_past_deadline()
+{
+    // a deadline already passed fires on the next tick, not in the tick being processed
+    static struct timer_wheel wheel;
+    struct test_timer timer;
+    struct test_context context = { &wheel, 10 * TICK_NS };
+
+    timer_wheel_init(&wheel, TICK_NS, 0);
+    timer_wheel_advance(&wheel, context.now_ns, timer_fired, &context);
+    init_timer(&timer, 3 * TICK_NS);
+    timer_wheel_schedule(&wheel, &timer.entry, timer.deadline_ns);
+    TEST_ASSERT_EQUAL_INT(1, timer_wheel_timeout_ms(&wheel, context.now_ns));
+    timer_wheel_advance(&wheel, context.now_ns, timer_fired, &context);
+    TEST_ASSERT_EQUAL_INT(0, timer.fired);
+    context.now_ns += TICK_NS;
+    timer_wheel_advance(&wheel, context.now_ns, timer_fired, &context);
+    TEST_ASSERT_EQUAL_INT(1, timer.fired);
+}